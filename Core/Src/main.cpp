@@ -86,7 +86,6 @@ void SystemClock_Config(void);
 /* USER CODE BEGIN 0 */
 
 char cmd_input_chr = 0;
-char sim_input_chr = 0;
 
 unsigned rs485_cnt = 0;
 char rs485_input_chr[100] = {0};
@@ -158,7 +157,6 @@ int main(void)
 
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
-	HAL_UART_Receive_IT(&SIM_MODULE_UART, (uint8_t*) &sim_input_chr, sizeof(char));
 	HAL_UART_Receive_IT(&CMD_UART, (uint8_t*) &cmd_input_chr, sizeof(char));
 	HAL_UART_Receive_IT(&RS485_UART, (uint8_t*)&rs485_input_chr[rs485_cnt++], 1);
 
@@ -227,6 +225,9 @@ int main(void)
         // Record & settings synchronize process
         log_tick();
 
+        // FLASH non-blocking transfers
+        flash_w25qxx_async_status();
+
         // CMD process
         cmd_process();
 
@@ -353,10 +354,7 @@ void HAL_RCC_CSSCallback(void)
 }
 
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
-	if (huart->Instance == SIM_MODULE_UART.Instance) {
-		sim_proccess_input(sim_input_chr);
-		HAL_UART_Receive_IT(&SIM_MODULE_UART, (uint8_t*)&sim_input_chr, 1);
-	} else if (huart->Instance == CMD_UART.Instance) {
+	if (huart->Instance == CMD_UART.Instance) {
 		cmd_input(cmd_input_chr);
 		HAL_UART_Receive_IT(&CMD_UART, (uint8_t*)&cmd_input_chr, 1);
 	} else if (huart->Instance == RS485_UART.Instance) {
@@ -369,6 +367,43 @@ void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
 	}
 }
 
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size) {
+	if (huart->Instance == SIM_MODULE_UART.Instance) {
+		sim_rx_event(Size);
+	}
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
+	if (huart->Instance == SIM_MODULE_UART.Instance) {
+		sim_tx_complete();
+	}
+}
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+	if (huart->Instance == SIM_MODULE_UART.Instance) {
+		sim_rx_error();
+		sim_tx_error();
+	}
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi) {
+	if (hspi->Instance == FLASH_SPI.Instance) {
+		flash_w25qxx_spi_tx_cplt_callback();
+	}
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi) {
+	if (hspi->Instance == FLASH_SPI.Instance) {
+		flash_w25qxx_spi_rx_cplt_callback();
+	}
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi) {
+	if (hspi->Instance == FLASH_SPI.Instance) {
+		flash_w25qxx_spi_error_callback();
+	}
+}
+
 int _write(int, uint8_t *ptr, int len) {
     HAL_UART_Transmit(&BEDUG_UART, (uint8_t*)ptr, static_cast<uint16_t>(len), GENERAL_TIMEOUT_MS);
 #ifdef DEBUG
@@ -0,0 +1,143 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "RecordCodec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "Varint.h"
+#include "RecordDB.h"
+
+
+static const char BASE64_CHARS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+RecordCodec::RecordCodec(): prevId(0), prevTime(0) {}
+
+uint32_t RecordCodec::encodeHeader(uint8_t* data)
+{
+    prevId   = 0;
+    prevTime = 0;
+    data[0]  = VERSION;
+    return HEADER_SIZE;
+}
+
+uint32_t RecordCodec::encode(const RecordDB::Record& record, uint8_t* data)
+{
+    uint32_t len = 0;
+    len += Varint::put(data + len, record.id - prevId);
+    len += Varint::put(data + len, Varint::zigzag(static_cast<int64_t>(record.time - prevTime)));
+    len += Varint::put(data + len, Varint::zigzag(record.level));
+    len += Varint::put(data + len, record.press);
+    len += Varint::put(data + len, record.pump_wok_time);
+    len += Varint::put(data + len, record.pump_downtime);
+    data[len++] = record.inputs;
+
+    prevId   = record.id;
+    prevTime = record.time;
+    return len;
+}
+
+#if RECORD_CODEC_DECODER
+uint32_t RecordCodec::decodeHeader(const uint8_t* data, uint32_t size)
+{
+    prevId   = 0;
+    prevTime = 0;
+    if (size < HEADER_SIZE || data[0] != VERSION) {
+        return 0;
+    }
+    return HEADER_SIZE;
+}
+
+uint32_t RecordCodec::decode(const uint8_t* data, uint32_t size, RecordDB::Record* record)
+{
+    uint64_t fields[6] = {};
+    uint32_t len = 0;
+    for (unsigned i = 0; i < sizeof(fields) / sizeof(*fields); i++) {
+        uint32_t fieldLen = Varint::get(data + len, size - len, &fields[i]);
+        if (!fieldLen) {
+            return 0;
+        }
+        len += fieldLen;
+    }
+    if (len >= size || fields[0] > UINT32_MAX || fields[3] > UINT16_MAX) {
+        return 0;
+    }
+
+    record->id            = static_cast<uint32_t>(prevId + fields[0]);
+    record->time          = prevTime + static_cast<uint64_t>(Varint::unzigzag(fields[1]));
+    record->level         = static_cast<int32_t>(Varint::unzigzag(fields[2]));
+    record->press         = static_cast<uint16_t>(fields[3]);
+    record->pump_wok_time = static_cast<uint32_t>(fields[4]);
+    record->pump_downtime = static_cast<uint32_t>(fields[5]);
+    record->inputs        = data[len++];
+
+    prevId   = record->id;
+    prevTime = record->time;
+    return len;
+}
+#endif
+
+uint32_t RecordCodec::getBase64Size(uint32_t size)
+{
+    return (size + 2) / 3 * 4;
+}
+
+uint32_t RecordCodec::encodeBase64(const uint8_t* data, uint32_t size, uint32_t offset, char* text, uint32_t len)
+{
+    uint32_t textSize = getBase64Size(size);
+    uint32_t count = 0;
+    for (uint32_t pos = offset; pos < textSize && count < len; pos++) {
+        uint32_t group = pos / 4 * 3;
+        uint32_t idx   = pos % 4;
+        if (group + idx > size) {
+            // The last group has 1 or 2 bytes
+            text[count++] = '=';
+            continue;
+        }
+        uint32_t bits = static_cast<uint32_t>(data[group]) << 16;
+        if (group + 1 < size) {
+            bits |= static_cast<uint32_t>(data[group + 1]) << 8;
+        }
+        if (group + 2 < size) {
+            bits |= data[group + 2];
+        }
+        text[count++] = BASE64_CHARS[(bits >> (18 - 6 * idx)) & 0x3F];
+    }
+    return count;
+}
+
+#if RECORD_CODEC_DECODER
+uint32_t RecordCodec::decodeBase64(const char* text, uint32_t len, uint8_t* data, uint32_t size)
+{
+    if (len % 4) {
+        return 0;
+    }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < len; i += 4) {
+        // Only the last group is padded
+        uint32_t pad = 0;
+        if (i + 4 == len) {
+            pad = (text[i + 3] == '=') ? ((text[i + 2] == '=') ? 2 : 1) : 0;
+        }
+        uint32_t bits = 0;
+        for (uint32_t j = 0; j < 4 - pad; j++) {
+            const char* chr = text[i + j] ? strchr(BASE64_CHARS, text[i + j]) : nullptr;
+            if (!chr) {
+                return 0;
+            }
+            bits = (bits << 6) | static_cast<uint32_t>(chr - BASE64_CHARS);
+        }
+        bits <<= 6 * pad;
+
+        uint32_t bytes = 3 - pad;
+        if (count + bytes > size) {
+            return 0;
+        }
+        for (uint32_t j = 0; j < bytes; j++) {
+            data[count++] = static_cast<uint8_t>(bits >> (16 - 8 * j));
+        }
+    }
+    return count;
+}
+#endif
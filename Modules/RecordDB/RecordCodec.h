@@ -0,0 +1,82 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#pragma once
+
+
+#include <stdint.h>
+
+#include "RecordDB.h"
+
+
+// The decoder is built for the host tools only
+#ifndef RECORD_CODEC_DECODER
+#   define RECORD_CODEC_DECODER (0)
+#endif
+
+
+/*
+ * Compact upload encoding of the record batch: [version][record]...[record].
+ * Record: [ID delta][time delta][level][pressure][pump work][pump downtime][inputs].
+ * The deltas are counted from the previous record of the batch (from zero for the first one),
+ * the time delta and the level are zigzag varints, the counters are varints, the inputs are one byte.
+ * The batch is sent as the base64 text.
+ */
+class RecordCodec
+{
+public:
+    static constexpr uint8_t  VERSION         = 1;
+    static constexpr uint32_t HEADER_SIZE     = 1;
+    static constexpr uint32_t RECORD_SIZE_MAX = 5 + 10 + 5 + 3 + 5 + 5 + 1;
+
+    RecordCodec();
+
+    /**
+     * Starts the batch: the next record deltas are counted from zero.
+     * @param data Batch buffer (HEADER_SIZE bytes).
+     * @return Number of the written bytes.
+     */
+    uint32_t encodeHeader(uint8_t* data);
+    /**
+     * @param record Record to add.
+     * @param data   Batch buffer position (RECORD_SIZE_MAX bytes).
+     * @return Number of the written bytes.
+     */
+    uint32_t encode(const RecordDB::Record& record, uint8_t* data);
+
+#if RECORD_CODEC_DECODER
+    /**
+     * Decoder of the batch for the host tools.
+     * @return Number of the read bytes, 0 - unknown version.
+     */
+    uint32_t decodeHeader(const uint8_t* data, uint32_t size);
+    /**
+     * @return Number of the read bytes, 0 - the record is broken.
+     */
+    uint32_t decode(const uint8_t* data, uint32_t size, RecordDB::Record* record);
+#endif
+
+    /**
+     * @return Length of the base64 text of the data.
+     */
+    static uint32_t getBase64Size(uint32_t size);
+    /**
+     * Writes a part of the base64 text: the text is not kept in the memory.
+     * @param data   Binary data.
+     * @param size   Binary data size.
+     * @param offset Text position.
+     * @param text   Result text part.
+     * @param len    Text part length.
+     * @return Number of the written chars.
+     */
+    static uint32_t encodeBase64(const uint8_t* data, uint32_t size, uint32_t offset, char* text, uint32_t len);
+#if RECORD_CODEC_DECODER
+    /**
+     * @return Number of the decoded bytes, 0 - the text is broken.
+     */
+    static uint32_t decodeBase64(const char* text, uint32_t len, uint8_t* data, uint32_t size);
+#endif
+
+private:
+    uint32_t prevId;
+    uint64_t prevTime;
+};
@@ -5,24 +5,56 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "w25qxx.h"
 #include "StorageAT.h"
+#include "StorageDriver.h"
 
 #include "glog.h"
 #include "soul.h"
+#include "crc16.h"
 #include "level.h"
 #include "clock.h"
 #include "gutils.h"
 #include "settings.h"
+#include "SettingsDB.h"
+#include "Varint.h"
+#include "RecordIndex.h"
+#include "RecordLegacy.h"
 
 
 extern StorageAT storage;
+extern StorageDriver storageDriver;
 
 extern settings_t settings;
 
 
-const char* RecordDB::RECORD_PREFIX = "RCR";
+#define ERASE_TIMEOUT_MS ((uint32_t)500)
+
+
+static_assert(
+    RECORD_LOG_SECTORS * (FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE) <= RecordIndex::PAGES_MAX,
+    "record log pages do not fit in the index page field"
+);
+
+
 const char* RecordDB::TAG = "RCR";
 
+bool     RecordDB::initialized   = false;
+uint32_t RecordDB::headerAddress = 0;
+uint32_t RecordDB::sectorsCount  = 0;
+uint32_t RecordDB::writePage     = 0;
+uint32_t RecordDB::writeSlot     = 0;
+uint32_t RecordDB::writePosition = 0;
+uint32_t RecordDB::lastId        = 0;
+
+bool             RecordDB::hasWriteBase  = false;
+uint32_t         RecordDB::writeBaseSlot = 0;
+RecordDB::Record RecordDB::writeBase     = {};
+
+uint32_t RecordDB::erasedAhead   = 0;
+bool     RecordDB::erasing       = false;
+uint32_t RecordDB::erasingSector = 0;
+
 
 RecordDB::RecordDB(uint32_t recordId): m_recordId(recordId) { }
 
@@ -31,52 +63,107 @@ void RecordDB::setRecordId(uint32_t recordId)
 	m_recordId = recordId;
 }
 
-RecordDB::RecordStatus RecordDB::load()
+uint32_t RecordDB::getReservedPages()
 {
-    uint32_t address = 0;
+    if (!is_status(MEMORY_INITIALIZED)) {
+        return 0;
+    }
 
-    StorageStatus storageStatus = storage.find(FIND_MODE_EQUAL, &address, RECORD_PREFIX, this->record.id);
-    if (storageStatus == STORAGE_BUSY) {
-    	return RECORD_ERROR;
+    setRegion();
+
+    LogHeader header = {};
+    if (storageDriver.read(headerAddress, reinterpret_cast<uint8_t*>(&header), sizeof(header)) != STORAGE_OK) {
+        return 0;
+    }
+    if (header.magic != LOG_MAGIC || header.version != LOG_VERSION || header.sectors != sectorsCount) {
+        return 0;
     }
-    if (storageStatus != STORAGE_OK) {
-    	storageStatus = storage.find(FIND_MODE_NEXT, &address, RECORD_PREFIX, this->record.id);
+
+    return (sectorsCount + 1) * PAGES_PER_SECTOR;
+}
+
+uint32_t RecordDB::getLastId()
+{
+    uint32_t id = 0;
+    if (isLegacy() && RecordLegacy::getLastId(&id) == RECORD_OK) {
+        return id;
     }
-    if (storageStatus != STORAGE_OK) {
+    return initialized ? lastId : 0;
+}
+
+void RecordDB::eraseTick()
+{
+    if (!initialized || erasing || erasedAhead >= RECORD_ERASE_POOL_SIZE) {
+        return;
+    }
+
+    // The pool must not take the sectors with the newest records
+    if (erasedAhead + 2 >= sectorsCount) {
+        return;
+    }
+
+    if (flash_w25qxx_async_status() == FLASH_BUSY) {
+        return;
+    }
+
+    uint32_t sector = getPoolSector(erasedAhead);
+    for (uint32_t i = 0; i < PAGES_PER_SECTOR; i++) {
+        RecordIndex::remove(sector * PAGES_PER_SECTOR + i);
+    }
+
+    bool empty = false;
+    if (isSectorEmpty(sector, &empty) != RECORD_OK) {
+        return;
+    }
+    if (empty) {
+        erasedAhead++;
+        return;
+    }
+
+    erasing = true;
+    erasingSector = sector;
+    if (storageDriver.eraseSectorAsync(getPageAddress(sector * PAGES_PER_SECTOR), eraseEnd) != STORAGE_OK) {
+        erasing = false;
+    }
+
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error load: find clust");
+    printTagLog(RecordDB::TAG, "background erase sector=%lu start", sector);
 #endif
-        return (storageStatus == STORAGE_NOT_FOUND) ? RECORD_NO_LOG : RECORD_ERROR;
+}
+
+RecordDB::RecordStatus RecordDB::load()
+{
+    if (isLegacy()) {
+        return RecordLegacy::load(this->m_recordId, &this->record);
     }
 
-    RecordStatus recordStatus = this->loadClust(address);
-    if (recordStatus != RECORD_OK) {
+    if (init() != RECORD_OK) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error load: load clust");
+        printTagLog(RecordDB::TAG, "error load: init log");
 #endif
-        return (storageStatus == STORAGE_NOT_FOUND) ? RECORD_NO_LOG : RECORD_ERROR;
+        return RECORD_ERROR;
     }
 
-    bool recordFound = false;
-    unsigned id;
-    for (unsigned i = 0; i < CLUST_SIZE; i++) {
-    	if (this->m_clust.records[i].id == this->m_recordId) {
-    		recordFound = true;
-    		id = i;
-    		break;
-    	}
-    }
-    if (!recordFound) {
+    Record found = {};
+    RecordStatus recordStatus = findNext(this->m_recordId ? this->m_recordId - 1 : 0, &found);
+    if (recordStatus != RECORD_OK) {
 #if RECORD_BEDUG
         printTagLog(RecordDB::TAG, "error load: find record");
+#endif
+        return recordStatus;
+    }
+
+    if (found.id != this->m_recordId) {
+#if RECORD_BEDUG
+        printTagLog(RecordDB::TAG, "error load: record id=%lu not found", this->m_recordId);
 #endif
         return RECORD_NO_LOG;
     }
 
-    memcpy(reinterpret_cast<void*>(&(this->record)), reinterpret_cast<void*>(&(this->m_clust.records[id])), sizeof(this->record));
+    memcpy(reinterpret_cast<void*>(&(this->record)), reinterpret_cast<void*>(&found), sizeof(this->record));
 
 #if RECORD_BEDUG
-    printTagLog(RecordDB::TAG, "record loaded from address=%08X", (unsigned int)address);
+    printTagLog(RecordDB::TAG, "record id=%lu loaded", this->record.id);
 #endif
 
     return RECORD_OK;
@@ -84,50 +171,34 @@ RecordDB::RecordStatus RecordDB::load()
 
 RecordDB::RecordStatus RecordDB::loadNext()
 {
-    uint32_t address = 0;
+    if (isLegacy()) {
+        return RecordLegacy::loadNext(this->m_recordId, &this->record);
+    }
 
-    StorageStatus storageStatus = storage.find(FIND_MODE_NEXT, &address, RECORD_PREFIX, this->m_recordId);
-    if (storageStatus != STORAGE_OK) {
+    if (init() != RECORD_OK) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error load next: find next record");
+        printTagLog(RecordDB::TAG, "error load next: init log");
 #endif
-        return (storageStatus == STORAGE_NOT_FOUND) ? RECORD_NO_LOG : RECORD_ERROR;
+        return RECORD_ERROR;
     }
 
-    RecordStatus recordStatus = this->loadClust(address);
+    Record found = {};
+    RecordStatus recordStatus = findNext(this->m_recordId, &found);
     if (recordStatus != RECORD_OK) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error load next: load clust");
-#endif
-        return (storageStatus == STORAGE_NOT_FOUND) ? RECORD_NO_LOG : RECORD_ERROR;
-    }
-
-    bool recordFound = false;
-	unsigned idx;
-	uint32_t curId = 0xFFFFFFFF;
-	for (unsigned i = 0; i < CLUST_SIZE; i++) {
-		if (this->m_clust.records[i].id > this->m_recordId && curId > this->m_clust.records[i].id) {
-			curId =this->m_clust.records[i].id;
-			recordFound = true;
-			idx = i;
-			break;
-		}
-	}
-    if (!recordFound) {
-#if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error load next: find record");
+        printTagLog(RecordDB::TAG, "error load next: find next record");
 #endif
-        return RECORD_NO_LOG;
+        return recordStatus;
     }
 
     memcpy(
 		reinterpret_cast<void*>(&(this->record)),
-		reinterpret_cast<void*>(&(this->m_clust.records[idx])),
+		reinterpret_cast<void*>(&found),
 		sizeof(this->record)
 	);
 
 #if RECORD_BEDUG
-    printTagLog(RecordDB::TAG, "next record loaded from address=%08X", (unsigned int)address);
+    printTagLog(RecordDB::TAG, "next record id=%lu loaded", this->record.id);
 #endif
 
     return RECORD_OK;
@@ -135,110 +206,88 @@ RecordDB::RecordStatus RecordDB::loadNext()
 
 RecordDB::RecordStatus RecordDB::save()
 {
-    uint32_t id = 0;
-    RecordStatus recordStatus = getNewId(&id);
-    if (recordStatus != RECORD_OK) {
+    if (isLegacy()) {
+        RecordStatus recordStatus = RecordLegacy::save(&this->record);
+        if (recordStatus == RECORD_OK) {
+            set_status(HAS_NEW_RECORD);
+            printRecord();
+        }
+        return recordStatus;
+    }
+
+    if (init() != RECORD_OK) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error save: get new id");
+        printTagLog(RecordDB::TAG, "error save: init log");
 #endif
         return RECORD_ERROR;
     }
 
-    this->record.id = id;
+    if (!RecordIndex::isBuilt()) {
+        buildIndex();
+    }
+
+    this->record.id = (lastId + 1 <= settings.server_log_id) ? settings.server_log_id + 1 : lastId + 1;
 
-    uint32_t address = 0;
-    StorageFindMode findMode = FIND_MODE_MAX;
-    StorageStatus storageStatus = storage.find(findMode, &address, RECORD_PREFIX);
-    if (storageStatus == STORAGE_BUSY) {
-    	return RECORD_ERROR;
+    const uint32_t pagesCount = sectorsCount * PAGES_PER_SECTOR;
+
+    uint8_t data[ENTRY_SIZE_MAX] = {};
+    uint32_t size = encodeEntry(hasWriteBase ? &writeBase : nullptr, writeBaseSlot, &this->record, data);
+    if (writeSlot >= SLOTS_PER_PAGE || writePosition + size > FLASH_W25_PAGE_SIZE) {
+        // The record does not fit: it is the full record of the next page
+        setWritePage((writePage + 1) % pagesCount, nullptr);
+        size = encodeEntry(nullptr, 0, &this->record, data);
     }
 
-	bool idFound = false;
-	uint32_t idx;
-    while (storageStatus != STORAGE_OOM) {
-		if (storageStatus != STORAGE_OK) {
-			findMode = FIND_MODE_EMPTY;
-			storageStatus = storage.find(findMode, &address, RECORD_PREFIX);
-		}
-		if (storageStatus != STORAGE_OK) {
-			findMode = FIND_MODE_MIN;
-			storageStatus = storage.find(findMode, &address, RECORD_PREFIX);
-		}
-		if (storageStatus == STORAGE_BUSY) {
-#if RECORD_BEDUG
-			printTagLog(RecordDB::TAG, "error save: find address for save record (storage busy)");
-#endif
-			return RECORD_ERROR;
-		}
-		if (storageStatus != STORAGE_OK) {
+    if (!isWriteSectorStarted()) {
+        const uint32_t sector = writePage / PAGES_PER_SECTOR;
+        if (erasing && erasingSector == sector) {
+            util_wait_event(isEraseEnd, ERASE_TIMEOUT_MS);
+        }
+
+        RecordStatus recordStatus = RECORD_OK;
+        if (erasedAhead) {
+            // The sector was erased in the background
+            erasedAhead--;
+        } else {
+            recordStatus = prepareSector(sector);
+        }
+        if (recordStatus != RECORD_OK) {
 #if RECORD_BEDUG
-			printTagLog(RecordDB::TAG, "error save: find address for save record");
+            printTagLog(RecordDB::TAG, "error save: prepare sector=%lu", sector);
 #endif
-			return RECORD_ERROR;
-		}
+            return RECORD_ERROR;
+        }
+    }
 
-		if (findMode != FIND_MODE_EMPTY) {
-			recordStatus = this->loadClust(address);
-		}
-		if (recordStatus != RECORD_OK) {
-#if RECORD_BEDUG
-			printTagLog(RecordDB::TAG, "error save: load clust");
-#endif
-			return RECORD_ERROR;
-		}
-		if (findMode == FIND_MODE_MIN || findMode == FIND_MODE_EMPTY) {
-			memset(reinterpret_cast<void*>(&(this->m_clust)), 0, sizeof(this->m_clust));
-		}
-
-		idFound = false;
-		for (unsigned i = 0; i < __arr_len(this->m_clust.records); i++) {
-			if (this->m_clust.records[i].id == 0) {
-				idFound = true;
-				idx = i;
-				break;
-			}
-		}
-		if (idFound) {
-			break;
-		}
-
-		storageStatus = STORAGE_ERROR;
-    }
-
-    if (!idFound) {
+    uint32_t pageAddress = getPageAddress(writePage);
+    uint32_t address = pageAddress + writePosition;
+    const uint8_t offset = static_cast<uint8_t>(writePosition);
+    const uint32_t slot = writeSlot;
+
+    // The entry is committed by its offset: a torn entry is not in the offsets table
+    StorageStatus status = storageDriver.program(address, data, size);
+    if (status == STORAGE_OK) {
+        status = storageDriver.program(pageAddress + slot, &offset, sizeof(offset));
+    }
+    // A failed slot may be partially programmed: it is skipped anyway
+    writePosition += size;
+    writeSlot++;
+    if (status != STORAGE_OK) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error save: find record id in clust");
+        printTagLog(RecordDB::TAG, "error save: program entry address=%08X", (unsigned int)address);
 #endif
         return RECORD_ERROR;
     }
 
-    this->m_clust.rcrd_magic = CLUST_MAGIC;
-    this->m_clust.rcrd_ver = CLUST_VERSION;
-    memcpy(
-		reinterpret_cast<void*>(&(this->m_clust.records[idx])),
-		reinterpret_cast<void*>(&(this->record)),
-		sizeof(this->record)
-	);
-    if (idx < CLUST_SIZE) {
-    	memset(
-			reinterpret_cast<void*>(&(this->m_clust.records[idx + 1])),
-			0,
-			((CLUST_SIZE - idx - 1) * sizeof(struct _Record))
-		);
-    }
-
-    storageStatus = storage.rewrite(
-        address,
-        RECORD_PREFIX,
-        this->record.id,
-        reinterpret_cast<uint8_t*>(&this->m_clust),
-        sizeof(this->m_clust)
-    );
-    if (storageStatus != STORAGE_OK) {
-#if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error save: save clust");
-#endif
-        return RECORD_ERROR;
+    if (data[0] == ENTRY_FULL) {
+        memcpy(reinterpret_cast<void*>(&writeBase), reinterpret_cast<void*>(&this->record), sizeof(writeBase));
+        writeBaseSlot = slot;
+        hasWriteBase  = true;
+    }
+
+    lastId = this->record.id;
+    if (RecordIndex::isBuilt()) {
+        RecordIndex::add(writePage, this->record.id, this->record.id);
     }
 
     set_status(HAS_NEW_RECORD);
@@ -248,95 +297,625 @@ RecordDB::RecordStatus RecordDB::save()
 		"record saved on address=%08X",
 		(unsigned int)address
 	);
+    printRecord();
+
+    return RECORD_OK;
+}
+
+void RecordDB::printRecord()
+{
     gprint("ID:    %lu\n",         record.id);
 	gprint("Time:  %s\n",          get_clock_time_format_by_sec(record.time));
 	gprint("Level: %ld %s\n",      record.level / 1000, (record.level == LEVEL_ERROR ? "" : "l"));
 	gprint("Press: %u.%02u MPa\n", record.press / 100, record.press % 100);
 //	gprint("Press 2: %d.%02d MPa\n",                     record.press_2 / 100, record.press_2 % 100);
+}
 
-    return RECORD_OK;
+bool RecordDB::isLegacy()
+{
+    if (initialized) {
+        return false;
+    }
+
+    if (!is_status(MEMORY_INITIALIZED) || !is_status(SETTINGS_INITIALIZED)) {
+        return false;
+    }
+
+    if (getReservedPages()) {
+        return false;
+    }
+
+    // The log is formatted over the clusters only when the server has all their records
+    uint32_t id = 0;
+    if (RecordLegacy::getLastId(&id) != RECORD_OK) {
+        return true;
+    }
+    return id > settings.server_log_id;
 }
 
-RecordDB::RecordStatus RecordDB::loadClust(uint32_t address)
+RecordDB::RecordStatus RecordDB::init()
 {
-    RecordClust tmpClust;
-    StorageStatus status = storage.load(address, reinterpret_cast<uint8_t*>(&tmpClust), sizeof(tmpClust));
-    if (status != STORAGE_OK) {
+    if (initialized) {
+        return RECORD_OK;
+    }
+
+    if (!is_status(MEMORY_INITIALIZED) || !is_status(SETTINGS_INITIALIZED)) {
+        return RECORD_ERROR;
+    }
+
+    if (!getReservedPages() && format() != RECORD_OK) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error load clust");
+        printTagLog(RecordDB::TAG, "error init: format log");
 #endif
         return RECORD_ERROR;
     }
 
-    if (tmpClust.rcrd_magic != CLUST_MAGIC) {
+    // Sectors are written one by one with increasing IDs: the newest sector has the max first ID
+    uint32_t newestSector = sectorsCount;
+    uint32_t newestId = 0;
+    for (uint32_t sector = 0; sector < sectorsCount; sector++) {
+        uint32_t id = 0;
+        if (getSectorFirstId(sector, &id) != RECORD_OK) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error record clust magic");
+            printTagLog(RecordDB::TAG, "error init: read sector=%lu", sector);
 #endif
-        storage.clearAddress(address);
-        return RECORD_ERROR;
+            return RECORD_ERROR;
+        }
+        if (id > newestId) {
+            newestId = id;
+            newestSector = sector;
+        }
     }
 
-    if (tmpClust.rcrd_ver != CLUST_VERSION) {
+    setWritePage(0, nullptr);
+    lastId = 0;
+    erasedAhead = 0;
+    if (newestSector < sectorsCount) {
+        // Pages are written one by one: the last not empty page of the newest sector is the write page
+        for (uint32_t i = 0; i < PAGES_PER_SECTOR; i++) {
+            uint32_t page = newestSector * PAGES_PER_SECTOR + i;
+            LogPage logPage = {};
+            if (readPage(page, &logPage) != RECORD_OK) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error record clust version");
+                printTagLog(RecordDB::TAG, "error init: read page=%lu", page);
 #endif
-        storage.clearAddress(address);
-        return RECORD_ERROR;
+                return RECORD_ERROR;
+            }
+            if (isPageEmpty(&logPage)) {
+                break;
+            }
+            for (uint32_t slot = 0; slot < SLOTS_PER_PAGE; slot++) {
+                Record found = {};
+                if (decodeEntry(&logPage, slot, &found) && lastId < found.id) {
+                    lastId = found.id;
+                }
+            }
+            setWritePage(page, &logPage);
+        }
     }
 
-    memcpy(reinterpret_cast<void*>(&this->m_clust), reinterpret_cast<void*>(&tmpClust), sizeof(this->m_clust));
+    initialized = true;
+
+    buildIndex();
 
 #if RECORD_BEDUG
-    printTagLog(RecordDB::TAG, "clust loaded from address=%08X", (unsigned int)address);
+    printTagLog(RecordDB::TAG, "log initialized: sectors=%lu write page=%lu slot=%lu last id=%lu", sectorsCount, writePage, writeSlot, lastId);
 #endif
 
     return RECORD_OK;
 }
 
-RecordDB::RecordStatus RecordDB::getNewId(uint32_t *newId)
+RecordDB::RecordStatus RecordDB::format()
 {
-    uint32_t address = 0;
+    setRegion();
+
+    storage.setPagesCount(flash_w25qxx_get_pages_count() - SettingsDB::getReservedPages() - (sectorsCount + 1) * PAGES_PER_SECTOR);
 
-    StorageStatus status = storage.find(FIND_MODE_MAX, &address, RECORD_PREFIX);
-    if (status == STORAGE_NOT_FOUND) {
-        *newId = settings.server_log_id + 1;
+    uint32_t addrs[PAGES_PER_SECTOR] = {};
+    for (uint32_t i = 0; i < PAGES_PER_SECTOR; i++) {
+        addrs[i] = headerAddress + i * FLASH_W25_PAGE_SIZE;
+    }
+    if (storageDriver.erase(addrs, PAGES_PER_SECTOR) != STORAGE_OK) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "max ID not found, reset max ID");
+        printTagLog(RecordDB::TAG, "error format: erase header");
 #endif
-        return RECORD_OK;
+        return RECORD_ERROR;
     }
-    if (status != STORAGE_OK) {
+
+    LogHeader header = {};
+    header.magic   = LOG_MAGIC;
+    header.version = LOG_VERSION;
+    header.sectors = static_cast<uint16_t>(sectorsCount);
+    if (storageDriver.program(headerAddress, reinterpret_cast<uint8_t*>(&header), sizeof(header)) != STORAGE_OK) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error get new id");
+        printTagLog(RecordDB::TAG, "error format: write header");
 #endif
         return RECORD_ERROR;
     }
 
-    RecordClust tmpClust;
-    status = storage.load(address, reinterpret_cast<uint8_t*>(&tmpClust), sizeof(tmpClust));
-    if (status != STORAGE_OK) {
+    printTagLog(RecordDB::TAG, "log formatted: address=%08X sectors=%lu", (unsigned int)headerAddress, sectorsCount);
+
+    return RECORD_OK;
+}
+
+RecordDB::RecordStatus RecordDB::buildIndex()
+{
+    if (!initialized) {
+        return RECORD_ERROR;
+    }
+
+    uint32_t oldest = 0, sectors = 0;
+    getDataSectors(&oldest, &sectors);
+
+    const uint32_t pagesCount  = sectorsCount * PAGES_PER_SECTOR;
+    const uint32_t oldestPage  = oldest * PAGES_PER_SECTOR;
+    const uint32_t writeSector = writePage / PAGES_PER_SECTOR;
+
+    uint32_t pages = sectors * PAGES_PER_SECTOR;
+    if (sectors < sectorsCount || oldest != writeSector) {
+        // Pages after the write pointer are empty
+        pages -= PAGES_PER_SECTOR - 1 - writePage % PAGES_PER_SECTOR;
+    }
+
+    // Only the newest pages fit in RAM: the oldest ones are searched on the FLASH
+    uint32_t start = 0;
+    uint32_t fromId = 0;
+    if (pages > RECORD_INDEX_SIZE) {
+        start = pages - RECORD_INDEX_SIZE;
+        fromId = 0xFFFFFFFF;
+        for (uint32_t i = start; i > 0 && start - i < PAGES_PER_SECTOR; i--) {
+            uint32_t minId = 0, maxId = 0;
+            if (getPageRange((oldestPage + i - 1) % pagesCount, &minId, &maxId) != RECORD_OK) {
+                return RECORD_ERROR;
+            }
+            if (maxId) {
+                fromId = maxId;
+                break;
+            }
+        }
+    }
+
+    RecordIndex::reset(fromId);
+
+    uint32_t prevMaxId = 0;
+    for (uint32_t i = start; i < pages; i++) {
+        uint32_t page = (oldestPage + i) % pagesCount;
+        if (i + 1 < pages) {
+            prefetchPage((page + 1) % pagesCount);
+        }
+        uint32_t minId = 0, maxId = 0;
+        if (getPageRange(page, &minId, &maxId) != RECORD_OK) {
+#if RECORD_BEDUG
+            printTagLog(RecordDB::TAG, "error build index: read page=%lu", page);
+#endif
+            RecordIndex::reset(0);
+            return RECORD_ERROR;
+        }
+        if (!maxId) {
+            continue;
+        }
+        if (maxId <= prevMaxId) {
 #if RECORD_BEDUG
-        printTagLog(RecordDB::TAG, "error get new id");
+            printTagLog(RecordDB::TAG, "error build index: page=%lu ids are not monotonic", page);
 #endif
+            RecordIndex::reset(0);
+            return RECORD_ERROR;
+        }
+        RecordIndex::add(page, minId, maxId);
+        prevMaxId = maxId;
+    }
+
+    RecordIndex::setBuilt();
+
+#if RECORD_BEDUG
+    printTagLog(RecordDB::TAG, "index built from id=%lu to id=%lu", fromId, prevMaxId);
+#endif
+
+    return RECORD_OK;
+}
+
+RecordDB::RecordStatus RecordDB::prepareSector(uint32_t sector)
+{
+    uint32_t addrs[PAGES_PER_SECTOR] = {};
+    for (uint32_t i = 0; i < PAGES_PER_SECTOR; i++) {
+        addrs[i] = getPageAddress(sector * PAGES_PER_SECTOR + i);
+        RecordIndex::remove(sector * PAGES_PER_SECTOR + i);
+    }
+
+    // Erases the sector only if it is not empty
+    if (storageDriver.erase(addrs, PAGES_PER_SECTOR) != STORAGE_OK) {
         return RECORD_ERROR;
     }
 
-    *newId = 0;
-    for (unsigned i = 0; i < __arr_len(tmpClust.records); i++) {
-    	if (*newId < tmpClust.records[i].id) {
-    		*newId = tmpClust.records[i].id;
-    	}
+    return RECORD_OK;
+}
+
+RecordDB::RecordStatus RecordDB::isSectorEmpty(uint32_t sector, bool* empty)
+{
+    *empty = false;
+    for (uint32_t i = 0; i < PAGES_PER_SECTOR; i++) {
+        LogPage logPage = {};
+        if (readPage(sector * PAGES_PER_SECTOR + i, &logPage) != RECORD_OK) {
+            return RECORD_ERROR;
+        }
+        if (!isPageEmpty(&logPage)) {
+            return RECORD_OK;
+        }
     }
+    *empty = true;
+    return RECORD_OK;
+}
 
-    if (*newId + 1 <= settings.server_log_id) {
-    	*newId = settings.server_log_id + 1;
-    } else {
-        *newId = *newId + 1;
+void RecordDB::eraseEnd(flash_status_t status)
+{
+    if (status == FLASH_OK) {
+        erasedAhead++;
     }
+    erasing = false;
 
 #if RECORD_BEDUG
-    printTagLog(RecordDB::TAG, "new ID received from address=%08X id=%lu", (unsigned int)address, *newId);
+    printTagLog(RecordDB::TAG, "background erase sector=%lu end status=%u", erasingSector, status);
 #endif
+}
+
+bool RecordDB::isEraseEnd()
+{
+    return flash_w25qxx_async_status() != FLASH_BUSY && !erasing;
+}
+
+RecordDB::RecordStatus RecordDB::findNext(uint32_t id, Record* record)
+{
+    if (!RecordIndex::isBuilt()) {
+        buildIndex();
+    }
+
+    uint32_t indexPage = 0;
+    StorageStatus storageStatus = RecordIndex::findNext(id, &indexPage);
+    if (storageStatus == STORAGE_NOT_FOUND) {
+        return RECORD_NO_LOG;
+    }
+    if (storageStatus == STORAGE_OK) {
+        if (findNextInPage(indexPage, id, record) == RECORD_OK) {
+            return RECORD_OK;
+        }
+        RecordIndex::remove(indexPage);
+    }
+
+    // Binary search of the sector with the record on the FLASH
+    uint32_t oldest = 0, sectors = 0;
+    getDataSectors(&oldest, &sectors);
+
+    uint32_t left = 0, right = sectors;
+    while (left < right) {
+        uint32_t mid = left + (right - left) / 2;
+        uint32_t firstId = 0;
+        if (getSectorFirstId((oldest + mid) % sectorsCount, &firstId) != RECORD_OK) {
+            return RECORD_ERROR;
+        }
+        if (firstId && firstId <= id) {
+            left = mid + 1;
+        } else {
+            right = mid;
+        }
+    }
+
+    // The record is in the last sector with first ID <= id or it is the first one of the next sector
+    uint32_t from = left ? left - 1 : 0;
+    uint32_t to   = (left + 1 < sectors) ? left + 1 : sectors;
+    for (uint32_t i = from * PAGES_PER_SECTOR; i < to * PAGES_PER_SECTOR; i++) {
+        uint32_t page = (oldest * PAGES_PER_SECTOR + i) % (sectorsCount * PAGES_PER_SECTOR);
+        RecordStatus recordStatus = findNextInPage(page, id, record);
+        if (recordStatus != RECORD_NO_LOG) {
+            return recordStatus;
+        }
+    }
 
+    return RECORD_NO_LOG;
+}
+
+RecordDB::RecordStatus RecordDB::findNextInPage(uint32_t page, uint32_t id, Record* record)
+{
+    LogPage logPage = {};
+    if (readPage(page, &logPage) != RECORD_OK) {
+        return RECORD_ERROR;
+    }
+
+    for (uint32_t i = 0; i < SLOTS_PER_PAGE; i++) {
+        if (logPage.offsets[i] == SLOT_EMPTY) {
+            continue;
+        }
+        if (!decodeEntry(&logPage, i, record) || record->id <= id) {
+            continue;
+        }
+        // The next record of the log upload is on the next page: it is read while this one is sent
+        if (page != writePage && (i + 1 == SLOTS_PER_PAGE || logPage.offsets[i + 1] == SLOT_EMPTY)) {
+            prefetchPage((page + 1) % (sectorsCount * PAGES_PER_SECTOR));
+        }
+        return RECORD_OK;
+    }
+
+    return RECORD_NO_LOG;
+}
+
+RecordDB::RecordStatus RecordDB::getPageRange(uint32_t page, uint32_t* minId, uint32_t* maxId)
+{
+    LogPage logPage = {};
+    if (readPage(page, &logPage) != RECORD_OK) {
+        return RECORD_ERROR;
+    }
+
+    *minId = 0;
+    *maxId = 0;
+    for (uint32_t i = 0; i < SLOTS_PER_PAGE; i++) {
+        Record found = {};
+        if (logPage.offsets[i] == SLOT_EMPTY || !decodeEntry(&logPage, i, &found)) {
+            continue;
+        }
+        if (!*minId) {
+            *minId = found.id;
+        }
+        *maxId = found.id;
+    }
+
+    return RECORD_OK;
+}
+
+RecordDB::RecordStatus RecordDB::getSectorFirstId(uint32_t sector, uint32_t* id)
+{
+    uint32_t minId = 0, maxId = 0;
+    if (getPageRange(sector * PAGES_PER_SECTOR, &minId, &maxId) != RECORD_OK) {
+        return RECORD_ERROR;
+    }
+    *id = minId;
+    return RECORD_OK;
+}
+
+RecordDB::RecordStatus RecordDB::readPage(uint32_t page, LogPage* logPage)
+{
+    StorageStatus status = storageDriver.read(
+        getPageAddress(page),
+        reinterpret_cast<uint8_t*>(logPage),
+        sizeof(LogPage)
+    );
+    if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+        printTagLog(RecordDB::TAG, "error read page=%lu", page);
+#endif
+        return RECORD_ERROR;
+    }
     return RECORD_OK;
 }
+
+void RecordDB::prefetchPage(uint32_t page)
+{
+#if STORAGE_DRIVER_USE_BUFFER
+    StorageDriver::prefetch(getPageAddress(page));
+#else
+    (void)page;
+#endif
+}
+
+void RecordDB::setRegion()
+{
+    // The settings journal is at the end of the memory, the log is right below it
+    uint32_t sectors = (flash_w25qxx_get_pages_count() - SettingsDB::getReservedPages()) / PAGES_PER_SECTOR;
+    sectorsCount = RECORD_LOG_SECTORS;
+    if (sectorsCount + 1 > sectors / 2) {
+        sectorsCount = sectors / 2 - 1;
+    }
+    headerAddress = (sectors - sectorsCount - 1) * FLASH_W25_SECTOR_SIZE;
+}
+
+void RecordDB::setWritePage(uint32_t page, const LogPage* logPage)
+{
+    writePage     = page;
+    writeSlot     = 0;
+    writePosition = SLOTS_PER_PAGE;
+    hasWriteBase  = false;
+    writeBaseSlot = 0;
+    if (!logPage) {
+        return;
+    }
+
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(logPage);
+    for (uint32_t i = FLASH_W25_PAGE_SIZE; i > SLOTS_PER_PAGE; i--) {
+        // Torn entries are not in the offsets table but their bytes are not empty
+        if (data[i - 1] != 0xFF) {
+            writePosition = i;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < SLOTS_PER_PAGE; i++) {
+        if (logPage->offsets[i] == SLOT_EMPTY) {
+            continue;
+        }
+        writeSlot = i + 1;
+
+        uint8_t  type = 0;
+        uint64_t fields[ENTRY_FIELDS] = {};
+        bool     valid = false;
+        uint32_t size = parseEntry(logPage, i, &type, fields, &valid);
+        // The last bytes of an entry may be 0xFF
+        if (size && writePosition < logPage->offsets[i] + size) {
+            writePosition = logPage->offsets[i] + size;
+        }
+        if (valid && type == ENTRY_FULL && decodeEntry(logPage, i, &writeBase)) {
+            writeBaseSlot = i;
+            hasWriteBase  = true;
+        }
+    }
+}
+
+bool RecordDB::isWriteSectorStarted()
+{
+    return writePage % PAGES_PER_SECTOR || writeSlot || writePosition > SLOTS_PER_PAGE;
+}
+
+void RecordDB::getDataSectors(uint32_t* oldest, uint32_t* sectors)
+{
+    const uint32_t writeSector = writePage / PAGES_PER_SECTOR;
+
+    // The first not erased sector after the write pointer keeps the oldest records if the log has wrapped
+    for (uint32_t i = 0; i <= erasedAhead + (erasing ? 1 : 0) && i < sectorsCount; i++) {
+        uint32_t sector = getPoolSector(i);
+        uint32_t id = 0;
+        if (getSectorFirstId(sector, &id) != RECORD_OK || !id) {
+            continue;
+        }
+        *oldest  = sector;
+        *sectors = (sector == writeSector) ? sectorsCount : (writeSector + sectorsCount - sector) % sectorsCount + 1;
+        return;
+    }
+
+    *oldest  = 0;
+    *sectors = writeSector + 1;
+}
+
+uint32_t RecordDB::getPoolSector(uint32_t idx)
+{
+    // The write sector itself is not prepared until the write pointer is on its start
+    uint32_t sector = writePage / PAGES_PER_SECTOR;
+    if (isWriteSectorStarted()) {
+        sector++;
+    }
+    return (sector + idx) % sectorsCount;
+}
+
+uint32_t RecordDB::getPageAddress(uint32_t page)
+{
+    return headerAddress + FLASH_W25_SECTOR_SIZE + page * FLASH_W25_PAGE_SIZE;
+}
+
+bool RecordDB::isPageEmpty(const LogPage* logPage)
+{
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(logPage);
+    for (uint32_t i = 0; i < sizeof(LogPage); i++) {
+        if (data[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t RecordDB::encodeEntry(const Record* base, uint32_t baseSlot, const Record* record, uint8_t* data)
+{
+    uint32_t size = 0;
+    if (base) {
+        // Deltas are zigzag encoded: the counters may be reset
+        const int64_t deltas[ENTRY_FIELDS] = {
+            static_cast<int64_t>(record->id) - static_cast<int64_t>(base->id),
+            static_cast<int64_t>(record->time - base->time),
+            static_cast<int64_t>(record->level) - static_cast<int64_t>(base->level),
+            static_cast<int64_t>(record->press) - static_cast<int64_t>(base->press),
+            static_cast<int64_t>(record->pump_wok_time) - static_cast<int64_t>(base->pump_wok_time),
+            static_cast<int64_t>(record->pump_downtime) - static_cast<int64_t>(base->pump_downtime),
+            static_cast<int64_t>(record->inputs) - static_cast<int64_t>(base->inputs),
+        };
+        data[size++] = static_cast<uint8_t>(ENTRY_DELTA | baseSlot);
+        for (uint32_t i = 0; i < ENTRY_FIELDS; i++) {
+            size += Varint::put(data + size, Varint::zigzag(deltas[i]));
+        }
+    } else {
+        const uint64_t fields[ENTRY_FIELDS] = {
+            record->id,
+            record->time,
+            Varint::zigzag(record->level),
+            record->press,
+            record->pump_wok_time,
+            record->pump_downtime,
+            record->inputs,
+        };
+        data[size++] = ENTRY_FULL;
+        for (uint32_t i = 0; i < ENTRY_FIELDS; i++) {
+            size += Varint::put(data + size, fields[i]);
+        }
+    }
+
+    uint16_t crc = crc16_ccitt(data, size);
+    data[size++] = static_cast<uint8_t>(crc >> 8);
+    data[size++] = static_cast<uint8_t>(crc);
+
+    return size;
+}
+
+uint32_t RecordDB::parseEntry(const LogPage* logPage, uint32_t slot, uint8_t* type, uint64_t* fields, bool* valid)
+{
+    *valid = false;
+
+    const uint8_t offset = logPage->offsets[slot];
+    if (offset == SLOT_EMPTY || offset < SLOTS_PER_PAGE) {
+        return 0;
+    }
+
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(logPage) + offset;
+    const uint32_t size = FLASH_W25_PAGE_SIZE - offset;
+
+    uint32_t len = 0;
+    *type = data[len++];
+    for (uint32_t i = 0; i < ENTRY_FIELDS; i++) {
+        uint32_t fieldLen = Varint::get(data + len, size - len, &fields[i]);
+        if (!fieldLen) {
+            return 0;
+        }
+        len += fieldLen;
+    }
+    if (len + sizeof(uint16_t) > size) {
+        return 0;
+    }
+
+    uint16_t crc = static_cast<uint16_t>((data[len] << 8) | data[len + 1]);
+    *valid = (crc == crc16_ccitt(data, len)) && (*type == ENTRY_FULL || (*type & ~0x1F) == ENTRY_DELTA);
+
+    return len + sizeof(uint16_t);
+}
+
+bool RecordDB::decodeEntry(const LogPage* logPage, uint32_t slot, Record* record)
+{
+    uint8_t  type = 0;
+    uint64_t fields[ENTRY_FIELDS] = {};
+    bool     valid = false;
+    parseEntry(logPage, slot, &type, fields, &valid);
+    if (!valid) {
+        return false;
+    }
+
+    if (type == ENTRY_FULL) {
+        record->id            = static_cast<uint32_t>(fields[0]);
+        record->time          = fields[1];
+        record->level         = static_cast<int32_t>(Varint::unzigzag(fields[2]));
+        record->press         = static_cast<uint16_t>(fields[3]);
+        record->pump_wok_time = static_cast<uint32_t>(fields[4]);
+        record->pump_downtime = static_cast<uint32_t>(fields[5]);
+        record->inputs        = static_cast<uint8_t>(fields[6]);
+        return record->id != 0;
+    }
+
+    // A delta entry is decoded by the full record of the page only
+    const uint32_t baseSlot = type & 0x1F;
+    if (baseSlot >= slot ||
+        logPage->offsets[baseSlot] == SLOT_EMPTY ||
+        logPage->offsets[baseSlot] < SLOTS_PER_PAGE ||
+        logPage->data[logPage->offsets[baseSlot] - SLOTS_PER_PAGE] != ENTRY_FULL
+    ) {
+        return false;
+    }
+    Record base = {};
+    if (!decodeEntry(logPage, baseSlot, &base)) {
+        return false;
+    }
+
+    int64_t deltas[ENTRY_FIELDS] = {};
+    for (uint32_t i = 0; i < ENTRY_FIELDS; i++) {
+        deltas[i] = Varint::unzigzag(fields[i]);
+    }
+    record->id            = static_cast<uint32_t>(base.id + deltas[0]);
+    record->time          = base.time + static_cast<uint64_t>(deltas[1]);
+    record->level         = static_cast<int32_t>(base.level + deltas[2]);
+    record->press         = static_cast<uint16_t>(base.press + deltas[3]);
+    record->pump_wok_time = static_cast<uint32_t>(base.pump_wok_time + deltas[4]);
+    record->pump_downtime = static_cast<uint32_t>(base.pump_downtime + deltas[5]);
+    record->inputs        = static_cast<uint8_t>(base.inputs + deltas[6]);
+
+    return record->id != 0;
+}
@@ -5,14 +5,36 @@
 
 #include <stdint.h>
 
-#include "StorageAT.h"
+#include "w25qxx.h"
 
 
 #ifdef DEBUG
 #   define RECORD_BEDUG (0)
 #endif
 
+#ifndef RECORD_LOG_SECTORS
+#   define RECORD_LOG_SECTORS (128)
+#endif
+
+#ifndef RECORD_ERASE_POOL_SIZE
+#   define RECORD_ERASE_POOL_SIZE (2)
+#endif
+
 
+/*
+ * Records are appended to the log region at the end of the FLASH
+ * (one header sector + RECORD_LOG_SECTORS data sectors). The region is
+ * a ring of sectors: a save programs only the next empty entry slot.
+ * eraseTick() keeps RECORD_ERASE_POOL_SIZE sectors ahead of the write
+ * pointer erased, so a save erases a sector only if the pool is empty.
+ *
+ * A log page starts with the table of entry offsets (0xFF - empty slot).
+ * An entry is a full record or a delta from the full record of the same
+ * page, both are varint encoded, so any slot is decoded by two entries.
+ *
+ * The log is formatted only after the server has acknowledged the records
+ * of the old StorageAT clusters, until then RecordLegacy keeps them.
+ */
 class RecordDB
 {
 public:
@@ -42,37 +64,89 @@ public:
 
     void setRecordId(uint32_t recordId);
 
+    // FLASH pages at the end of the memory that are reserved for the record log
+    static uint32_t getReservedPages();
+
+    // Background erase of the sectors ahead of the write pointer (call it when the log is idle)
+    static void eraseTick();
+
+    // ID of the newest saved record (0 - the log is not initialized)
+    static uint32_t getLastId();
+
     Record record = {};
 
 private:
-    static const char* RECORD_PREFIX;
     static const char* TAG;
 
-    static const uint32_t CLUST_MAGIC   = 0xBEDAC0DE;
-    static const uint8_t  CLUST_VERSION = 0x02;
-    static const uint32_t CLUST_SIZE    = (
-		(
-			STORAGE_PAGE_PAYLOAD_SIZE -
-			sizeof(CLUST_MAGIC) -
-			sizeof(CLUST_VERSION)
-		) /
-		sizeof(struct _Record)
-	);
-
-    typedef struct __attribute__((packed)) _RecordClust {
-        uint32_t rcrd_magic;
-        uint8_t  rcrd_ver;
-        Record   records[CLUST_SIZE];
-    } RecordClust;
+    static const uint32_t LOG_MAGIC     = 0xBEDAC0DE;
+    static const uint8_t  LOG_VERSION   = 0x04;
+    static const uint8_t  ENTRY_FULL    = 0xA5;
+    static const uint8_t  ENTRY_DELTA   = 0x40; // | base slot
+    static const uint8_t  SLOT_EMPTY    = 0xFF;
+
+    static constexpr uint32_t PAGES_PER_SECTOR   = FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE;
+    static constexpr uint32_t SLOTS_PER_PAGE     = 24;
+    static constexpr uint32_t ENTRY_SIZE_MAX     = 64;
+    static constexpr uint32_t ENTRY_FIELDS       = 7;
+
+    typedef struct __attribute__((packed)) _LogHeader {
+        uint32_t magic;
+        uint8_t  version;
+        uint16_t sectors;
+    } LogHeader;
+
+    typedef struct __attribute__((packed)) _LogPage {
+        uint8_t offsets[SLOTS_PER_PAGE];                      // Entry offsets in page
+        uint8_t data[FLASH_W25_PAGE_SIZE - SLOTS_PER_PAGE];   // Entries: type, varint fields, CRC16
+    } LogPage;
+
+    static bool     initialized;
+    static uint32_t headerAddress;
+    static uint32_t sectorsCount;
+    static uint32_t writePage;
+    static uint32_t writeSlot;
+    static uint32_t writePosition;
+    static uint32_t lastId;
+
+    static bool     hasWriteBase;
+    static uint32_t writeBaseSlot;
+    static Record   writeBase;
+
+    static uint32_t erasedAhead;
+    static bool     erasing;
+    static uint32_t erasingSector;
 
     uint32_t m_recordId;
 
-    uint32_t m_clustId;
-    RecordClust m_clust;
-
 
     RecordDB() {}
 
-    RecordStatus loadClust(uint32_t address);
-    RecordStatus getNewId(uint32_t *newId);
+    void printRecord();
+
+    static bool         isLegacy();
+    static RecordStatus init();
+    static RecordStatus format();
+    static RecordStatus buildIndex();
+    static RecordStatus prepareSector(uint32_t sector);
+    static RecordStatus isSectorEmpty(uint32_t sector, bool* empty);
+    static void         eraseEnd(flash_status_t status);
+    static bool         isEraseEnd();
+    static RecordStatus findNext(uint32_t id, Record* record);
+    static RecordStatus findNextInPage(uint32_t page, uint32_t id, Record* record);
+    static RecordStatus getPageRange(uint32_t page, uint32_t* minId, uint32_t* maxId);
+    static RecordStatus getSectorFirstId(uint32_t sector, uint32_t* id);
+    static RecordStatus readPage(uint32_t page, LogPage* logPage);
+    static void         prefetchPage(uint32_t page);
+
+    static void     setRegion();
+    static void     setWritePage(uint32_t page, const LogPage* logPage);
+    static bool     isWriteSectorStarted();
+    static void     getDataSectors(uint32_t* oldest, uint32_t* sectors);
+    static uint32_t getPoolSector(uint32_t idx);
+    static uint32_t getPageAddress(uint32_t page);
+    static bool     isPageEmpty(const LogPage* logPage);
+
+    static uint32_t encodeEntry(const Record* base, uint32_t baseSlot, const Record* record, uint8_t* data);
+    static uint32_t parseEntry(const LogPage* logPage, uint32_t slot, uint8_t* type, uint64_t* fields, bool* valid);
+    static bool     decodeEntry(const LogPage* logPage, uint32_t slot, Record* record);
 };
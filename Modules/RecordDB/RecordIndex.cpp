@@ -0,0 +1,131 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "RecordIndex.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "w25qxx.h"
+#include "StorageAT.h"
+
+
+bool RecordIndex::built = false;
+uint32_t RecordIndex::coverFrom = 0;
+unsigned RecordIndex::count = 0;
+RecordIndex::Entry RecordIndex::entries[RECORD_INDEX_SIZE] = {};
+
+
+void RecordIndex::reset(uint32_t fromId)
+{
+    built     = false;
+    coverFrom = fromId;
+    count     = 0;
+    memset(reinterpret_cast<void*>(entries), 0, sizeof(entries));
+}
+
+bool RecordIndex::isBuilt()
+{
+    return built;
+}
+
+void RecordIndex::setBuilt()
+{
+    built = true;
+}
+
+bool RecordIndex::getMax(uint32_t* page, uint32_t* maxId)
+{
+    if (!built || !count) {
+        return false;
+    }
+
+    *page    = entries[count - 1].page;
+    *maxId   = entries[count - 1].maxId;
+    return true;
+}
+
+StorageStatus RecordIndex::findNext(uint32_t id, uint32_t* page)
+{
+    if (!built || id < coverFrom) {
+        return STORAGE_ERROR;
+    }
+
+    unsigned left = 0, right = count;
+    while (left < right) {
+        unsigned mid = left + (right - left) / 2;
+        if (entries[mid].maxId > id) {
+            right = mid;
+        } else {
+            left = mid + 1;
+        }
+    }
+    if (left >= count) {
+        return STORAGE_NOT_FOUND;
+    }
+
+    *page = entries[left].page;
+    return STORAGE_OK;
+}
+
+void RecordIndex::add(uint32_t page, uint32_t minId, uint32_t maxId)
+{
+    if (page >= PAGES_MAX) {
+        return;
+    }
+
+    if (count && entries[count - 1].page == page) {
+        uint32_t pageMinId = entries[count - 1].maxId - entries[count - 1].minDelta;
+        entries[count - 1].maxId    = maxId;
+        entries[count - 1].minDelta = getDelta(pageMinId, maxId);
+        return;
+    }
+
+    remove(page);
+
+    if (count && entries[count - 1].maxId >= maxId) {
+        // IDs are not monotonic anymore: the index has to be rebuilt
+        reset(0);
+        return;
+    }
+
+    if (count >= RECORD_INDEX_SIZE) {
+        coverFrom = entries[0].maxId;
+        removeIdx(0);
+    }
+
+    entries[count].page     = static_cast<uint16_t>(page);
+    entries[count].minDelta = getDelta(minId, maxId);
+    entries[count].maxId    = maxId;
+    count++;
+}
+
+void RecordIndex::remove(uint32_t page)
+{
+    for (unsigned i = 0; i < count; i++) {
+        if (entries[i].page == page) {
+            removeIdx(i);
+            return;
+        }
+    }
+}
+
+uint16_t RecordIndex::getDelta(uint32_t minId, uint32_t maxId)
+{
+    if (maxId - minId > 0xFFFF) {
+        return 0xFFFF;
+    }
+    return static_cast<uint16_t>(maxId - minId);
+}
+
+void RecordIndex::removeIdx(unsigned idx)
+{
+    if (idx >= count) {
+        return;
+    }
+    memmove(
+        reinterpret_cast<void*>(&entries[idx]),
+        reinterpret_cast<void*>(&entries[idx + 1]),
+        (count - idx - 1) * sizeof(Entry)
+    );
+    count--;
+}
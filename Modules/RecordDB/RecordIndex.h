@@ -0,0 +1,54 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#pragma once
+
+
+#include <stdint.h>
+
+#include "w25qxx.h"
+#include "StorageAT.h"
+
+
+#ifndef RECORD_INDEX_SIZE
+#   define RECORD_INDEX_SIZE (64)
+#endif
+
+
+/*
+ * RAM index of the newest record log pages.
+ * Entries are sorted by the max record ID and every record with
+ * ID > coverFrom is guaranteed to be in one of the indexed pages.
+ * Pages are numbered from the start of the log region (not the FLASH),
+ * so the index does not depend on the chip size.
+ */
+class RecordIndex
+{
+public:
+    static void reset(uint32_t fromId);
+    static bool isBuilt();
+    static void setBuilt();
+
+    static bool getMax(uint32_t* page, uint32_t* maxId);
+    static StorageStatus findNext(uint32_t id, uint32_t* page);
+
+    static void add(uint32_t page, uint32_t minId, uint32_t maxId);
+    static void remove(uint32_t page);
+
+    // Max number of the log region pages
+    static constexpr uint32_t PAGES_MAX = 0x10000;
+
+private:
+    typedef struct __attribute__((packed)) _Entry {
+        uint16_t page;     // Log region page
+        uint16_t minDelta; // maxId - min record ID in page
+        uint32_t maxId;    // Max record ID in page
+    } Entry;
+
+    static bool     built;
+    static uint32_t coverFrom;
+    static unsigned count;
+    static Entry    entries[RECORD_INDEX_SIZE];
+
+    static uint16_t getDelta(uint32_t minId, uint32_t maxId);
+    static void removeIdx(unsigned idx);
+};
@@ -0,0 +1,235 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "RecordLegacy.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "StorageAT.h"
+
+#include "glog.h"
+#include "gutils.h"
+#include "settings.h"
+
+
+extern StorageAT storage;
+
+extern settings_t settings;
+
+
+const char* RecordLegacy::PREFIX = "RCR";
+const char* RecordLegacy::TAG    = "RCR";
+
+bool     RecordLegacy::lastIdLoaded = false;
+uint32_t RecordLegacy::lastId       = 0;
+
+
+RecordDB::RecordStatus RecordLegacy::getLastId(uint32_t* id)
+{
+    if (lastIdLoaded) {
+        *id = lastId;
+        return RecordDB::RECORD_OK;
+    }
+
+    uint32_t address = 0;
+    StorageStatus status = storage.find(FIND_MODE_MAX, &address, PREFIX);
+    if (status == STORAGE_NOT_FOUND) {
+        lastId       = 0;
+        lastIdLoaded = true;
+        *id          = lastId;
+        return RecordDB::RECORD_OK;
+    }
+    if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+        printTagLog(RecordLegacy::TAG, "error get last id: find clust");
+#endif
+        return RecordDB::RECORD_ERROR;
+    }
+
+    RecordClust clust = {};
+    if (loadClust(address, &clust) != RecordDB::RECORD_OK) {
+        return RecordDB::RECORD_ERROR;
+    }
+
+    lastId = 0;
+    for (unsigned i = 0; i < CLUST_SIZE; i++) {
+        if (lastId < clust.records[i].id) {
+            lastId = clust.records[i].id;
+        }
+    }
+    lastIdLoaded = true;
+    *id          = lastId;
+
+#if RECORD_BEDUG
+    printTagLog(RecordLegacy::TAG, "last id=%lu in clust address=%08X", lastId, (unsigned int)address);
+#endif
+
+    return RecordDB::RECORD_OK;
+}
+
+RecordDB::RecordStatus RecordLegacy::load(uint32_t id, RecordDB::Record* record)
+{
+    uint32_t address = 0;
+    StorageStatus storageStatus = storage.find(FIND_MODE_EQUAL, &address, PREFIX, id);
+    if (storageStatus == STORAGE_BUSY) {
+        return RecordDB::RECORD_ERROR;
+    }
+    if (storageStatus != STORAGE_OK) {
+        storageStatus = storage.find(FIND_MODE_NEXT, &address, PREFIX, id);
+    }
+    if (storageStatus != STORAGE_OK) {
+        return (storageStatus == STORAGE_NOT_FOUND) ? RecordDB::RECORD_NO_LOG : RecordDB::RECORD_ERROR;
+    }
+
+    RecordClust clust = {};
+    if (loadClust(address, &clust) != RecordDB::RECORD_OK) {
+        return RecordDB::RECORD_ERROR;
+    }
+
+    for (unsigned i = 0; i < CLUST_SIZE; i++) {
+        if (clust.records[i].id == id) {
+            memcpy(reinterpret_cast<void*>(record), reinterpret_cast<void*>(&clust.records[i]), sizeof(RecordDB::Record));
+            return RecordDB::RECORD_OK;
+        }
+    }
+
+    return RecordDB::RECORD_NO_LOG;
+}
+
+RecordDB::RecordStatus RecordLegacy::loadNext(uint32_t id, RecordDB::Record* record)
+{
+    uint32_t address = 0;
+    StorageStatus storageStatus = storage.find(FIND_MODE_NEXT, &address, PREFIX, id);
+    if (storageStatus != STORAGE_OK) {
+#if RECORD_BEDUG
+        printTagLog(RecordLegacy::TAG, "error load next: find next record");
+#endif
+        return (storageStatus == STORAGE_NOT_FOUND) ? RecordDB::RECORD_NO_LOG : RecordDB::RECORD_ERROR;
+    }
+
+    RecordClust clust = {};
+    if (loadClust(address, &clust) != RecordDB::RECORD_OK) {
+        return RecordDB::RECORD_ERROR;
+    }
+
+    // The records of a cluster are saved with increasing IDs
+    for (unsigned i = 0; i < CLUST_SIZE; i++) {
+        if (clust.records[i].id > id) {
+            memcpy(reinterpret_cast<void*>(record), reinterpret_cast<void*>(&clust.records[i]), sizeof(RecordDB::Record));
+            return RecordDB::RECORD_OK;
+        }
+    }
+
+#if RECORD_BEDUG
+    printTagLog(RecordLegacy::TAG, "error load next: find record");
+#endif
+
+    return RecordDB::RECORD_NO_LOG;
+}
+
+RecordDB::RecordStatus RecordLegacy::save(RecordDB::Record* record)
+{
+    uint32_t id = 0;
+    if (getLastId(&id) != RecordDB::RECORD_OK) {
+        return RecordDB::RECORD_ERROR;
+    }
+    record->id = (id + 1 <= settings.server_log_id) ? settings.server_log_id + 1 : id + 1;
+
+    RecordClust clust = {};
+    uint32_t address = 0;
+    StorageFindMode findMode = FIND_MODE_MAX;
+    StorageStatus storageStatus = storage.find(findMode, &address, PREFIX);
+    if (storageStatus == STORAGE_BUSY) {
+        return RecordDB::RECORD_ERROR;
+    }
+
+    bool idFound = false;
+    uint32_t idx = 0;
+    while (storageStatus != STORAGE_OOM) {
+        if (storageStatus != STORAGE_OK) {
+            findMode = FIND_MODE_EMPTY;
+            storageStatus = storage.find(findMode, &address, PREFIX);
+        }
+        if (storageStatus != STORAGE_OK) {
+            findMode = FIND_MODE_MIN;
+            storageStatus = storage.find(findMode, &address, PREFIX);
+        }
+        if (storageStatus != STORAGE_OK) {
+#if RECORD_BEDUG
+            printTagLog(RecordLegacy::TAG, "error save: find address for save record");
+#endif
+            return RecordDB::RECORD_ERROR;
+        }
+
+        if (findMode == FIND_MODE_MIN || findMode == FIND_MODE_EMPTY) {
+            memset(reinterpret_cast<void*>(&clust), 0, sizeof(clust));
+        } else if (loadClust(address, &clust) != RecordDB::RECORD_OK) {
+            return RecordDB::RECORD_ERROR;
+        }
+
+        for (unsigned i = 0; i < CLUST_SIZE; i++) {
+            if (clust.records[i].id == 0) {
+                idFound = true;
+                idx = i;
+                break;
+            }
+        }
+        if (idFound) {
+            break;
+        }
+
+        storageStatus = STORAGE_ERROR;
+    }
+
+    if (!idFound) {
+#if RECORD_BEDUG
+        printTagLog(RecordLegacy::TAG, "error save: find record id in clust");
+#endif
+        return RecordDB::RECORD_ERROR;
+    }
+
+    clust.rcrd_magic = CLUST_MAGIC;
+    clust.rcrd_ver   = CLUST_VERSION;
+    memcpy(reinterpret_cast<void*>(&clust.records[idx]), reinterpret_cast<void*>(record), sizeof(RecordDB::Record));
+
+    storageStatus = storage.rewrite(
+        address,
+        PREFIX,
+        record->id,
+        reinterpret_cast<uint8_t*>(&clust),
+        sizeof(clust)
+    );
+    if (storageStatus != STORAGE_OK) {
+#if RECORD_BEDUG
+        printTagLog(RecordLegacy::TAG, "error save: save clust");
+#endif
+        return RecordDB::RECORD_ERROR;
+    }
+
+    lastId = record->id;
+
+    printTagLog(RecordLegacy::TAG, "record saved on clust address=%08X", (unsigned int)address);
+
+    return RecordDB::RECORD_OK;
+}
+
+RecordDB::RecordStatus RecordLegacy::loadClust(uint32_t address, RecordClust* clust)
+{
+    StorageStatus status = storage.load(address, reinterpret_cast<uint8_t*>(clust), sizeof(RecordClust));
+    if (status != STORAGE_OK) {
+#if RECORD_BEDUG
+        printTagLog(RecordLegacy::TAG, "error load clust");
+#endif
+        return RecordDB::RECORD_ERROR;
+    }
+
+    if (clust->rcrd_magic != CLUST_MAGIC || clust->rcrd_ver != CLUST_VERSION) {
+#if RECORD_BEDUG
+        printTagLog(RecordLegacy::TAG, "error record clust magic or version");
+#endif
+        storage.clearAddress(address);
+        return RecordDB::RECORD_ERROR;
+    }
+
+    return RecordDB::RECORD_OK;
+}
@@ -0,0 +1,57 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#pragma once
+
+
+#include <stdint.h>
+
+#include "StorageAT.h"
+#include "RecordDB.h"
+
+
+/*
+ * Record clusters of the StorageAT ("RCR") saved before the record log.
+ * The log region may overlap the clusters, so RecordDB keeps using them
+ * (the same load and save as before the log) until the server acknowledges
+ * their newest record, the log is formatted after that.
+ */
+class RecordLegacy
+{
+public:
+    /**
+     * @param id Result ID of the newest record in the clusters (0 - no clusters).
+     * @return RECORD_ERROR if the storage is not available.
+     */
+    static RecordDB::RecordStatus getLastId(uint32_t* id);
+
+    static RecordDB::RecordStatus load(uint32_t id, RecordDB::Record* record);
+    static RecordDB::RecordStatus loadNext(uint32_t id, RecordDB::Record* record);
+    // Sets the new record ID and saves the record
+    static RecordDB::RecordStatus save(RecordDB::Record* record);
+
+private:
+    static const char* PREFIX;
+    static const char* TAG;
+
+    static const uint32_t CLUST_MAGIC   = 0xBEDAC0DE;
+    static const uint8_t  CLUST_VERSION = 0x02;
+    static const uint32_t CLUST_SIZE    = (
+        (
+            STORAGE_PAGE_PAYLOAD_SIZE -
+            sizeof(CLUST_MAGIC) -
+            sizeof(CLUST_VERSION)
+        ) /
+        sizeof(RecordDB::Record)
+    );
+
+    typedef struct __attribute__((packed)) _RecordClust {
+        uint32_t         rcrd_magic;
+        uint8_t          rcrd_ver;
+        RecordDB::Record records[CLUST_SIZE];
+    } RecordClust;
+
+    static bool     lastIdLoaded;
+    static uint32_t lastId;
+
+    static RecordDB::RecordStatus loadClust(uint32_t address, RecordClust* clust);
+};
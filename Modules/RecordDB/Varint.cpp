@@ -0,0 +1,39 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "Varint.h"
+
+#include <stdint.h>
+
+
+uint32_t Varint::put(uint8_t* data, uint64_t value)
+{
+    uint32_t len = 0;
+    while (value >= 0x80) {
+        data[len++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    data[len++] = static_cast<uint8_t>(value);
+    return len;
+}
+
+uint32_t Varint::get(const uint8_t* data, uint32_t size, uint64_t* value)
+{
+    *value = 0;
+    for (uint32_t i = 0; i < size && i < SIZE_MAX_BYTES; i++) {
+        *value |= static_cast<uint64_t>(data[i] & 0x7F) << (7 * i);
+        if (!(data[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+uint64_t Varint::zigzag(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+int64_t Varint::unzigzag(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
@@ -0,0 +1,31 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#pragma once
+
+
+#include <stdint.h>
+
+
+/*
+ * LEB128 varints of the record log entries and the upload batch.
+ * Signed values are zigzag encoded: small negative values stay short.
+ */
+class Varint
+{
+public:
+    static constexpr uint32_t SIZE_MAX_BYTES = 10;
+
+    /**
+     * @param data  Buffer (SIZE_MAX_BYTES bytes).
+     * @param value Value to write.
+     * @return Number of the written bytes.
+     */
+    static uint32_t put(uint8_t* data, uint64_t value);
+    /**
+     * @return Number of the read bytes, 0 - the varint is broken.
+     */
+    static uint32_t get(const uint8_t* data, uint32_t size, uint64_t* value);
+
+    static uint64_t zigzag(int64_t value);
+    static int64_t  unzigzag(uint64_t value);
+};
@@ -0,0 +1,238 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+/*
+ * Host test of the record upload codec (RECORD_CODEC_DECODER=1).
+ * Every batch is encoded, split into base64 parts of different lengths,
+ * decoded back and compared with the source records.
+ * Usage: record_codec_test
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "RecordDB.h"
+#include "RecordCodec.h"
+
+
+#define TEST_RECORDS_MAX ((uint32_t)8)
+#define TEST_BATCH_SIZE  (RecordCodec::HEADER_SIZE + TEST_RECORDS_MAX * RecordCodec::RECORD_SIZE_MAX)
+#define TEST_TEXT_SIZE   ((TEST_BATCH_SIZE + 2) / 3 * 4 + 1)
+
+
+typedef struct _test_batch_t {
+    const char*      name;
+    uint32_t         count;
+    RecordDB::Record records[TEST_RECORDS_MAX];
+} test_batch_t;
+
+
+static void _test_base64_vectors();
+static void _test_base64_broken();
+static void _test_batch(const test_batch_t& batch);
+
+
+static unsigned errors = 0;
+static unsigned tails[3] = {};
+
+
+static const test_batch_t batches[] = {
+    {
+        "one record",
+        1,
+        {
+            {1, 1700000000, 125000, 120, 3600, 2592000, 0x01},
+        }
+    },
+    {
+        "increasing records",
+        4,
+        {
+            {100, 1700000000, 125000, 120, 3600, 86400, 0x01},
+            {101, 1700000300, 124993, 121, 3603, 86690, 0x00},
+            {102, 1700000600, 124986, 122, 3606, 86980, 0x3F},
+            {103, 1700000900, 124979, 123, 3609, 87270, 0x02},
+        }
+    },
+    {
+        "negative time delta",
+        3,
+        {
+            {7, 1700000600, 5000, 100, 0, 0, 0},
+            {8, 1700000000, 5000, 100, 0, 0, 0},
+            {9, 0,          5000, 100, 0, 0, 0},
+        }
+    },
+    {
+        "negative level",
+        3,
+        {
+            {10, 1700000000, -1,             0, 1, 2, 3},
+            {11, 1700000300, -125000,        0, 1, 2, 3},
+            {12, 1700000600, INT32_MIN,      0, 1, 2, 3},
+        }
+    },
+    {
+        "non-monotonic ids",
+        4,
+        {
+            {500,        1700000000, 1000, 10, 0, 0, 0},
+            {20,         1700000300, 1000, 10, 0, 0, 0},
+            {UINT32_MAX, 1700000600, 1000, 10, 0, 0, 0},
+            {3,          1700000900, 1000, 10, 0, 0, 0},
+        }
+    },
+    {
+        "field limits",
+        2,
+        {
+            {UINT32_MAX, UINT64_MAX, INT32_MAX, UINT16_MAX, UINT32_MAX, UINT32_MAX, 0xFF},
+            {0,          0,          INT32_MIN, 0,          0,          0,          0x00},
+        }
+    },
+};
+
+
+int main()
+{
+    _test_base64_vectors();
+    _test_base64_broken();
+
+    for (unsigned i = 0; i < sizeof(batches) / sizeof(*batches); i++) {
+        _test_batch(batches[i]);
+    }
+
+    // The batches have to check the base64 text of every data tail
+    for (unsigned i = 0; i < sizeof(tails) / sizeof(*tails); i++) {
+        if (!tails[i]) {
+            printf("no batch with %u tail bytes\n", i);
+            errors++;
+        }
+    }
+
+    printf("errors: %u\n", errors);
+
+    return errors ? 1 : 0;
+}
+
+void _test_base64_vectors()
+{
+    // RFC 4648 test vectors: 0, 1 and 2 bytes in the last group
+    const char* data[] = {"", "f", "fo", "foo", "foob", "fooba", "foobar"};
+    const char* text[] = {"", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy"};
+    for (unsigned i = 0; i < sizeof(data) / sizeof(*data); i++) {
+        const uint32_t size = static_cast<uint32_t>(strlen(data[i]));
+        char result[16] = {};
+        uint32_t len = RecordCodec::encodeBase64(reinterpret_cast<const uint8_t*>(data[i]), size, 0, result, sizeof(result) - 1);
+        if (len != RecordCodec::getBase64Size(size) || strcmp(result, text[i])) {
+            printf("base64 \"%s\": \"%s\" expected \"%s\"\n", data[i], result, text[i]);
+            errors++;
+        }
+
+        uint8_t decoded[16] = {};
+        if (RecordCodec::decodeBase64(text[i], len, decoded, sizeof(decoded)) != size || memcmp(decoded, data[i], size)) {
+            printf("base64 \"%s\": decode error\n", text[i]);
+            errors++;
+        }
+    }
+}
+
+void _test_base64_broken()
+{
+    uint8_t decoded[16] = {};
+    const char* text[] = {"Zg=", "Zm9*", "Zg==Zg=="};
+    for (unsigned i = 0; i < sizeof(text) / sizeof(*text); i++) {
+        if (RecordCodec::decodeBase64(text[i], static_cast<uint32_t>(strlen(text[i])), decoded, sizeof(decoded))) {
+            printf("base64 \"%s\": broken text is decoded\n", text[i]);
+            errors++;
+        }
+    }
+    if (RecordCodec::decodeBase64("Zm9vYmFy", 8, decoded, 5)) {
+        printf("base64: buffer overflow is not refused\n");
+        errors++;
+    }
+}
+
+void _test_batch(const test_batch_t& batch)
+{
+    RecordCodec encoder;
+    uint8_t data[TEST_BATCH_SIZE] = {};
+    uint32_t size = encoder.encodeHeader(data);
+    for (uint32_t i = 0; i < batch.count; i++) {
+        uint32_t len = encoder.encode(batch.records[i], data + size);
+        if (!len || len > RecordCodec::RECORD_SIZE_MAX) {
+            printf("%s: record %u encoded to %u bytes\n", batch.name, i, len);
+            errors++;
+            return;
+        }
+        size += len;
+    }
+    tails[size % 3]++;
+
+    // The text is written by parts as the upload does: every part length is checked
+    const uint32_t textSize = RecordCodec::getBase64Size(size);
+    for (uint32_t part = 1; part <= textSize; part++) {
+        char text[TEST_TEXT_SIZE] = {};
+        uint32_t offset = 0;
+        while (offset < textSize) {
+            uint32_t len = RecordCodec::encodeBase64(data, size, offset, text + offset, part);
+            if (!len) {
+                break;
+            }
+            offset += len;
+        }
+        if (offset != textSize || strlen(text) != textSize) {
+            printf("%s: base64 part=%u length %u expected %u\n", batch.name, part, offset, textSize);
+            errors++;
+            return;
+        }
+
+        uint8_t decoded[TEST_BATCH_SIZE] = {};
+        if (RecordCodec::decodeBase64(text, textSize, decoded, sizeof(decoded)) != size || memcmp(decoded, data, size)) {
+            printf("%s: base64 part=%u decode error\n", batch.name, part);
+            errors++;
+            return;
+        }
+    }
+
+    RecordCodec decoder;
+    uint32_t offset = decoder.decodeHeader(data, size);
+    if (offset != RecordCodec::HEADER_SIZE) {
+        printf("%s: header decode error\n", batch.name);
+        errors++;
+        return;
+    }
+    uint32_t count = 0;
+    while (offset < size) {
+        RecordDB::Record record = {};
+        uint32_t len = decoder.decode(data + offset, size - offset, &record);
+        if (!len) {
+            printf("%s: record %u decode error\n", batch.name, count);
+            errors++;
+            return;
+        }
+        if (count >= batch.count || memcmp(&record, &batch.records[count], sizeof(record))) {
+            printf("%s: record %u does not match\n", batch.name, count);
+            errors++;
+            return;
+        }
+        offset += len;
+        count++;
+    }
+    if (count != batch.count) {
+        printf("%s: %u records decoded, %u expected\n", batch.name, count, batch.count);
+        errors++;
+        return;
+    }
+
+    // A truncated batch has to be refused, not decoded to a wrong record
+    RecordDB::Record record = {};
+    RecordCodec truncated;
+    offset = truncated.decodeHeader(data, size);
+    if (truncated.decode(data + offset, 1, &record)) {
+        printf("%s: truncated record is decoded\n", batch.name);
+        errors++;
+    }
+
+    printf("%-24s %2u records %4u bytes %4u base64 chars\n", batch.name, batch.count, size, textSize);
+}
@@ -0,0 +1,273 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+/*
+ * Host benchmark of RecordDB on the emulated chip (FLASH_EMULATOR=1).
+ * Prints SPI commands, bytes, emulated time and erases per record save
+ * and load and checks that all the saved records are loaded back in order.
+ * Usage: record_db_bench [flash file]
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "StorageAT.h"
+#include "StorageDriver.h"
+
+#include "soul.h"
+#include "clock.h"
+#include "system.h"
+#include "w25qxx.h"
+#include "settings.h"
+#include "RecordDB.h"
+#include "SettingsDB.h"
+#include "w25qxx_emu.h"
+
+
+#define BENCH_FLASH_PATH        "record_db_bench.bin"
+#define BENCH_BLOCKS_COUNT      ((uint32_t)32)  // W25Q16
+#define BENCH_RECORDS_COUNT     ((uint32_t)1000)
+#define BENCH_LOAD_STEP         ((uint32_t)37)
+
+// A save programs the entry and its offset: the protection off and on, the write enable,
+// the program, the write disable and the CRC read-back for each (the status polls are not counted)
+#define BENCH_SAVE_COMMANDS_MAX ((uint32_t)20)
+// The next record is in the cached page mostly, a new page is one read
+#define BENCH_NEXT_COMMANDS_MAX ((uint32_t)1)
+// The page of the record is found by the RAM index: one read
+#define BENCH_LOAD_COMMANDS_MAX ((uint32_t)2)
+
+
+typedef struct _bench_t {
+	const char* name;
+	uint32_t    commands;
+	uint32_t    tx_bytes;
+	uint32_t    rx_bytes;
+	uint64_t    time_us;
+	uint32_t    erases;
+
+	flash_stats_t     flash_start;
+	flash_emu_stats_t emu_start;
+} bench_t;
+
+
+static void _bench_begin(bench_t* bench, const char* name);
+static void _bench_resume(bench_t* bench);
+static void _bench_pause(bench_t* bench);
+static void _bench_end(const bench_t* bench, const uint32_t count);
+static void _bench_expect_commands(const bench_t* bench, const uint32_t count, const uint32_t max_commands);
+static void _bench_fill(RecordDB::Record* record, const uint32_t idx);
+static void _bench_idle();
+
+
+StorageDriver storageDriver;
+StorageAT storage(0, &storageDriver, FLASH_W25_SECTOR_SIZE);
+
+static unsigned errors = 0;
+
+
+extern "C" {
+
+// Utils timers use the HAL tick
+uint32_t HAL_GetTick(void)
+{
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+// The host has no RTC: the record time is printed as seconds
+uint8_t get_clock_date()
+{
+	return 1;
+}
+
+char* get_clock_time_format()
+{
+	static char time[] = "00:00:00";
+	return time;
+}
+
+char* get_clock_time_format_by_sec(uint64_t seconds)
+{
+	static char time[24] = "";
+	snprintf(time, sizeof(time), "%llu s", (unsigned long long)seconds);
+	return time;
+}
+
+char* get_system_serial_str(void)
+{
+	static char serial[] = "bench";
+	return serial;
+}
+
+}
+
+
+int main(int argc, char** argv)
+{
+	const char* path = argc > 1 ? argv[1] : BENCH_FLASH_PATH;
+	unlink(path);
+	if (flash_emu_init(path, BENCH_BLOCKS_COUNT) != FLASH_OK || flash_w25qxx_init() != FLASH_OK) {
+		printf("flash init error\n");
+		return 1;
+	}
+	set_status(MEMORY_INITIALIZED);
+	storage.setPagesCount(flash_w25qxx_get_pages_count() - SettingsDB::getReservedPages() - RecordDB::getReservedPages());
+	settings.server_log_id = 0;
+	set_status(SETTINGS_INITIALIZED);
+
+	bench_t save = {};
+	_bench_begin(&save, "save record");
+	for (uint32_t i = 0; i < BENCH_RECORDS_COUNT; i++) {
+		RecordDB record(0);
+		_bench_fill(&record.record, i);
+
+		_bench_resume(&save);
+		RecordDB::RecordStatus status = record.save();
+		_bench_pause(&save);
+
+		if (status != RecordDB::RECORD_OK || record.record.id != i + 1) {
+			printf("save record %u error\n", i);
+			errors++;
+			break;
+		}
+
+		// The log erases the sectors ahead while it waits for the next record
+		_bench_idle();
+	}
+
+	bench_t load_next = {};
+	_bench_begin(&load_next, "load next record");
+	RecordDB record(0);
+	uint32_t loaded = 0;
+	while (true) {
+		_bench_resume(&load_next);
+		RecordDB::RecordStatus status = record.loadNext();
+		_bench_pause(&load_next);
+		if (status != RecordDB::RECORD_OK) {
+			break;
+		}
+
+		RecordDB::Record expected = {};
+		_bench_fill(&expected, loaded);
+		expected.id = loaded + 1;
+		if (memcmp(&record.record, &expected, sizeof(expected))) {
+			printf("load next record %u: wrong record id=%u\n", loaded + 1, record.record.id);
+			errors++;
+			break;
+		}
+
+		record.setRecordId(record.record.id);
+		loaded++;
+	}
+	if (loaded != BENCH_RECORDS_COUNT) {
+		printf("load next: %u records loaded, %u expected\n", loaded, BENCH_RECORDS_COUNT);
+		errors++;
+	}
+
+	bench_t load = {};
+	_bench_begin(&load, "load record by id");
+	uint32_t loads = 0;
+	for (uint32_t id = 1; id <= BENCH_RECORDS_COUNT; id += BENCH_LOAD_STEP) {
+		RecordDB found(id);
+		_bench_resume(&load);
+		RecordDB::RecordStatus status = found.load();
+		_bench_pause(&load);
+		if (status != RecordDB::RECORD_OK || found.record.id != id) {
+			printf("load record id=%u error\n", id);
+			errors++;
+		}
+		loads++;
+	}
+
+	printf("\n%-24s %10s %10s %10s %10s %8s\n", "operation", "cmd/op", "tx B/op", "rx B/op", "us/op", "erases");
+	_bench_end(&save, BENCH_RECORDS_COUNT);
+	_bench_end(&load_next, loaded);
+	_bench_end(&load, loads);
+
+	_bench_expect_commands(&save, BENCH_RECORDS_COUNT, BENCH_SAVE_COMMANDS_MAX);
+	_bench_expect_commands(&load_next, loaded, BENCH_NEXT_COMMANDS_MAX);
+	_bench_expect_commands(&load, loads, BENCH_LOAD_COMMANDS_MAX);
+
+	flash_emu_deinit();
+	unlink(path);
+
+	printf("errors: %u\n", errors);
+
+	return errors ? 1 : 0;
+}
+
+void _bench_begin(bench_t* bench, const char* name)
+{
+	memset(bench, 0, sizeof(bench_t));
+	bench->name = name;
+}
+
+void _bench_resume(bench_t* bench)
+{
+	flash_w25qxx_get_stats(&bench->flash_start);
+	flash_emu_get_stats(&bench->emu_start);
+}
+
+void _bench_pause(bench_t* bench)
+{
+	flash_stats_t flash = {};
+	flash_emu_stats_t emu = {};
+	flash_w25qxx_get_stats(&flash);
+	flash_emu_get_stats(&emu);
+
+	bench->commands += emu.commands - bench->emu_start.commands;
+	bench->tx_bytes += flash.tx_bytes - bench->flash_start.tx_bytes;
+	bench->rx_bytes += flash.rx_bytes - bench->flash_start.rx_bytes;
+	bench->time_us  += emu.time_us - bench->emu_start.time_us;
+	bench->erases   += emu.erases - bench->emu_start.erases;
+}
+
+void _bench_end(const bench_t* bench, const uint32_t count)
+{
+	if (!count) {
+		return;
+	}
+	printf(
+		"%-24s %10.2f %10u %10u %10llu %8u\n",
+		bench->name,
+		(double)bench->commands / count,
+		bench->tx_bytes / count,
+		bench->rx_bytes / count,
+		(unsigned long long)(bench->time_us / count),
+		bench->erases
+	);
+}
+
+void _bench_expect_commands(const bench_t* bench, const uint32_t count, const uint32_t max_commands)
+{
+	if (count && bench->commands > max_commands * count) {
+		printf(
+			"%s: %.2f commands/op, expected %u commands/op at most\n",
+			bench->name,
+			(double)bench->commands / count,
+			max_commands
+		);
+		errors++;
+	}
+}
+
+void _bench_fill(RecordDB::Record* record, const uint32_t idx)
+{
+	memset(record, 0, sizeof(RecordDB::Record));
+	record->time          = 1700000000ULL + idx * 300;
+	record->level         = 500000 - (int32_t)idx * 7;
+	record->press         = (uint16_t)(120 + idx % 5);
+	record->pump_wok_time = idx * 3;
+	record->pump_downtime = idx * 290;
+	record->inputs        = (uint8_t)(idx & 0x03);
+}
+
+void _bench_idle()
+{
+	RecordDB::eraseTick();
+	while (flash_w25qxx_async_status() == FLASH_BUSY) {}
+}
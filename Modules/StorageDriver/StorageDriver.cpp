@@ -2,11 +2,16 @@
 
 #include "StorageDriver.h"
 
+#include <cstring>
+#include <algorithm>
+
 #include "glog.h"
 #include "soul.h"
+#include "gutils.h"
 #include "bmacro.h"
 
 #include "StorageType.h"
+#include "storage_driver.h"
 
 #ifdef EEPROM_MODE
 #   include "at24cm01.h"
@@ -15,7 +20,8 @@
 #endif
 
 
-#define ERROR_TIMEOUT_MS ((uint32_t)200)
+#define ERROR_TIMEOUT_MS    ((uint32_t)200)
+#define PREFETCH_TIMEOUT_MS ((uint32_t)100)
 
 
 bool StorageDriver::hasError = false;
@@ -23,9 +29,19 @@ utl::Timer StorageDriver::timer(ERROR_TIMEOUT_MS);
 
 #if STORAGE_DRIVER_USE_BUFFER
 
-bool StorageDriver::hasBuffer = false;
-uint8_t StorageDriver::bufferPage[STORAGE_PAGE_SIZE] = {};
-uint32_t StorageDriver::lastAddress = 0;
+StorageDriver::CacheLine StorageDriver::cache[STORAGE_DRIVER_CACHE_SIZE] = {};
+uint32_t StorageDriver::cacheTick = 0;
+uint32_t StorageDriver::cacheHits = 0;
+uint32_t StorageDriver::cacheMisses = 0;
+uint32_t StorageDriver::cacheEvictions = 0;
+
+#endif
+
+#if STORAGE_DRIVER_USE_BUFFER && !defined(EEPROM_MODE)
+
+volatile bool StorageDriver::prefetching = false;
+uint32_t StorageDriver::prefetchAddress = 0;
+StorageDriver::CacheLine* StorageDriver::prefetchLine = nullptr;
 
 #endif
 
@@ -44,8 +60,7 @@ StorageStatus StorageDriver::read(const uint32_t address, uint8_t *data, const u
 
 #if STORAGE_DRIVER_USE_BUFFER
 
-	if (hasBuffer && lastAddress == address && len == STORAGE_PAGE_SIZE) {
-		memcpy(data, bufferPage, len);
+	if (cacheRead(address, data, len)) {
 
 #	if STORAGE_DRIVER_BEDUG
 		printTagLog(TAG, "Copy %lu address start", address);
@@ -89,10 +104,8 @@ StorageStatus StorageDriver::read(const uint32_t address, uint8_t *data, const u
 
 #if STORAGE_DRIVER_USE_BUFFER
 
-    if (lastAddress != address && len == STORAGE_PAGE_SIZE) {
-    	memcpy(bufferPage, data, STORAGE_PAGE_SIZE);
-    	lastAddress = address;
-    	hasBuffer = true;
+    if (len == STORAGE_PAGE_SIZE) {
+    	cacheSave(address, data);
     }
 
 #endif
@@ -117,25 +130,45 @@ StorageStatus StorageDriver::read(const uint32_t address, uint8_t *data, const u
 
 #if STORAGE_DRIVER_USE_BUFFER
 
-	if (hasBuffer && lastAddress == address && len == STORAGE_PAGE_SIZE) {
-		memcpy(data, bufferPage, len);
+	// A missed page is read whole: the next reads of its headers and entries are served from RAM
+	for (uint32_t done = 0; done < len && status == FLASH_OK;) {
+		const uint32_t curAddress  = address + done;
+		const uint32_t pageAddress = (curAddress / STORAGE_PAGE_SIZE) * STORAGE_PAGE_SIZE;
+		const uint32_t part        = std::min(len - done, pageAddress + STORAGE_PAGE_SIZE - curAddress);
+		// Cached pages are copied while the prefetch is in progress, a miss waits for the SPI
+		bool cached = cacheRead(curAddress, data + done, part);
+		if (!cached && prefetching) {
+			prefetchWait();
+			cached = cacheRead(curAddress, data + done, part);
+		}
+		if (cached) {
 
 #	if STORAGE_DRIVER_BEDUG
-		printTagLog(TAG, "Copy %lu address start", address);
+			printTagLog(TAG, "Copy %lu address start", curAddress);
 #	endif
 
-	} else {
-
-#endif
-
-		status = flash_w25qxx_read(address, data, len);
-#if STORAGE_DRIVER_BEDUG
-		printTagLog(TAG, "Read %lu address start", address);
-#endif
+		} else {
+			CacheLine* line = cacheVictim();
+			status = flash_w25qxx_read(pageAddress, line->page, STORAGE_PAGE_SIZE);
+			if (status == FLASH_OK) {
+				line->address = pageAddress;
+				line->used    = ++cacheTick;
+				line->valid   = true;
+				memcpy(data + done, line->page + (curAddress - pageAddress), part);
+			}
+#	if STORAGE_DRIVER_BEDUG
+			printTagLog(TAG, "Read %lu address start", pageAddress);
+#	endif
+		}
+		done += part;
+	}
 
-#if STORAGE_DRIVER_USE_BUFFER
+#else
 
-	}
+	status = flash_w25qxx_read(address, data, len);
+#	if STORAGE_DRIVER_BEDUG
+	printTagLog(TAG, "Read %lu address start", address);
+#	endif
 
 #endif
 	if (hasError && !timer.wait()) {
@@ -160,16 +193,6 @@ StorageStatus StorageDriver::read(const uint32_t address, uint8_t *data, const u
         return STORAGE_ERROR;
     }
 
-#if STORAGE_DRIVER_USE_BUFFER
-
-    if (lastAddress != address && len == STORAGE_PAGE_SIZE) {
-    	memcpy(bufferPage, data, STORAGE_PAGE_SIZE);
-    	lastAddress = address;
-    	hasBuffer = true;
-    }
-
-#endif
-
 #if STORAGE_DRIVER_BEDUG
 	printTagLog(TAG, "Read %lu address success", address);
 #endif
@@ -199,9 +222,7 @@ StorageStatus StorageDriver::write(const uint32_t address, const uint8_t *data,
 
 #if STORAGE_DRIVER_USE_BUFFER
 
-	if (lastAddress == address) {
-		hasBuffer = false;
-	}
+	cacheInvalidate(address, len);
 
 #endif
 
@@ -227,6 +248,14 @@ StorageStatus StorageDriver::write(const uint32_t address, const uint8_t *data,
         return STORAGE_ERROR;
     }
 
+#if STORAGE_DRIVER_USE_BUFFER
+
+	if (len == STORAGE_PAGE_SIZE) {
+		cacheSave(address, data);
+	}
+
+#endif
+
 #if STORAGE_DRIVER_BEDUG
 	printTagLog(TAG, "Write %lu address success", address);
 #endif
@@ -248,13 +277,17 @@ StorageStatus StorageDriver::write(const uint32_t address, const uint8_t *data,
 	printTagLog(TAG, "Write %lu address start", address);
 #endif
 
+#if STORAGE_DRIVER_USE_BUFFER
+
+	prefetchWait();
+
+#endif
+
 	flash_status_t status = flash_w25qxx_write(address, data, len);
 
 #if STORAGE_DRIVER_USE_BUFFER
 
-	if (lastAddress == address) {
-		hasBuffer = false;
-	}
+	cacheInvalidate(address, len);
 
 #endif
 
@@ -280,6 +313,14 @@ StorageStatus StorageDriver::write(const uint32_t address, const uint8_t *data,
         return STORAGE_ERROR;
     }
 
+#if STORAGE_DRIVER_USE_BUFFER
+
+	if (len == STORAGE_PAGE_SIZE) {
+		cacheSave(address, data);
+	}
+
+#endif
+
 #if STORAGE_DRIVER_BEDUG
 	printTagLog(TAG, "Write %lu address success", address);
 #endif
@@ -290,6 +331,303 @@ StorageStatus StorageDriver::write(const uint32_t address, const uint8_t *data,
 #endif
 }
 
+#ifndef EEPROM_MODE
+
+StorageStatus StorageDriver::program(const uint32_t address, const uint8_t *data, const uint32_t len)
+{
+	if (is_error(POWER_ERROR) || is_status(MEMORY_ERROR)) {
+
+#if STORAGE_DRIVER_BEDUG
+		printTagLog(TAG, "Error power");
+#endif
+
+		return STORAGE_ERROR;
+	}
+
+#if STORAGE_DRIVER_BEDUG
+	printTagLog(TAG, "Program %lu address start", address);
+#endif
+
+#if STORAGE_DRIVER_USE_BUFFER
+
+	prefetchWait();
+
+#endif
+
+	flash_status_t status = flash_w25qxx_program(address, data, len);
+
+#if STORAGE_DRIVER_USE_BUFFER
+
+	if (status == FLASH_OK) {
+		cacheUpdate(address, data, len);
+	} else {
+		cacheInvalidate(address, len);
+	}
+
+#endif
+
+	return getWriteStatus(status);
+}
+
+StorageStatus StorageDriver::eraseSectorAsync(const uint32_t address, flash_async_callback_t callback)
+{
+	if (is_error(POWER_ERROR) || is_status(MEMORY_ERROR)) {
+
+#if STORAGE_DRIVER_BEDUG
+		printTagLog(TAG, "Error power");
+#endif
+
+		return STORAGE_ERROR;
+	}
+
+#if STORAGE_DRIVER_BEDUG
+	printTagLog(TAG, "Erase sector %lu address start", address);
+#endif
+
+#if STORAGE_DRIVER_USE_BUFFER
+
+	prefetchWait();
+
+	const uint32_t sectorAddress = (address / FLASH_W25_SECTOR_SIZE) * FLASH_W25_SECTOR_SIZE;
+	cacheInvalidate(sectorAddress, FLASH_W25_SECTOR_SIZE);
+
+#endif
+
+	return getWriteStatus(flash_w25qxx_erase_sector_async(address, callback));
+}
+
+StorageStatus StorageDriver::getWriteStatus(const flash_status_t status)
+{
+	if (hasError && !timer.wait()) {
+		set_status(MEMORY_WRITE_FAULT);
+	}
+	if (!hasError && status != FLASH_OK) {
+		hasError = true;
+		timer.start();
+	}
+#if STORAGE_DRIVER_BEDUG
+	if (status != FLASH_OK) {
+		printTagLog(TAG, "Write error=%u", status);
+	}
+#endif
+	if (status == FLASH_BUSY) {
+		return STORAGE_BUSY;
+	}
+	if (status == FLASH_OOM) {
+		return STORAGE_OOM;
+	}
+	if (status != FLASH_OK) {
+		return STORAGE_ERROR;
+	}
+
+	hasError = false;
+	reset_status(MEMORY_WRITE_FAULT);
+	return STORAGE_OK;
+}
+
+#endif
+
+#if STORAGE_DRIVER_USE_BUFFER && !defined(EEPROM_MODE)
+
+StorageStatus StorageDriver::prefetch(const uint32_t address)
+{
+	if (is_error(POWER_ERROR) || is_status(MEMORY_ERROR)) {
+		return STORAGE_ERROR;
+	}
+
+	// The victim line is not evicted while the SPI is busy
+	if (prefetching || flash_w25qxx_async_status() == FLASH_BUSY) {
+		return STORAGE_BUSY;
+	}
+	const uint32_t pageAddress = (address / STORAGE_PAGE_SIZE) * STORAGE_PAGE_SIZE;
+	for (unsigned i = 0; i < STORAGE_DRIVER_CACHE_SIZE; i++) {
+		if (cache[i].valid && cache[i].address == pageAddress) {
+			return STORAGE_OK;
+		}
+	}
+
+	prefetchLine        = cacheVictim();
+	prefetchLine->valid = false;
+	prefetchAddress     = pageAddress;
+	prefetching         = true;
+
+	flash_status_t status = flash_w25qxx_read_async(pageAddress, prefetchLine->page, STORAGE_PAGE_SIZE, prefetchEnd);
+	if (status != FLASH_OK) {
+		prefetching = false;
+	}
+#if STORAGE_DRIVER_BEDUG
+	printTagLog(TAG, "Prefetch %lu address start status=%u", pageAddress, status);
+#endif
+	if (status == FLASH_BUSY) {
+		return STORAGE_BUSY;
+	}
+	if (status == FLASH_OOM) {
+		return STORAGE_OOM;
+	}
+	if (status != FLASH_OK) {
+		return STORAGE_ERROR;
+	}
+
+	return STORAGE_OK;
+}
+
+void StorageDriver::prefetchEnd(flash_status_t status)
+{
+	if (status == FLASH_OK) {
+		prefetchLine->address = prefetchAddress;
+		prefetchLine->used    = ++cacheTick;
+		prefetchLine->valid   = true;
+	}
+	prefetching = false;
+}
+
+void StorageDriver::prefetchWait()
+{
+	if (prefetching && !util_wait_event(isPrefetchEnd, PREFETCH_TIMEOUT_MS)) {
+#	if STORAGE_DRIVER_BEDUG
+		printTagLog(TAG, "Prefetch %lu address timeout", prefetchAddress);
+#	endif
+		prefetching = false;
+	}
+}
+
+bool StorageDriver::isPrefetchEnd()
+{
+	return flash_w25qxx_async_status() != FLASH_BUSY && !prefetching;
+}
+
+#endif
+
+#if STORAGE_DRIVER_USE_BUFFER
+
+bool StorageDriver::cacheRead(const uint32_t address, uint8_t* data, const uint32_t len)
+{
+	const uint32_t pageAddress = (address / STORAGE_PAGE_SIZE) * STORAGE_PAGE_SIZE;
+	const uint32_t offset      = address - pageAddress;
+	if (offset + len > STORAGE_PAGE_SIZE) {
+		return false;
+	}
+
+	// Partial reads are served from the cached page too
+	for (unsigned i = 0; i < STORAGE_DRIVER_CACHE_SIZE; i++) {
+		if (cache[i].valid && cache[i].address == pageAddress) {
+			memcpy(data, cache[i].page + offset, len);
+			cache[i].used = ++cacheTick;
+			cacheHits++;
+			return true;
+		}
+	}
+
+	cacheMisses++;
+	return false;
+}
+
+void StorageDriver::cacheSave(const uint32_t address, const uint8_t* data)
+{
+	if (address % STORAGE_PAGE_SIZE) {
+		return;
+	}
+
+	for (unsigned i = 0; i < STORAGE_DRIVER_CACHE_SIZE; i++) {
+		if (cache[i].valid && cache[i].address == address) {
+			memcpy(cache[i].page, data, STORAGE_PAGE_SIZE);
+			cache[i].used = ++cacheTick;
+			return;
+		}
+	}
+
+	CacheLine* line = cacheVictim();
+	memcpy(line->page, data, STORAGE_PAGE_SIZE);
+	line->address = address;
+	line->used    = ++cacheTick;
+	line->valid   = true;
+}
+
+void StorageDriver::cacheUpdate(const uint32_t address, const uint8_t* data, const uint32_t len)
+{
+	for (unsigned i = 0; i < STORAGE_DRIVER_CACHE_SIZE; i++) {
+		if (!cache[i].valid ||
+			cache[i].address >= address + len ||
+			address >= cache[i].address + STORAGE_PAGE_SIZE
+		) {
+			continue;
+		}
+		const uint32_t start = std::max(address, cache[i].address);
+		const uint32_t end   = std::min(address + len, cache[i].address + STORAGE_PAGE_SIZE);
+		memcpy(cache[i].page + (start - cache[i].address), data + (start - address), end - start);
+	}
+}
+
+void StorageDriver::cacheInvalidate(const uint32_t address, const uint32_t len)
+{
+	for (unsigned i = 0; i < STORAGE_DRIVER_CACHE_SIZE; i++) {
+		if (cache[i].valid &&
+			cache[i].address < address + len &&
+			address < cache[i].address + STORAGE_PAGE_SIZE
+		) {
+			cache[i].valid = false;
+		}
+	}
+}
+
+StorageDriver::CacheLine* StorageDriver::cacheVictim()
+{
+	CacheLine* victim = nullptr;
+	for (unsigned i = 0; i < STORAGE_DRIVER_CACHE_SIZE; i++) {
+#	ifndef EEPROM_MODE
+		if (prefetching && &cache[i] == prefetchLine) {
+			continue;
+		}
+#	endif
+		if (!cache[i].valid) {
+			return &cache[i];
+		}
+		if (!victim || cache[i].used < victim->used) {
+			victim = &cache[i];
+		}
+	}
+
+	cacheEvictions++;
+	victim->valid = false;
+	return victim;
+}
+
+#endif
+
+void StorageDriver::invalidate(const uint32_t address, const uint32_t len)
+{
+#if STORAGE_DRIVER_USE_BUFFER
+#	ifndef EEPROM_MODE
+	prefetchWait();
+#	endif
+	cacheInvalidate(address, len);
+#endif
+}
+
+void StorageDriver::showStats()
+{
+#if STORAGE_DRIVER_USE_BUFFER
+	printTagLog(
+		TAG,
+		"Page cache: size=%u hits=%lu misses=%lu evictions=%lu",
+		STORAGE_DRIVER_CACHE_SIZE,
+		cacheHits,
+		cacheMisses,
+		cacheEvictions
+	);
+#endif
+#ifndef EEPROM_MODE
+	flash_stats_t stats = {};
+	flash_w25qxx_get_stats(&stats);
+	printTagLog(TAG, "Flash SPI: tx=%lu rx=%lu bytes", stats.tx_bytes, stats.rx_bytes);
+#endif
+}
+
+extern "C" void storage_show_stats()
+{
+	StorageDriver::showStats();
+}
+
 #ifdef EEPROM_MODE
 StorageStatus StorageDriver::erase(const uint32_t*, const uint32_t)
 #else
@@ -313,8 +651,22 @@ StorageStatus StorageDriver::erase(const uint32_t* addresses, const uint32_t cou
 	printTagLog(TAG, "Erase addresses start");
 #endif
 
+#if STORAGE_DRIVER_USE_BUFFER
+
+	prefetchWait();
+
+#endif
+
 	flash_status_t status = flash_w25qxx_erase_addresses(addresses, count);
 
+#if STORAGE_DRIVER_USE_BUFFER
+
+	for (uint32_t i = 0; i < count; i++) {
+		cacheInvalidate(addresses[i], STORAGE_PAGE_SIZE);
+	}
+
+#endif
+
 	if (hasError && !timer.wait()) {
 		set_status(MEMORY_WRITE_FAULT);
 	}
@@ -8,6 +8,10 @@
 #include "Timer.h"
 #include "StorageAT.h"
 
+#ifndef EEPROM_MODE
+#   include "w25qxx.h"
+#endif
+
 
 #ifdef DEBUG
 #   define STORAGE_DRIVER_BEDUG   (0)
@@ -15,6 +19,10 @@
 
 #define STORAGE_DRIVER_USE_BUFFER (1)
 
+#ifndef STORAGE_DRIVER_CACHE_SIZE
+#   define STORAGE_DRIVER_CACHE_SIZE (4)  // Cached pages count
+#endif
+
 
 struct StorageDriver: public IStorageDriver
 {
@@ -25,13 +33,60 @@ private:
 	static utl::Timer timer;
 
 #if STORAGE_DRIVER_USE_BUFFER
-    static bool     hasBuffer;
-    static uint8_t  bufferPage[STORAGE_PAGE_SIZE];
-    static uint32_t lastAddress;
+    struct CacheLine {
+        bool     valid;
+        uint32_t address;
+        uint32_t used;  // Last access tick for LRU
+        uint8_t  page[STORAGE_PAGE_SIZE];
+    };
+
+    static CacheLine cache[STORAGE_DRIVER_CACHE_SIZE];
+    static uint32_t  cacheTick;
+    static uint32_t  cacheHits;
+    static uint32_t  cacheMisses;
+    static uint32_t  cacheEvictions;
+
+    static bool cacheRead(const uint32_t address, uint8_t* data, const uint32_t len);
+    static void cacheSave(const uint32_t address, const uint8_t* data);
+    static void cacheUpdate(const uint32_t address, const uint8_t* data, const uint32_t len);
+    static void cacheInvalidate(const uint32_t address, const uint32_t len);
+    static CacheLine* cacheVictim();
+#endif
+
+#if STORAGE_DRIVER_USE_BUFFER && !defined(EEPROM_MODE)
+    static volatile bool prefetching;
+    static uint32_t      prefetchAddress;
+    static CacheLine*    prefetchLine;
+
+    static void prefetchWait();
+
+    static void prefetchEnd(flash_status_t status);
+    static bool isPrefetchEnd();
+#endif
+
+#ifndef EEPROM_MODE
+    static StorageStatus getWriteStatus(const flash_status_t status);
 #endif
 
 public:
+    // Prints page cache and SPI counters
+    static void showStats();
+    // Drops the cached pages of the range: the memory was changed not by the driver
+    static void invalidate(const uint32_t address, const uint32_t len);
+
+#if STORAGE_DRIVER_USE_BUFFER && !defined(EEPROM_MODE)
+    // Starts the non-blocking read of the page with the address to the cache, read() of this page waits for it
+    static StorageStatus prefetch(const uint32_t address);
+#endif
+
     StorageStatus read(const uint32_t address, uint8_t *data, const uint32_t len) override;
     StorageStatus write(const uint32_t address, const uint8_t *data, const uint32_t len) override;
     StorageStatus erase(const uint32_t*, const uint32_t) override;
+
+#ifndef EEPROM_MODE
+    // Programs erased bytes of one page without the read-modify-write of write()
+    StorageStatus program(const uint32_t address, const uint8_t *data, const uint32_t len);
+    // Starts the non-blocking erase of the sector with the address
+    StorageStatus eraseSectorAsync(const uint32_t address, flash_async_callback_t callback);
+#endif
 };
@@ -0,0 +1,20 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#ifndef _STORAGE_DRIVER_H_
+#define _STORAGE_DRIVER_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+void storage_show_stats();
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -9,8 +9,11 @@
 #include "soul.h"
 #include "pump.h"
 #include "level.h"
+#include "log.h"
 #include "gutils.h"
 #include "settings.h"
+#include "sim_module.h"
+#include "storage_driver.h"
 
 
 #define STR_CMD_SIZE (20)
@@ -22,6 +25,9 @@ static void _clear();
 static void _cmd_status();
 static void _cmd_saveadcmin();
 static void _cmd_saveadcmax();
+static void _cmd_storage();
+static void _cmd_sim();
+static void _cmd_log();
 
 
 typedef struct _action_t {
@@ -34,6 +40,9 @@ static const action_t actions[] = {
 	{"status",     _cmd_status},
 	{"saveadcmin", _cmd_saveadcmin},
 	{"saveadcmax", _cmd_saveadcmax},
+	{"storage",    _cmd_storage},
+	{"sim",        _cmd_sim},
+	{"log",        _cmd_log},
 };
 static const char TAG[] = "CMD";
 static char buffer[2 * STR_CMD_SIZE] = { 0 };
@@ -89,19 +98,35 @@ void _clear()
 void _cmd_status()
 {
 	settings_show();
+	settings_show_dirty();
 	pump_show_status();
 }
 
 void _cmd_saveadcmin()
 {
-	settings.tank_ADC_min = get_level_adc();
+	settings_set_tank_ADC_min(get_level_adc());
 	printTagLog(TAG, "New adc min value: %lu", settings.tank_ADC_min);
-	set_status(NEED_SAVE_SETTINGS);
 }
 
 void _cmd_saveadcmax()
 {
-	settings.tank_ADC_max = get_level_adc();
+	settings_set_tank_ADC_max(get_level_adc());
 	printTagLog(TAG, "New adc min value: %lu", settings.tank_ADC_max);
-	set_status(NEED_SAVE_SETTINGS);
+}
+
+void _cmd_storage()
+{
+	storage_show_stats();
+}
+
+void _cmd_sim()
+{
+	sim_show_rx_stats();
+	sim_show_tx_stats();
+	sim_show_http_stats();
+}
+
+void _cmd_log()
+{
+	log_show_cycle_stats();
 }
@@ -3,6 +3,7 @@
 #include "log.h"
 
 #include <ctype.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdlib.h>
@@ -16,15 +17,40 @@
 #include "gutils.h"
 #include "system.h"
 #include "settings.h"
+#include "settings_backup.h"
 #include "pressure.h"
 #include "sim_module.h"
 
 #include "RecordDB.h"
+#include "RecordCodec.h"
+#include "log_fields.h"
 
 
 #define BASE_SERVER_DELAY_SEC (DAY_MS / SECOND_MS)
 #define SEND_DELAY_NS         (60 * SECOND_MS)
-#define CHAR_PARAM_SIZE       (30)
+#define RETRY_DELAY_MS        (10 * SECOND_MS)
+#define RETRY_DELAY_MAX_MS    (10 * MINUTE_MS)
+#define RETRY_SHIFT_MAX       (6)
+#if LOG_BATCH_MODE
+#   define BATCH_RECORDS      (LOG_BATCH_RECORDS_MAX)
+// The requests are sent back-to-back while the backlog fills the whole batch
+#   define BURST_BACKLOG      (LOG_BATCH_RECORDS_MAX)
+#else
+#   define BATCH_RECORDS      (1)
+#   define BURST_BACKLOG      (2)
+#endif
+#define RECORD_LINE_SIZE      (160)
+// The request header values are not longer than the buffers of their sources
+#define HEADER_SERIAL_LEN     (24) // get_system_serial_str()
+#define HEADER_STATUS_LEN     (34) // get_status_name()
+#define HEADER_TIME_LEN       (29) // get_clock_time_format()
+#define HEADER_NUMBER_LEN     (10) // uint32_t
+#define HEADER_NUMBERS_COUNT  (6)  // fw_id, cf_id, adclevel, enc, backlog, drain
+#define REQUEST_HEADER_SIZE   ( \
+	sizeof("id=\nfw_id=\ncf_id=\nadclevel=\nstatus=\nt=\nenc=\nbacklog=\ndrain=\n") + \
+	HEADER_SERIAL_LEN + HEADER_STATUS_LEN + HEADER_TIME_LEN + HEADER_NUMBERS_COUNT * HEADER_NUMBER_LEN \
+)
+#define RECORDS_SIZE_MAX      (SIM_REQUEST_MAX_SIZE - REQUEST_HEADER_SIZE)
 #define ERRORS_MAX            (5)
 
 
@@ -35,12 +61,31 @@ typedef struct, _log_rtc_ram_t {
 } log_rtc_ram_t;
 )
 
-static bool _find_param(char** dst, const char* src, const char* param);
+static_assert(sizeof(log_rtc_ram_t) <= SYSTEM_RTC_RAM_COUNTERS_IDX - SYSTEM_RTC_RAM_LOG_IDX, "log RTC RAM overlaps the counters");
+static_assert(REQUEST_HEADER_SIZE + RECORD_LINE_SIZE <= SIM_REQUEST_MAX_SIZE, "the request header leaves no place for a record");
+
 static void _make_record(RecordDB& record);
+static unsigned _format_record(char* line, const unsigned size, const RecordDB::Record& rcrd);
+static bool _request_printf(const char* format, ...);
+static bool _request_next_piece();
+static unsigned _request_write(char* chunk, const unsigned size, const unsigned offset);
+static void _batch_begin(struct _log_batch_t* batch, const bool binary, const uint32_t from_id);
+static bool _batch_add_record(struct _log_batch_t* batch, const RecordDB::Record& rcrd);
+static void _prefetch_start(const uint32_t from_id);
+static void _prefetch_tick();
+static bool _prefetch_ready();
+static void _prefetch_take();
+static void _prefetch_cancel();
 static bool _update_time(char* data);
+static void _unknown_field(const char* key, const unsigned length);
 static void _save_rtc_ram_log();
 static void _load_rtc_ram_log();
 static void _clear_log();
+static void _scheduler_update_backlog();
+static void _scheduler_ack(const uint32_t server_log_id);
+static uint32_t _scheduler_next_delay(const bool has_records);
+static uint32_t _scheduler_retry_delay(const uint32_t base_ms);
+static uint32_t _scheduler_random();
 
 
 static void _init_s(void);
@@ -59,29 +104,47 @@ static void send_timeout_a(void);
 static void error_a(void);
 
 
-#if LOG_BEDUG
 static const char* TAG                = "LOG";
-#endif
 
 static const char* T_DASH_FIELD       = "-";
 static const char* T_TIME_FIELD       = "t";
 static const char* T_COLON_FIELD      = ":";
-static const char* TIME_FIELD         = "t";
-static const char* CF_ID_FIELD        = "cf_id";
-static const char* CF_DATA_FIELD      = "cf";
-static const char* CF_PWR_FIELD       = "pwr";
-static const char* CF_LTRMIN_FIELD    = "ltrmin";
-static const char* CF_LTRMAX_FIELD    = "ltrmax";
-static const char* CF_TRGT_FIELD      = "trgt";
-static const char* CF_SLEEP_FIELD     = "sleep";
-static const char* CF_SPEED_FIELD     = "speed";
-static const char* CF_LOGID_FIELD     = "d_hwm";
-static const char* CF_CLEAR_FIELD     = "clr";
-static const char* CF_URL_FIELD       = "url";
-static const char* CF_OUTA_FIELD      = "outa";
-static const char* CF_OUTB_FIELD      = "outb";
-static const char* CF_OUTC_FIELD      = "outc";
-static const char* CF_OUTD_FIELD      = "outd";
+static const char* BATCH_FIELD        = "db=";
+static const char* LINE_END           = "\r\n";
+typedef struct _log_field_info_t {
+	void (*number)(uint32_t value);
+	void (*text)(const char* value);
+} log_field_info_t;
+
+static void _pwr_field(uint32_t value);
+static void _sleep_field(uint32_t value);
+static void _clear_field(uint32_t value);
+static void _outa_field(uint32_t value);
+static void _outb_field(uint32_t value);
+static void _outc_field(uint32_t value);
+static void _outd_field(uint32_t value);
+static void _url_field(const char* value);
+
+// Handlers of the log_field_t response fields
+static constexpr log_field_info_t fields[LOG_FIELDS_COUNT] = {
+	{nullptr,             nullptr},     // t
+	{nullptr,             nullptr},     // d_hwm
+	{nullptr,             nullptr},     // cf_id
+	{nullptr,             nullptr},     // cf
+	{_pwr_field,          nullptr},     // pwr
+	{pump_update_ltrmin,  nullptr},     // ltrmin
+	{pump_update_ltrmax,  nullptr},     // ltrmax
+	{pump_update_target,  nullptr},     // trgt
+	{_sleep_field,        nullptr},     // sleep
+	{pump_update_speed,   nullptr},     // speed
+	{_clear_field,        nullptr},     // clr
+	{_outa_field,         nullptr},     // outa
+	{_outb_field,         nullptr},     // outb
+	{_outc_field,         nullptr},     // outc
+	{_outd_field,         nullptr},     // outd
+	{nullptr,             _url_field},  // url
+	{nullptr,             nullptr},     // enc
+};
 
 
 FSM_GC_CREATE(log_fsm);
@@ -122,53 +185,186 @@ static util_old_timer_t base_server_timer = {};
 
 static bool first_request     = true;
 static bool new_record_loaded = false;
+static bool binary_records    = false;
 static uint32_t sended_id     = 0;
 static RecordDB record(0);
+
+/*
+ * Records of the request: the binary records are one RecordCodec batch.
+ * The next batch is prefetched from the FLASH into the second buffer
+ * while the module sends the request and waits for the response.
+ */
+typedef struct _log_batch_t {
+	bool             binary;
+	union {
+		RecordDB::Record records[BATCH_RECORDS];
+		uint8_t          data[RecordCodec::HEADER_SIZE + BATCH_RECORDS * RecordCodec::RECORD_SIZE_MAX];
+	};
+	unsigned         data_len;
+	RecordCodec      codec;
+	unsigned         count;
+	unsigned         length;   // Request text length of the records
+	uint32_t         from_id;  // The records are loaded after the ID
+	uint32_t         last_id;
+} log_batch_t;
+
+/*
+ * The request is not kept as text: the header and the records are written
+ * into the module chunks by _request_write(), the length is counted before.
+ * The binary records are one "db=" line with the base64 of the batch.
+ */
+typedef struct _log_request_t {
+	char             header[REQUEST_HEADER_SIZE];
+	unsigned         header_len;
+	bool             header_overflow;
+	log_batch_t*     batch;
+	unsigned         length;
+
+	char             line[RECORD_LINE_SIZE];
+	const char*      line_ptr; // nullptr - the batch base64 text
+	unsigned         line_len;
+	unsigned         line_pos;
+	unsigned         piece;
+} log_request_t;
+
+typedef struct _log_prefetch_t {
+	log_batch_t*     batch;
+	bool             active;
+} log_prefetch_t;
+
+typedef struct _log_cycle_t {
+	uint32_t          check_ms; // The module network check start
+	uint32_t          send_ms;  // The request build start
+	uint32_t          sent_ms;  // The request is given to the module
+	log_cycle_stats_t stats;
+} log_cycle_t;
+
+static log_batch_t batches[2] = {};
+static log_request_t request = {};
+static log_prefetch_t prefetch = {};
+static log_cycle_t cycle = {};
 static log_rtc_ram_t log_rtc_ram = {};
 static unsigned base_server_erros = 0;
 
+/*
+ * Upload scheduler: the backlog is counted from the newest record ID and the server
+ * acknowledged ID, the drain rate is the smoothed count of the acknowledged records per hour.
+ */
+typedef struct _log_scheduler_t {
+	uint32_t backlog;
+	uint32_t drain_rate;
+	uint32_t ack_id;
+	uint32_t ack_ms;
+	unsigned failures;
+	uint32_t seed;
+} log_scheduler_t;
+
+static log_scheduler_t scheduler = {};
+
 
 void log_init()
 {
 	fsm_gc_init(&log_fsm, log_fsm_table, __arr_len(log_fsm_table));
+
+	request.batch  = &batches[0];
+	prefetch.batch = &batches[1];
+
+	// The retry jitter differs between the devices
+	scheduler.seed = HAL_GetUIDw0() ^ HAL_GetUIDw1() ^ HAL_GetUIDw2() ^ getMillis();
+	if (!scheduler.seed) {
+		scheduler.seed = 1;
+	}
+}
+
+void log_get_cycle_stats(log_cycle_stats_t* stats)
+{
+	*stats = cycle.stats;
+}
+
+void log_show_cycle_stats()
+{
+	printTagLog(
+		TAG,
+		"upload: cycles=%lu prefetched=%lu last: net=%lums build=%lums flight=%lums parse=%lums cycle=%lums",
+		cycle.stats.cycles,
+		cycle.stats.prefetched,
+		cycle.stats.net_ms,
+		cycle.stats.build_ms,
+		cycle.stats.flight_ms,
+		cycle.stats.parse_ms,
+		cycle.stats.cycle_ms
+	);
 }
 
 void log_tick()
 {
 	fsm_gc_proccess(&log_fsm);
+
+	if (fsm_gc_is_state(&log_fsm, &idle_s)) {
+		RecordDB::eraseTick();
+	}
 }
 
-bool _find_param(char** dst, const char* src, const char* param)
+void _unknown_field(const char* key, const unsigned length)
 {
-	char search_param[CHAR_PARAM_SIZE] = {0};
-	if (strlen(param) > sizeof(search_param) - 3) {
-		return false;
-	}
+#if LOG_BEDUG
+	printTagLog(TAG, "unknown response key \"%.*s\"", (int)length, key);
+#else
+	(void)key;
+	(void)length;
+#endif
+}
 
-	char* ptr = NULL;
+void _pwr_field(uint32_t value)
+{
+	pump_update_enable_state(value);
+}
 
-	snprintf(search_param, sizeof(search_param), "\n%s=", param);
-	ptr = strnstr(src, search_param, strlen(src));
-	if (ptr) {
-		*dst = ptr + strlen(search_param);
-		return true;
-	}
+void _sleep_field(uint32_t value)
+{
+	set_settings_sleep(value * SECOND_MS);
+	_load_rtc_ram_log();
+}
 
-	snprintf(search_param, sizeof(search_param), "=%s=", param);
-	ptr = strnstr(src, search_param, strlen(src));
-	if (ptr) {
-		*dst = ptr + strlen(search_param);
-		return true;
+void _clear_field(uint32_t value)
+{
+	if (value == 1) {
+		_clear_log();
 	}
+}
 
-	snprintf(search_param, sizeof(search_param), ";%s=", param);
-	ptr = strnstr(src, search_param, strlen(src));
-	if (ptr) {
-		*dst = ptr + strlen(search_param);
-		return true;
-	}
+void _outa_field(uint32_t value)
+{
+	settings_set_output(0, value ? 1 : 0);
+}
 
-	return false;
+void _outb_field(uint32_t value)
+{
+	settings_set_output(1, value ? 1 : 0);
+}
+
+void _outc_field(uint32_t value)
+{
+	settings_set_output(2, value ? 1 : 0);
+}
+
+void _outd_field(uint32_t value)
+{
+	settings_set_output(3, value ? 1 : 0);
+}
+
+void _url_field(const char* value)
+{
+	char url[CHAR_SETIINGS_SIZE] = "";
+	for (unsigned i = 0; i < __min(strlen(value), sizeof(url) - 1); i++) {
+		if (value[i] == ';' ||
+			isspace(value[i])
+		) {
+			break;
+		}
+		url[i] = value[i];
+	}
+	set_settings_url(url);
 }
 
 void _make_record(RecordDB& record)
@@ -195,6 +391,266 @@ void _make_record(RecordDB& record)
 	}
 }
 
+unsigned _format_record(char* line, const unsigned size, const RecordDB::Record& rcrd)
+{
+	int len = snprintf(
+		line,
+		size,
+		"d="
+			"id=%lu;"
+			"t=%s;"
+			"level=%ld;"
+			"press=%u.%02u;"
+			"pumpw=%lu;"
+			"inp1=%u;"
+			"inp2=%u;"
+			"inp3=%u;"
+			"inp4=%u;"
+			"inp5=%u;"
+			"inp6=%u;"
+			"pumpd=%lu\r\n",
+		rcrd.id,
+		get_clock_time_format_by_sec(rcrd.time),
+		rcrd.level,
+		rcrd.press / 100, rcrd.press % 100,
+		rcrd.pump_wok_time,
+		(unsigned)__get_bit(rcrd.inputs, 0),
+		(unsigned)__get_bit(rcrd.inputs, 1),
+		(unsigned)__get_bit(rcrd.inputs, 2),
+		(unsigned)__get_bit(rcrd.inputs, 3),
+		(unsigned)__get_bit(rcrd.inputs, 4),
+		(unsigned)__get_bit(rcrd.inputs, 5),
+		rcrd.pump_downtime
+	);
+	if (len < 0) {
+		return 0;
+	}
+	return __min((unsigned)len, size - 1);
+}
+
+bool _request_printf(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(
+		request.header + request.header_len,
+		sizeof(request.header) - request.header_len,
+		format,
+		args
+	);
+	va_end(args);
+	// A cut field would break the line of the next one: the request is not sent
+	if (len < 0 || request.header_len + (unsigned)len >= sizeof(request.header)) {
+		request.header[request.header_len] = 0;
+		request.header_overflow = true;
+		return false;
+	}
+	request.header_len += (unsigned)len;
+	return true;
+}
+
+void _batch_begin(log_batch_t* batch, const bool binary, const uint32_t from_id)
+{
+	batch->binary   = binary;
+	batch->data_len = binary ? batch->codec.encodeHeader(batch->data) : 0;
+	batch->count    = 0;
+	batch->length   = 0;
+	batch->from_id  = from_id;
+	batch->last_id  = from_id;
+}
+
+bool _batch_add_record(log_batch_t* batch, const RecordDB::Record& rcrd)
+{
+	if (batch->count >= BATCH_RECORDS) {
+		return false;
+	}
+	// The rejected record does not change the batch and its codec state
+	RecordCodec codec = batch->codec;
+	uint8_t  data[RecordCodec::RECORD_SIZE_MAX] = {};
+	unsigned data_size = 0;
+	unsigned length    = 0;
+	if (batch->binary) {
+		data_size = codec.encode(rcrd, data);
+		length    = strlen(BATCH_FIELD) + RecordCodec::getBase64Size(batch->data_len + data_size) + strlen(LINE_END);
+	} else {
+		// The request line is not changed: the prefetch runs while the request is written
+		char line[RECORD_LINE_SIZE] = "";
+		length = batch->length + _format_record(line, sizeof(line), rcrd);
+	}
+	if (length > RECORDS_SIZE_MAX) {
+		return false;
+	}
+	if (batch->binary) {
+		memcpy(batch->data + batch->data_len, data, data_size);
+		batch->data_len += data_size;
+		batch->codec     = codec;
+	} else {
+		batch->records[batch->count] = rcrd;
+	}
+	batch->length   = length;
+	batch->last_id  = rcrd.id;
+	batch->count++;
+	return true;
+}
+
+void _prefetch_start(const uint32_t from_id)
+{
+	_batch_begin(prefetch.batch, binary_records, from_id);
+	prefetch.active = true;
+}
+
+void _prefetch_tick()
+{
+	if (!prefetch.active) {
+		return;
+	}
+	// One record is loaded per tick
+	record.setRecordId(prefetch.batch->last_id);
+	if (record.loadNext() != RecordDB::RECORD_OK ||
+		!_batch_add_record(prefetch.batch, record.record) ||
+		prefetch.batch->count >= BATCH_RECORDS
+	) {
+		prefetch.active = false;
+	}
+}
+
+bool _prefetch_ready()
+{
+	// The server acknowledged the whole previous request and the encoding is not changed
+	return prefetch.batch->count &&
+		prefetch.batch->from_id == settings.server_log_id &&
+		prefetch.batch->binary == binary_records;
+}
+
+void _prefetch_take()
+{
+	log_batch_t* batch = request.batch;
+	request.batch   = prefetch.batch;
+	prefetch.batch  = batch;
+	prefetch.active = false;
+}
+
+void _prefetch_cancel()
+{
+	prefetch.active       = false;
+	prefetch.batch->count = 0;
+}
+
+unsigned _request_write(char* chunk, const unsigned size, const unsigned offset)
+{
+	if (!offset) {
+		request.piece    = 0;
+		request.line_ptr = request.header;
+		request.line_len = request.header_len;
+		request.line_pos = 0;
+	}
+
+	unsigned len = 0;
+	while (len < size) {
+		if (request.line_pos >= request.line_len) {
+			if (!_request_next_piece()) {
+				break;
+			}
+			continue;
+		}
+		unsigned part = __min(size - len, request.line_len - request.line_pos);
+		if (request.line_ptr) {
+			memcpy(chunk + len, request.line_ptr + request.line_pos, part);
+		} else {
+			RecordCodec::encodeBase64(request.batch->data, request.batch->data_len, request.line_pos, chunk + len, part);
+		}
+		request.line_pos += part;
+		len += part;
+	}
+	return len;
+}
+
+bool _request_next_piece()
+{
+	const log_batch_t* batch = request.batch;
+	request.line_pos = 0;
+	if (!batch->binary) {
+		if (request.piece >= batch->count) {
+			return false;
+		}
+		// The record line is formatted again: the same record gives the same line
+		request.line_ptr = request.line;
+		request.line_len = _format_record(request.line, sizeof(request.line), batch->records[request.piece++]);
+		return true;
+	}
+
+	if (!batch->count) {
+		return false;
+	}
+	switch (request.piece++) {
+	case 0:
+		request.line_ptr = BATCH_FIELD;
+		request.line_len = strlen(BATCH_FIELD);
+		return true;
+	case 1:
+		request.line_ptr = nullptr;
+		request.line_len = RecordCodec::getBase64Size(batch->data_len);
+		return true;
+	case 2:
+		request.line_ptr = LINE_END;
+		request.line_len = strlen(LINE_END);
+		return true;
+	default:
+		return false;
+	}
+}
+
+void _scheduler_update_backlog()
+{
+	uint32_t last_id = RecordDB::getLastId();
+	scheduler.backlog = last_id > settings.server_log_id ? last_id - settings.server_log_id : 0;
+}
+
+void _scheduler_ack(const uint32_t server_log_id)
+{
+	uint32_t time = getMillis();
+	if (scheduler.ack_ms && server_log_id >= scheduler.ack_id) {
+		uint32_t delay = __max(time - scheduler.ack_ms, (uint32_t)1);
+		uint32_t rate  = (uint32_t)((uint64_t)(server_log_id - scheduler.ack_id) * 60 * MINUTE_MS / delay);
+		scheduler.drain_rate = (3 * scheduler.drain_rate + rate) / 4;
+	}
+	scheduler.ack_id = server_log_id;
+	scheduler.ack_ms = time;
+}
+
+uint32_t _scheduler_next_delay(const bool has_records)
+{
+	scheduler.failures = 0;
+	_scheduler_update_backlog();
+	if (!has_records || !scheduler.backlog) {
+		// Caught up: the server is still asked every SEND_DELAY_NS for its commands
+		return __min(settings.sleep_ms, (uint32_t)SEND_DELAY_NS);
+	}
+	if (scheduler.backlog >= BURST_BACKLOG) {
+		return 0;
+	}
+	return GENERAL_TIMEOUT_MS;
+}
+
+uint32_t _scheduler_retry_delay(const uint32_t base_ms)
+{
+	uint32_t delay = base_ms << __min(scheduler.failures, (unsigned)RETRY_SHIFT_MAX);
+	delay = __max(__min(delay, (uint32_t)RETRY_DELAY_MAX_MS), base_ms);
+	scheduler.failures++;
+	// The devices that lost the server at the same time do not retry together,
+	// the jitter is added on top so the first retry is not sooner than base_ms
+	return delay + _scheduler_random() % (delay / 4 + 1);
+}
+
+uint32_t _scheduler_random()
+{
+	// xorshift32
+	scheduler.seed ^= scheduler.seed << 13;
+	scheduler.seed ^= scheduler.seed >> 17;
+	scheduler.seed ^= scheduler.seed << 5;
+	return scheduler.seed;
+}
+
 bool _update_time(char* data)
 {
 	// Parse time
@@ -257,7 +713,7 @@ bool _update_time(char* data)
 void _save_rtc_ram_log()
 {
 	for (uint8_t i = 0; i < sizeof(log_rtc_ram); i++) {
-		if (!set_system_rtc_ram(i, ((uint8_t*)&log_rtc_ram)[i])) {
+		if (!set_system_rtc_ram(SYSTEM_RTC_RAM_LOG_IDX + i, ((uint8_t*)&log_rtc_ram)[i])) {
 			return;
 		}
 	}
@@ -269,7 +725,7 @@ void _load_rtc_ram_log()
 	uint64_t sleep_sec = settings.sleep_ms / SECOND_MS;
 	uint8_t byte = 0;
 	for (uint8_t i = 0; i < sizeof(log_rtc_ram); i++) {
-		if (get_system_rtc_ram(i, &byte)) {
+		if (get_system_rtc_ram(SYSTEM_RTC_RAM_LOG_IDX + i, &byte)) {
 			((uint8_t*)&log_rtc_ram)[i] = byte;
 		} else {
 			memset(&log_rtc_ram, 0xFF, sizeof(log_rtc_ram));
@@ -305,12 +761,13 @@ void _load_rtc_ram_log()
 
 void _clear_log()
 {
-	settings.server_log_id = 0;
-	settings.cf_id = 0;
-	settings.pump_work_sec = 0;
-	settings.pump_work_day_sec = 0;
-	settings.pump_downtime_sec = 0;
-	set_status(NEED_SAVE_SETTINGS);
+	_prefetch_cancel();
+	settings_set_server_log_id(0);
+	settings_set_cf_id(0);
+	settings_set_pump_work_sec(0);
+	settings_set_pump_work_day_sec(0);
+	settings_set_pump_downtime_sec(0);
+	settings_backup_counters();
 }
 
 void _init_s(void)
@@ -354,6 +811,8 @@ void _check_net_s(void)
 
 void _send_s(void)
 {
+	_prefetch_tick();
+
 	if (has_http_response()) {
 		fsm_gc_push_event(&log_fsm, &success_e);
 	}
@@ -375,6 +834,7 @@ void init_tims_a(void)
 
 void check_net_a(void)
 {
+	cycle.check_ms = getMillis();
 	util_old_timer_start(&timer, 5 * SECOND_MS);
 }
 
@@ -386,13 +846,17 @@ void save_a(void)
 #if LOG_BEDUG
 		printTagLog(TAG, "Saving record");
 #endif
-		settings.pump_work_sec = 0;
-		settings.pump_downtime_sec = 0;
-		set_status(NEED_SAVE_SETTINGS);
+		settings_set_pump_work_sec(0);
+		settings_set_pump_downtime_sec(0);
+		settings_backup_counters();
 		reset_status(NEW_RECORD_WAS_NOT_SAVED);
 		log_rtc_ram.log_time = record.record.time;
 		_save_rtc_ram_log();
 		util_old_timer_start(&log_timer, settings.sleep_ms);
+		// The new record is sent without waiting for the caught-up delay, the retry backoff is kept
+		if (!scheduler.failures) {
+			util_old_timer_start(&send_timer, GENERAL_TIMEOUT_MS);
+		}
 	} else {
 		set_status(NEW_RECORD_WAS_NOT_SAVED);
 		util_old_timer_start(&log_timer, GENERAL_TIMEOUT_MS);
@@ -412,7 +876,10 @@ void base_a(void)
 
 void check_timeout_a(void)
 {
-	util_old_timer_start(&send_timer, 10 * SECOND_MS);
+	util_old_timer_start(&send_timer, _scheduler_retry_delay(RETRY_DELAY_MS));
+#if LOG_BEDUG
+	printTagLog(TAG, "network timeout: retry in %lu ms", send_timer.delay);
+#endif
 }
 
 void send_a(void)
@@ -420,10 +887,13 @@ void send_a(void)
 #if LOG_BEDUG
 	printTagLog(TAG, "Sending request");
 #endif
-	char data[SIM_LOG_SIZE] = {};
-	snprintf(
-		data,
-		sizeof(data),
+	cycle.stats.net_ms   = getMillis() - cycle.check_ms;
+	cycle.stats.cycle_ms = cycle.send_ms ? getMillis() - cycle.send_ms : 0;
+	cycle.send_ms        = getMillis();
+
+	request.header_len      = 0;
+	request.header_overflow = false;
+	_request_printf(
 		"id=%s\n"
 		"fw_id=%u\n"
 		"cf_id=%lu\n",
@@ -432,30 +902,31 @@ void send_a(void)
 		is_base_server() ? 0 : settings.cf_id
 	);
 	if (!settings.calibrated) {
-		snprintf(
-			data + strlen(data),
-			sizeof(data) - strlen(data),
-			"adclevel=%lu\n",
-			get_level_adc()
-		);
+		_request_printf("adclevel=%lu\n", get_level_adc());
 	}
 	if (has_errors()) {
-		snprintf(
-			data + strlen(data),
-			sizeof(data) - strlen(data),
-			"status=%s\n",
-			get_status_name(get_first_error())
-		);
-	}
-	snprintf(
-		data + strlen(data),
-		sizeof(data) - strlen(data),
-		"t=%s\n",
-		get_clock_time_format()
-	);
+		_request_printf("status=%s\n", get_status_name(get_first_error()));
+	}
+	_request_printf("t=%s\n", get_clock_time_format());
+#if LOG_BINARY_RECORDS
+	_request_printf("enc=%u\n", RecordCodec::VERSION);
+#endif
+	_scheduler_update_backlog();
+	_request_printf("backlog=%lu\ndrain=%lu\n", scheduler.backlog, scheduler.drain_rate);
+	if (request.header_overflow) {
+#if LOG_BEDUG
+		printTagLog(TAG, "error request: header is longer than %u bytes", (unsigned)sizeof(request.header));
+#endif
+		fsm_gc_push_event(&log_fsm, &error_e);
+		return;
+	}
 
+	// The prefetched records are not loaded again
+	bool prefetched = !first_request && !is_base_server() && _prefetch_ready();
 	RecordDB::RecordStatus recordStatus = RecordDB::RECORD_NO_LOG;
-	if (!new_record_loaded && is_status(HAS_NEW_RECORD)) {
+	if (prefetched) {
+		recordStatus = RecordDB::RECORD_OK;
+	} else if (!new_record_loaded && is_status(HAS_NEW_RECORD)) {
 		record.setRecordId(settings.server_log_id);
 		recordStatus = record.loadNext();
 	}
@@ -466,6 +937,7 @@ void send_a(void)
 		printTagLog(TAG, "error load record");
 #endif
 	}
+	bool live_record = false;
 	if (!first_request && is_status(NEW_RECORD_WAS_NOT_SAVED)) {
 		util_old_timer_start(&log_timer, settings.sleep_ms);
 #if LOG_BEDUG
@@ -477,46 +949,46 @@ void send_a(void)
 		log_rtc_ram.log_time = record.record.time;
 		_save_rtc_ram_log();
 		record.record.id = settings.server_log_id + 1;
+		live_record = true;
+		prefetched  = false;
 	}
 	if (!first_request &&
 		// settings.calibrated &&
 		recordStatus == RecordDB::RECORD_OK &&
 		!is_base_server()
 	) {
-		snprintf(
-			data + strlen(data),
-			sizeof(data) - strlen(data),
-			"d="
-				"id=%lu;"
-				"t=%s;"
-				"level=%ld;"
-				"press=%u.%02u;"
-				"pumpw=%lu;"
-				"inp1=%u;"
-				"inp2=%u;"
-				"inp3=%u;"
-				"inp4=%u;"
-				"inp5=%u;"
-				"inp6=%u;"
-				"pumpd=%lu\r\n",
-			record.record.id,
-			get_clock_time_format_by_sec(record.record.time),
-			record.record.level,
-			record.record.press / 100, record.record.press % 100,
-			record.record.pump_wok_time,
-			(unsigned)__get_bit(record.record.inputs, 0),
-			(unsigned)__get_bit(record.record.inputs, 1),
-			(unsigned)__get_bit(record.record.inputs, 2),
-			(unsigned)__get_bit(record.record.inputs, 3),
-			(unsigned)__get_bit(record.record.inputs, 4),
-			(unsigned)__get_bit(record.record.inputs, 5),
-			record.record.pump_downtime
-		);
+		if (prefetched) {
+			_prefetch_take();
+			cycle.stats.prefetched++;
+		} else {
+			_batch_begin(request.batch, binary_records, settings.server_log_id);
+			_batch_add_record(request.batch, record.record);
+#if LOG_BATCH_MODE
+			for (unsigned i = 1; !live_record && i < LOG_BATCH_RECORDS_MAX; i++) {
+				record.setRecordId(request.batch->last_id);
+				if (record.loadNext() != RecordDB::RECORD_OK) {
+					break;
+				}
+				if (!_batch_add_record(request.batch, record.record)) {
+					break;
+				}
+			}
+#endif
+		}
 		new_record_loaded = true;
-		sended_id = record.record.id;
+		sended_id = request.batch->last_id;
 	} else {
+		_batch_begin(request.batch, binary_records, settings.server_log_id);
 		sended_id = 0;
 	}
+	request.length = request.header_len + request.batch->length;
+
+	// The next records are loaded while the module sends the request
+	if (sended_id && !live_record) {
+		_prefetch_start(sended_id);
+	} else {
+		_prefetch_cancel();
+	}
 
 	if (is_status(DS1307_READY)) {
 		new_record_loaded = false;
@@ -524,9 +996,11 @@ void send_a(void)
 
 
 #if LOG_BEDUG
-	printTagLog(TAG, "request:\n%s", data);
+	printTagLog(TAG, "request: %u bytes, %u records\n%s", request.length, request.batch->count, request.header);
 #endif
-	send_sim_http_post(data);
+	send_sim_http_post(request.length, _request_write);
+	cycle.sent_ms        = getMillis();
+	cycle.stats.build_ms = cycle.sent_ms - cycle.send_ms;
 
 	util_old_timer_start(&timer,      30 * SECOND_MS);
 	util_old_timer_start(&send_timer, 10 * SECOND_MS);
@@ -536,8 +1010,10 @@ void parse_a(void)
 {
 	fsm_gc_clear(&log_fsm);
 
+	uint32_t parse_ms = getMillis();
+	cycle.stats.flight_ms = parse_ms - cycle.sent_ms;
+
 	char* var_ptr = get_response();
-	char* data_ptr = var_ptr;
 
 	if (is_base_server()) {
 		log_rtc_ram.base_server_time = get_clock_timestamp();
@@ -556,14 +1032,17 @@ void parse_a(void)
 		return;
 	}
 
-	if (!_find_param(&data_ptr, var_ptr, TIME_FIELD)) {
+	char* values[LOG_FIELDS_COUNT] = {};
+	log_fields_parse(var_ptr, values, _unknown_field);
+
+	if (!values[LOG_FIELD_TIME]) {
 #if LOG_BEDUG
 		printTagLog(TAG, "unable to parse response (no time) - [%s]", var_ptr);
 #endif
 		return;
 	}
 
-	if (_update_time(data_ptr)) {
+	if (_update_time(values[LOG_FIELD_TIME])) {
 #if LOG_BEDUG
 		printTagLog(TAG, "time updated");
 #endif
@@ -575,13 +1054,14 @@ void parse_a(void)
 	}
 
 	// Parse configuration:
-	if (!_find_param(&data_ptr, var_ptr, CF_LOGID_FIELD)) {
+	if (!values[LOG_FIELD_LOG_ID]) {
 #if LOG_BEDUG
 		printTagLog(TAG, "unable to parse response (log_id not found) - %s", var_ptr);
 #endif
 		return;
 	}
-	settings.server_log_id = atoi(data_ptr);
+	settings_set_server_log_id(atoi(values[LOG_FIELD_LOG_ID]));
+	_scheduler_ack(settings.server_log_id);
 	if (sended_id && sended_id < settings.server_log_id) {
 		util_old_timer_start(&log_timer, GENERAL_TIMEOUT_MS);
 #if LOG_BEDUG
@@ -590,99 +1070,66 @@ void parse_a(void)
 	}
 	first_request = false;
 
+#if LOG_BINARY_RECORDS
+	// The server repeats the accepted records encoding in every response
+	binary_records = values[LOG_FIELD_ENC] && atoi(values[LOG_FIELD_ENC]) == RecordCodec::VERSION;
+#endif
+
 #if LOG_BEDUG
 	printTagLog(TAG, "Recieved response from the server");
 #endif
 
-	if (!_find_param(&data_ptr, var_ptr, CF_ID_FIELD)) {
+	if (values[LOG_FIELD_CF_ID]) {
+		settings_set_cf_id(atoi(values[LOG_FIELD_CF_ID]));
+	} else {
 #if LOG_BEDUG
 		printTagLog(TAG, "unable to parse response (cf_id not found) - %s", var_ptr);
 #endif
 	}
-	settings.cf_id = atoi(data_ptr);
 
-	if (!_find_param(&data_ptr, var_ptr, CF_DATA_FIELD)) {
+	if (!values[LOG_FIELD_CF_DATA]) {
 #if LOG_BEDUG
 		printTagLog(TAG, "warning: no cf_id data - [%s]", var_ptr);
 #endif
 	}
 
-	if (_find_param(&data_ptr, var_ptr, CF_PWR_FIELD)) {
-		pump_update_enable_state(atoi(data_ptr));
-	}
-
-	if (_find_param(&data_ptr, var_ptr, CF_LTRMIN_FIELD)) {
-		pump_update_ltrmin(atoi(data_ptr));
-	}
-
-	if (_find_param(&data_ptr, var_ptr, CF_LTRMAX_FIELD)) {
-		pump_update_ltrmax(atoi(data_ptr));
-	}
-
-	if (_find_param(&data_ptr, var_ptr, CF_TRGT_FIELD)) {
-		pump_update_target(atoi(data_ptr));
-	}
-
-	if (_find_param(&data_ptr, var_ptr, CF_SLEEP_FIELD)) {
-		set_settings_sleep(atoi(data_ptr) * SECOND_MS);
-		_load_rtc_ram_log();
-	}
-
-	if (_find_param(&data_ptr, var_ptr, CF_SPEED_FIELD)) {
-		pump_update_speed(atoi(data_ptr));
-	}
-
-	if (_find_param(&data_ptr, var_ptr, CF_CLEAR_FIELD)) {
-		if (atoi(data_ptr) == 1) {
-			_clear_log();
+	for (unsigned i = LOG_FIELD_CF_DATA + 1; i < LOG_FIELDS_COUNT; i++) {
+		if (!values[i]) {
+			continue;
 		}
-	}
-
-	if (_find_param(&data_ptr, var_ptr, CF_OUTA_FIELD)) {
-		settings.outputs[0] = atoi(data_ptr) ? 1 : 0;
-	}
-	if (_find_param(&data_ptr, var_ptr, CF_OUTB_FIELD)) {
-		settings.outputs[1] = atoi(data_ptr) ? 1 : 0;
-	}
-	if (_find_param(&data_ptr, var_ptr, CF_OUTC_FIELD)) {
-		settings.outputs[2] = atoi(data_ptr) ? 1 : 0;
-	}
-	if (_find_param(&data_ptr, var_ptr, CF_OUTD_FIELD)) {
-		settings.outputs[3] = atoi(data_ptr) ? 1 : 0;
-	}
-
-	if (_find_param(&data_ptr, var_ptr, CF_URL_FIELD)) {
-		char url[CHAR_SETIINGS_SIZE] = "";
-		for (unsigned i = 0; i < __min(strlen(data_ptr), sizeof(url) - 1); i++) {
-			if (data_ptr[i] == ';' ||
-				isspace(data_ptr[i])
-			) {
-				break;
-			}
-			url[i] = data_ptr[i];
+		if (fields[i].number) {
+			fields[i].number((uint32_t)atoi(values[i]));
+		} else if (fields[i].text) {
+			fields[i].text(values[i]);
 		}
-		set_settings_url(url);
 	}
 
 #if LOG_BEDUG
 	printTagLog(TAG, "configuration updated");
 #endif
 	settings_show();
-	set_status(NEED_SAVE_SETTINGS);
 
 
 	RecordDB::RecordStatus recordStatus = RecordDB::RECORD_NO_LOG;
-	if (is_status(HAS_NEW_RECORD)) {
+	if (_prefetch_ready()) {
+		recordStatus = RecordDB::RECORD_OK;
+	} else if (is_status(HAS_NEW_RECORD)) {
 		record.setRecordId(settings.server_log_id);
 		recordStatus = record.loadNext();
 	}
+	// The loaded record guards the bursts: a broken record is not sent back-to-back
 	if (recordStatus == RecordDB::RECORD_OK) {
-		util_old_timer_start(&send_timer, GENERAL_TIMEOUT_MS);
 		set_status(HAS_NEW_RECORD);
 	} else {
-		util_old_timer_start(&send_timer, SEND_DELAY_NS);
 		reset_status(HAS_NEW_RECORD);
 	}
+	util_old_timer_start(&send_timer, _scheduler_next_delay(recordStatus == RecordDB::RECORD_OK));
+#if LOG_BEDUG
+	printTagLog(TAG, "next request in %lu ms (backlog=%lu drain=%lu/h)", send_timer.delay, scheduler.backlog, scheduler.drain_rate);
+#endif
+
+	cycle.stats.parse_ms = getMillis() - parse_ms;
+	cycle.stats.cycles++;
 }
 
 void send_timeout_a(void)
@@ -698,12 +1145,15 @@ void send_timeout_a(void)
 		set_main_server();
 	}
 
-	util_old_timer_start(&send_timer, 10 * SECOND_MS);
+	util_old_timer_start(&send_timer, _scheduler_retry_delay(RETRY_DELAY_MS));
+#if LOG_BEDUG
+	printTagLog(TAG, "request timeout: retry in %lu ms", send_timer.delay);
+#endif
 }
 
 void error_a(void)
 {
 	fsm_gc_clear(&log_fsm);
 
-	util_old_timer_start(&send_timer, SEND_DELAY_NS);
+	util_old_timer_start(&send_timer, _scheduler_retry_delay(SEND_DELAY_NS));
 }
@@ -4,11 +4,51 @@
 #define _LOG_H_
 
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <stdint.h>
+
+
 #define LOG_BEDUG (1)
 
+/* Pack as many records as fit in SIM_REQUEST_MAX_SIZE into one request */
+#ifndef LOG_BATCH_MODE
+#   define LOG_BATCH_MODE        (1)
+#endif
+
+#ifndef LOG_BATCH_RECORDS_MAX
+#   define LOG_BATCH_RECORDS_MAX (16)
+#endif
+
+/* Send the records as the base64 RecordCodec batch after the server answers "enc=" with its version */
+#ifndef LOG_BINARY_RECORDS
+#   define LOG_BINARY_RECORDS    (1)
+#endif
+
+
+typedef struct _log_cycle_stats_t {
+	uint32_t cycles;     // Requests with the parsed response
+	uint32_t prefetched; // Requests sent with the records prefetched during the previous request
+	uint32_t net_ms;     // Wait for the module network of the last request
+	uint32_t build_ms;   // Build time of the last request
+	uint32_t flight_ms;  // Upload, HTTP action and response read time of the last request
+	uint32_t parse_ms;   // Response parse time of the last request
+	uint32_t cycle_ms;   // Time between the last two requests
+} log_cycle_stats_t;
+
 
 void log_init();
 void log_tick();
+void log_get_cycle_stats(log_cycle_stats_t* stats);
+void log_show_cycle_stats();
+
+
+#ifdef __cplusplus
+}
+#endif
 
 
 #endif
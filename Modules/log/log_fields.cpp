@@ -0,0 +1,112 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "log_fields.h"
+
+#include <string.h>
+
+
+#define FIELD_HASH_SIZE (32)
+
+
+static constexpr const char* keys[LOG_FIELDS_COUNT] = {
+	"t",
+	"d_hwm",
+	"cf_id",
+	"cf",
+	"pwr",
+	"ltrmin",
+	"ltrmax",
+	"trgt",
+	"sleep",
+	"speed",
+	"clr",
+	"outa",
+	"outb",
+	"outc",
+	"outd",
+	"url",
+	"enc",
+};
+
+static constexpr unsigned _field_key_length(const char* key)
+{
+	unsigned length = 0;
+	while (key[length]) {
+		length++;
+	}
+	return length;
+}
+
+// Perfect hash of the response keys: first char, last char and length
+static constexpr unsigned _field_hash(const char* key, const unsigned length)
+{
+	return ((unsigned)(uint8_t)key[0] + 2 * (unsigned)(uint8_t)key[length - 1] + 7 * length) % FIELD_HASH_SIZE;
+}
+
+typedef struct _log_field_slots_t {
+	uint8_t field[FIELD_HASH_SIZE];
+	bool    perfect;
+} log_field_slots_t;
+
+static constexpr log_field_slots_t _build_field_slots()
+{
+	log_field_slots_t slots = {};
+	for (unsigned i = 0; i < FIELD_HASH_SIZE; i++) {
+		slots.field[i] = LOG_FIELDS_COUNT;
+	}
+	slots.perfect = true;
+	for (unsigned i = 0; i < LOG_FIELDS_COUNT; i++) {
+		const unsigned length = _field_key_length(keys[i]);
+		const unsigned slot   = _field_hash(keys[i], length);
+		if (slots.field[slot] != LOG_FIELDS_COUNT || length > LOG_FIELD_KEY_MAX) {
+			slots.perfect = false;
+		}
+		slots.field[slot] = (uint8_t)i;
+	}
+	return slots;
+}
+
+static constexpr log_field_slots_t field_slots = _build_field_slots();
+static_assert(field_slots.perfect, "log response field hash has collisions");
+
+
+int log_fields_find(const char* key, const unsigned length)
+{
+	if (!length || length > LOG_FIELD_KEY_MAX) {
+		return -1;
+	}
+	const unsigned field = field_slots.field[_field_hash(key, length)];
+	if (field == LOG_FIELDS_COUNT) {
+		return -1;
+	}
+	if (strncmp(keys[field], key, length) || keys[field][length]) {
+		return -1;
+	}
+	return (int)field;
+}
+
+void log_fields_parse(char* response, char** values, log_fields_unknown_f unknown)
+{
+	// A key starts after '\n', ';' or '=' ("cf=pwr=1;ltrmin=2"), the first value is kept
+	const char* key = response;
+	for (char* ptr = response; *ptr; ptr++) {
+		if (*ptr == '\n' || *ptr == ';') {
+			key = ptr + 1;
+			continue;
+		}
+		if (*ptr != '=') {
+			continue;
+		}
+
+		const unsigned length = (unsigned)(ptr - key);
+		const int field = log_fields_find(key, length);
+		if (field >= 0) {
+			if (!values[field]) {
+				values[field] = ptr + 1;
+			}
+		} else if (length && unknown) {
+			unknown(key, length);
+		}
+		key = ptr + 1;
+	}
+}
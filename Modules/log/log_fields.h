@@ -0,0 +1,59 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#ifndef _LOG_FIELDS_H_
+#define _LOG_FIELDS_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <stdint.h>
+
+
+#define LOG_FIELD_KEY_MAX (8)
+
+
+/* Server response fields in the order they are applied */
+typedef enum _log_field_t {
+	LOG_FIELD_TIME = 0,
+	LOG_FIELD_LOG_ID,
+	LOG_FIELD_CF_ID,
+	LOG_FIELD_CF_DATA,
+	LOG_FIELD_PWR,
+	LOG_FIELD_LTRMIN,
+	LOG_FIELD_LTRMAX,
+	LOG_FIELD_TRGT,
+	LOG_FIELD_SLEEP,
+	LOG_FIELD_SPEED,
+	LOG_FIELD_CLEAR,
+	LOG_FIELD_OUTA,
+	LOG_FIELD_OUTB,
+	LOG_FIELD_OUTC,
+	LOG_FIELD_OUTD,
+	LOG_FIELD_URL,
+	LOG_FIELD_ENC,
+	LOG_FIELDS_COUNT
+} log_field_t;
+
+
+/* Called for a response key that is not a log_field_t (the key is not terminated) */
+typedef void (*log_fields_unknown_f)(const char* key, const unsigned length);
+
+
+/* Returns the log_field_t of the key or -1 */
+int log_fields_find(const char* key, const unsigned length);
+/*
+ * Sets values[field] to the first value of each field in the response
+ * (the values end with '\n', ';' or the response end), unknown may be NULL
+ */
+void log_fields_parse(char* response, char** values, log_fields_unknown_f unknown);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,321 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+/*
+ * Host test of the server response parser (log_fields).
+ * Checks the parsed values and the unknown keys of captured server responses
+ * and compares the parse time with the per-field search used before
+ * (three "\n<key>=", "=<key>=" and ";<key>=" scans of the whole response for each field).
+ * Usage: log_fields_test
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "log_fields.h"
+
+
+#define TEST_BENCH_ROUNDS     ((uint32_t)20000)
+#define TEST_UNKNOWN_MAX      (8)
+#define TEST_PARAM_SIZE       (16)
+
+
+typedef struct _test_response_t {
+	const char* name;
+	const char* response;
+	const char* values[LOG_FIELDS_COUNT];
+	const char* unknown[TEST_UNKNOWN_MAX];
+} test_response_t;
+
+
+// Responses captured from the server (the body follows the "+HTTPREAD" line)
+static const test_response_t responses[] = {
+	{
+		"configuration",
+		"\nt=2024-03-12t14:05:33\nd_hwm=1250\ncf_id=7\n"
+		"cf=pwr=1;ltrmin=500;ltrmax=12000;trgt=3000;sleep=60;speed=1000;clr=0;outa=0;outb=1;outc=0;outd=1;url=dispenser.example.com/api\n"
+		"enc=1\n",
+		{
+			"2024-03-12t14:05:33", "1250", "7", "pwr=1", "1", "500", "12000", "3000",
+			"60", "1000", "0", "0", "1", "0", "1", "dispenser.example.com/api", "1"
+		},
+		{}
+	},
+	{
+		"acknowledge",
+		"\nt=2024-03-12t14:10:01\nd_hwm=1262\ncf_id=7\n",
+		{"2024-03-12t14:10:01", "1262", "7"},
+		{}
+	},
+	{
+		"new server keys",
+		"\r\nt=2024-03-12t14:15:00\r\nd_hwm=1270\r\nfw=1.4.2\r\ncf_id=8\r\n"
+		"cf=pwr=0;pwr=1;ltrmin=400;bonus=5;url=a.example.com;configuration=2;=3\r\n"
+		"motd=hello\r\n",
+		{
+			"2024-03-12t14:15:00", "1270", "8", "pwr=0", "0", "400", nullptr, nullptr,
+			nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, "a.example.com", nullptr
+		},
+		{"fw", "bonus", "configuration", "motd"}
+	},
+};
+
+
+static const char* keys[LOG_FIELDS_COUNT] = {
+	"t", "d_hwm", "cf_id", "cf", "pwr", "ltrmin", "ltrmax", "trgt", "sleep",
+	"speed", "clr", "outa", "outb", "outc", "outd", "url", "enc",
+};
+
+
+static void _test_find();
+static void _test_response(const test_response_t* test);
+static void _test_bench();
+static bool _value_equals(const char* value, const char* expected);
+static void _unknown_key(const char* key, const unsigned length);
+static void _unknown_count(const char* key, const unsigned length);
+static void _legacy_parse(const char* response, const char** values);
+static bool _legacy_find_param(const char** dst, const char* src, const char* param);
+static const char* _legacy_strnstr(const char* haystack, const char* needle, size_t length);
+static uint64_t _now_ns();
+
+
+static unsigned errors = 0;
+
+static char     unknown[TEST_UNKNOWN_MAX][LOG_FIELD_KEY_MAX * 2] = {};
+static unsigned unknown_count = 0;
+
+
+int main()
+{
+	_test_find();
+	for (unsigned i = 0; i < sizeof(responses) / sizeof(*responses); i++) {
+		_test_response(&responses[i]);
+	}
+	_test_bench();
+
+	printf("errors: %u\n", errors);
+
+	return errors ? 1 : 0;
+}
+
+void _test_find()
+{
+	for (unsigned i = 0; i < LOG_FIELDS_COUNT; i++) {
+		if (log_fields_find(keys[i], (unsigned)strlen(keys[i])) != (int)i) {
+			printf("find \"%s\": field not found\n", keys[i]);
+			errors++;
+		}
+	}
+
+	// Prefixes, extensions and the keys of the same hash
+	static const char* unknown_keys[] = {"", "c", "cf_", "outaa", "out", "u", "tt", "clear", "ltrminmax", "URL"};
+	for (unsigned i = 0; i < sizeof(unknown_keys) / sizeof(*unknown_keys); i++) {
+		const int field = log_fields_find(unknown_keys[i], (unsigned)strlen(unknown_keys[i]));
+		if (field >= 0) {
+			printf("find \"%s\": found field %d\n", unknown_keys[i], field);
+			errors++;
+		}
+	}
+}
+
+void _test_response(const test_response_t* test)
+{
+	char response[256] = "";
+	strncpy(response, test->response, sizeof(response) - 1);
+
+	char* values[LOG_FIELDS_COUNT] = {};
+	unknown_count = 0;
+	log_fields_parse(response, values, _unknown_key);
+
+	if (strcmp(response, test->response)) {
+		printf("%s: the response is changed\n", test->name);
+		errors++;
+	}
+
+	for (unsigned i = 0; i < LOG_FIELDS_COUNT; i++) {
+		if (!_value_equals(values[i], test->values[i])) {
+			printf(
+				"%s: field \"%s\" value \"%.16s\", expected \"%s\"\n",
+				test->name,
+				keys[i],
+				values[i] ? values[i] : "(none)",
+				test->values[i] ? test->values[i] : "(none)"
+			);
+			errors++;
+		}
+	}
+
+	unsigned expected_count = 0;
+	while (expected_count < TEST_UNKNOWN_MAX && test->unknown[expected_count]) {
+		expected_count++;
+	}
+	if (unknown_count != expected_count) {
+		printf("%s: %u unknown keys reported, expected %u\n", test->name, unknown_count, expected_count);
+		errors++;
+		return;
+	}
+	for (unsigned i = 0; i < expected_count; i++) {
+		if (strcmp(unknown[i], test->unknown[i])) {
+			printf("%s: unknown key \"%s\" reported, expected \"%s\"\n", test->name, unknown[i], test->unknown[i]);
+			errors++;
+		}
+	}
+
+	// The callback is optional
+	char* silent_values[LOG_FIELDS_COUNT] = {};
+	log_fields_parse(response, silent_values, nullptr);
+	if (memcmp(values, silent_values, sizeof(values))) {
+		printf("%s: the values depend on the unknown key callback\n", test->name);
+		errors++;
+	}
+}
+
+void _test_bench()
+{
+	const unsigned count = sizeof(responses) / sizeof(*responses);
+	char buffers[sizeof(responses) / sizeof(*responses)][256] = {};
+	for (unsigned i = 0; i < count; i++) {
+		strncpy(buffers[i], responses[i].response, sizeof(buffers[i]) - 1);
+	}
+
+	// The values of both parsers are the same for the keys the old one finds
+	for (unsigned i = 0; i < count; i++) {
+		char* values[LOG_FIELDS_COUNT] = {};
+		const char* legacy_values[LOG_FIELDS_COUNT] = {};
+		log_fields_parse(buffers[i], values, nullptr);
+		_legacy_parse(buffers[i], legacy_values);
+		for (unsigned j = 0; j < LOG_FIELDS_COUNT; j++) {
+			if (legacy_values[j] && values[j] != legacy_values[j]) {
+				printf("%s: field \"%s\" differs from the old parser\n", responses[i].name, keys[j]);
+				errors++;
+			}
+		}
+	}
+
+	volatile uintptr_t sink = 0;
+
+	uint64_t start = _now_ns();
+	for (uint32_t round = 0; round < TEST_BENCH_ROUNDS; round++) {
+		for (unsigned i = 0; i < count; i++) {
+			char* values[LOG_FIELDS_COUNT] = {};
+			log_fields_parse(buffers[i], values, _unknown_count);
+			sink = sink + (uintptr_t)values[LOG_FIELD_URL];
+		}
+	}
+	const uint64_t parse_ns = _now_ns() - start;
+
+	start = _now_ns();
+	for (uint32_t round = 0; round < TEST_BENCH_ROUNDS; round++) {
+		for (unsigned i = 0; i < count; i++) {
+			const char* values[LOG_FIELDS_COUNT] = {};
+			_legacy_parse(buffers[i], values);
+			sink = sink + (uintptr_t)values[LOG_FIELD_URL];
+		}
+	}
+	const uint64_t legacy_ns = _now_ns() - start;
+	(void)sink;
+
+	const uint32_t parses = TEST_BENCH_ROUNDS * count;
+	printf("\n%-24s %10s\n", "parser", "ns/resp");
+	printf("%-24s %10llu\n", "single pass", (unsigned long long)(parse_ns / parses));
+	printf("%-24s %10llu\n", "search per field", (unsigned long long)(legacy_ns / parses));
+
+	if (parse_ns >= legacy_ns) {
+		printf("the single pass parser is not faster than the search per field\n");
+		errors++;
+	}
+}
+
+bool _value_equals(const char* value, const char* expected)
+{
+	if (!value || !expected) {
+		return !value && !expected;
+	}
+	const size_t length = strlen(expected);
+	if (strncmp(value, expected, length)) {
+		return false;
+	}
+	return value[length] == '\0' || value[length] == '\n' || value[length] == '\r' || value[length] == ';';
+}
+
+void _unknown_key(const char* key, const unsigned length)
+{
+	if (unknown_count >= TEST_UNKNOWN_MAX) {
+		printf("too many unknown keys\n");
+		errors++;
+		return;
+	}
+	snprintf(unknown[unknown_count], sizeof(unknown[unknown_count]), "%.*s", (int)length, key);
+	unknown_count++;
+}
+
+void _unknown_count(const char* key, const unsigned length)
+{
+	(void)key;
+	(void)length;
+	unknown_count++;
+}
+
+// parse_a() before the single pass parser: a search of every field
+void _legacy_parse(const char* response, const char** values)
+{
+	for (unsigned i = 0; i < LOG_FIELDS_COUNT; i++) {
+		const char* value = nullptr;
+		if (_legacy_find_param(&value, response, keys[i])) {
+			values[i] = value;
+		}
+	}
+}
+
+bool _legacy_find_param(const char** dst, const char* src, const char* param)
+{
+	char search_param[TEST_PARAM_SIZE] = {0};
+	if (strlen(param) > sizeof(search_param) - 3) {
+		return false;
+	}
+
+	const char* ptr = NULL;
+
+	snprintf(search_param, sizeof(search_param), "\n%s=", param);
+	ptr = _legacy_strnstr(src, search_param, strlen(src));
+	if (ptr) {
+		*dst = ptr + strlen(search_param);
+		return true;
+	}
+
+	snprintf(search_param, sizeof(search_param), "=%s=", param);
+	ptr = _legacy_strnstr(src, search_param, strlen(src));
+	if (ptr) {
+		*dst = ptr + strlen(search_param);
+		return true;
+	}
+
+	snprintf(search_param, sizeof(search_param), ";%s=", param);
+	ptr = _legacy_strnstr(src, search_param, strlen(src));
+	if (ptr) {
+		*dst = ptr + strlen(search_param);
+		return true;
+	}
+
+	return false;
+}
+
+// The host C library has no strnstr()
+const char* _legacy_strnstr(const char* haystack, const char* needle, size_t length)
+{
+	const size_t needle_length = strlen(needle);
+	for (size_t i = 0; i + needle_length <= length && haystack[i]; i++) {
+		if (!strncmp(haystack + i, needle, needle_length)) {
+			return haystack + i;
+		}
+	}
+	return NULL;
+}
+
+uint64_t _now_ns()
+{
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
@@ -15,6 +15,7 @@
 #include "system.h"
 #include "fsm_gc.h"
 #include "settings.h"
+#include "settings_backup.h"
 #include "pressure.h"
 
 
@@ -186,7 +187,7 @@ void pump_update_speed(uint32_t speed)
 	if (speed == settings.pump_speed) {
 		return;
 	}
-    settings.pump_speed = speed;
+    settings_set_pump_speed(speed);
 	settings_updated = true;
 }
 
@@ -195,7 +196,7 @@ void pump_update_enable_state(bool enabled)
 	if (settings.pump_enabled == enabled) {
 		return;
 	}
-	settings.pump_enabled = enabled;
+	settings_set_pump_enabled(enabled);
 	settings_updated = true;
 }
 
@@ -204,7 +205,7 @@ void pump_update_ltrmin(uint32_t ltrmin)
 	if (ltrmin == settings.tank_ltr_min) {
 		return;
 	}
-	settings.tank_ltr_min = ltrmin;
+	settings_set_tank_ltr_min(ltrmin);
 	settings_updated = true;
 }
 
@@ -213,7 +214,7 @@ void pump_update_ltrmax(uint32_t ltrmax)
 	if (ltrmax == settings.tank_ltr_max) {
 		return;
 	}
-	settings.tank_ltr_max = ltrmax;
+	settings_set_tank_ltr_max(ltrmax);
 	settings_updated = true;
 }
 
@@ -224,7 +225,7 @@ void pump_update_target(uint32_t target_ltr)
 	if (target_ltr == settings.pump_target_ml) {
 		return;
 	}
-	settings.pump_target_ml = target_ltr;
+	settings_set_pump_target_ml(target_ltr);
 	settings_updated = true;
 }
 
@@ -273,10 +274,10 @@ void _pump_check_log_date()
 #if PUMP_BEDUG
 		printTagLog(TAG, "update pump log: day counter - %u -> %u", settings.pump_log_date, cur_date);
 #endif
-		settings.pump_work_day_sec = 0;
-		settings.pump_log_date = cur_date;
+		settings_set_pump_work_day_sec(0);
+		settings_set_pump_log_date(cur_date);
 
-		set_status(NEED_SAVE_SETTINGS);
+		settings_backup_counters();
 	}
 }
 
@@ -473,14 +474,14 @@ void save_and_down_a(void)
 	uint32_t res_time_ms = getMillis() - timer.start;
 	uint32_t time_sec    = res_time_ms / SECOND_MS;
 
-	settings.pump_work_day_sec += time_sec;
-	settings.pump_work_sec     += time_sec;
+	settings_set_pump_work_day_sec(settings.pump_work_day_sec + time_sec);
+	settings_set_pump_work_sec(settings.pump_work_sec + time_sec);
 
 #if PUMP_BEDUG
 	printTagLog(TAG, "update work log: time added (%lu s)", time_sec);
 #endif
 
-	set_status(NEED_SAVE_SETTINGS);
+	settings_backup_counters();
 
 	util_old_timer_start(&timer, need_time_ms - res_time_ms);
 
@@ -505,13 +506,13 @@ void save_and_work_a(void)
 	uint32_t res_time_ms = getMillis() - timer.start;
 	uint32_t time_sec    = res_time_ms / SECOND_MS;
 
-    settings.pump_downtime_sec += time_sec;
+    settings_set_pump_downtime_sec(settings.pump_downtime_sec + time_sec);
 
 #if PUMP_BEDUG
     printTagLog(TAG, "update downtime log: time added (%lu s)", time_sec);
 #endif
 
-	set_status(NEED_SAVE_SETTINGS);
+	settings_backup_counters();
 
 	util_old_timer_start(&timer, need_time_ms - res_time_ms);
 
@@ -535,24 +536,25 @@ void save_a(void)
 	uint32_t time_sec    = res_time_ms / SECOND_MS;
 
 	if (was_enabled) {
-		settings.pump_work_day_sec += time_sec;
-		settings.pump_work_sec     += time_sec;
+		settings_set_pump_work_day_sec(settings.pump_work_day_sec + time_sec);
+		settings_set_pump_work_sec(settings.pump_work_sec + time_sec);
 #if PUMP_BEDUG
 		printTagLog(TAG, "update work log: time added (%lu s)", time_sec);
 #endif
 	} else {
-		settings.pump_downtime_sec += time_sec;
+		settings_set_pump_downtime_sec(settings.pump_downtime_sec + time_sec);
 #if PUMP_BEDUG
 		printTagLog(TAG, "update downtime log: time added (%lu s)", time_sec);
 #endif
 	}
 
-	set_status(NEED_SAVE_SETTINGS);
+	settings_backup_counters();
 }
 
 void error_a(void)
 {
 	save_a();
+	settings_backup_checkpoint();
 
 	HAL_GPIO_WritePin(MOT_FET_GPIO_Port, MOT_FET_Pin, GPIO_PIN_RESET);
 
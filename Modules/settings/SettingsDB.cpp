@@ -5,6 +5,7 @@
 
 #include "glog.h"
 #include "soul.h"
+#include "crc16.h"
 #include "gutils.h"
 #include "settings.h"
 
@@ -13,18 +14,106 @@
 #include "CodeStopwatch.h"
 
 
-extern StorageAT* storage;
+extern StorageAT storage;
+extern StorageDriver storageDriver;
+
+
+static_assert(sizeof(settings_t) <= 0x100, "settings journal entry offset is one byte");
+
+
+bool     SettingsDB::journalLoaded = false;
+bool     SettingsDB::hasActive     = false;
+uint32_t SettingsDB::activeSector  = 0;
+uint32_t SettingsDB::sequence      = 0;
+uint32_t SettingsDB::writeOffset   = 0;
+bool     SettingsDB::needCompact   = false;
+uint8_t  SettingsDB::image[SettingsDB::IMAGE_SIZE] = {};
 
 
 SettingsDB::SettingsDB(uint8_t* settings, uint32_t size): size(size), settings(settings) { }
 
+uint32_t SettingsDB::getReservedPages()
+{
+    return JOURNAL_SECTORS * (FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE);
+}
+
 SettingsStatus SettingsDB::load()
+{
+    if (this->size > IMAGE_SIZE) {
+        return SETTINGS_ERROR;
+    }
+
+    // The RAM image is the last saved settings while the active sector header is not changed.
+    // The header is read from the chip: the page cache has the header written by this module
+    if (journalLoaded && hasActive) {
+        JournalHeader header = {};
+        if (flash_w25qxx_read(getSectorAddress(activeSector), reinterpret_cast<uint8_t*>(&header), sizeof(header)) == FLASH_OK &&
+            isHeaderValid(&header) &&
+            header.sequence == sequence
+        ) {
+            memcpy(this->settings, image, this->size);
+            return SETTINGS_OK;
+        }
+        storageDriver.invalidate(getSectorAddress(0), JOURNAL_SECTORS * FLASH_W25_SECTOR_SIZE);
+    }
+
+    if (loadJournal() == SETTINGS_OK) {
+        memcpy(this->settings, image, this->size);
+#if SETTINGS_DB_BEDUG
+        printTagLog(SettingsDB::TAG, "settings loaded (sector=%lu sequence=%lu offset=%lu)", activeSector, sequence, writeOffset);
+#endif
+        return SETTINGS_OK;
+    }
+
+    // Settings saved before the journal are moved into it by the next save
+    if (loadLegacy() != SETTINGS_OK) {
+        return SETTINGS_ERROR;
+    }
+    set_status(NEED_SAVE_SETTINGS);
+
+    return SETTINGS_OK;
+}
+
+SettingsStatus SettingsDB::save()
+{
+	utl::CodeStopwatch stopwatch(TAG, GENERAL_TIMEOUT_MS);
+
+    if (this->size > IMAGE_SIZE) {
+        return SETTINGS_ERROR;
+    }
+
+    if (!journalLoaded) {
+        loadJournal();
+    }
+    if (!hasActive || needCompact) {
+        return compact();
+    }
+
+    uint32_t changesSize = getChangesSize();
+    if (!changesSize) {
+        return SETTINGS_OK;
+    }
+    if (writeOffset + changesSize > FLASH_W25_SECTOR_SIZE) {
+        return compact();
+    }
+    if (appendChanges() != SETTINGS_OK) {
+        return compact();
+    }
+
+#if SETTINGS_DB_BEDUG
+    printTagLog(SettingsDB::TAG, "settings saved (%lu bytes, offset=%lu)", changesSize, writeOffset);
+#endif
+
+    return SETTINGS_OK;
+}
+
+SettingsStatus SettingsDB::loadLegacy()
 {
 	uint32_t address1 = 0, address2 = 0;
 	StorageStatus status = STORAGE_OK;
 
 	bool needResaveFirst = false, needResaveSecond = false;
-    status = storage->find(FIND_MODE_EQUAL, &address1, PREFIX, 1);
+    status = storage.find(FIND_MODE_EQUAL, &address1, PREFIX, 1);
     if (status != STORAGE_OK) {
 #if SETTINGS_DB_BEDUG
         printTagLog(SettingsDB::TAG, "error load settings: try to find duplicate (error=%02X)", status);
@@ -32,7 +121,7 @@ SettingsStatus SettingsDB::load()
         needResaveFirst = true;
     }
 
-    status = storage->find(FIND_MODE_EQUAL, &address2, PREFIX, 2);
+    status = storage.find(FIND_MODE_EQUAL, &address2, PREFIX, 2);
     if (status != STORAGE_OK) {
 #if SETTINGS_DB_BEDUG
         printTagLog(SettingsDB::TAG, "error load settings: storage find error=%02X", status);
@@ -42,9 +131,9 @@ SettingsStatus SettingsDB::load()
 
     settings_t tmpSettings = {};
     if (!needResaveFirst) {
-        status = storage->load(address1, reinterpret_cast<uint8_t*>(&tmpSettings), this->size);
+        status = storage.load(address1, reinterpret_cast<uint8_t*>(&tmpSettings), this->size);
     } else if (!needResaveSecond) {
-        status = storage->load(address2, reinterpret_cast<uint8_t*>(&tmpSettings), this->size);
+        status = storage.load(address2, reinterpret_cast<uint8_t*>(&tmpSettings), this->size);
     } else {
     	status = STORAGE_NOT_FOUND;
     }
@@ -58,88 +147,276 @@ SettingsStatus SettingsDB::load()
     memcpy(this->settings, &tmpSettings, this->size);
 
 #if SETTINGS_DB_BEDUG
-    printTagLog(SettingsDB::TAG, "settings loaded");
+    printTagLog(SettingsDB::TAG, "legacy settings loaded");
 #endif
 
-    if (needResaveFirst || needResaveSecond) {
-    	set_status(NEED_SAVE_SETTINGS);
-    }
-
     return SETTINGS_OK;
 }
 
-SettingsStatus SettingsDB::save()
+SettingsStatus SettingsDB::loadJournal()
 {
-	utl::CodeStopwatch stopwatch(TAG, GENERAL_TIMEOUT_MS);
-
-	uint32_t address = 0;
-	StorageStatus status = STORAGE_OK;
-
-    status = storage->find(FIND_MODE_EQUAL, &address, PREFIX, 1);
+    journalLoaded = false;
+    hasActive     = false;
+    needCompact   = false;
+    writeOffset   = 0;
+    memset(image, 0, sizeof(image));
 
-    if (status != STORAGE_OK) {
+    for (uint32_t i = 0; i < JOURNAL_SECTORS; i++) {
+        JournalHeader header = {};
+        if (storageDriver.read(getSectorAddress(i), reinterpret_cast<uint8_t*>(&header), sizeof(header)) != STORAGE_OK) {
 #if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings: storage find error, try to find duplicate (error=%02X)", status);
+            printTagLog(SettingsDB::TAG, "error load journal: read sector=%lu", i);
 #endif
-    	status = storage->find(FIND_MODE_EQUAL, &address, PREFIX, 2);
+            return SETTINGS_ERROR;
+        }
+        if (!isHeaderValid(&header)) {
+            continue;
+        }
+        if (!hasActive || static_cast<int32_t>(header.sequence - sequence) > 0) {
+            hasActive    = true;
+            activeSector = i;
+            sequence     = header.sequence;
+        }
     }
 
-    if (status == STORAGE_NOT_FOUND) {
+    if (!hasActive) {
+        journalLoaded = true;
 #if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings: storage find duplicate error, try to find empty (error=%02X)", status);
+        printTagLog(SettingsDB::TAG, "journal not found");
 #endif
-        status = storage->find(FIND_MODE_EMPTY, &address);
+        return SETTINGS_ERROR;
     }
 
-    if (status == STORAGE_NOT_FOUND) {
-        // Search for any address
-#if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings: storage find empty error, try to find any address (error=%02X)", status);
+    if (!replaySector(activeSector)) {
+        hasActive = false;
+        return SETTINGS_ERROR;
+    }
+
+    journalLoaded = true;
+    return SETTINGS_OK;
+}
+
+bool SettingsDB::replaySector(uint32_t sector)
+{
+    // One read of the maximum entry size covers tens of small entries
+    uint8_t buffer[sizeof(EntryHeader) + ENTRY_DATA_MAX + sizeof(uint16_t)] = {};
+
+    const uint32_t address = getSectorAddress(sector);
+    uint32_t offset = sizeof(JournalHeader);
+    bool end = false;
+    while (!end && offset + ENTRY_OVERHEAD < FLASH_W25_SECTOR_SIZE) {
+        const uint32_t count = std::min(static_cast<uint32_t>(sizeof(buffer)), FLASH_W25_SECTOR_SIZE - offset);
+        if (storageDriver.read(address + offset, buffer, count) != STORAGE_OK) {
+            return false;
+        }
+#if STORAGE_DRIVER_USE_BUFFER
+        // The next window page is read while the entries of this one are replayed
+        if (offset + count < FLASH_W25_SECTOR_SIZE) {
+            StorageDriver::prefetch(address + offset + count);
+        }
 #endif
-    	status = storage->find(FIND_MODE_NEXT, &address, "", 0);
+
+        uint32_t position = 0;
+        while (position + ENTRY_OVERHEAD <= count) {
+            const EntryHeader* entry = reinterpret_cast<const EntryHeader*>(buffer + position);
+            if (entry->magic == 0xFF) {
+                end = true;
+                break;
+            }
+            if (entry->magic != ENTRY_MAGIC ||
+                !entry->length ||
+                offset + position + ENTRY_OVERHEAD + entry->length > FLASH_W25_SECTOR_SIZE
+            ) {
+                // The entry was torn by the power loss: the next save starts a new sector
+                needCompact = true;
+                end = true;
+                break;
+            }
+
+            const uint32_t length = entry->length;
+            if (position + ENTRY_OVERHEAD + length > count) {
+                // The entry continues in the next read
+                break;
+            }
+            const uint8_t* data = buffer + position + sizeof(EntryHeader);
+            if (crc16_ccitt(buffer + position, sizeof(EntryHeader) + length) != static_cast<uint16_t>((data[length] << 8) | data[length + 1])) {
+                needCompact = true;
+                end = true;
+                break;
+            }
+
+            for (uint32_t i = 0; i < length && entry->offset + i < IMAGE_SIZE; i++) {
+                image[entry->offset + i] = data[i];
+            }
+            position += ENTRY_OVERHEAD + length;
+        }
+
+        if (!position && !end) {
+            break;
+        }
+        offset += position;
     }
 
-    if (status != STORAGE_OK) {
+    writeOffset = offset;
+    return true;
+}
+
+SettingsStatus SettingsDB::compact()
+{
+    const uint32_t target = hasActive ? (activeSector + 1) % JOURNAL_SECTORS : 0;
+    const uint32_t address = getSectorAddress(target);
+    const uint32_t pagesCount = FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE;
+    const uint32_t lastOffset = writeOffset;
+
+    needCompact = true;
+
+    uint32_t addrs[pagesCount] = {};
+    for (uint32_t i = 0; i < pagesCount; i++) {
+        addrs[i] = address + i * FLASH_W25_PAGE_SIZE;
+    }
+    if (storageDriver.erase(addrs, pagesCount) != STORAGE_OK) {
 #if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings: storage find error=%02X", status);
+        printTagLog(SettingsDB::TAG, "error compact: erase sector=%lu", target);
 #endif
         return SETTINGS_ERROR;
     }
 
-    // Save original settings
-	status = storage->rewrite(address, PREFIX, 1, this->settings, this->size);
-    if (status != STORAGE_OK) {
+    writeOffset = sizeof(JournalHeader);
+    for (uint32_t offset = 0; offset < this->size; offset += ENTRY_DATA_MAX) {
+        uint32_t length = std::min(ENTRY_DATA_MAX, this->size - offset);
+        if (appendEntry(target, offset, this->settings + offset, length) != SETTINGS_OK) {
 #if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings: storage save error=%02X address=%lu", status, address);
+            printTagLog(SettingsDB::TAG, "error compact: write settings sector=%lu", target);
 #endif
+            writeOffset = lastOffset;
+            return SETTINGS_ERROR;
+        }
+    }
+
+    // The header is the commit of the new sector: the previous one stays valid until it is written
+    JournalHeader header = {};
+    header.magic    = JOURNAL_MAGIC;
+    header.sequence = hasActive ? sequence + 1 : 1;
+    header.crc      = crc16_ccitt(reinterpret_cast<uint8_t*>(&header), sizeof(header) - sizeof(header.crc));
+    if (programData(address, reinterpret_cast<uint8_t*>(&header), sizeof(header)) != SETTINGS_OK) {
+#if SETTINGS_DB_BEDUG
+        printTagLog(SettingsDB::TAG, "error compact: write header sector=%lu", target);
+#endif
+        writeOffset = lastOffset;
         return SETTINGS_ERROR;
     }
 
-    // Save duplicate settings
-	status = storage->find(FIND_MODE_EQUAL, &address, PREFIX, 2);
+    hasActive     = true;
+    activeSector  = target;
+    sequence      = header.sequence;
+    needCompact   = false;
+    journalLoaded = true;
+    memcpy(image, this->settings, this->size);
 
-    if (status == STORAGE_NOT_FOUND) {
 #if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings duplicate: storage find error, try to find empty (error=%02X)", status);
+    printTagLog(SettingsDB::TAG, "journal compacted (sector=%lu sequence=%lu)", activeSector, sequence);
 #endif
-        status = storage->find(FIND_MODE_EMPTY, &address);
-    }
 
-	status = storage->rewrite(address, PREFIX, 2, this->settings, this->size);
-    if (status != STORAGE_OK) {
+    return SETTINGS_OK;
+}
+
+SettingsStatus SettingsDB::appendChanges()
+{
+    uint32_t length = 0;
+    uint32_t offset = getNextChange(0, &length);
+    while (length) {
+        if (appendEntry(activeSector, offset, this->settings + offset, length) != SETTINGS_OK) {
 #if SETTINGS_DB_BEDUG
-        printTagLog(SettingsDB::TAG, "error save settings duplicate: storage save error=%02X address=%lu", status, address);
+            printTagLog(SettingsDB::TAG, "error append: offset=%lu length=%lu", offset, length);
 #endif
+            needCompact = true;
+            return SETTINGS_ERROR;
+        }
+        memcpy(image + offset, this->settings + offset, length);
+        offset = getNextChange(offset + length, &length);
+    }
+    return SETTINGS_OK;
+}
+
+SettingsStatus SettingsDB::appendEntry(uint32_t sector, uint32_t offset, const uint8_t* data, uint32_t length)
+{
+    uint8_t buffer[sizeof(EntryHeader) + ENTRY_DATA_MAX + sizeof(uint16_t)] = {};
+    EntryHeader* entry = reinterpret_cast<EntryHeader*>(buffer);
+    entry->magic  = ENTRY_MAGIC;
+    entry->offset = static_cast<uint8_t>(offset);
+    entry->length = static_cast<uint8_t>(length);
+    memcpy(buffer + sizeof(EntryHeader), data, length);
+
+    uint16_t crc = crc16_ccitt(buffer, sizeof(EntryHeader) + length);
+    buffer[sizeof(EntryHeader) + length]     = static_cast<uint8_t>(crc >> 8);
+    buffer[sizeof(EntryHeader) + length + 1] = static_cast<uint8_t>(crc);
+
+    if (writeOffset + ENTRY_OVERHEAD + length > FLASH_W25_SECTOR_SIZE) {
         return SETTINGS_ERROR;
     }
+    if (programData(getSectorAddress(sector) + writeOffset, buffer, ENTRY_OVERHEAD + length) != SETTINGS_OK) {
+        return SETTINGS_ERROR;
+    }
+    writeOffset += ENTRY_OVERHEAD + length;
 
-    if (this->load() == SETTINGS_OK) {
-#if SETTINGS_DB_BEDUG
-    	printTagLog(SettingsDB::TAG, "settings saved successfully (address=%lu)", address);
-#endif
+    return SETTINGS_OK;
+}
+
+SettingsStatus SettingsDB::programData(uint32_t address, const uint8_t* data, uint32_t length)
+{
+    while (length) {
+        // StorageDriver::program() does not cross the page boundary
+        uint32_t part = std::min(length, FLASH_W25_PAGE_SIZE - address % FLASH_W25_PAGE_SIZE);
+        if (storageDriver.program(address, data, part) != STORAGE_OK) {
+            return SETTINGS_ERROR;
+        }
+        address += part;
+        data    += part;
+        length  -= part;
+    }
+    return SETTINGS_OK;
+}
+
+uint32_t SettingsDB::getChangesSize()
+{
+    uint32_t result = 0;
+    uint32_t length = 0;
+    uint32_t offset = getNextChange(0, &length);
+    while (length) {
+        result += ENTRY_OVERHEAD + length;
+        offset = getNextChange(offset + length, &length);
+    }
+    return result;
+}
+
+uint32_t SettingsDB::getNextChange(uint32_t offset, uint32_t* length)
+{
+    while (offset < this->size && this->settings[offset] == image[offset]) {
+        offset++;
+    }
+    if (offset >= this->size) {
+        *length = 0;
+        return offset;
+    }
 
-    	return SETTINGS_OK;
+    // Close changes are merged: an entry header costs more than a few unchanged bytes
+    uint32_t end = offset + 1;
+    for (uint32_t i = end; i < this->size && i - end < ENTRY_MERGE_GAP && i - offset < ENTRY_DATA_MAX; i++) {
+        if (this->settings[i] != image[i]) {
+            end = i + 1;
+        }
     }
+    *length = end - offset;
+    return offset;
+}
 
-    return SETTINGS_ERROR;
+uint32_t SettingsDB::getSectorAddress(uint32_t sector)
+{
+    return flash_w25qxx_get_pages_count() * FLASH_W25_PAGE_SIZE - (JOURNAL_SECTORS - sector) * FLASH_W25_SECTOR_SIZE;
+}
+
+bool SettingsDB::isHeaderValid(const JournalHeader* header)
+{
+    return header->magic == JOURNAL_MAGIC &&
+           header->crc == crc16_ccitt(reinterpret_cast<const uint8_t*>(header), sizeof(JournalHeader) - sizeof(header->crc));
 }
@@ -6,6 +6,7 @@
 
 #include "main.h"
 #include "settings.h"
+#include "w25qxx.h"
 
 
 #ifdef DEBUG
@@ -13,6 +14,16 @@
 #endif
 
 
+/*
+ * Settings journal: two sectors at the end of the FLASH memory (below the scratch sector).
+ * The active sector starts with a header, the next bytes are entries with the changed
+ * settings bytes: [magic][offset][length][data...][CRC16]. A save appends only the
+ * bytes that differ from the last saved settings. When the active sector is full the
+ * whole settings are written into the other (older) sector and its header is programmed
+ * last with the next sequence number.
+ * load() reads both sector headers and replays the newest valid sector, later loads
+ * return the RAM image if the active sector header is not changed.
+ */
 class SettingsDB
 {
 private:
@@ -22,11 +33,58 @@ private:
     static constexpr char PREFIX[] = "STG";
     static constexpr char TAG[] = "STG";
 
+    static constexpr uint32_t JOURNAL_SECTORS  = 2;
+    static constexpr uint32_t JOURNAL_MAGIC    = 0x5E77A1B6;
+    static constexpr uint8_t  ENTRY_MAGIC      = 0xA7;
+    static constexpr uint32_t ENTRY_DATA_MAX   = 0xFF;
+    static constexpr uint32_t ENTRY_MERGE_GAP  = 4; // Changed bytes closer than the gap are saved in one entry
+    static constexpr uint32_t IMAGE_SIZE       = sizeof(settings_t);
+
+    typedef struct __attribute__((packed)) _JournalHeader {
+        uint32_t magic;
+        uint32_t sequence;
+        uint16_t crc;
+    } JournalHeader;
+
+    typedef struct __attribute__((packed)) _EntryHeader {
+        uint8_t magic;
+        uint8_t offset;
+        uint8_t length;
+    } EntryHeader;
+
+    static constexpr uint32_t ENTRY_OVERHEAD = sizeof(EntryHeader) + sizeof(uint16_t);
+
+    static bool     journalLoaded;
+    static bool     hasActive;
+    static uint32_t activeSector;
+    static uint32_t sequence;
+    static uint32_t writeOffset;
+    static bool     needCompact;
+    static uint8_t  image[IMAGE_SIZE];
+
+    SettingsStatus loadLegacy();
+    SettingsStatus compact();
+    SettingsStatus appendChanges();
+    uint32_t       getChangesSize();
+    uint32_t       getNextChange(uint32_t offset, uint32_t* length);
+
+    static SettingsStatus loadJournal();
+    static bool           replaySector(uint32_t sector);
+    static SettingsStatus appendEntry(uint32_t sector, uint32_t offset, const uint8_t* data, uint32_t length);
+    static SettingsStatus programData(uint32_t address, const uint8_t* data, uint32_t length);
+    static uint32_t       getSectorAddress(uint32_t sector);
+    static bool           isHeaderValid(const JournalHeader* header);
+
 public:
     SettingsDB(uint8_t* settings, uint32_t size);
 
     SettingsStatus load();
     SettingsStatus save();
+
+    /**
+     * @return Number of the pages at the end of the FLASH memory used by the settings journal.
+     */
+    static uint32_t getReservedPages();
 };
 
 
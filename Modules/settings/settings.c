@@ -29,6 +29,23 @@ const char defaultUrl[CHAR_SETIINGS_SIZE]  = "urv.iot.turtton.ru";
 
 settings_t settings = { 0 };
 
+static settings_dirty_t settings_dirty = 0;
+static uint32_t settings_change_ms[SETTINGS_FIELDS_COUNT] = { 0 };
+static uint32_t settings_dirty_first_ms = 0;
+static uint32_t settings_dirty_last_ms = 0;
+
+#if SETTINGS_BEDUG
+static const char* settings_field_names[SETTINGS_FIELDS_COUNT] = {
+#define SETTINGS_FIELD_NAME(name, type) #name,
+	SETTINGS_FIELDS(SETTINGS_FIELD_NAME)
+#undef SETTINGS_FIELD_NAME
+	"url",
+	"outputs",
+};
+#endif
+
+_Static_assert(SETTINGS_FIELDS_COUNT <= sizeof(settings_dirty_t) * BITS_IN_BYTE, "settings dirty mask is too small");
+
 
 settings_t* settings_get()
 {
@@ -38,6 +55,7 @@ settings_t* settings_get()
 void settings_set(settings_t* other)
 {
 	memcpy((uint8_t*)&settings, (uint8_t*)other, sizeof(settings));
+	settings_mark_dirty(SETTINGS_DIRTY_ALL);
 }
 
 uint32_t settings_size()
@@ -100,6 +118,10 @@ void settings_reset(settings_t* other)
 	other->calibrated = 0;
 
 	memset(other->outputs, 0, sizeof(other->outputs));
+
+	if (other == &settings) {
+		settings_mark_dirty(SETTINGS_DIRTY_ALL);
+	}
 }
 
 void settings_show()
@@ -165,13 +187,98 @@ void set_settings_url(const char* url)
 	if (!strlen(url)) {
 		return;
 	}
-	memset(settings.url, 0, sizeof(settings.url));
-	strncpy(settings.url, url, __min(sizeof(settings.url) - 1, strlen(url)));
+	char tmp[sizeof(settings.url)] = {0};
+	strncpy(tmp, url, __min(sizeof(tmp) - 1, strlen(url)));
+	if (memcmp(settings.url, tmp, sizeof(tmp))) {
+		memcpy(settings.url, tmp, sizeof(tmp));
+		settings_mark_dirty(SETTINGS_DIRTY(url));
+	}
 }
 
 void set_settings_sleep(uint32_t sleep)
 {
 	if (sleep) {
-		settings.sleep_ms = sleep;
+		settings_set_sleep_ms(sleep);
+	}
+}
+
+#define SETTINGS_FIELD_SETTER(name, type)                \
+	void settings_set_##name(type value)                 \
+	{                                                    \
+		if (settings.name != value) {                    \
+			settings.name = value;                       \
+			settings_mark_dirty(SETTINGS_DIRTY(name));   \
+		}                                                \
+	}
+SETTINGS_FIELDS(SETTINGS_FIELD_SETTER)
+#undef SETTINGS_FIELD_SETTER
+
+void settings_set_output(unsigned idx, uint8_t state)
+{
+	if (idx >= __arr_len(settings.outputs)) {
+		return;
+	}
+	if (settings.outputs[idx] != state) {
+		settings.outputs[idx] = state;
+		settings_mark_dirty(SETTINGS_DIRTY(outputs));
+	}
+}
+
+void settings_mark_dirty(settings_dirty_t fields)
+{
+	uint32_t now = getMillis();
+	for (unsigned i = 0; i < SETTINGS_FIELDS_COUNT; i++) {
+		if (__get_bit(fields, i)) {
+			settings_change_ms[i] = now;
+		}
+	}
+
+	if (fields & ~SETTINGS_DIRTY_LAZY) {
+		if (!(settings_dirty & ~SETTINGS_DIRTY_LAZY)) {
+			settings_dirty_first_ms = now;
+		}
+		settings_dirty_last_ms = now;
 	}
+	settings_dirty |= fields;
+}
+
+void settings_clear_dirty(settings_dirty_t fields)
+{
+	settings_dirty &= ~fields;
+}
+
+settings_dirty_t settings_get_dirty()
+{
+	return settings_dirty;
+}
+
+uint32_t settings_get_change_ms(settings_field_t field)
+{
+	if (field >= SETTINGS_FIELDS_COUNT) {
+		return 0;
+	}
+	return settings_change_ms[field];
+}
+
+uint32_t settings_get_dirty_first_ms()
+{
+	return settings_dirty_first_ms;
+}
+
+uint32_t settings_get_dirty_last_ms()
+{
+	return settings_dirty_last_ms;
+}
+
+void settings_show_dirty()
+{
+#if SETTINGS_BEDUG
+	uint32_t now = getMillis();
+	gprint("Dirty settings:   0x%08lX\n", settings_dirty);
+	for (unsigned i = 0; i < SETTINGS_FIELDS_COUNT; i++) {
+		if (__get_bit(settings_dirty, i)) {
+			gprint("  %-18s %lu ms ago\n", settings_field_names[i], now - settings_change_ms[i]);
+		}
+	}
+#endif
 }
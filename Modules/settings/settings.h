@@ -102,6 +102,46 @@ typedef struct __attribute__((packed)) _settings_t  {
 } settings_t;
 
 
+/*
+ * Settings fields with generated setters settings_set_<name>(value).
+ * Setters mark the field dirty only when the value changes.
+ * The url and outputs arrays have their own setters.
+ */
+#define SETTINGS_FIELDS(FIELD)           \
+	FIELD(cf_id,             uint32_t)   \
+	FIELD(pump_enabled,      uint8_t)    \
+	FIELD(sleep_ms,          uint32_t)   \
+	FIELD(server_log_id,     uint32_t)   \
+	FIELD(tank_ADC_min,      uint32_t)   \
+	FIELD(tank_ADC_max,      uint32_t)   \
+	FIELD(tank_ltr_max,      uint32_t)   \
+	FIELD(tank_ltr_min,      uint32_t)   \
+	FIELD(pump_target_ml,    uint32_t)   \
+	FIELD(pump_speed,        uint32_t)   \
+	FIELD(pump_work_sec,     uint32_t)   \
+	FIELD(pump_downtime_sec, uint32_t)   \
+	FIELD(pump_work_day_sec, uint32_t)   \
+	FIELD(pump_log_date,     uint8_t)    \
+	FIELD(registrated,       uint8_t)    \
+	FIELD(calibrated,        uint8_t)
+
+typedef enum _settings_field_t {
+#define SETTINGS_FIELD_ENUM(name, type) SETTINGS_FIELD_##name,
+	SETTINGS_FIELDS(SETTINGS_FIELD_ENUM)
+#undef SETTINGS_FIELD_ENUM
+	SETTINGS_FIELD_url,
+	SETTINGS_FIELD_outputs,
+	SETTINGS_FIELDS_COUNT
+} settings_field_t;
+
+typedef uint32_t settings_dirty_t;
+
+#define SETTINGS_DIRTY(name)  ((settings_dirty_t)1 << SETTINGS_FIELD_##name)
+#define SETTINGS_DIRTY_ALL    ((settings_dirty_t)(((uint64_t)1 << SETTINGS_FIELDS_COUNT) - 1))
+/* Fields that are kept in the RTC RAM (settings_backup.h) and are not a reason to save the FLASH settings */
+#define SETTINGS_DIRTY_LAZY   (SETTINGS_DIRTY(pump_work_sec) | SETTINGS_DIRTY(pump_downtime_sec) | SETTINGS_DIRTY(pump_work_day_sec))
+
+
 extern settings_t settings;
 
 
@@ -124,6 +164,22 @@ void settings_show();
 void set_settings_url(const char* url);
 void set_settings_sleep(uint32_t sleep);
 
+#define SETTINGS_FIELD_SETTER(name, type) void settings_set_##name(type value);
+SETTINGS_FIELDS(SETTINGS_FIELD_SETTER)
+#undef SETTINGS_FIELD_SETTER
+void settings_set_output(unsigned idx, uint8_t state);
+
+/* marks the fields changed outside of the setters */
+void settings_mark_dirty(settings_dirty_t fields);
+void settings_clear_dirty(settings_dirty_t fields);
+settings_dirty_t settings_get_dirty();
+/* getMillis() of the last field change */
+uint32_t settings_get_change_ms(settings_field_t field);
+/* getMillis() of the first and the last not lazy change after the settings were saved */
+uint32_t settings_get_dirty_first_ms();
+uint32_t settings_get_dirty_last_ms();
+void settings_show_dirty();
+
 void settings_update();
 
 
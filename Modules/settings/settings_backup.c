@@ -0,0 +1,103 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "settings_backup.h"
+
+#include <string.h>
+
+#include "glog.h"
+#include "soul.h"
+#include "crc16.h"
+#include "gutils.h"
+#include "system.h"
+#include "settings.h"
+
+
+#define SETTINGS_BACKUP_MAGIC ((uint8_t)0xC7)
+
+
+TYPE_PACK(
+typedef struct, _settings_backup_t {
+	uint8_t  magic;
+	uint32_t pump_work_sec;
+	uint32_t pump_downtime_sec;
+	uint32_t pump_work_day_sec;
+	uint16_t crc;
+} settings_backup_t;
+)
+
+
+#if SETTINGS_BACKUP_BEDUG
+static const char TAG[] = "BKUP";
+#endif
+
+extern settings_t settings;
+
+static util_old_timer_t checkpoint_timer = {0};
+static bool checkpoint_started = false;
+
+
+void settings_backup_restore()
+{
+	checkpoint_started = true;
+	util_old_timer_start(&checkpoint_timer, SETTINGS_BACKUP_CHECKPOINT_MS);
+
+	settings_backup_t backup = {0};
+	for (uint8_t i = 0; i < sizeof(backup); i++) {
+		if (!get_system_rtc_ram(SYSTEM_RTC_RAM_COUNTERS_IDX + i, &((uint8_t*)&backup)[i])) {
+#if SETTINGS_BACKUP_BEDUG
+			printTagLog(TAG, "error restore: RTC RAM read");
+#endif
+			return;
+		}
+	}
+
+	if (backup.magic != SETTINGS_BACKUP_MAGIC ||
+		backup.crc != crc16_ccitt((uint8_t*)&backup, sizeof(backup) - sizeof(backup.crc))
+	) {
+#if SETTINGS_BACKUP_BEDUG
+		printTagLog(TAG, "RTC RAM counters are not valid: FLASH counters are used");
+#endif
+		settings_backup_counters();
+		return;
+	}
+
+	settings_set_pump_work_sec(backup.pump_work_sec);
+	settings_set_pump_downtime_sec(backup.pump_downtime_sec);
+	settings_set_pump_work_day_sec(backup.pump_work_day_sec);
+
+#if SETTINGS_BACKUP_BEDUG
+	printTagLog(TAG, "counters restored: work=%lu downtime=%lu work day=%lu", backup.pump_work_sec, backup.pump_downtime_sec, backup.pump_work_day_sec);
+#endif
+}
+
+void settings_backup_counters()
+{
+	settings_backup_t backup = {0};
+	backup.magic             = SETTINGS_BACKUP_MAGIC;
+	backup.pump_work_sec     = settings.pump_work_sec;
+	backup.pump_downtime_sec = settings.pump_downtime_sec;
+	backup.pump_work_day_sec = settings.pump_work_day_sec;
+	backup.crc               = crc16_ccitt((uint8_t*)&backup, sizeof(backup) - sizeof(backup.crc));
+
+	for (uint8_t i = 0; i < sizeof(backup); i++) {
+		if (!set_system_rtc_ram(SYSTEM_RTC_RAM_COUNTERS_IDX + i, ((uint8_t*)&backup)[i])) {
+#if SETTINGS_BACKUP_BEDUG
+			printTagLog(TAG, "error save: RTC RAM write");
+#endif
+			// Without the RTC RAM the counters are saved only in the FLASH memory
+			settings_backup_checkpoint();
+			return;
+		}
+	}
+
+	if (!checkpoint_started || !util_old_timer_wait(&checkpoint_timer)) {
+		settings_backup_checkpoint();
+	}
+}
+
+void settings_backup_checkpoint()
+{
+	checkpoint_started = true;
+	util_old_timer_start(&checkpoint_timer, SETTINGS_BACKUP_CHECKPOINT_MS);
+	set_status(NEED_SAVE_SETTINGS);
+}
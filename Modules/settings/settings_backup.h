@@ -0,0 +1,47 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#ifndef _SETTINGS_BACKUP_H_
+#define _SETTINGS_BACKUP_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "gutils.h"
+
+
+#ifdef DEBUG
+#   define SETTINGS_BACKUP_BEDUG (1)
+#endif
+
+
+/*
+ * Pump counters (pump_work_sec, pump_downtime_sec and pump_work_day_sec)
+ * change on every pump switch and every record. They are kept in the
+ * battery-backed RTC RAM and are saved to the FLASH settings only once
+ * per SETTINGS_BACKUP_CHECKPOINT_MS or by settings_backup_checkpoint().
+ */
+#ifndef SETTINGS_BACKUP_CHECKPOINT_MS
+#   define SETTINGS_BACKUP_CHECKPOINT_MS (60 * MINUTE_MS)
+#endif
+
+
+/* Replaces the settings counters with the RTC RAM counters (after the settings load) */
+void settings_backup_restore();
+/* Saves the settings counters to the RTC RAM (has to be called after every counters change) */
+void settings_backup_counters();
+/* Requests the settings counters save to the FLASH memory */
+void settings_backup_checkpoint();
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -8,20 +8,31 @@
 #include "soul.h"
 #include "main.h"
 #include "fsm_gc.h"
+#include "gutils.h"
 
 #include "Timer.h"
 #include "SettingsDB.h"
+#include "settings_backup.h"
 #include "CodeStopwatch.h"
 
 
 void _stng_check(void);
+bool _stng_save_due(void);
 
 void _stng_init_s(void);
 void _stng_idle_s(void);
 void _stng_save_s(void);
 void _stng_load_s(void);
 
-void _stng_update_hash_a(void);
+
+// Settings are saved when they were not changed for SETTINGS_SAVE_DELAY_MS,
+// a burst of changes delays the save for SETTINGS_SAVE_MAX_DELAY_MS at most
+#ifndef SETTINGS_SAVE_DELAY_MS
+#   define SETTINGS_SAVE_DELAY_MS     (SECOND_MS)
+#endif
+#ifndef SETTINGS_SAVE_MAX_DELAY_MS
+#   define SETTINGS_SAVE_MAX_DELAY_MS (10 * SECOND_MS)
+#endif
 
 
 #if SETTINGS_BEDUG
@@ -29,9 +40,6 @@ const char STNGw_TAG[] = "STGw";
 #endif
 
 
-static unsigned old_hash = 0;
-
-
 FSM_GC_CREATE(stng_fsm)
 
 FSM_GC_CREATE_EVENT(stng_saved_e,   0)
@@ -44,13 +52,13 @@ FSM_GC_CREATE_STATE(stng_load_s, _stng_load_s)
 
 FSM_GC_CREATE_TABLE(
 	stng_fsm_table,
-	{&stng_init_s, &stng_updated_e, &stng_idle_s, _stng_update_hash_a},
+	{&stng_init_s, &stng_updated_e, &stng_idle_s, NULL},
 
 	{&stng_idle_s, &stng_saved_e,   &stng_load_s, NULL},
 	{&stng_idle_s, &stng_updated_e, &stng_save_s, NULL},
 
-	{&stng_load_s, &stng_updated_e, &stng_idle_s, _stng_update_hash_a},
-	{&stng_save_s, &stng_saved_e,   &stng_idle_s, _stng_update_hash_a}
+	{&stng_load_s, &stng_updated_e, &stng_idle_s, NULL},
+	{&stng_save_s, &stng_saved_e,   &stng_idle_s, NULL}
 )
 
 extern "C" void settings_update()
@@ -98,6 +106,9 @@ void _stng_init_s(void)
 	}
 
 	if (status == SETTINGS_OK) {
+		settings_clear_dirty(SETTINGS_DIRTY_ALL);
+		settings_backup_restore();
+
 		reset_error(SETTINGS_LOAD_ERROR);
 		settings_show();
 
@@ -113,13 +124,11 @@ void _stng_init_s(void)
 
 void _stng_idle_s(void)
 {
-	if (is_status(NEED_SAVE_SETTINGS)) {
+	if (is_status(NEED_SAVE_SETTINGS) || _stng_save_due()) {
 		reset_status(SYSTEM_SOFTWARE_READY);
-		_stng_check();
 		fsm_gc_push_event(&stng_fsm, &stng_updated_e);
 	} else if (is_status(NEED_LOAD_SETTINGS)) {
 		reset_status(SYSTEM_SOFTWARE_READY);
-		_stng_check();
 		fsm_gc_push_event(&stng_fsm, &stng_saved_e);
 	}
 }
@@ -128,11 +137,15 @@ void _stng_save_s(void)
 {
 	SettingsStatus status = SETTINGS_OK;
 	SettingsDB settingsDB(reinterpret_cast<uint8_t*>(&settings), settings_size());
-	if (old_hash != util_hash((uint8_t*)&settings, sizeof(settings))) {
+	settings_dirty_t dirty = settings_get_dirty();
+	if (dirty || is_status(NEED_SAVE_SETTINGS)) {
+#if SETTINGS_BEDUG
+		printTagLog(STNGw_TAG, "save settings: dirty=0x%08lX", dirty);
+#endif
 		status = settingsDB.save();
 	}
 	if (status == SETTINGS_OK) {
-		_stng_check();
+		settings_clear_dirty(dirty);
 		fsm_gc_push_event(&stng_fsm, &stng_saved_e);
 
 		settings_show();
@@ -149,6 +162,8 @@ void _stng_load_s(void)
 	SettingsDB settingsDB(reinterpret_cast<uint8_t*>(&settings), settings_size());
 	SettingsStatus status = settingsDB.load();
 	if (status == SETTINGS_OK) {
+		settings_clear_dirty(SETTINGS_DIRTY_ALL);
+		settings_backup_restore();
 		_stng_check();
 		fsm_gc_push_event(&stng_fsm, &stng_updated_e);
 
@@ -160,7 +175,12 @@ void _stng_load_s(void)
 	}
 }
 
-void _stng_update_hash_a(void)
+bool _stng_save_due(void)
 {
-	old_hash = util_hash((uint8_t*)&settings, sizeof(settings));
+	if (!(settings_get_dirty() & ~SETTINGS_DIRTY_LAZY)) {
+		return false;
+	}
+	uint32_t now = getMillis();
+	return now - settings_get_dirty_last_ms() >= SETTINGS_SAVE_DELAY_MS ||
+		   now - settings_get_dirty_first_ms() >= SETTINGS_SAVE_MAX_DELAY_MS;
 }
@@ -0,0 +1,133 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "sim_at.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+static void _sim_at_line(sim_at_t* at);
+static bool _sim_at_prefix(const char* line, const char* prefix, const char** value);
+
+
+void sim_at_reset(sim_at_t* at)
+{
+	memset(at, 0, sizeof(sim_at_t));
+}
+
+void sim_at_expect(sim_at_t* at, const char* token)
+{
+	at->expected = token;
+	at->events &= ~(uint32_t)SIM_AT_EVENT_EXPECTED;
+}
+
+bool sim_at_feed(sim_at_t* at, const char chr)
+{
+	// Payload bytes are not parsed: a body line may look like a result code
+	if (at->payload_left) {
+		at->payload_left--;
+		if (!at->payload_left) {
+			at->events |= SIM_AT_EVENT_PAYLOAD;
+		}
+		return true;
+	}
+
+	if (chr == '\n') {
+		_sim_at_line(at);
+		at->line_len = 0;
+		at->line[0]  = 0;
+		return false;
+	}
+	if (chr == '\r') {
+		return false;
+	}
+	// The prompt and the "+IPD,<length>:" header are not ended by a line break
+	if (chr == '>' && !at->line_len) {
+		at->events |= SIM_AT_EVENT_PROMPT;
+		return false;
+	}
+	if (chr == ':' && !strncmp(at->line, "+ipd,", 5)) {
+		at->payload_left = strtoul(at->line + 5, NULL, 10);
+		at->line_len = 0;
+		at->line[0]  = 0;
+		return false;
+	}
+	// The tail of a long line is dropped: the events are recognized by the line beginning
+	if (at->line_len < sizeof(at->line) - 1) {
+		at->line[at->line_len++] = chr;
+		at->line[at->line_len]   = 0;
+	}
+	return false;
+}
+
+void sim_at_clear(sim_at_t* at)
+{
+	at->events = 0;
+}
+
+bool sim_at_take(sim_at_t* at, const uint32_t events)
+{
+	if (!(at->events & events)) {
+		return false;
+	}
+	at->events &= ~events;
+	return true;
+}
+
+void _sim_at_line(sim_at_t* at)
+{
+	if (!at->line_len) {
+		return;
+	}
+
+	const char* line  = at->line;
+	const char* value = NULL;
+	char* end = NULL;
+	if (!strcmp(line, "ok")) {
+		at->events |= SIM_AT_EVENT_OK;
+	} else if (!strcmp(line, "error") ||
+		_sim_at_prefix(line, "+cme error", &value) ||
+		!strcmp(line, "send fail") ||
+		!strcmp(line, "connect fail")
+	) {
+		at->events |= SIM_AT_EVENT_ERROR;
+	} else if (!strcmp(line, "download")) {
+		at->events |= SIM_AT_EVENT_DOWNLOAD;
+	} else if (!strcmp(line, "connect ok") || !strcmp(line, "already connect")) {
+		at->events |= SIM_AT_EVENT_CONNECT;
+	} else if (!strcmp(line, "send ok")) {
+		at->events |= SIM_AT_EVENT_SENT;
+	} else if (!strcmp(line, "closed") || !strcmp(line, "close ok")) {
+		at->events |= SIM_AT_EVENT_CLOSED;
+	} else if (_sim_at_prefix(line, "+httpaction: ", &value)) {
+		at->http_method = (unsigned)strtoul(value, &end, 10);
+		at->http_status = (*end == ',') ? (unsigned)strtoul(end + 1, &end, 10) : 0;
+		at->http_length = (*end == ',') ? strtoul(end + 1, &end, 10) : 0;
+		at->events |= SIM_AT_EVENT_HTTPACTION;
+	} else if (_sim_at_prefix(line, "+httpread: ", &value)) {
+		at->payload_left = strtoul(value, NULL, 10);
+		if (!at->payload_left) {
+			at->events |= SIM_AT_EVENT_PAYLOAD;
+		}
+	} else if (_sim_at_prefix(line, "content-length: ", &value)) {
+		at->content_length = strtoul(value, NULL, 10);
+		at->events |= SIM_AT_EVENT_LENGTH;
+	} else if (_sim_at_prefix(line, "+csq: ", &value)) {
+		at->csq = (unsigned)strtoul(value, NULL, 10);
+		at->events |= SIM_AT_EVENT_CSQ;
+	}
+
+	if (at->expected && strstr(line, at->expected)) {
+		at->events |= SIM_AT_EVENT_EXPECTED;
+	}
+}
+
+bool _sim_at_prefix(const char* line, const char* prefix, const char** value)
+{
+	size_t len = strlen(prefix);
+	if (strncmp(line, prefix, len)) {
+		return false;
+	}
+	*value = line + len;
+	return true;
+}
@@ -0,0 +1,71 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#ifndef _SIM_AT_H_
+#define _SIM_AT_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#ifndef SIM_AT_LINE_SIZE
+#   define SIM_AT_LINE_SIZE (64)
+#endif
+
+
+/* Events of the complete module lines */
+typedef enum _sim_at_event_t {
+	SIM_AT_EVENT_OK         = 0x0001, // "OK" final result
+	SIM_AT_EVENT_ERROR      = 0x0002, // "ERROR", "+CME ERROR: ...", "SEND FAIL" or "CONNECT FAIL"
+	SIM_AT_EVENT_DOWNLOAD   = 0x0004, // AT+HTTPDATA is ready for the data
+	SIM_AT_EVENT_HTTPACTION = 0x0008, // "+HTTPACTION: <method>,<status>,<length>" URC
+	SIM_AT_EVENT_LENGTH     = 0x0010, // "Content-Length: <length>" line of AT+HTTPHEAD
+	SIM_AT_EVENT_PAYLOAD    = 0x0020, // All bytes of "+HTTPREAD: <length>" were received
+	SIM_AT_EVENT_CSQ        = 0x0040, // "+CSQ: <rssi>,<ber>"
+	SIM_AT_EVENT_EXPECTED   = 0x0080, // A line contains the sim_at_expect() token
+	SIM_AT_EVENT_PROMPT     = 0x0100, // "> " AT+CIPSEND is ready for the data
+	SIM_AT_EVENT_CONNECT    = 0x0200, // "CONNECT OK" or "ALREADY CONNECT" of AT+CIPSTART
+	SIM_AT_EVENT_SENT       = 0x0400, // "SEND OK" of AT+CIPSEND
+	SIM_AT_EVENT_CLOSED     = 0x0800, // "CLOSED" URC or "CLOSE OK" of AT+CIPCLOSE
+} sim_at_event_t;
+
+
+typedef struct _sim_at_t {
+	char        line[SIM_AT_LINE_SIZE];
+	unsigned    line_len;
+	uint32_t    payload_left;
+	const char* expected;
+
+	uint32_t    events;
+
+	unsigned    http_method;
+	unsigned    http_status;
+	uint32_t    http_length;
+	uint32_t    content_length;
+	unsigned    csq;
+} sim_at_t;
+
+
+/* Resets the parser state and the events */
+void sim_at_reset(sim_at_t* at);
+/* Sets the token for SIM_AT_EVENT_EXPECTED (the string has to be valid while it is expected) */
+void sim_at_expect(sim_at_t* at, const char* token);
+/* Parses the next lowercase byte from the module, returns true for the "+HTTPREAD" and "+IPD" payload bytes */
+bool sim_at_feed(sim_at_t* at, const char chr);
+/* Clears the events received before the next command */
+void sim_at_clear(sim_at_t* at);
+/* Returns true and clears the events if any of them was received */
+bool sim_at_take(sim_at_t* at, const uint32_t events);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
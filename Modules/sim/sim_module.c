@@ -17,6 +17,7 @@
 #include "main.h"
 #include "fsm_gc.h"
 #include "gutils.h"
+#include "sim_at.h"
 #include "settings.h"
 
 
@@ -24,6 +25,12 @@
 #define SIM_DELAY_MS     (10000)
 #define SIM_HTTP_MS      (15000)
 #define SIM_HTTP_SIZE    (90)
+// AT+HTTPDATA input time: the body is written while it is sent
+#define SIM_HTTPDATA_MS  (5000)
+#ifndef SIM_HTTP_IDLE_MS
+// The idle session is closed, the next request opens it again
+#   define SIM_HTTP_IDLE_MS (5 * MINUTE_MS)
+#endif
 
 
 extern settings_t settings;
@@ -39,12 +46,91 @@ const char* SUCCESS_HTTP_RESP = "200 ok";
 const char* LINE_BREAK        = "\r\n";
 const char* DOUBLE_LINE_BREAK = "\r\n\r\n";
 const char* SIM_ERR_RESPONSE  = "\r\nerror\r\n";
+const char  SIM_END_OF_STRING[] = { END_OF_STRING };
+
+
+typedef enum _sim_seq_status_t {
+	SIM_SEQ_RUN = 0,
+	SIM_SEQ_DONE,
+	SIM_SEQ_FAIL,
+} sim_seq_status_t;
+
+typedef enum _sim_step_flags_t {
+	SIM_STEP_OPTIONAL = 0x01, // The script goes on after the step fail
+} sim_step_flags_t;
+
+/*
+ * AT script step: the command is sent (a step without the command only waits),
+ * the step is done after the expected events or the line with the token.
+ * The scripts are constant tables in the FLASH memory.
+ */
+typedef struct _sim_step_t {
+	const char* command;                                    // Constant command
+	void        (*format)(char* command, const unsigned size); // Command with the parameters
+	const char* token;                                      // Expected line token
+	uint32_t    events;                                     // Expected sim_at events
+	uint32_t    timeout_ms;
+	uint8_t     retries;                                    // Command repeats after the fail
+	uint8_t     flags;
+	bool        (*done)(void);                              // Called after the events, false - the step fails
+} sim_step_t;
+
+#define SIM_SCRIPT(steps) (steps), __arr_len(steps)
+
+
+/*
+ * The DMA writes the module stream into the circular buffer. The interrupt
+ * (producer) publishes the total count of the written bytes, sim_process()
+ * (consumer) reads the bytes up to it: neither side writes the other side counters.
+ */
+typedef struct _sim_rx_t {
+	uint8_t           buffer[SIM_RX_BUFFER_SIZE];
+
+	// Producer (interrupt)
+	volatile uint32_t head;
+	volatile uint32_t events;
+	volatile uint32_t errors;
+	volatile uint32_t restart_head;
+	uint16_t          position;
+
+	// Consumer (sim_process)
+	uint32_t          tail;
+	uint32_t          read_position;
+	uint32_t          lost;
+	uint32_t          errors_seen;
+} sim_rx_t;
 
 
-typedef struct _sim_command_t {
-    char request [50];
-    char response[20];
-} sim_command_t;
+typedef struct _sim_tx_fragment_t {
+	const uint8_t* data;
+	uint16_t       len;
+} sim_tx_fragment_t;
+
+/*
+ * The DMA sends the queued fragments one after another without copying them:
+ * a fragment has to be valid until it is sent. sim_process() (producer) adds
+ * the fragments, HAL_UART_TxCpltCallback() (consumer) starts the next one.
+ * The request body is written into the chunks: a chunk is written again after
+ * the queue tail passes its fragment.
+ */
+typedef struct _sim_tx_t {
+	sim_tx_fragment_t fragments[SIM_TX_FRAGMENTS_COUNT];
+	char              command[SIM_TX_COMMAND_SIZE];
+	char              chunks[SIM_TX_CHUNKS_COUNT][SIM_TX_CHUNK_SIZE];
+
+	// Producer (sim_process)
+	volatile uint32_t head;
+	uint32_t          dropped;
+	uint32_t          padded;
+	uint32_t          chunk_heads[SIM_TX_CHUNKS_COUNT];
+	unsigned          chunk;
+
+	// Consumer (interrupt)
+	volatile uint32_t tail;
+	volatile bool     busy;
+	volatile uint32_t sent;
+	volatile uint32_t errors;
+} sim_tx_t;
 
 
 typedef struct _sim_state_t {
@@ -52,62 +138,172 @@ typedef struct _sim_state_t {
 	unsigned counter;
 
 	char     url[CHAR_SETIINGS_SIZE];
+	char     http_url[CHAR_SETIINGS_SIZE]; // AT+HTTPPARA URL of the HTTP session
 
-	char     request[SIM_LOG_SIZE];
+	sim_request_writer_t writer;
+	unsigned request_len;
+	unsigned request_sent;
+	bool     uploading;
+	uint8_t  request_header[SIM_TCP_FRAME_HEADER_SIZE];
 	char     response[RESPONSE_SIZE];
 	unsigned resp_cnt;
 	unsigned resp_len;
 
+	uint8_t  frame_header[SIM_TCP_FRAME_HEADER_SIZE];
+	unsigned frame_cnt;
+	unsigned frame_len;
+	bool     frame_done;
+
+	sim_at_t at;
+
 	unsigned errors;
 
 	util_old_timer_t timer;
 
+	const sim_step_t* steps;
+	unsigned steps_count;
+	unsigned step;
+	unsigned retries;
+	bool     step_sent;
+
 	bool     is_base_server;
 	bool     http_error;
+	bool     http_reused;
+	bool     idle;         // The session was closed after SIM_HTTP_IDLE_MS: the next request opens it
+
+	uint32_t phase_ms;
+	uint32_t setup_ms;
+	uint32_t data_ms;
+	uint32_t action_ms;
 } sim_state_t;
 
 
 sim_state_t sim_state = {0};
-
-
-const sim_command_t start_cmds[] = {
-	{"AT",                                "ok"},
-	{"ATE0",                              "ok"},
-	{"AT+CSQ",                            "ok"},
-	{"AT+CGMR",                           "sim868"},
-	{"AT+COPS?",                          "ok"},
-	{"AT+SAPBR=2,1",                      "ok"},
-	{"AT+SAPBR=3,1,\"CONTYPE\",\"GPRS\"", "ok"},
-	{"AT+SAPBR=3,1,\"APN\",\"internet\"", "ok"},
-	{"AT+SAPBR=1,1",                      "ok"},
-};
+static sim_rx_t sim_rx = {0};
+static sim_tx_t sim_tx = {0};
+static sim_http_stats_t sim_http = {0};
 
 
 void _sim_send_cmd(const char* cmd);
+void _sim_send_data(const void* data, const unsigned len);
+void _sim_tx_start();
+void _sim_upload_start();
+void _sim_upload_process();
+void _sim_rx_start();
+void _sim_rx_read();
 void _sim_clear_response();
-bool _sim_validate(const char* target);
+bool _sim_validate(const uint32_t events);
+bool _sim_wait();
+uint32_t _sim_phase_end();
+void _sim_http_end();
+#if SIM_TCP_TRANSPORT
+void _sim_tcp_frame_byte(const uint8_t byte);
+#endif
+
+void _sim_seq_start(const sim_step_t* steps, const unsigned count);
+sim_seq_status_t _sim_seq_process();
+sim_seq_status_t _sim_seq_next();
+sim_seq_status_t _sim_run_script(const sim_step_t* steps, const unsigned count);
+
+bool _sim_session_done(void);
+bool _sim_upload_done(void);
+#if SIM_TCP_TRANSPORT
+void _sim_cipstart_format(char* command, const unsigned size);
+void _sim_cipsend_format(char* command, const unsigned size);
+bool _sim_cipsend_done(void);
+#else
+void _sim_httppara_format(char* command, const unsigned size);
+void _sim_httpdata_format(char* command, const unsigned size);
+void _sim_httpread_format(char* command, const unsigned size);
+bool _sim_httpdata_done(void);
+bool _sim_httpaction_done(void);
+bool _sim_httphead_done(void);
+bool _sim_httpread_done(void);
+#endif
 
 void _sim_init_s(void);
 void _sim_start_s(void);
-void _sim_start_iterate_s(void);
-void _sim_init_http_s(void);
-void _sim_start_http_s(void);
-void _sim_send_http_s(void);
-void _sim_send_post_s(void);
-void _sim_wait_post_s(void);
-void _sim_read_data_s(void);
-void _sim_wait_data_s(void);
+void _sim_connect_s(void);
+#if !SIM_TCP_TRANSPORT
+void _sim_url_s(void);
+#endif
+void _sim_wait_request_s(void);
+void _sim_idle_s(void);
+void _sim_post_s(void);
+#if SIM_TCP_TRANSPORT
+void _sim_tcp_wait_s(void);
+#endif
 void _sim_wait_user_s(void);
-void _sim_close_http_s(void);
+void _sim_close_s(void);
 void _sim_change_url_s(void);
 void _sim_count_error_s(void);
 void _sim_reset_s(void);
 void _sim_error_s(void);
 
 
+static const sim_step_t sim_start_steps[] = {
+	{.command = "AT",                                .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+	{.command = "ATE0",                              .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+	{.command = "AT+CSQ",                            .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+	{.command = "AT+CGMR",                           .token  = "sim868",        .timeout_ms = SIM_DELAY_MS},
+	{.command = "AT+COPS?",                          .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+#if SIM_TCP_TRANSPORT
+	{.command = "AT+CIPSHUT",                        .token  = "shut ok",       .timeout_ms = SIM_DELAY_MS},
+	{.command = "AT+CIPMUX=0",                       .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+	{.command = "AT+CIPHEAD=1",                      .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+	{.command = "AT+CSTT=\"internet\"",              .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+	{.command = "AT+CIICR",                          .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+	{.command = "AT+CIFSR",                          .token  = ".",             .timeout_ms = SIM_DELAY_MS},
+#else
+	{.command = "AT+SAPBR=2,1",                      .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+	{.command = "AT+SAPBR=3,1,\"CONTYPE\",\"GPRS\"", .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+	{.command = "AT+SAPBR=3,1,\"APN\",\"internet\"", .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+	// The bearer may be already opened before the MCU reset
+	{.command = "AT+SAPBR=1,1",                      .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS, .flags = SIM_STEP_OPTIONAL},
+#endif
+};
+
+#if SIM_TCP_TRANSPORT
+static const sim_step_t sim_connect_steps[] = {
+	{.format = _sim_cipstart_format, .events = SIM_AT_EVENT_CONNECT, .timeout_ms = SIM_HTTP_MS, .done = _sim_session_done},
+};
+
+static const sim_step_t sim_post_steps[] = {
+	{.format = _sim_cipsend_format, .events = SIM_AT_EVENT_PROMPT, .timeout_ms = SIM_HTTP_MS, .done = _sim_cipsend_done},
+	{.events = SIM_AT_EVENT_SENT, .timeout_ms = SIM_HTTP_MS, .done = _sim_upload_done},
+};
+
+static const sim_step_t sim_close_steps[] = {
+	// The connection may be already closed by the server
+	{.command = "AT+CIPCLOSE", .events = SIM_AT_EVENT_CLOSED | SIM_AT_EVENT_ERROR, .timeout_ms = SIM_DELAY_MS},
+};
+#else
+static const sim_step_t sim_connect_steps[] = {
+	{.command = "AT+HTTPINIT", .events = SIM_AT_EVENT_OK, .timeout_ms = 5000},
+};
+
+static const sim_step_t sim_url_steps[] = {
+	{.format = _sim_httppara_format, .events = SIM_AT_EVENT_OK, .timeout_ms = 5000, .done = _sim_session_done},
+};
+
+static const sim_step_t sim_post_steps[] = {
+	{.format = _sim_httpdata_format, .events = SIM_AT_EVENT_DOWNLOAD,   .timeout_ms = SIM_HTTP_MS, .done = _sim_httpdata_done},
+	{.events = SIM_AT_EVENT_OK,                                          .timeout_ms = SIM_HTTP_MS, .done = _sim_upload_done},
+	{.command = "AT+HTTPACTION=1",   .events = SIM_AT_EVENT_HTTPACTION, .timeout_ms = SIM_HTTP_MS, .done = _sim_httpaction_done},
+	{.command = "AT+HTTPHEAD",       .events = SIM_AT_EVENT_LENGTH,     .timeout_ms = SIM_HTTP_MS, .done = _sim_httphead_done},
+	{.format = _sim_httpread_format, .events = SIM_AT_EVENT_OK,         .timeout_ms = SIM_HTTP_MS, .done = _sim_httpread_done},
+};
+
+static const sim_step_t sim_close_steps[] = {
+	{.command = "AT+HTTPTERM", .events = SIM_AT_EVENT_OK, .timeout_ms = SIM_DELAY_MS},
+};
+#endif
+
+
 FSM_GC_CREATE(sim_fsm)
 
 FSM_GC_CREATE_EVENT(sim_end_e ,    0)
+FSM_GC_CREATE_EVENT(sim_next_e,    0)
 FSM_GC_CREATE_EVENT(sim_change_e,  0)
 FSM_GC_CREATE_EVENT(sim_success_e, 1)
 FSM_GC_CREATE_EVENT(sim_timeout_e, 2)
@@ -115,16 +311,18 @@ FSM_GC_CREATE_EVENT(sim_error_e,   3)
 
 FSM_GC_CREATE_STATE(sim_init_s,           _sim_init_s)
 FSM_GC_CREATE_STATE(sim_start_s,          _sim_start_s)
-FSM_GC_CREATE_STATE(sim_start_iterate_s,  _sim_start_iterate_s)
-FSM_GC_CREATE_STATE(sim_init_http_s,      _sim_init_http_s)
-FSM_GC_CREATE_STATE(sim_start_http_s,     _sim_start_http_s)
-FSM_GC_CREATE_STATE(sim_send_http_s,      _sim_send_http_s)
-FSM_GC_CREATE_STATE(sim_send_post_s,      _sim_send_post_s)
-FSM_GC_CREATE_STATE(sim_wait_post_s,      _sim_wait_post_s)
-FSM_GC_CREATE_STATE(sim_read_data_s,      _sim_read_data_s)
-FSM_GC_CREATE_STATE(sim_wait_data_s,      _sim_wait_data_s)
+FSM_GC_CREATE_STATE(sim_connect_s,        _sim_connect_s)
+#if !SIM_TCP_TRANSPORT
+FSM_GC_CREATE_STATE(sim_url_s,            _sim_url_s)
+#endif
+FSM_GC_CREATE_STATE(sim_wait_request_s,   _sim_wait_request_s)
+FSM_GC_CREATE_STATE(sim_idle_s,           _sim_idle_s)
+FSM_GC_CREATE_STATE(sim_post_s,           _sim_post_s)
+#if SIM_TCP_TRANSPORT
+FSM_GC_CREATE_STATE(sim_tcp_wait_s,       _sim_tcp_wait_s)
+#endif
 FSM_GC_CREATE_STATE(sim_wait_user_s,      _sim_wait_user_s)
-FSM_GC_CREATE_STATE(sim_close_http_s,     _sim_close_http_s)
+FSM_GC_CREATE_STATE(sim_close_s,          _sim_close_s)
 FSM_GC_CREATE_STATE(sim_change_url_s,     _sim_change_url_s)
 FSM_GC_CREATE_STATE(sim_count_error_s,    _sim_count_error_s)
 FSM_GC_CREATE_STATE(sim_reset_s,          _sim_reset_s)
@@ -134,40 +332,50 @@ FSM_GC_CREATE_TABLE(
 	sim_fsm_table,
 	{&sim_init_s,           &sim_success_e,  &sim_reset_s,          NULL},
 
-	{&sim_start_s,          &sim_success_e,  &sim_start_iterate_s,  NULL},
-
-	{&sim_start_iterate_s,  &sim_success_e,  &sim_start_s,          NULL},
-	{&sim_start_iterate_s,  &sim_timeout_e,  &sim_count_error_s,    NULL},
-	{&sim_start_iterate_s,  &sim_end_e,      &sim_init_http_s,      NULL},
+	{&sim_start_s,          &sim_success_e,  &sim_connect_s,        NULL},
+	{&sim_start_s,          &sim_timeout_e,  &sim_count_error_s,    NULL},
 
-	{&sim_init_http_s,      &sim_success_e,  &sim_start_http_s,     NULL},
-	{&sim_init_http_s,      &sim_timeout_e,  &sim_close_http_s,     NULL},
+#if SIM_TCP_TRANSPORT
+	{&sim_connect_s,        &sim_success_e,  &sim_wait_request_s,   NULL},
+	{&sim_connect_s,        &sim_timeout_e,  &sim_close_s,          NULL},
+#else
+	{&sim_connect_s,        &sim_success_e,  &sim_url_s,            NULL},
+	{&sim_connect_s,        &sim_timeout_e,  &sim_close_s,          NULL},
 
-	{&sim_start_http_s,     &sim_success_e,  &sim_send_http_s,      NULL},
-	{&sim_start_http_s,     &sim_timeout_e,  &sim_close_http_s,     NULL},
-
-	{&sim_send_http_s,      &sim_success_e,  &sim_send_post_s,      NULL},
-	{&sim_send_http_s,      &sim_timeout_e,  &sim_close_http_s,     NULL},
+	{&sim_url_s,            &sim_success_e,  &sim_wait_request_s,   NULL},
+	{&sim_url_s,            &sim_timeout_e,  &sim_close_s,          NULL},
+#endif
 
-	{&sim_send_post_s,      &sim_success_e,  &sim_wait_post_s,      NULL},
-	{&sim_send_post_s,      &sim_timeout_e,  &sim_close_http_s,     NULL},
+	{&sim_wait_request_s,   &sim_success_e,  &sim_post_s,           NULL},
+#if SIM_TCP_TRANSPORT
+	{&sim_wait_request_s,   &sim_change_e,   &sim_close_s,          NULL},
+#else
+	{&sim_wait_request_s,   &sim_change_e,   &sim_url_s,            NULL},
+#endif
+	{&sim_wait_request_s,   &sim_end_e,      &sim_close_s,          NULL},
 
-	{&sim_wait_post_s,      &sim_success_e,  &sim_read_data_s,      NULL},
-	{&sim_wait_post_s,      &sim_timeout_e,  &sim_close_http_s,     NULL},
+#if SIM_TCP_TRANSPORT
+	{&sim_post_s,           &sim_success_e,  &sim_tcp_wait_s,       NULL},
+	{&sim_post_s,           &sim_timeout_e,  &sim_close_s,          NULL},
 
-	{&sim_read_data_s,      &sim_success_e,  &sim_wait_data_s,      NULL},
-	{&sim_read_data_s,      &sim_timeout_e,  &sim_close_http_s,     NULL},
+	{&sim_tcp_wait_s,       &sim_success_e,  &sim_wait_user_s,      NULL},
+	{&sim_tcp_wait_s,       &sim_timeout_e,  &sim_close_s,          NULL},
+#else
+	{&sim_post_s,           &sim_success_e,  &sim_wait_user_s,      NULL},
+	{&sim_post_s,           &sim_timeout_e,  &sim_close_s,          NULL},
+#endif
 
-	{&sim_wait_data_s,      &sim_success_e,  &sim_wait_user_s,      NULL},
-	{&sim_wait_data_s,      &sim_timeout_e,  &sim_close_http_s,     NULL},
+	{&sim_wait_user_s,      &sim_success_e,  &sim_close_s,          NULL},
+	{&sim_wait_user_s,      &sim_next_e,     &sim_wait_request_s,   NULL},
 
-	{&sim_wait_user_s,      &sim_success_e,  &sim_close_http_s,     NULL},
+	{&sim_close_s,          &sim_success_e,  &sim_connect_s,        NULL},
+	{&sim_close_s,          &sim_end_e,      &sim_idle_s,           NULL},
+	{&sim_close_s,          &sim_change_e,   &sim_change_url_s,     NULL},
+	{&sim_close_s,          &sim_timeout_e,  &sim_count_error_s,    NULL},
 
-	{&sim_close_http_s,     &sim_success_e,  &sim_init_http_s,      NULL},
-	{&sim_close_http_s,     &sim_change_e,   &sim_change_url_s,      NULL},
-	{&sim_close_http_s,     &sim_timeout_e,  &sim_count_error_s,    NULL},
+	{&sim_idle_s,           &sim_success_e,  &sim_connect_s,        NULL},
 
-	{&sim_change_url_s,     &sim_success_e,  &sim_init_http_s,      NULL},
+	{&sim_change_url_s,     &sim_success_e,  &sim_connect_s,        NULL},
 	{&sim_change_url_s,     &sim_error_e,    &sim_error_s,          NULL},
 
 	{&sim_count_error_s,    &sim_success_e,  &sim_start_s,          NULL},
@@ -181,36 +389,125 @@ FSM_GC_CREATE_TABLE(
 
 void sim_begin() {
 	fsm_gc_init(&sim_fsm, sim_fsm_table, __arr_len(sim_fsm_table));
+	_sim_rx_start();
 }
 
 void sim_process()
 {
+	_sim_rx_read();
+	_sim_upload_process();
 	fsm_gc_proccess(&sim_fsm);
 }
 
-void sim_proccess_input(const char input_chr)
+void sim_rx_event(const uint16_t position)
 {
-    sim_state.response[sim_state.resp_cnt++] = (uint8_t)tolower(input_chr);
-    if (sim_state.resp_cnt >= sizeof(sim_state.response) - 1) {
-		_sim_clear_response();
-    }
+	// The DMA half and full transfer events come at least every half of the buffer
+	sim_rx.head += (uint32_t)(position + SIM_RX_BUFFER_SIZE - sim_rx.position) % SIM_RX_BUFFER_SIZE;
+	sim_rx.position = position % SIM_RX_BUFFER_SIZE;
+	sim_rx.events++;
+}
+
+void sim_rx_error()
+{
+	HAL_UART_AbortReceive(&SIM_MODULE_UART);
+	// The reception starts again from the buffer beginning
+	sim_rx.restart_head = sim_rx.head;
+	sim_rx.position     = 0;
+	sim_rx.errors++;
+	_sim_rx_start();
 }
 
-void send_sim_http_post(const char* data)
+void sim_tx_complete()
 {
-    if (!fsm_gc_is_state(&sim_fsm, &sim_send_http_s) || sim_state.done) {
+	sim_tx.sent += sim_tx.fragments[sim_tx.tail % SIM_TX_FRAGMENTS_COUNT].len;
+	sim_tx.tail++;
+	sim_tx.busy = false;
+	_sim_tx_start();
+}
+
+void sim_tx_error()
+{
+	if (!sim_tx.busy || SIM_MODULE_UART.gState != HAL_UART_STATE_READY) {
+		return;
+	}
+	// The transmission was stopped by the HAL: the rest of the queue is dropped
+	sim_tx.tail = sim_tx.head;
+	sim_tx.busy = false;
+	sim_tx.errors++;
+}
+
+void sim_get_rx_stats(sim_rx_stats_t* stats)
+{
+	stats->received = sim_rx.head;
+	stats->lost     = sim_rx.lost;
+	stats->events   = sim_rx.events;
+	stats->errors   = sim_rx.errors;
+}
+
+void sim_get_tx_stats(sim_tx_stats_t* stats)
+{
+	stats->sent    = sim_tx.sent;
+	stats->dropped = sim_tx.dropped;
+	stats->errors  = sim_tx.errors;
+	stats->padded  = sim_tx.padded;
+}
+
+void sim_show_rx_stats()
+{
+	sim_rx_stats_t stats = {0};
+	sim_get_rx_stats(&stats);
+	printTagLog(
+		SIM_TAG,
+		"UART RX: received=%lu lost=%lu interrupts=%lu errors=%lu",
+		stats.received,
+		stats.lost,
+		stats.events,
+		stats.errors
+	);
+}
+
+void sim_show_tx_stats()
+{
+	sim_tx_stats_t stats = {0};
+	sim_get_tx_stats(&stats);
+	printTagLog(
+		SIM_TAG,
+		"UART TX: sent=%lu dropped=%lu errors=%lu padded=%lu",
+		stats.sent,
+		stats.dropped,
+		stats.errors,
+		stats.padded
+	);
+}
+
+void sim_get_http_stats(sim_http_stats_t* stats)
+{
+	memcpy(stats, &sim_http, sizeof(sim_http));
+}
+
+void sim_show_http_stats()
+{
+	printTagLog(
+		SIM_TAG,
+		"HTTP: requests=%lu reused=%lu last: setup=%lums data=%lums action=%lums read=%lums",
+		sim_http.requests,
+		sim_http.reused,
+		sim_http.setup_ms,
+		sim_http.data_ms,
+		sim_http.action_ms,
+		sim_http.read_ms
+	);
+}
+
+void send_sim_http_post(const unsigned length, sim_request_writer_t writer)
+{
+    if (!if_network_ready() || sim_state.done) {
         return;
     }
-    memset(sim_state.request, 0, sizeof(sim_state.request));
-    snprintf(
-		sim_state.request,
-        sizeof(sim_state.request),
-        "%s"
-        "%c",
-        data,
-        END_OF_STRING
-    );
-    sim_state.done = true;
+    // The body is written into the TX chunks after the module asks for it
+    sim_state.writer      = writer;
+    sim_state.request_len = __min(length, (unsigned)SIM_REQUEST_MAX_SIZE);
+    sim_state.done        = true;
 }
 
 char* get_response()
@@ -243,7 +540,7 @@ void set_main_server()
 
 bool if_network_ready()
 {
-	return fsm_gc_is_state(&sim_fsm, &sim_send_http_s);
+	return fsm_gc_is_state(&sim_fsm, &sim_wait_request_s) || fsm_gc_is_state(&sim_fsm, &sim_idle_s);
 }
 
 bool has_http_response()
@@ -253,278 +550,554 @@ bool has_http_response()
 
 void _sim_send_cmd(const char* cmd)
 {
-    HAL_UART_Transmit(&SIM_MODULE_UART, (uint8_t*)cmd, (uint16_t)strlen(cmd), GENERAL_TIMEOUT_MS);
-    HAL_UART_Transmit(&SIM_MODULE_UART, (uint8_t*)LINE_BREAK, (uint16_t)strlen(LINE_BREAK), GENERAL_TIMEOUT_MS);
+    if (sim_tx.head != sim_tx.tail) {
+        // The module did not answer the previous command: its transmission is not needed
+        HAL_UART_AbortTransmit(&SIM_MODULE_UART);
+        sim_tx.dropped += sim_tx.head - sim_tx.tail;
+        sim_tx.tail = sim_tx.head;
+        sim_tx.busy = false;
+    }
+    // The command stops the request upload
+    sim_state.uploading = false;
+    // The command buffer is not changed until the command is sent
+    strncpy(sim_tx.command, cmd, sizeof(sim_tx.command) - 1);
+    sim_tx.command[sizeof(sim_tx.command) - 1] = 0;
+
+    // Only the lines received after the command complete it
+    sim_at_clear(&sim_state.at);
+    _sim_send_data(sim_tx.command, strlen(sim_tx.command));
+    _sim_send_data(LINE_BREAK, strlen(LINE_BREAK));
 #if SIM_MODULE_DEBUG
     printTagLog(SIM_TAG, "send - %s\r\n", cmd);
 #endif
 }
 
-bool _sim_validate(const char* target)
+void _sim_send_data(const void* data, const unsigned len)
 {
-    if (strnstr(sim_state.response, target, sizeof(sim_state.response))) {
-#if SIM_MODULE_DEBUG
-        printTagLog(SIM_TAG, "success - [%s]\n", sim_state.response);
-#endif
-        return true;
+    if (!len) {
+        return;
     }
-    return false;
+    if (sim_tx.head - sim_tx.tail >= SIM_TX_FRAGMENTS_COUNT) {
+        sim_tx.dropped++;
+        return;
+    }
+    sim_tx_fragment_t* fragment = &sim_tx.fragments[sim_tx.head % SIM_TX_FRAGMENTS_COUNT];
+    fragment->data = (const uint8_t*)data;
+    fragment->len  = (uint16_t)len;
+    sim_tx.head++;
+
+    // HAL_UART_TxCpltCallback() can not start the next fragment at the same time
+    __disable_irq();
+    _sim_tx_start();
+    __enable_irq();
 }
 
-void _sim_clear_response()
+void _sim_tx_start()
 {
-    memset(sim_state.response, 0, sizeof(sim_state.response));
-    sim_state.resp_cnt = 0;
+	if (sim_tx.busy || sim_tx.head == sim_tx.tail) {
+		return;
+	}
+	sim_tx_fragment_t* fragment = &sim_tx.fragments[sim_tx.tail % SIM_TX_FRAGMENTS_COUNT];
+	sim_tx.busy = true;
+	if (HAL_UART_Transmit_DMA(&SIM_MODULE_UART, (uint8_t*)fragment->data, fragment->len) != HAL_OK) {
+		sim_tx.tail = sim_tx.head;
+		sim_tx.busy = false;
+		sim_tx.errors++;
+	}
 }
 
+void _sim_upload_start()
+{
+	sim_state.request_sent = 0;
+	sim_state.uploading    = true;
+	for (unsigned i = 0; i < SIM_TX_CHUNKS_COUNT; i++) {
+		sim_tx.chunk_heads[i] = sim_tx.tail;
+	}
+	_sim_upload_process();
+}
 
-void _sim_init_s(void)
+void _sim_upload_process()
 {
-	memset(&sim_state, 0, sizeof(sim_state));
-	strncpy(sim_state.url, settings.url, sizeof(sim_state.url));
+	while (sim_state.uploading) {
+		if (sim_state.request_sent >= sim_state.request_len) {
+			sim_state.uploading = false;
+#if !SIM_TCP_TRANSPORT
+			_sim_send_data(SIM_END_OF_STRING, sizeof(SIM_END_OF_STRING));
+#endif
+			break;
+		}
 
-	sim_state.counter = 0;
-	util_old_timer_start(&sim_state.timer, 1500);
+		const unsigned idx = sim_tx.chunk % SIM_TX_CHUNKS_COUNT;
+		if ((int32_t)(sim_tx.tail - sim_tx.chunk_heads[idx]) < 0 ||
+			sim_tx.head - sim_tx.tail >= SIM_TX_FRAGMENTS_COUNT
+		) {
+			// The chunk is not sent yet
+			break;
+		}
 
-	fsm_gc_push_event(&sim_fsm, &sim_success_e);
+		char* chunk = sim_tx.chunks[idx];
+		unsigned size = __min(sim_state.request_len - sim_state.request_sent, (unsigned)SIM_TX_CHUNK_SIZE);
+		unsigned len = sim_state.writer ? sim_state.writer(chunk, size, sim_state.request_sent) : 0;
+		if (!len || len > size) {
+			// The module waits for the whole request length
+			memset(chunk, '\n', size);
+			sim_tx.padded += size;
+			len = size;
+		}
+
+		_sim_send_data(chunk, len);
+		sim_tx.chunk_heads[idx] = sim_tx.head;
+		sim_tx.chunk++;
+		sim_state.request_sent += len;
+	}
 }
 
-void _sim_start_s(void)
+bool _sim_validate(const uint32_t events)
 {
-	memset(sim_state.response, 0, sizeof(sim_state.response));
-	_sim_send_cmd(start_cmds[sim_state.counter].request);
-	util_old_timer_start(&sim_state.timer, SIM_DELAY_MS);
-	fsm_gc_push_event(&sim_fsm, &sim_success_e);
+    if (sim_at_take(&sim_state.at, events)) {
+#if SIM_MODULE_DEBUG
+        printTagLog(SIM_TAG, "success - [%s]\n", sim_state.response);
+#endif
+        return true;
+    }
+    return false;
 }
 
-void _sim_start_iterate_s(void)
+bool _sim_wait()
 {
-	if (_sim_validate(start_cmds[sim_state.counter].response)) {
-		sim_state.counter++;
-		_sim_clear_response();
-		fsm_gc_push_event(&sim_fsm, &sim_success_e);
+	// The HTTP and TCP commands do not wait for the timeout after the error result
+	if (sim_at_take(&sim_state.at, SIM_AT_EVENT_ERROR | SIM_AT_EVENT_CLOSED)) {
+		return false;
 	}
+	return util_old_timer_wait(&sim_state.timer);
+}
 
-	if (sim_state.counter >= __arr_len(start_cmds)) {
-		sim_state.counter = 0;
-		sim_state.errors  = 0;
-
-		fsm_gc_clear(&sim_fsm);
-		_sim_clear_response();
-		fsm_gc_push_event(&sim_fsm, &sim_end_e);
-	}
+uint32_t _sim_phase_end()
+{
+	uint32_t time = getMillis();
+	uint32_t delay = time - sim_state.phase_ms;
+	sim_state.phase_ms = time;
+	return delay;
+}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
-		return;
+void _sim_http_end()
+{
+	sim_http.requests++;
+	if (sim_state.http_reused) {
+		sim_http.reused++;
 	}
-
-	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+	sim_http.setup_ms  = sim_state.setup_ms;
+	sim_http.data_ms   = sim_state.data_ms;
+	sim_http.action_ms = sim_state.action_ms;
+	sim_http.read_ms   = _sim_phase_end();
+#if SIM_MODULE_DEBUG
+	sim_show_http_stats();
+#endif
 }
 
-void _sim_init_http_s(void)
+void _sim_seq_start(const sim_step_t* steps, const unsigned count)
 {
-	sim_state.http_error = false;
-
-	if (!sim_state.counter) {
-		sim_state.counter++;
-		_sim_clear_response();
+	sim_state.steps       = steps;
+	sim_state.steps_count = count;
+	sim_state.step        = 0;
+	sim_state.retries     = 0;
+	sim_state.step_sent   = false;
+}
 
-		_sim_send_cmd("AT+HTTPINIT");
-		util_old_timer_start(&sim_state.timer, 5000);
+sim_seq_status_t _sim_seq_process()
+{
+	if (sim_state.step >= sim_state.steps_count) {
+		return SIM_SEQ_DONE;
 	}
 
-	if (_sim_validate("ok")) {
-		_sim_clear_response();
-
-		sim_state.counter = 0;
-
-		fsm_gc_clear(&sim_fsm);
-		fsm_gc_push_event(&sim_fsm, &sim_success_e);
+	const sim_step_t* step = &sim_state.steps[sim_state.step];
+	if (!sim_state.step_sent) {
+		sim_state.step_sent = true;
+		sim_at_expect(&sim_state.at, step->token);
+		if (step->format) {
+			char command[SIM_TX_COMMAND_SIZE] = { 0 };
+			step->format(command, sizeof(command));
+			_sim_clear_response();
+			_sim_send_cmd(command);
+		} else if (step->command) {
+			_sim_clear_response();
+			_sim_send_cmd(step->command);
+		}
+		util_old_timer_start(&sim_state.timer, step->timeout_ms);
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
-		return;
+	uint32_t events = step->events | (step->token ? SIM_AT_EVENT_EXPECTED : 0);
+	if (_sim_validate(events)) {
+		if (!step->done || step->done()) {
+			return _sim_seq_next();
+		}
+	} else if (_sim_wait()) {
+		return SIM_SEQ_RUN;
 	}
 
-	_sim_clear_response();
-
-	sim_state.counter = 0;
+	if (sim_state.retries < step->retries) {
+		sim_state.retries++;
+		sim_state.step_sent = false;
+		return SIM_SEQ_RUN;
+	}
+	if (step->flags & SIM_STEP_OPTIONAL) {
+		return _sim_seq_next();
+	}
+	sim_at_expect(&sim_state.at, NULL);
+	return SIM_SEQ_FAIL;
+}
 
-	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+sim_seq_status_t _sim_seq_next()
+{
+	sim_state.step++;
+	sim_state.retries   = 0;
+	sim_state.step_sent = false;
+	if (sim_state.step < sim_state.steps_count) {
+		return SIM_SEQ_RUN;
+	}
+	sim_at_expect(&sim_state.at, NULL);
+	return SIM_SEQ_DONE;
 }
 
-void _sim_start_http_s(void)
+sim_seq_status_t _sim_run_script(const sim_step_t* steps, const unsigned count)
 {
 	if (!sim_state.counter) {
 		sim_state.counter++;
-		_sim_clear_response();
-
-		char httppara[SIM_HTTP_SIZE] = { 0 };
-		snprintf(httppara, sizeof(httppara), "AT+HTTPPARA=\"URL\",\"http://%s/api/log/ep\"", sim_state.url);
-
-		_sim_send_cmd(httppara);
-		util_old_timer_start(&sim_state.timer, 5000);
+		_sim_seq_start(steps, count);
 	}
-
-	if (_sim_validate("ok")) {
-		sim_state.done = false;
+	sim_seq_status_t status = _sim_seq_process();
+	if (status != SIM_SEQ_RUN) {
 		sim_state.counter = 0;
-		_sim_clear_response();
 		fsm_gc_clear(&sim_fsm);
-		fsm_gc_push_event(&sim_fsm, &sim_success_e);
 	}
+	return status;
+}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
-		return;
-	}
+bool _sim_session_done(void)
+{
+	// The request may be already received when only the URL is changed
+	strncpy(sim_state.http_url, sim_state.url, sizeof(sim_state.http_url));
+	sim_state.setup_ms = _sim_phase_end();
+	return true;
+}
 
-	sim_state.counter = 0;
-	sim_state.http_error = true;
-	util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
-	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+bool _sim_upload_done(void)
+{
+	sim_state.data_ms = _sim_phase_end();
+	return true;
 }
 
-void _sim_send_http_s(void)
+#if SIM_TCP_TRANSPORT
+void _sim_cipstart_format(char* command, const unsigned size)
 {
-	if (!sim_state.done) {
-		return;
+	// The server URL is "host" or "host:port"
+	const char* port = strchr(sim_state.url, ':');
+	int host_len = port ? (int)(port - sim_state.url) : (int)strlen(sim_state.url);
+	if (port) {
+		snprintf(command, size, "AT+CIPSTART=\"TCP\",\"%.*s\",\"%s\"", host_len, sim_state.url, port + 1);
+	} else {
+		snprintf(command, size, "AT+CIPSTART=\"TCP\",\"%.*s\",\"%u\"", host_len, sim_state.url, SIM_TCP_PORT);
 	}
+}
 
-	if (!sim_state.counter) {
-		sim_state.counter++;
-		_sim_clear_response();
+void _sim_cipsend_format(char* command, const unsigned size)
+{
+	sim_state.request_header[0] = SIM_TCP_FRAME_MAGIC;
+	sim_state.request_header[1] = SIM_TCP_FRAME_REQUEST;
+	sim_state.request_header[2] = (uint8_t)(sim_state.request_len >> 8);
+	sim_state.request_header[3] = (uint8_t)(sim_state.request_len & 0xFF);
 
-		char httpdata[SIM_HTTP_SIZE] = { 0 };
-		snprintf(httpdata, sizeof(httpdata), "AT+HTTPDATA=%d,%d", strlen(sim_state.request), 1000);
-		memset(sim_state.response, 0, sizeof(sim_state.response));
-		_sim_send_cmd(httpdata);
-		util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
-	}
+	snprintf(command, size, "AT+CIPSEND=%u", sim_state.request_len + SIM_TCP_FRAME_HEADER_SIZE);
+}
 
-	if (_sim_validate("download")) {
-		_sim_clear_response();
+bool _sim_cipsend_done(void)
+{
+	_sim_send_data(sim_state.request_header, sizeof(sim_state.request_header));
+	_sim_upload_start();
+	return true;
+}
+#else
+void _sim_httppara_format(char* command, const unsigned size)
+{
+	snprintf(command, size, "AT+HTTPPARA=\"URL\",\"http://%s/api/log/ep\"", sim_state.url);
+}
 
-		fsm_gc_clear(&sim_fsm);
+void _sim_httpdata_format(char* command, const unsigned size)
+{
+	// The END_OF_STRING is sent after the request
+	snprintf(command, size, "AT+HTTPDATA=%u,%d", (unsigned)(sim_state.request_len + sizeof(SIM_END_OF_STRING)), SIM_HTTPDATA_MS);
+}
 
-		_sim_send_cmd(sim_state.request);
-		util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
+void _sim_httpread_format(char* command, const unsigned size)
+{
+	snprintf(command, size, "AT+HTTPREAD=0,%u", sim_state.resp_len);
+}
 
-		fsm_gc_push_event(&sim_fsm, &sim_success_e);
-	}
+bool _sim_httpdata_done(void)
+{
+	_sim_upload_start();
+	return true;
+}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
-		return;
+bool _sim_httpaction_done(void)
+{
+	if (sim_state.at.http_status != 200) {
+#if SIM_MODULE_DEBUG
+		printTagLog(SIM_TAG, "HTTP status %u", sim_state.at.http_status);
+#endif
+		return false;
 	}
-
-	sim_state.counter = 0;
-	sim_state.http_error = true;
-	util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
-	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+	sim_state.resp_len  = sim_state.at.http_length;
+	sim_state.action_ms = _sim_phase_end();
+	return true;
 }
 
-void _sim_send_post_s(void)
+bool _sim_httphead_done(void)
 {
-	if (_sim_validate("ok")) {
-		_sim_clear_response();
-		sim_state.done = false;
+	sim_state.resp_len = sim_state.at.content_length;
+	return true;
+}
 
-		fsm_gc_clear(&sim_fsm);
+bool _sim_httpread_done(void)
+{
+	_sim_http_end();
+	return true;
+}
+#endif
 
-		_sim_send_cmd("AT+HTTPACTION=1");
-		util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
+void _sim_rx_start()
+{
+	if (HAL_UARTEx_ReceiveToIdle_DMA(&SIM_MODULE_UART, sim_rx.buffer, sizeof(sim_rx.buffer)) != HAL_OK) {
+#if SIM_MODULE_DEBUG
+		printTagLog(SIM_TAG, "error start UART DMA reception");
+#endif
+	}
+}
 
-		fsm_gc_push_event(&sim_fsm, &sim_success_e);
+void _sim_rx_read()
+{
+	uint32_t errors = sim_rx.errors;
+	if (sim_rx.errors_seen != errors) {
+		sim_rx.errors_seen = errors;
+		uint32_t restart_head = sim_rx.restart_head;
+		sim_rx.lost += restart_head - sim_rx.tail;
+		sim_rx.tail = restart_head;
+		sim_rx.read_position = 0;
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
-		return;
+	uint32_t head = sim_rx.head;
+	uint32_t count = head - sim_rx.tail;
+	if (count > SIM_RX_BUFFER_SIZE) {
+		// sim_process() was blocked longer than the buffer lasts
+		uint32_t skip = count - SIM_RX_BUFFER_SIZE;
+		sim_rx.lost += skip;
+		sim_rx.tail += skip;
+		sim_rx.read_position = (sim_rx.read_position + skip) % SIM_RX_BUFFER_SIZE;
+		count = SIM_RX_BUFFER_SIZE;
 	}
 
-	sim_state.http_error = true;
-	util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
-	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t byte = sim_rx.buffer[sim_rx.read_position];
+		char chr = (char)tolower(byte);
+#if SIM_TCP_TRANSPORT
+		// The response contains only the payload of the server frames
+		if (sim_at_feed(&sim_state.at, chr)) {
+			_sim_tcp_frame_byte(byte);
+		}
+#else
+		sim_at_feed(&sim_state.at, chr);
+		sim_state.response[sim_state.resp_cnt++] = chr;
+		sim_state.response[sim_state.resp_cnt]   = 0;
+		if (sim_state.resp_cnt >= sizeof(sim_state.response) - 1) {
+			_sim_clear_response();
+		}
+#endif
+		sim_rx.read_position = (sim_rx.read_position + 1) % SIM_RX_BUFFER_SIZE;
+	}
+	sim_rx.tail += count;
 }
 
-void _sim_wait_post_s(void)
+void _sim_clear_response()
 {
-	const char* httpaction = "+httpaction: 1,200,";
-
-	if (!sim_state.done && _sim_validate(httpaction)) {
-		sim_state.done = true;
-	} else if (sim_state.done) {
-		char* ptr = strnstr(
-			sim_state.response,
-			httpaction,
-			sizeof(sim_state.response)
-		) + strlen(httpaction);
-		char format[32] = {0};
-		snprintf(format, sizeof(format) - 1, "%s%u\r\n", httpaction, (unsigned)atoi(ptr));
-		if (strnstr(sim_state.response, format, sizeof(sim_state.response))) {
-			sim_state.resp_len = (unsigned)atoi(ptr);
-			sim_state.done = false;
-
-			fsm_gc_clear(&sim_fsm);
-
-			_sim_send_cmd("AT+HTTPHEAD");
-			util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
+	// The response is always a null terminated string: there is no need to clear the whole buffer
+	sim_state.response[0] = 0;
+	sim_state.resp_cnt = 0;
+}
 
-			fsm_gc_push_event(&sim_fsm, &sim_success_e);
+#if SIM_TCP_TRANSPORT
+void _sim_tcp_frame_byte(const uint8_t byte)
+{
+	if (sim_state.frame_cnt < SIM_TCP_FRAME_HEADER_SIZE) {
+		if (!sim_state.frame_cnt && byte != SIM_TCP_FRAME_MAGIC) {
+			return;
+		}
+		sim_state.frame_header[sim_state.frame_cnt++] = byte;
+		if (sim_state.frame_cnt < SIM_TCP_FRAME_HEADER_SIZE) {
+			return;
+		}
+		_sim_clear_response();
+		sim_state.frame_len = ((unsigned)sim_state.frame_header[2] << 8) | sim_state.frame_header[3];
+	} else {
+		// The text is lowercase as the HTTP response; the tail of a long frame is dropped
+		if (sim_state.resp_cnt < sizeof(sim_state.response) - 1) {
+			sim_state.response[sim_state.resp_cnt++] = (char)tolower(byte);
+			sim_state.response[sim_state.resp_cnt]   = 0;
 		}
+		sim_state.frame_cnt++;
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (sim_state.frame_cnt - SIM_TCP_FRAME_HEADER_SIZE < sim_state.frame_len) {
 		return;
 	}
+	if (sim_state.frame_header[1] == SIM_TCP_FRAME_RESPONSE) {
+		sim_state.frame_done = true;
+	}
+	sim_state.frame_cnt = 0;
+}
+#endif
+
+
+void _sim_init_s(void)
+{
+	memset(&sim_state, 0, sizeof(sim_state));
+	strncpy(sim_state.url, settings.url, sizeof(sim_state.url));
 
 	sim_state.counter = 0;
-	sim_state.http_error = true;
-	util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
-	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+	util_old_timer_start(&sim_state.timer, 1500);
+
+	fsm_gc_push_event(&sim_fsm, &sim_success_e);
 }
 
-void _sim_read_data_s(void)
+void _sim_start_s(void)
 {
-	const char* contentlength = "content-length: ";
+	switch (_sim_run_script(SIM_SCRIPT(sim_start_steps))) {
+	case SIM_SEQ_DONE:
+		sim_state.errors = 0;
+		_sim_clear_response();
+		fsm_gc_push_event(&sim_fsm, &sim_success_e);
+		break;
+	case SIM_SEQ_FAIL:
+		fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+		break;
+	default:
+		break;
+	}
+}
 
-	if (!sim_state.done && _sim_validate(contentlength)) {
-		sim_state.done = true;
-	} else if (sim_state.done) {
-		char* ptr = strnstr(
-			sim_state.response,
-			contentlength,
-			sizeof(sim_state.response)
-		) + strlen(contentlength);
-		char format[32] = {0};
-		snprintf(format, sizeof(format) - 1, "%s%u\r\n", contentlength, (unsigned)atoi(ptr));
-		if (strnstr(sim_state.response, format, sizeof(sim_state.response))) {
-			sim_state.resp_len = (unsigned)atoi(ptr);
+void _sim_connect_s(void)
+{
+	if (!sim_state.counter) {
+		if (!sim_state.idle) {
 			sim_state.done = false;
-			_sim_clear_response();
+		}
+		sim_state.idle        = false;
+		sim_state.http_error  = false;
+		sim_state.http_reused = false;
+		sim_state.http_url[0] = 0;
+		sim_state.phase_ms    = getMillis();
+	}
 
-			fsm_gc_clear(&sim_fsm);
+	switch (_sim_run_script(SIM_SCRIPT(sim_connect_steps))) {
+	case SIM_SEQ_DONE:
+		util_old_timer_start(&sim_state.timer, SIM_HTTP_IDLE_MS);
+		fsm_gc_push_event(&sim_fsm, &sim_success_e);
+		break;
+	case SIM_SEQ_FAIL:
+#if SIM_TCP_TRANSPORT
+		sim_state.http_error = true;
+#endif
+		fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+		break;
+	default:
+		break;
+	}
+}
 
-			char request[SIM_HTTP_SIZE] = { 0 };
-			snprintf(request, sizeof(request), "AT+HTTPREAD=0,%u", sim_state.resp_len);
-			_sim_send_cmd(request);
-			util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
+#if !SIM_TCP_TRANSPORT
+void _sim_url_s(void)
+{
+	switch (_sim_run_script(SIM_SCRIPT(sim_url_steps))) {
+	case SIM_SEQ_DONE:
+		util_old_timer_start(&sim_state.timer, SIM_HTTP_IDLE_MS);
+		fsm_gc_push_event(&sim_fsm, &sim_success_e);
+		break;
+	case SIM_SEQ_FAIL:
+		sim_state.http_error = true;
+		fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+		break;
+	default:
+		break;
+	}
+}
+#endif
 
-			fsm_gc_push_event(&sim_fsm, &sim_success_e);
+void _sim_wait_request_s(void)
+{
+	if (!sim_state.done) {
+		if (sim_at_take(&sim_state.at, SIM_AT_EVENT_CLOSED) ||
+			!util_old_timer_wait(&sim_state.timer)
+		) {
+#if SIM_MODULE_DEBUG
+			printTagLog(SIM_TAG, "session is closed or idle");
+#endif
+			sim_state.idle = true;
+			fsm_gc_push_event(&sim_fsm, &sim_end_e);
 		}
+		return;
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (strncmp(sim_state.http_url, sim_state.url, sizeof(sim_state.http_url))) {
+		// The server was changed: the pending request is sent after the new URL is set
+		sim_state.phase_ms = getMillis();
+		fsm_gc_push_event(&sim_fsm, &sim_change_e);
 		return;
 	}
 
+	sim_state.phase_ms = getMillis();
+#if SIM_TCP_TRANSPORT
+	sim_state.frame_cnt  = 0;
+	sim_state.frame_done = false;
+#endif
+	fsm_gc_push_event(&sim_fsm, &sim_success_e);
+}
+
+void _sim_idle_s(void)
+{
+	// The session is opened again only for the next request
+	if (!sim_state.done) {
+		return;
+	}
 	sim_state.counter = 0;
-	sim_state.http_error = true;
-	util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
-	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+	fsm_gc_push_event(&sim_fsm, &sim_success_e);
+}
+
+void _sim_post_s(void)
+{
+	switch (_sim_run_script(SIM_SCRIPT(sim_post_steps))) {
+	case SIM_SEQ_DONE:
+#if !SIM_TCP_TRANSPORT
+		sim_state.done = false;
+#endif
+		util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
+		fsm_gc_push_event(&sim_fsm, &sim_success_e);
+		break;
+	case SIM_SEQ_FAIL:
+		sim_state.http_error = true;
+		fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+		break;
+	default:
+		break;
+	}
 }
 
-void _sim_wait_data_s(void)
+#if SIM_TCP_TRANSPORT
+void _sim_tcp_wait_s(void)
 {
-	if (_sim_validate("ok")) {
+	if (sim_state.frame_done) {
+		sim_state.frame_done = false;
+		sim_state.action_ms  = _sim_phase_end();
+		_sim_http_end();
+
 		fsm_gc_clear(&sim_fsm);
 
 		sim_state.done = false;
@@ -533,15 +1106,14 @@ void _sim_wait_data_s(void)
 		fsm_gc_push_event(&sim_fsm, &sim_success_e);
 	}
 
-	if (util_old_timer_wait(&sim_state.timer)) {
+	if (_sim_wait()) {
 		return;
 	}
 
-	sim_state.counter = 0;
 	sim_state.http_error = true;
-	util_old_timer_start(&sim_state.timer, SIM_HTTP_MS);
 	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
 }
+#endif
 
 void _sim_wait_user_s(void)
 {
@@ -551,42 +1123,54 @@ void _sim_wait_user_s(void)
 
 	_sim_clear_response();
 
+	sim_state.done    = false;
 	sim_state.counter = 0;
 
-	fsm_gc_push_event(&sim_fsm, &sim_success_e);
+	if (sim_state.http_error ||
+		strncmp(sim_state.url, settings.url, strlen(sim_state.url))
+	) {
+		fsm_gc_push_event(&sim_fsm, &sim_success_e);
+		return;
+	}
+
+	// The next request is sent in the same session
+	sim_state.http_reused = true;
+	sim_state.setup_ms    = 0;
+	util_old_timer_start(&sim_state.timer, SIM_HTTP_IDLE_MS);
+	fsm_gc_push_event(&sim_fsm, &sim_next_e);
 }
 
-void _sim_close_http_s(void)
+void _sim_close_s(void)
 {
-	if (!sim_state.counter) {
+	switch (_sim_run_script(SIM_SCRIPT(sim_close_steps))) {
+	case SIM_SEQ_DONE:
 		_sim_clear_response();
-
-		sim_state.counter++;
-
-		_sim_send_cmd("AT+HTTPTERM");
-		util_old_timer_start(&sim_state.timer, SIM_DELAY_MS);
-	}
-
-	if (_sim_validate("ok")) {
-		_sim_clear_response();
-
-		sim_state.counter = 0;
-
-		fsm_gc_clear(&sim_fsm);
+#if SIM_TCP_TRANSPORT
+		if (sim_state.http_error) {
+			sim_state.done = false;
+			fsm_gc_push_event(&sim_fsm, &sim_change_e);
+		} else {
+			if (!sim_state.is_base_server) {
+				set_main_server();
+			}
+			fsm_gc_push_event(&sim_fsm, sim_state.idle ? &sim_end_e : &sim_success_e);
+		}
+#else
 		if (sim_state.http_error ||
 			strncmp(sim_state.url, settings.url, strlen(sim_state.url))
 		) {
 			fsm_gc_push_event(&sim_fsm, &sim_change_e);
 		} else {
-			fsm_gc_push_event(&sim_fsm, &sim_success_e);
+			fsm_gc_push_event(&sim_fsm, sim_state.idle ? &sim_end_e : &sim_success_e);
 		}
+#endif
+		break;
+	case SIM_SEQ_FAIL:
+		fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
+		break;
+	default:
+		break;
 	}
-
-	if (util_old_timer_wait(&sim_state.timer)) {
-		return;
-	}
-
-	fsm_gc_push_event(&sim_fsm, &sim_timeout_e);
 }
 
 void _sim_change_url_s(void)
@@ -7,6 +7,7 @@ extern "C" {
 #endif
 
 
+#include <stdint.h>
 #include <stdbool.h>
 
 
@@ -17,7 +18,79 @@ extern "C" {
 
 #define RESPONSE_SIZE (800)
 #define END_OF_STRING (0x1a)
-#define SIM_LOG_SIZE  (300)
+// Circular DMA buffer of the module UART: ~44 ms of the 115200 baud stream
+#ifndef SIM_RX_BUFFER_SIZE
+#   define SIM_RX_BUFFER_SIZE (512)
+#endif
+#ifndef SIM_TX_FRAGMENTS_COUNT
+#   define SIM_TX_FRAGMENTS_COUNT (4)
+#endif
+#ifndef SIM_TX_COMMAND_SIZE
+#   define SIM_TX_COMMAND_SIZE (96)
+#endif
+// The request body is written by the user into the chunks while the DMA sends the previous one
+#ifndef SIM_TX_CHUNKS_COUNT
+#   define SIM_TX_CHUNKS_COUNT (2)
+#endif
+#ifndef SIM_TX_CHUNK_SIZE
+#   define SIM_TX_CHUNK_SIZE (64)
+#endif
+// Raw TCP transport (AT+CIPSTART/AT+CIPSEND) instead of the AT+HTTP requests
+#ifndef SIM_TCP_TRANSPORT
+#   define SIM_TCP_TRANSPORT (0)
+#endif
+#ifndef SIM_TCP_PORT
+#   define SIM_TCP_PORT (7000) // The port is used when the server URL does not contain it
+#endif
+
+/*
+ * TCP transport frame: [magic][type][payload length high byte][payload length low byte][payload].
+ * The request payload is the HTTP request body, the response payload is the HTTP response body.
+ */
+#define SIM_TCP_FRAME_MAGIC       (0xA5)
+#define SIM_TCP_FRAME_HEADER_SIZE (4)
+#define SIM_TCP_FRAME_REQUEST     (0x01)
+#define SIM_TCP_FRAME_RESPONSE    (0x81)
+
+// Maximum request body length: one AT+CIPSEND packet or one AT+HTTPDATA upload
+#ifndef SIM_REQUEST_MAX_SIZE
+#   if SIM_TCP_TRANSPORT
+#       define SIM_REQUEST_MAX_SIZE (1460 - SIM_TCP_FRAME_HEADER_SIZE)
+#   else
+#       define SIM_REQUEST_MAX_SIZE (4096)
+#   endif
+#endif
+
+
+/*
+ * Request body writer: fills the chunk with the next body bytes and returns their count.
+ * offset - body bytes already written (0 - the body is written from the beginning).
+ */
+typedef unsigned (*sim_request_writer_t)(char* chunk, const unsigned size, const unsigned offset);
+
+
+typedef struct _sim_rx_stats_t {
+	uint32_t received; // Bytes received from the module
+	uint32_t lost;     // Bytes overwritten by the DMA before sim_process() read them
+	uint32_t events;   // DMA half/full transfer and UART IDLE line interrupts
+	uint32_t errors;   // UART errors (the reception was restarted)
+} sim_rx_stats_t;
+
+typedef struct _sim_tx_stats_t {
+	uint32_t sent;    // Bytes sent to the module
+	uint32_t dropped; // Fragments dropped: the queue was full or a new command was sent
+	uint32_t errors;  // DMA start or transfer errors
+	uint32_t padded;  // Request bytes padded: the writer finished before the request length
+} sim_tx_stats_t;
+
+typedef struct _sim_http_stats_t {
+	uint32_t requests;  // Completed HTTP requests
+	uint32_t reused;    // Requests sent without AT+HTTPINIT and AT+HTTPPARA
+	uint32_t setup_ms;  // AT+HTTPINIT and AT+HTTPPARA time of the last request (0 - reused session)
+	uint32_t data_ms;   // AT+HTTPDATA time of the last request
+	uint32_t action_ms; // AT+HTTPACTION time of the last request
+	uint32_t read_ms;   // AT+HTTPHEAD and AT+HTTPREAD time of the last request
+} sim_http_stats_t;
 
 
 extern char sim_response[RESPONSE_SIZE];
@@ -25,8 +98,22 @@ extern char sim_response[RESPONSE_SIZE];
 
 void sim_begin();
 void sim_process();
-void sim_proccess_input(const char input_chr);
-void send_sim_http_post(const char* data);
+/* HAL_UARTEx_RxEventCallback() of the module UART: position - DMA buffer write position */
+void sim_rx_event(const uint16_t position);
+/* HAL_UART_ErrorCallback() of the module UART */
+void sim_rx_error();
+/* HAL_UART_TxCpltCallback() of the module UART */
+void sim_tx_complete();
+/* HAL_UART_ErrorCallback() of the module UART */
+void sim_tx_error();
+void sim_get_rx_stats(sim_rx_stats_t* stats);
+void sim_show_rx_stats();
+void sim_get_tx_stats(sim_tx_stats_t* stats);
+void sim_show_tx_stats();
+void sim_get_http_stats(sim_http_stats_t* stats);
+void sim_show_http_stats();
+/* length - exact body length, the writer is called from sim_process() until the body is sent */
+void send_sim_http_post(const unsigned length, sim_request_writer_t writer);
 bool has_http_response();
 bool if_network_ready();
 char* get_response();
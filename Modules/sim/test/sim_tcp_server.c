@@ -0,0 +1,234 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "sim_tcp_server.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+
+#define SERVER_POLL_MS  (20)
+#define SERVER_SPLIT_US (100000)  // Pause between the two parts of a split response
+
+
+typedef struct _sim_tcp_server_t {
+	int             listen_fd;
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	volatile bool   stop;
+
+	unsigned        split;
+	unsigned        close_after;
+
+	sim_tcp_server_stats_t stats;
+} sim_tcp_server_t;
+
+
+static void* _server_thread(void* arg);
+static void _server_connection(const int fd);
+static bool _server_recv(const int fd, uint8_t* data, const unsigned len);
+static bool _server_send(const int fd, const uint8_t* data, const unsigned len);
+
+
+static sim_tcp_server_t server = {
+	.listen_fd = -1,
+	.lock      = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+uint16_t sim_tcp_server_start()
+{
+	server.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (server.listen_fd < 0) {
+		return 0;
+	}
+
+	// The system chooses a free port
+	struct sockaddr_in addr = {0};
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port        = 0;
+	socklen_t addr_len = sizeof(addr);
+	if (bind(server.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+		listen(server.listen_fd, 1) ||
+		getsockname(server.listen_fd, (struct sockaddr*)&addr, &addr_len)
+	) {
+		close(server.listen_fd);
+		server.listen_fd = -1;
+		return 0;
+	}
+
+	server.stop = false;
+	if (pthread_create(&server.thread, NULL, _server_thread, NULL)) {
+		close(server.listen_fd);
+		server.listen_fd = -1;
+		return 0;
+	}
+
+	return ntohs(addr.sin_port);
+}
+
+void sim_tcp_server_stop()
+{
+	if (server.listen_fd < 0) {
+		return;
+	}
+	server.stop = true;
+	pthread_join(server.thread, NULL);
+	close(server.listen_fd);
+	server.listen_fd = -1;
+}
+
+void sim_tcp_server_split(const unsigned request)
+{
+	pthread_mutex_lock(&server.lock);
+	server.split = request;
+	pthread_mutex_unlock(&server.lock);
+}
+
+void sim_tcp_server_close_after(const unsigned request)
+{
+	pthread_mutex_lock(&server.lock);
+	server.close_after = request;
+	pthread_mutex_unlock(&server.lock);
+}
+
+void sim_tcp_server_get_stats(sim_tcp_server_stats_t* stats)
+{
+	pthread_mutex_lock(&server.lock);
+	memcpy(stats, &server.stats, sizeof(server.stats));
+	pthread_mutex_unlock(&server.lock);
+}
+
+unsigned sim_tcp_server_response(char* response, const unsigned size, const unsigned request)
+{
+	// The keys of the log server response: the time, the last saved record id and the configuration id
+	int len = snprintf(
+		response,
+		size,
+		"\nt=2024-03-12t14:%02u:%02u\nd_hwm=%u\ncf_id=7\n",
+		(request / 60) % 60,
+		request % 60,
+		request
+	);
+	return (len > 0 && (unsigned)len < size) ? (unsigned)len : 0;
+}
+
+void* _server_thread(void* arg)
+{
+	(void)arg;
+	while (!server.stop) {
+		struct pollfd listen_poll = { .fd = server.listen_fd, .events = POLLIN };
+		if (poll(&listen_poll, 1, SERVER_POLL_MS) <= 0) {
+			continue;
+		}
+		int fd = accept(server.listen_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		int nodelay = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+		pthread_mutex_lock(&server.lock);
+		server.stats.accepts++;
+		pthread_mutex_unlock(&server.lock);
+
+		_server_connection(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+void _server_connection(const int fd)
+{
+	uint8_t header[SIM_TCP_FRAME_HEADER_SIZE] = {0};
+	uint8_t payload[SIM_REQUEST_MAX_SIZE] = {0};
+	while (_server_recv(fd, header, sizeof(header))) {
+		const unsigned len = ((unsigned)header[2] << 8) | header[3];
+		if (header[0] != SIM_TCP_FRAME_MAGIC ||
+			header[1] != SIM_TCP_FRAME_REQUEST ||
+			len > sizeof(payload) ||
+			!_server_recv(fd, payload, len)
+		) {
+			pthread_mutex_lock(&server.lock);
+			server.stats.errors++;
+			pthread_mutex_unlock(&server.lock);
+			return;
+		}
+
+		pthread_mutex_lock(&server.lock);
+		const unsigned request = ++server.stats.requests;
+		memcpy(server.stats.last, payload, len);
+		server.stats.last_len = len;
+		const bool split = (server.split == request);
+		const bool close_connection = (server.close_after == request);
+		pthread_mutex_unlock(&server.lock);
+
+		uint8_t frame[SIM_TCP_FRAME_HEADER_SIZE + SIM_TCP_SERVER_RESPONSE_SIZE] = {0};
+		const unsigned response_len = sim_tcp_server_response(
+			(char*)frame + SIM_TCP_FRAME_HEADER_SIZE,
+			SIM_TCP_SERVER_RESPONSE_SIZE,
+			request
+		);
+		frame[0] = SIM_TCP_FRAME_MAGIC;
+		frame[1] = SIM_TCP_FRAME_RESPONSE;
+		frame[2] = (uint8_t)(response_len >> 8);
+		frame[3] = (uint8_t)(response_len & 0xFF);
+		const unsigned frame_len = SIM_TCP_FRAME_HEADER_SIZE + response_len;
+
+		// The split frame comes in two "+IPD" packets of the module
+		const unsigned first_len = split ? SIM_TCP_FRAME_HEADER_SIZE + response_len / 2 : frame_len;
+		if (!_server_send(fd, frame, first_len)) {
+			return;
+		}
+		if (split) {
+			usleep(SERVER_SPLIT_US);
+			if (!_server_send(fd, frame + first_len, frame_len - first_len)) {
+				return;
+			}
+		}
+
+		if (close_connection) {
+			return;
+		}
+	}
+}
+
+bool _server_recv(const int fd, uint8_t* data, const unsigned len)
+{
+	unsigned received = 0;
+	while (received < len) {
+		if (server.stop) {
+			return false;
+		}
+		struct pollfd data_poll = { .fd = fd, .events = POLLIN };
+		if (poll(&data_poll, 1, SERVER_POLL_MS) <= 0) {
+			continue;
+		}
+		ssize_t count = recv(fd, data + received, len - received, 0);
+		if (count <= 0) {
+			return false;
+		}
+		received += (unsigned)count;
+	}
+	return true;
+}
+
+bool _server_send(const int fd, const uint8_t* data, const unsigned len)
+{
+	unsigned sent = 0;
+	while (sent < len) {
+		ssize_t count = send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+		if (count <= 0) {
+			return false;
+		}
+		sent += (unsigned)count;
+	}
+	return true;
+}
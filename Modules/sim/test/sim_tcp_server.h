@@ -0,0 +1,42 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#ifndef _SIM_TCP_SERVER_H_
+#define _SIM_TCP_SERVER_H_
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sim_module.h"
+
+
+#define SIM_TCP_SERVER_RESPONSE_SIZE (96)
+
+
+/*
+ * Local stand-in of the log server for the SIM_TCP_TRANSPORT frames.
+ * It listens on 127.0.0.1 in its own thread, serves one connection at a time
+ * and answers every request frame with a response frame.
+ */
+typedef struct _sim_tcp_server_stats_t {
+	unsigned accepts;   // Accepted connections
+	unsigned requests;  // Received request frames
+	unsigned errors;    // Broken request frames (the connection is closed)
+	uint8_t  last[SIM_REQUEST_MAX_SIZE];  // Payload of the last request
+	unsigned last_len;
+} sim_tcp_server_stats_t;
+
+
+/* Returns the listening port (0 - error) */
+uint16_t sim_tcp_server_start();
+void sim_tcp_server_stop();
+/* The response of the request is sent in two TCP segments */
+void sim_tcp_server_split(const unsigned request);
+/* The connection is closed after the response of the request */
+void sim_tcp_server_close_after(const unsigned request);
+void sim_tcp_server_get_stats(sim_tcp_server_stats_t* stats);
+/* Response payload of the request number (1 - the first request) */
+unsigned sim_tcp_server_response(char* response, const unsigned size, const unsigned request);
+
+
+#endif
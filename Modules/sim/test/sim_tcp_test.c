@@ -0,0 +1,513 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+/*
+ * Host test of the raw TCP transport (SIM_TCP_TRANSPORT=1) against the local
+ * stand-in server (sim_tcp_server.c). The module UART is replaced by a test
+ * double of the SIM868: it answers the AT commands and opens a real socket
+ * for AT+CIPSTART, so the request frames go through sim_at_feed() and
+ * _sim_tcp_frame_byte() as they do on the device.
+ * Usage: sim_tcp_test
+ */
+
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "main.h"
+#include "settings.h"
+#include "sim_module.h"
+#include "sim_tcp_server.h"
+
+
+#define TEST_WAIT_MS          ((uint32_t)5000)
+#define TEST_STEP_US          (100)
+#define TEST_LINE_SIZE        (128)
+#define TEST_IPD_SIZE         (256)  // Socket bytes of one "+IPD" packet
+#define TEST_RX_EVENT_SIZE    (SIM_RX_BUFFER_SIZE / 4)  // Bytes between the UART DMA events
+#define TEST_REQUESTS         { 1, 300, 1000, SIM_REQUEST_MAX_SIZE }
+// A request costs AT+CIPSEND and the frame header on the UART
+#define TEST_TX_OVERHEAD_MAX  ((uint32_t)24)
+// The prompt, "SEND OK", the "+IPD" header and the frame header
+#define TEST_RX_OVERHEAD_MAX  ((uint32_t)32)
+
+
+// SIM868 behind the UART: only the commands of the TCP transport are modeled
+typedef struct _test_modem_t {
+	char     line[TEST_LINE_SIZE];
+	unsigned line_len;
+	unsigned data_left;      // AT+CIPSEND bytes to receive
+	uint8_t  data[SIM_TCP_FRAME_HEADER_SIZE + SIM_REQUEST_MAX_SIZE];
+	unsigned data_len;
+	int      socket;         // -1 - no connection
+	bool     tx_pending;     // The UART DMA transfer is completed by the test loop
+
+	unsigned cipstarts;
+	unsigned cipcloses;
+	unsigned ipd_packets;
+	unsigned closed_urcs;    // "CLOSED": the server closed the connection
+} test_modem_t;
+
+typedef struct _test_uart_rx_t {
+	uint8_t* buffer;
+	uint16_t size;
+	uint16_t position;
+	uint16_t pending;        // Bytes written after the last DMA event
+} test_uart_rx_t;
+
+
+static void _test_start();
+static void _test_persistent();
+static void _test_split_response();
+static void _test_server_close();
+static bool _test_request(const unsigned length, sim_tx_stats_t* tx, sim_rx_stats_t* rx);
+static bool _test_wait(bool (*condition)(void));
+static void _test_step();
+static void _test_expect(const bool condition, const char* message);
+static unsigned _test_writer(char* chunk, const unsigned size, const unsigned offset);
+static bool _test_network_ready(void);
+static bool _test_response_ready(void);
+
+static void _modem_byte(const uint8_t byte);
+static void _modem_line(const char* line);
+static void _modem_cipstart(const char* line);
+static void _modem_cipsend_done();
+static void _modem_poll_socket();
+static void _modem_close_socket();
+static void _modem_reply(const char* text);
+static void _modem_write(const uint8_t* data, const unsigned len);
+
+
+UART_HandleTypeDef huart1 = { .gState = HAL_UART_STATE_READY };
+
+settings_t settings = {0};
+const char defaultUrl[CHAR_SETIINGS_SIZE] = "127.0.0.1:1";
+
+static test_modem_t   modem   = { .socket = -1 };
+static test_uart_rx_t uart_rx = {0};
+
+static const char* test_name = "";
+static unsigned errors = 0;
+static unsigned requests = 0;
+
+
+uint32_t HAL_GetTick(void)
+{
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+	(void)GPIOx;
+	(void)GPIO_Pin;
+	(void)PinState;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef* huart, uint8_t* pData, uint16_t Size)
+{
+	(void)huart;
+	uart_rx.buffer   = pData;
+	uart_rx.size     = Size;
+	uart_rx.position = 0;
+	uart_rx.pending  = 0;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef* huart)
+{
+	(void)huart;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef* huart, const uint8_t* pData, uint16_t Size)
+{
+	(void)huart;
+	for (uint16_t i = 0; i < Size; i++) {
+		_modem_byte(pData[i]);
+	}
+	modem.tx_pending = true;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef* huart)
+{
+	(void)huart;
+	modem.tx_pending = false;
+	return HAL_OK;
+}
+
+
+int main()
+{
+	const uint16_t port = sim_tcp_server_start();
+	if (!port) {
+		printf("stand-in server start error\n");
+		return 1;
+	}
+	snprintf(settings.url, sizeof(settings.url), "127.0.0.1:%u", port);
+
+	sim_begin();
+
+	_test_start();
+	_test_persistent();
+	_test_split_response();
+	_test_server_close();
+
+	_modem_close_socket();
+	sim_tcp_server_stop();
+
+	printf("errors: %u\n", errors);
+
+	return errors ? 1 : 0;
+}
+
+void _test_start()
+{
+	test_name = "start";
+	printf("%s\n", test_name);
+
+	// The module is reset and the connection is opened before the first request
+	_test_expect(_test_wait(_test_network_ready), "network is ready");
+	_test_expect(modem.cipstarts == 1 && modem.socket >= 0, "connection is opened");
+}
+
+void _test_persistent()
+{
+	test_name = "persistent connection";
+	printf("%s\n", test_name);
+
+	static const unsigned lengths[] = TEST_REQUESTS;
+	printf("\n%-24s %10s %10s %10s %10s\n", "request", "body B", "uart tx B", "uart rx B", "response B");
+	for (unsigned i = 0; i < sizeof(lengths) / sizeof(*lengths); i++) {
+		sim_tx_stats_t tx = {0};
+		sim_rx_stats_t rx = {0};
+		if (!_test_request(lengths[i], &tx, &rx)) {
+			return;
+		}
+
+		char response[SIM_TCP_SERVER_RESPONSE_SIZE] = "";
+		const unsigned response_len = sim_tcp_server_response(response, sizeof(response), requests);
+		printf("%-24s %10u %10u %10u %10u\n", "frame", lengths[i], tx.sent, rx.received, response_len);
+
+		_test_expect(tx.sent - lengths[i] <= TEST_TX_OVERHEAD_MAX, "UART TX overhead of the request");
+		_test_expect(rx.received - response_len <= TEST_RX_OVERHEAD_MAX, "UART RX overhead of the response");
+	}
+	printf("\n");
+
+	sim_tcp_server_stats_t stats = {0};
+	sim_tcp_server_get_stats(&stats);
+	_test_expect(stats.accepts == 1 && modem.cipstarts == 1, "requests are sent over one connection");
+	_test_expect(!modem.cipcloses, "connection is not closed between the requests");
+	_test_expect(!stats.errors, "server received whole frames");
+
+	sim_http_stats_t http = {0};
+	sim_get_http_stats(&http);
+	_test_expect(http.requests == requests && http.reused == requests - 1, "requests after the first reuse the connection");
+}
+
+void _test_split_response()
+{
+	test_name = "split response";
+	printf("%s\n", test_name);
+
+	// The frame header and the payload beginning come in one "+IPD" packet, the rest in another
+	sim_tcp_server_split(requests + 1);
+	const unsigned ipd_packets = modem.ipd_packets;
+	_test_request(100, NULL, NULL);
+	_test_expect(modem.ipd_packets - ipd_packets == 2, "response comes in two packets");
+}
+
+void _test_server_close()
+{
+	test_name = "server close";
+	printf("%s\n", test_name);
+
+	sim_tcp_server_close_after(requests + 1);
+	if (!_test_request(200, NULL, NULL)) {
+		return;
+	}
+
+	// The module reports "CLOSED", the idle session is closed and opened again by the next request
+	const unsigned cipcloses = modem.cipcloses;
+	const uint32_t start = HAL_GetTick();
+	while (modem.cipcloses == cipcloses && HAL_GetTick() - start < TEST_WAIT_MS) {
+		_test_step();
+	}
+	_test_expect(modem.closed_urcs == 1, "connection is closed by the server");
+	_test_expect(modem.cipcloses == cipcloses + 1, "session is closed");
+
+	const unsigned cipstarts = modem.cipstarts;
+	_test_request(50, NULL, NULL);
+	_test_expect(modem.cipstarts == cipstarts + 1, "connection is opened for the next request");
+
+	sim_tcp_server_stats_t stats = {0};
+	sim_tcp_server_get_stats(&stats);
+	_test_expect(stats.accepts == 2, "server accepted the new connection");
+}
+
+bool _test_request(const unsigned length, sim_tx_stats_t* tx, sim_rx_stats_t* rx)
+{
+	if (!_test_wait(_test_network_ready)) {
+		_test_expect(false, "network is ready for the request");
+		return false;
+	}
+
+	sim_tx_stats_t tx_start = {0};
+	sim_rx_stats_t rx_start = {0};
+	sim_get_tx_stats(&tx_start);
+	sim_get_rx_stats(&rx_start);
+
+	send_sim_http_post(length, _test_writer);
+	if (!_test_wait(_test_response_ready)) {
+		_test_expect(false, "response is received");
+		return false;
+	}
+	requests++;
+
+	if (tx) {
+		sim_get_tx_stats(tx);
+		tx->sent -= tx_start.sent;
+	}
+	if (rx) {
+		sim_get_rx_stats(rx);
+		rx->received -= rx_start.received;
+	}
+
+	sim_tcp_server_stats_t stats = {0};
+	sim_tcp_server_get_stats(&stats);
+	bool body_ok = (stats.requests == requests && stats.last_len == length);
+	for (unsigned i = 0; body_ok && i < length; i++) {
+		char expected = 0;
+		_test_writer(&expected, 1, i);
+		body_ok = (stats.last[i] == (uint8_t)expected);
+	}
+	_test_expect(body_ok, "server received the request body");
+
+	char expected[SIM_TCP_SERVER_RESPONSE_SIZE] = "";
+	sim_tcp_server_response(expected, sizeof(expected), requests);
+	const char* response = get_response();
+	_test_expect(!strcmp(response, expected), "response is the frame payload");
+
+	return true;
+}
+
+bool _test_wait(bool (*condition)(void))
+{
+	const uint32_t start = HAL_GetTick();
+	while (!condition()) {
+		if (HAL_GetTick() - start > TEST_WAIT_MS) {
+			return false;
+		}
+		_test_step();
+	}
+	return true;
+}
+
+void _test_step()
+{
+	if (modem.tx_pending) {
+		modem.tx_pending = false;
+		sim_tx_complete();
+	}
+	_modem_poll_socket();
+	sim_process();
+	usleep(TEST_STEP_US);
+}
+
+void _test_expect(const bool condition, const char* message)
+{
+	if (!condition) {
+		printf("%s: %s - FAIL\n", test_name, message);
+		errors++;
+	}
+}
+
+unsigned _test_writer(char* chunk, const unsigned size, const unsigned offset)
+{
+	// Record lines as the log writes them
+	for (unsigned i = 0; i < size; i++) {
+		const unsigned idx = offset + i;
+		chunk[i] = (idx % 40 == 39) ? '\n' : (char)('a' + idx % 26);
+	}
+	return size;
+}
+
+bool _test_network_ready(void)
+{
+	return if_network_ready();
+}
+
+bool _test_response_ready(void)
+{
+	return has_http_response();
+}
+
+void _modem_byte(const uint8_t byte)
+{
+	if (modem.data_left) {
+		modem.data[modem.data_len++] = byte;
+		modem.data_left--;
+		if (!modem.data_left) {
+			_modem_cipsend_done();
+		}
+		return;
+	}
+
+	if (byte == '\n') {
+		if (modem.line_len && modem.line[modem.line_len - 1] == '\r') {
+			modem.line_len--;
+		}
+		modem.line[modem.line_len] = 0;
+		if (modem.line_len) {
+			_modem_line(modem.line);
+		}
+		modem.line_len = 0;
+		return;
+	}
+	if (modem.line_len < sizeof(modem.line) - 1) {
+		modem.line[modem.line_len++] = (char)byte;
+	}
+}
+
+void _modem_line(const char* line)
+{
+	if (!strncmp(line, "AT+CSQ", 6)) {
+		_modem_reply("\r\n+CSQ: 20,0\r\n\r\nOK\r\n");
+	} else if (!strncmp(line, "AT+CGMR", 7)) {
+		_modem_reply("\r\nRevision:1418B05SIM868M32\r\n\r\nOK\r\n");
+	} else if (!strncmp(line, "AT+CIPSHUT", 10)) {
+		_modem_close_socket();
+		_modem_reply("\r\nSHUT OK\r\n");
+	} else if (!strncmp(line, "AT+CIFSR", 8)) {
+		_modem_reply("\r\n10.1.2.3\r\n");
+	} else if (!strncmp(line, "AT+CIPSTART=", 12)) {
+		_modem_cipstart(line);
+	} else if (!strncmp(line, "AT+CIPSEND=", 11)) {
+		const unsigned len = (unsigned)atoi(line + 11);
+		if (modem.socket < 0 || !len || len > sizeof(modem.data)) {
+			_modem_reply("\r\nERROR\r\n");
+			return;
+		}
+		modem.data_left = len;
+		modem.data_len  = 0;
+		_modem_reply("\r\n> ");
+	} else if (!strncmp(line, "AT+CIPCLOSE", 11)) {
+		modem.cipcloses++;
+		if (modem.socket < 0) {
+			_modem_reply("\r\nERROR\r\n");
+			return;
+		}
+		_modem_close_socket();
+		_modem_reply("\r\nCLOSE OK\r\n");
+	} else if (!strncmp(line, "AT", 2)) {
+		_modem_reply("\r\nOK\r\n");
+	}
+}
+
+void _modem_cipstart(const char* line)
+{
+	// AT+CIPSTART="TCP","<host>","<port>"
+	char host[32] = "";
+	unsigned port = 0;
+	modem.cipstarts++;
+	if (sscanf(line, "AT+CIPSTART=\"TCP\",\"%31[^\"]\",\"%u\"", host, &port) != 2) {
+		_modem_reply("\r\nERROR\r\n");
+		return;
+	}
+	if (modem.socket >= 0) {
+		_modem_reply("\r\nOK\r\n\r\nALREADY CONNECT\r\n");
+		return;
+	}
+
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port   = htons((uint16_t)port);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 ||
+		inet_pton(AF_INET, host, &addr.sin_addr) != 1 ||
+		connect(fd, (struct sockaddr*)&addr, sizeof(addr))
+	) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		_modem_reply("\r\nOK\r\n\r\nCONNECT FAIL\r\n");
+		return;
+	}
+	modem.socket = fd;
+	_modem_reply("\r\nOK\r\n\r\nCONNECT OK\r\n");
+}
+
+void _modem_cipsend_done()
+{
+	if (modem.socket < 0 || send(modem.socket, modem.data, modem.data_len, MSG_NOSIGNAL) != (ssize_t)modem.data_len) {
+		_modem_reply("\r\nSEND FAIL\r\n");
+		return;
+	}
+	_modem_reply("\r\nSEND OK\r\n");
+}
+
+void _modem_poll_socket()
+{
+	if (modem.socket < 0) {
+		return;
+	}
+	struct pollfd socket_poll = { .fd = modem.socket, .events = POLLIN };
+	if (poll(&socket_poll, 1, 0) <= 0) {
+		return;
+	}
+
+	uint8_t data[TEST_IPD_SIZE] = {0};
+	ssize_t count = recv(modem.socket, data, sizeof(data), 0);
+	if (count <= 0) {
+		_modem_close_socket();
+		modem.closed_urcs++;
+		_modem_reply("\r\nCLOSED\r\n");
+		return;
+	}
+
+	// AT+CIPHEAD=1: the data is prefixed with its length
+	char header[24] = "";
+	snprintf(header, sizeof(header), "\r\n+IPD,%d:", (int)count);
+	_modem_reply(header);
+	_modem_write(data, (unsigned)count);
+	modem.ipd_packets++;
+}
+
+void _modem_close_socket()
+{
+	if (modem.socket >= 0) {
+		close(modem.socket);
+		modem.socket = -1;
+	}
+}
+
+void _modem_reply(const char* text)
+{
+	_modem_write((const uint8_t*)text, (unsigned)strlen(text));
+}
+
+void _modem_write(const uint8_t* data, const unsigned len)
+{
+	// The circular DMA buffer: HAL_UARTEx_RxEventCallback() on the half and full transfer and the idle line
+	for (unsigned i = 0; i < len; i++) {
+		uart_rx.buffer[uart_rx.position] = data[i];
+		uart_rx.position = (uint16_t)((uart_rx.position + 1) % uart_rx.size);
+		if (++uart_rx.pending >= TEST_RX_EVENT_SIZE) {
+			uart_rx.pending = 0;
+			sim_rx_event(uart_rx.position);
+		}
+	}
+	if (uart_rx.pending) {
+		uart_rx.pending = 0;
+		sim_rx_event(uart_rx.position);
+	}
+}
@@ -0,0 +1,22 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+/*
+ * Included before every host test source (-include): the host has no interrupts,
+ * the UART callbacks are called by the test loop between sim_process() calls.
+ * The CMSIS functions are Cortex-M instructions, so they are replaced after main.h.
+ */
+
+#ifndef _SIM_TEST_IRQ_H_
+#define _SIM_TEST_IRQ_H_
+
+
+#include "main.h"
+
+
+#undef __disable_irq
+#undef __enable_irq
+#define __disable_irq() ((void)0)
+#define __enable_irq()  ((void)0)
+
+
+#endif
@@ -0,0 +1,18 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "crc16.h"
+
+#include <stdint.h>
+
+
+uint16_t crc16_ccitt(const uint8_t* data, const uint32_t len)
+{
+	uint16_t crc = 0xFFFF;
+	for (uint32_t i = 0; i < len; i++) {
+		crc ^= (uint16_t)(data[i] << 8);
+		for (unsigned j = 0; j < 8; j++) {
+			crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+		}
+	}
+	return crc;
+}
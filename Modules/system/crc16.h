@@ -0,0 +1,24 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#ifndef _CRC16_H_
+#define _CRC16_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <stdint.h>
+
+
+/* CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) of the record log, settings journal and RTC RAM backup */
+uint16_t crc16_ccitt(const uint8_t* data, const uint32_t len);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -18,6 +18,11 @@ extern "C" {
 #   define SYSTEM_BEDUG (1)
 #endif
 
+
+/* RTC RAM areas (get_system_rtc_ram() and set_system_rtc_ram() indexes) */
+#define SYSTEM_RTC_RAM_LOG_IDX      ((uint8_t)0)
+#define SYSTEM_RTC_RAM_COUNTERS_IDX ((uint8_t)16)
+
 #define SYSTEM_CANARY_WORD ((uint32_t)0xBEDAC0DE)
 
 #ifndef SYSTEM_ADC_VOLTAGE_COUNT
@@ -10,6 +10,8 @@
 #include "system.h"
 #include "hal_defs.h"
 
+#include "RecordDB.h"
+#include "SettingsDB.h"
 #include "StorageAT.h"
 #include "StorageDriver.h"
 
@@ -364,7 +366,7 @@ extern "C" void memory_watchdog_check()
 	if (!is_status(MEMORY_INITIALIZED)) {
 		if (flash_w25qxx_init() == FLASH_OK) {
 			set_status(MEMORY_INITIALIZED);
-			storage.setPagesCount(flash_w25qxx_get_pages_count());
+			storage.setPagesCount(flash_w25qxx_get_pages_count() - SettingsDB::getReservedPages() - RecordDB::getReservedPages());
 #ifdef WATCHDOG_BEDUG
 			printTagLog(TAG, "flash init success (%lu pages)", flash_w25qxx_get_pages_count());
 #endif
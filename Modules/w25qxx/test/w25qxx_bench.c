@@ -0,0 +1,257 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+/*
+ * Host benchmark of the W25Qxx driver on the emulated chip (FLASH_EMULATOR=1).
+ * Prints SPI bytes, emulated time and erases per driver operation, checks
+ * the read traffic of a page write and that the pages preserved by an erase
+ * relocation survive a power cut.
+ * Usage: w25qxx_bench [flash file]
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "w25qxx.h"
+#include "w25qxx_emu.h"
+
+
+#define BENCH_FLASH_PATH     "w25qxx_bench.bin"
+#define BENCH_BLOCKS_COUNT   ((uint32_t)32)  // W25Q16
+#define BENCH_PAGES_COUNT    ((uint32_t)64)
+#define BENCH_RECORDS_COUNT  ((uint32_t)256)
+#define BENCH_RECORD_SIZE    ((uint32_t)16)
+#define BENCH_PAGES_ADDR     ((uint32_t)0x10000)
+#define BENCH_RECORDS_ADDR   ((uint32_t)0x20000)
+#define BENCH_CUT_ADDR       ((uint32_t)0x30000)
+
+// The write used to read a page three times: range compare, erase check and read-back
+#define BENCH_OLD_WRITE_RX   ((uint32_t)(3 * FLASH_W25_PAGE_SIZE))
+// One page check read, the program status polls and the CRC read-back
+#define BENCH_WRITE_RX_MAX   ((uint32_t)(2 * FLASH_W25_PAGE_SIZE + FLASH_W25_PAGE_SIZE / 2))
+// One page check read only
+#define BENCH_SAME_RX_MAX    ((uint32_t)(FLASH_W25_PAGE_SIZE + 4))
+
+_Static_assert(BENCH_WRITE_RX_MAX < BENCH_OLD_WRITE_RX, "page write has to read less than the old write");
+
+
+typedef struct _bench_t {
+	const char*       name;
+	flash_emu_stats_t emu;
+	uint32_t          rx_per_op;
+} bench_t;
+
+
+static void _bench_begin(bench_t* bench, const char* name);
+static void _bench_end(bench_t* bench, const uint32_t count);
+static void _bench_fill(uint8_t* data, const uint32_t len, const uint8_t seed);
+static bool _bench_check(const uint32_t addr, const uint8_t* data, const uint32_t len);
+static void _bench_expect_rx(const bench_t* bench, const uint32_t max_rx);
+
+
+static unsigned errors = 0;
+
+
+// Utils timers use the HAL tick
+uint32_t HAL_GetTick(void)
+{
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+int main(int argc, char** argv)
+{
+	const char* path = argc > 1 ? argv[1] : BENCH_FLASH_PATH;
+	unlink(path);
+	if (flash_emu_init(path, BENCH_BLOCKS_COUNT) != FLASH_OK || flash_w25qxx_init() != FLASH_OK) {
+		printf("flash init error\n");
+		return 1;
+	}
+
+	printf("%-24s %10s %10s %10s %8s\n", "operation", "tx B/op", "rx B/op", "us/op", "erases");
+
+	uint8_t page[FLASH_W25_PAGE_SIZE] = {0};
+	bench_t bench = {0};
+
+	_bench_begin(&bench, "write erased page");
+	for (uint32_t i = 0; i < BENCH_PAGES_COUNT; i++) {
+		_bench_fill(page, sizeof(page), (uint8_t)i);
+		if (flash_w25qxx_write(BENCH_PAGES_ADDR + i * FLASH_W25_PAGE_SIZE, page, sizeof(page)) != FLASH_OK) {
+			errors++;
+		}
+	}
+	_bench_end(&bench, BENCH_PAGES_COUNT);
+	_bench_expect_rx(&bench, BENCH_WRITE_RX_MAX);
+
+	_bench_begin(&bench, "write same page");
+	for (uint32_t i = 0; i < BENCH_PAGES_COUNT; i++) {
+		_bench_fill(page, sizeof(page), (uint8_t)i);
+		if (flash_w25qxx_write(BENCH_PAGES_ADDR + i * FLASH_W25_PAGE_SIZE, page, sizeof(page)) != FLASH_OK) {
+			errors++;
+		}
+	}
+	_bench_end(&bench, BENCH_PAGES_COUNT);
+	_bench_expect_rx(&bench, BENCH_SAME_RX_MAX);
+
+	_bench_begin(&bench, "rewrite page (erase)");
+	for (uint32_t i = 0; i < BENCH_PAGES_COUNT; i++) {
+		_bench_fill(page, sizeof(page), (uint8_t)(i + 1));
+		if (flash_w25qxx_write(BENCH_PAGES_ADDR + i * FLASH_W25_PAGE_SIZE, page, sizeof(page)) != FLASH_OK) {
+			errors++;
+		}
+	}
+	_bench_end(&bench, BENCH_PAGES_COUNT);
+
+	_bench_begin(&bench, "read page");
+	for (uint32_t i = 0; i < BENCH_PAGES_COUNT; i++) {
+		_bench_fill(page, sizeof(page), (uint8_t)(i + 1));
+		if (!_bench_check(BENCH_PAGES_ADDR + i * FLASH_W25_PAGE_SIZE, page, sizeof(page))) {
+			errors++;
+		}
+	}
+	_bench_end(&bench, BENCH_PAGES_COUNT);
+
+	_bench_begin(&bench, "read page async");
+	for (uint32_t i = 0; i < BENCH_PAGES_COUNT; i++) {
+		uint8_t expected[FLASH_W25_PAGE_SIZE] = {0};
+		_bench_fill(expected, sizeof(expected), (uint8_t)(i + 1));
+		memset(page, 0, sizeof(page));
+		if (flash_w25qxx_read_async(BENCH_PAGES_ADDR + i * FLASH_W25_PAGE_SIZE, page, sizeof(page), NULL) != FLASH_OK) {
+			errors++;
+			continue;
+		}
+		flash_status_t status = FLASH_BUSY;
+		while ((status = flash_w25qxx_async_status()) == FLASH_BUSY) {}
+		if (status != FLASH_OK || memcmp(page, expected, sizeof(page))) {
+			errors++;
+		}
+	}
+	_bench_end(&bench, BENCH_PAGES_COUNT);
+
+	_bench_begin(&bench, "program record");
+	for (uint32_t i = 0; i < BENCH_RECORDS_COUNT; i++) {
+		_bench_fill(page, BENCH_RECORD_SIZE, (uint8_t)i);
+		if (flash_w25qxx_program(BENCH_RECORDS_ADDR + i * BENCH_RECORD_SIZE, page, BENCH_RECORD_SIZE) != FLASH_OK) {
+			errors++;
+		}
+	}
+	_bench_end(&bench, BENCH_RECORDS_COUNT);
+
+	_bench_fill(page, BENCH_RECORD_SIZE, 0);
+	if (flash_w25qxx_program(BENCH_RECORDS_ADDR, page, BENCH_RECORD_SIZE) == FLASH_OK) {
+		printf("program of not erased data was not refused\n");
+		errors++;
+	}
+
+	// The power is cut on every program and erase of the relocation in turn:
+	// the preserved page has to survive and the interrupted write has to be done again
+	uint8_t preserved[FLASH_W25_PAGE_SIZE] = {0};
+	uint8_t target[FLASH_W25_PAGE_SIZE] = {0};
+	_bench_fill(preserved, sizeof(preserved), 0xA0);
+	_bench_fill(target, sizeof(target), 0xB0);
+	if (flash_w25qxx_write(BENCH_CUT_ADDR, target, sizeof(target)) != FLASH_OK ||
+		flash_w25qxx_write(BENCH_CUT_ADDR + FLASH_W25_PAGE_SIZE, preserved, sizeof(preserved)) != FLASH_OK
+	) {
+		errors++;
+	}
+	unsigned cuts = 0;
+	for (uint32_t operation = 1; ; operation++) {
+		_bench_fill(target, sizeof(target), (uint8_t)(0xB0 + operation));
+
+		flash_emu_set_power_cut(operation);
+		flash_status_t status = flash_w25qxx_write(BENCH_CUT_ADDR, target, sizeof(target));
+		bool powered = flash_emu_is_powered();
+		flash_emu_set_power_cut(0);
+		if (powered) {
+			// All the operations of the write were done
+			if (status != FLASH_OK || !_bench_check(BENCH_CUT_ADDR, target, sizeof(target))) {
+				errors++;
+			}
+			break;
+		}
+		cuts++;
+
+		flash_emu_power_on();
+		if (flash_w25qxx_init() != FLASH_OK) {
+			printf("power cut %u: init error\n", operation);
+			errors++;
+			break;
+		}
+		if (!_bench_check(BENCH_CUT_ADDR + FLASH_W25_PAGE_SIZE, preserved, sizeof(preserved))) {
+			printf("power cut %u: preserved page is lost\n", operation);
+			errors++;
+		}
+		if (flash_w25qxx_write(BENCH_CUT_ADDR, target, sizeof(target)) != FLASH_OK ||
+			!_bench_check(BENCH_CUT_ADDR, target, sizeof(target))
+		) {
+			printf("power cut %u: write after recover error\n", operation);
+			errors++;
+		}
+		if (!_bench_check(BENCH_CUT_ADDR + FLASH_W25_PAGE_SIZE, preserved, sizeof(preserved))) {
+			printf("power cut %u: preserved page is lost after write\n", operation);
+			errors++;
+		}
+	}
+	printf("power cuts: %u checked\n", cuts);
+
+	flash_emu_deinit();
+	unlink(path);
+
+	printf("errors: %u\n", errors);
+
+	return errors ? 1 : 0;
+}
+
+void _bench_begin(bench_t* bench, const char* name)
+{
+	bench->name = name;
+	flash_w25qxx_reset_stats();
+	flash_emu_get_stats(&bench->emu);
+}
+
+void _bench_end(bench_t* bench, const uint32_t count)
+{
+	flash_stats_t stats = {0};
+	flash_emu_stats_t emu = {0};
+	flash_w25qxx_get_stats(&stats);
+	flash_emu_get_stats(&emu);
+
+	bench->rx_per_op = stats.rx_bytes / count;
+
+	printf(
+		"%-24s %10u %10u %10llu %8u\n",
+		bench->name,
+		stats.tx_bytes / count,
+		bench->rx_per_op,
+		(unsigned long long)((emu.time_us - bench->emu.time_us) / count),
+		emu.erases - bench->emu.erases
+	);
+}
+
+void _bench_fill(uint8_t* data, const uint32_t len, const uint8_t seed)
+{
+	for (uint32_t i = 0; i < len; i++) {
+		data[i] = (uint8_t)(seed * 31 + i * 7);
+	}
+}
+
+bool _bench_check(const uint32_t addr, const uint8_t* data, const uint32_t len)
+{
+	uint8_t read[FLASH_W25_PAGE_SIZE] = {0};
+	if (len > sizeof(read) || flash_w25qxx_read(addr, read, len) != FLASH_OK) {
+		return false;
+	}
+	return !memcmp(read, data, len);
+}
+
+void _bench_expect_rx(const bench_t* bench, const uint32_t max_rx)
+{
+	if (bench->rx_per_op > max_rx) {
+		printf("%s: rx %u B/op, expected %u B/op at most\n", bench->name, bench->rx_per_op, max_rx);
+		errors++;
+	}
+}
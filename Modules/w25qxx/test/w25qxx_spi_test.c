@@ -0,0 +1,514 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+/*
+ * Host test of the W25Qxx driver non-blocking transfers on the HAL SPI
+ * (FLASH_EMULATOR=0). The HAL SPI, DMA and CS pin are replaced by a test
+ * double: a DMA transfer is finished only when the test completes it,
+ * as the SPI interrupt does on the chip.
+ * Usage: w25qxx_spi_test
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "main.h"
+#include "w25qxx.h"
+
+
+#define TEST_JEDEC_ID        { 0xEF, 0x40, 0x15 }  // W25Q16
+#define TEST_READ_ADDR       ((uint32_t)0x012345)
+#define TEST_READ_LEN        ((uint32_t)64)
+#define TEST_ERASE_ADDR      ((uint32_t)0x010000)
+#define TEST_ERASE_POLLS     ((unsigned)3)
+#define TEST_WAIT_MS         ((uint32_t)2000)
+#define TEST_LOG_SIZE        ((unsigned)64)
+
+
+// The chip behind the SPI: only the commands of the tested transfers are modeled
+typedef struct _test_chip_t {
+	bool     selected;
+	bool     pattern;        // Read data is the address byte (0xFF - erased)
+	bool     wel;
+	bool     busy;           // Busy until the test resets it
+	unsigned busy_polls;     // SR1 reads that return BUSY
+	uint8_t  cmd[5];
+	uint8_t  cmd_len;
+	uint32_t read_addr;
+	unsigned erases;
+	uint8_t  log[TEST_LOG_SIZE];  // Received opcodes
+	unsigned log_len;
+} test_chip_t;
+
+typedef struct _test_dma_t {
+	bool              pending;
+	bool              is_rx;
+	uint8_t*          data;
+	uint16_t          len;
+	HAL_StatusTypeDef tx_result;  // Result of the next DMA start
+	HAL_StatusTypeDef rx_result;
+	unsigned          aborts;
+} test_dma_t;
+
+typedef struct _test_callback_t {
+	unsigned       calls;
+	flash_status_t status;
+} test_callback_t;
+
+
+static void _test_read_async();
+static void _test_read_async_errors();
+static void _test_read_async_timeout();
+static void _test_erase_async();
+static void _test_erase_async_timeout();
+
+static void _test_expect(const bool condition, const char* step);
+static void _test_reset();
+static void _test_dma_complete();
+static flash_status_t _test_wait_end(unsigned* busy_count);
+static bool _test_log_has(const uint8_t* opcodes, const unsigned count);
+static void _test_callback(flash_status_t status);
+
+static void _chip_transmit(const uint8_t* data, const uint32_t len);
+static void _chip_receive(uint8_t* data, const uint32_t len);
+static uint8_t _chip_cmd_len(const uint8_t opcode);
+
+
+SPI_HandleTypeDef hspi1;
+
+static test_chip_t     chip     = {0};
+static test_dma_t      dma      = {0};
+static test_callback_t callback = {0};
+
+static const char* test_name = "";
+static unsigned errors = 0;
+
+
+uint32_t HAL_GetTick(void)
+{
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+	(void)GPIOx;
+	if (GPIO_Pin != FLASH_CS_Pin) {
+		return;
+	}
+	bool selected = (PinState == GPIO_PIN_RESET);
+	if (chip.selected && !selected) {
+		// The chip starts the sector erase after CS goes high
+		if (chip.cmd_len == _chip_cmd_len(FLASH_W25_CMD_ERASE_SECTOR) && chip.cmd[0] == FLASH_W25_CMD_ERASE_SECTOR && chip.wel) {
+			chip.erases++;
+			chip.busy_polls = TEST_ERASE_POLLS;
+			chip.wel = false;
+		}
+	}
+	chip.selected = selected;
+	chip.cmd_len  = 0;
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin)
+{
+	(void)GPIOx;
+	(void)GPIO_Pin;
+	return chip.selected ? GPIO_PIN_RESET : GPIO_PIN_SET;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* hspi, const uint8_t* pData, uint16_t Size, uint32_t Timeout)
+{
+	(void)hspi;
+	(void)Timeout;
+	_chip_transmit(pData, Size);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef* hspi, uint8_t* pData, uint16_t Size, uint32_t Timeout)
+{
+	(void)hspi;
+	(void)Timeout;
+	_chip_receive(pData, Size);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef* hspi, const uint8_t* pData, uint16_t Size)
+{
+	(void)hspi;
+	if (dma.tx_result != HAL_OK || dma.pending) {
+		return dma.pending ? HAL_BUSY : dma.tx_result;
+	}
+	dma.pending = true;
+	dma.is_rx   = false;
+	dma.data    = (uint8_t*)pData;
+	dma.len     = Size;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef* hspi, uint8_t* pData, uint16_t Size)
+{
+	(void)hspi;
+	if (dma.rx_result != HAL_OK || dma.pending) {
+		return dma.pending ? HAL_BUSY : dma.rx_result;
+	}
+	dma.pending = true;
+	dma.is_rx   = true;
+	dma.data    = pData;
+	dma.len     = Size;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef* hspi)
+{
+	(void)hspi;
+	dma.pending = false;
+	dma.aborts++;
+	return HAL_OK;
+}
+
+
+int main()
+{
+	if (flash_w25qxx_init() != FLASH_OK) {
+		printf("flash init error\n");
+		return 1;
+	}
+
+	_test_read_async();
+	_test_read_async_errors();
+	_test_read_async_timeout();
+	_test_erase_async();
+	_test_erase_async_timeout();
+
+	printf("errors: %u\n", errors);
+
+	return errors ? 1 : 0;
+}
+
+void _test_read_async()
+{
+	test_name = "read async";
+	_test_reset();
+	chip.pattern = true;
+
+	uint8_t data[TEST_READ_LEN] = {0};
+	_test_expect(flash_w25qxx_read_async(TEST_READ_ADDR, data, sizeof(data), _test_callback) == FLASH_OK, "start");
+
+	// COMMAND: CS is set, the read command is sent by the DMA
+	_test_expect(chip.selected, "command: CS is set");
+	_test_expect(dma.pending && !dma.is_rx, "command: TX DMA is started");
+	_test_expect(
+		dma.len == 4 &&
+		dma.data[0] == FLASH_W25_CMD_READ &&
+		dma.data[1] == (uint8_t)(TEST_READ_ADDR >> 16) &&
+		dma.data[2] == (uint8_t)(TEST_READ_ADDR >> 8) &&
+		dma.data[3] == (uint8_t)TEST_READ_ADDR,
+		"command: read command and address"
+	);
+	_test_expect(flash_w25qxx_async_status() == FLASH_BUSY, "command: status is busy");
+	_test_expect(!callback.calls, "command: callback is not called");
+
+	// READ: CS stays set, the data is received by the DMA
+	_test_dma_complete();
+	_test_expect(chip.selected, "read: CS is set");
+	_test_expect(dma.pending && dma.is_rx && dma.len == TEST_READ_LEN, "read: RX DMA is started");
+	_test_expect(flash_w25qxx_async_status() == FLASH_BUSY, "read: status is busy");
+	_test_expect(!callback.calls, "read: callback is not called");
+
+	// IDLE: CS is reset, the callback has the result
+	_test_dma_complete();
+	_test_expect(!chip.selected, "idle: CS is reset");
+	_test_expect(callback.calls == 1 && callback.status == FLASH_OK, "idle: callback is called with OK");
+	_test_expect(flash_w25qxx_async_status() == FLASH_OK, "idle: status is OK");
+	bool data_ok = true;
+	for (uint32_t i = 0; i < TEST_READ_LEN; i++) {
+		data_ok &= (data[i] == (uint8_t)(TEST_READ_ADDR + i));
+	}
+	_test_expect(data_ok, "idle: data is read");
+
+	// A late DMA event does not change the result
+	flash_w25qxx_spi_rx_cplt_callback();
+	flash_w25qxx_spi_error_callback();
+	_test_expect(callback.calls == 1 && flash_w25qxx_async_status() == FLASH_OK, "idle: late DMA events are ignored");
+
+	uint8_t blocking[TEST_READ_LEN] = {0};
+	_test_expect(flash_w25qxx_read(TEST_READ_ADDR, blocking, sizeof(blocking)) == FLASH_OK && !memcmp(blocking, data, sizeof(data)), "blocking read after async read");
+}
+
+void _test_read_async_errors()
+{
+	uint8_t data[TEST_READ_LEN] = {0};
+
+	test_name = "error in command";
+	_test_reset();
+	_test_expect(flash_w25qxx_read_async(TEST_READ_ADDR, data, sizeof(data), _test_callback) == FLASH_OK, "start");
+	flash_w25qxx_spi_error_callback();
+	_test_expect(!chip.selected, "CS is reset");
+	_test_expect(callback.calls == 1 && callback.status == FLASH_ERROR, "callback is called with error");
+	_test_expect(flash_w25qxx_async_status() == FLASH_ERROR, "status is error");
+
+	test_name = "error in read";
+	_test_reset();
+	_test_expect(flash_w25qxx_read_async(TEST_READ_ADDR, data, sizeof(data), _test_callback) == FLASH_OK, "start");
+	_test_dma_complete();
+	flash_w25qxx_spi_error_callback();
+	_test_expect(!chip.selected, "CS is reset");
+	_test_expect(callback.calls == 1 && callback.status == FLASH_ERROR, "callback is called with error");
+	_test_expect(flash_w25qxx_async_status() == FLASH_ERROR, "status is error");
+
+	test_name = "TX DMA start error";
+	_test_reset();
+	dma.tx_result = HAL_ERROR;
+	_test_expect(flash_w25qxx_read_async(TEST_READ_ADDR, data, sizeof(data), _test_callback) == FLASH_ERROR, "start is refused");
+	_test_expect(!chip.selected, "CS is reset");
+	_test_expect(callback.calls == 1 && callback.status == FLASH_ERROR, "callback is called with error");
+
+	test_name = "RX DMA start error";
+	_test_reset();
+	dma.rx_result = HAL_ERROR;
+	_test_expect(flash_w25qxx_read_async(TEST_READ_ADDR, data, sizeof(data), _test_callback) == FLASH_OK, "start");
+	_test_dma_complete();
+	_test_expect(!dma.pending, "RX DMA is not started");
+	_test_expect(!chip.selected, "CS is reset");
+	_test_expect(callback.calls == 1 && callback.status == FLASH_ERROR, "callback is called with error");
+	_test_expect(flash_w25qxx_async_status() == FLASH_ERROR, "status is error");
+
+	// The driver is usable after the errors
+	test_name = "read after errors";
+	_test_reset();
+	chip.pattern = true;
+	_test_expect(flash_w25qxx_read_async(TEST_READ_ADDR, data, sizeof(data), _test_callback) == FLASH_OK, "start");
+	_test_dma_complete();
+	_test_dma_complete();
+	_test_expect(callback.calls == 1 && callback.status == FLASH_OK && data[0] == (uint8_t)TEST_READ_ADDR, "read is done");
+}
+
+void _test_read_async_timeout()
+{
+	test_name = "read timeout";
+	_test_reset();
+
+	uint8_t data[TEST_READ_LEN] = {0};
+	_test_expect(flash_w25qxx_read_async(TEST_READ_ADDR, data, sizeof(data), _test_callback) == FLASH_OK, "start");
+	_test_expect(flash_w25qxx_read_async(TEST_READ_ADDR, data, sizeof(data), NULL) == FLASH_BUSY, "second transfer is refused");
+
+	// The DMA is never completed: the transfer is aborted after FLASH_SPI_TIMEOUT_MS
+	const uint32_t start = HAL_GetTick();
+	_test_expect(_test_wait_end(NULL) == FLASH_ERROR, "status is error");
+	_test_expect(HAL_GetTick() - start < TEST_WAIT_MS, "transfer is aborted in time");
+	_test_expect(dma.aborts == 1 && !dma.pending, "SPI DMA is aborted");
+	_test_expect(!chip.selected, "CS is reset");
+	_test_expect(callback.calls == 1 && callback.status == FLASH_ERROR, "callback is called with error");
+
+	// The aborted transfer completion does not start the read
+	flash_w25qxx_spi_tx_cplt_callback();
+	_test_expect(!dma.pending && callback.calls == 1, "late TX event is ignored");
+}
+
+void _test_erase_async()
+{
+	test_name = "erase async";
+	_test_reset();
+
+	_test_expect(flash_w25qxx_erase_sector_async(TEST_ERASE_ADDR, _test_callback) == FLASH_OK, "start");
+	const uint8_t start_cmds[] = {
+		FLASH_W25_CMD_WRITE_ENABLE_SR, FLASH_W25_CMD_WRITE_SR1,  // Protection off
+		FLASH_W25_CMD_WRITE_ENABLE,
+		FLASH_W25_CMD_ERASE_SECTOR
+	};
+	_test_expect(_test_log_has(start_cmds, sizeof(start_cmds)), "protection off, write enable and erase commands");
+	_test_expect(chip.erases == 1, "chip erases the sector");
+	_test_expect(!chip.selected, "CS is reset while the chip erases");
+	_test_expect(!callback.calls, "callback is not called");
+
+	// ERASE: every status call polls SR1 once
+	chip.log_len = 0;
+	unsigned busy = 0;
+	_test_expect(_test_wait_end(&busy) == FLASH_OK, "status is OK");
+	_test_expect(busy == TEST_ERASE_POLLS, "status is busy while SR1 is busy");
+	_test_expect(callback.calls == 1 && callback.status == FLASH_OK, "callback is called with OK");
+	const uint8_t end_cmds[] = {
+		FLASH_W25_CMD_WRITE_DISABLE,
+		FLASH_W25_CMD_WRITE_ENABLE_SR, FLASH_W25_CMD_WRITE_SR1   // Protection on
+	};
+	_test_expect(_test_log_has(end_cmds, sizeof(end_cmds)), "write disable and protection on commands");
+	_test_expect(!chip.selected, "CS is reset");
+}
+
+void _test_erase_async_timeout()
+{
+	test_name = "erase timeout";
+	_test_reset();
+
+	_test_expect(flash_w25qxx_erase_sector_async(TEST_ERASE_ADDR, _test_callback) == FLASH_OK, "start");
+	chip.busy = true;
+
+	uint8_t data[TEST_READ_LEN] = {0};
+	_test_expect(flash_w25qxx_read_async(TEST_READ_ADDR, data, sizeof(data), NULL) == FLASH_BUSY, "read is refused while erasing");
+
+	const uint32_t start = HAL_GetTick();
+	_test_expect(_test_wait_end(NULL) == FLASH_ERROR, "status is error");
+	_test_expect(HAL_GetTick() - start < TEST_WAIT_MS, "erase is stopped in time");
+	_test_expect(callback.calls == 1 && callback.status == FLASH_ERROR, "callback is called with error");
+	_test_expect(!chip.selected, "CS is reset");
+
+	chip.busy = false;
+	_test_expect(flash_w25qxx_read_async(TEST_READ_ADDR, data, sizeof(data), NULL) == FLASH_OK, "read is started after the chip is free");
+	_test_dma_complete();
+	_test_dma_complete();
+	_test_expect(flash_w25qxx_async_status() == FLASH_OK, "read is done");
+}
+
+void _test_expect(const bool condition, const char* step)
+{
+	if (!condition) {
+		printf("%s: %s - FAIL\n", test_name, step);
+		errors++;
+	}
+}
+
+void _test_reset()
+{
+	memset(&callback, 0, sizeof(callback));
+	memset(&dma, 0, sizeof(dma));
+	dma.tx_result    = HAL_OK;
+	dma.rx_result    = HAL_OK;
+	chip.pattern     = false;
+	chip.busy        = false;
+	chip.busy_polls  = 0;
+	chip.erases      = 0;
+	chip.log_len     = 0;
+	printf("%s\n", test_name);
+}
+
+void _test_dma_complete()
+{
+	if (!dma.pending) {
+		return;
+	}
+	dma.pending = false;
+	// The SPI interrupt of the finished DMA transfer
+	if (dma.is_rx) {
+		_chip_receive(dma.data, dma.len);
+		flash_w25qxx_spi_rx_cplt_callback();
+	} else {
+		_chip_transmit(dma.data, dma.len);
+		flash_w25qxx_spi_tx_cplt_callback();
+	}
+}
+
+flash_status_t _test_wait_end(unsigned* busy_count)
+{
+	const uint32_t start = HAL_GetTick();
+	flash_status_t status = FLASH_BUSY;
+	while ((status = flash_w25qxx_async_status()) == FLASH_BUSY) {
+		if (busy_count) {
+			(*busy_count)++;
+		}
+		if (HAL_GetTick() - start > TEST_WAIT_MS) {
+			break;
+		}
+	}
+	return status;
+}
+
+bool _test_log_has(const uint8_t* opcodes, const unsigned count)
+{
+	// The opcodes have to be sent in this order, SR1 reads between them are skipped
+	unsigned found = 0;
+	for (unsigned i = 0; i < chip.log_len && found < count; i++) {
+		if (chip.log[i] == opcodes[found]) {
+			found++;
+		}
+	}
+	return found == count;
+}
+
+void _test_callback(flash_status_t status)
+{
+	callback.calls++;
+	callback.status = status;
+}
+
+void _chip_transmit(const uint8_t* data, const uint32_t len)
+{
+	if (!chip.selected) {
+		return;
+	}
+	for (uint32_t i = 0; i < len; i++) {
+		if (!chip.cmd_len && chip.log_len < TEST_LOG_SIZE) {
+			chip.log[chip.log_len++] = data[i];
+		}
+		if (chip.cmd_len < sizeof(chip.cmd)) {
+			chip.cmd[chip.cmd_len++] = data[i];
+		}
+		if (chip.cmd_len != _chip_cmd_len(chip.cmd[0])) {
+			continue;
+		}
+
+		switch (chip.cmd[0]) {
+		case FLASH_W25_CMD_WRITE_ENABLE:
+			chip.wel = true;
+			break;
+		case FLASH_W25_CMD_WRITE_DISABLE:
+			chip.wel = false;
+			break;
+		case FLASH_W25_CMD_READ:
+			chip.read_addr = ((uint32_t)chip.cmd[1] << 16) | ((uint32_t)chip.cmd[2] << 8) | chip.cmd[3];
+			continue;
+		case FLASH_W25_CMD_ERASE_SECTOR:
+		case FLASH_W25_CMD_READ_SR1:
+		case FLASH_W25_CMD_JEDEC_ID:
+			// Executed on CS reset or followed by the data
+			continue;
+		default:
+			break;
+		}
+		// The driver sends the short commands without CS toggling
+		chip.cmd_len = 0;
+	}
+}
+
+void _chip_receive(uint8_t* data, const uint32_t len)
+{
+	const uint8_t jedec_id[] = TEST_JEDEC_ID;
+	for (uint32_t i = 0; i < len; i++) {
+		switch (chip.cmd_len ? chip.cmd[0] : 0) {
+		case FLASH_W25_CMD_JEDEC_ID:
+			data[i] = i < sizeof(jedec_id) ? jedec_id[i] : 0;
+			break;
+		case FLASH_W25_CMD_READ_SR1:
+			data[i] = chip.wel ? 0x02 : 0x00;
+			if (chip.busy || chip.busy_polls) {
+				data[i] |= 0x01;
+			}
+			if (chip.busy_polls) {
+				chip.busy_polls--;
+			}
+			break;
+		case FLASH_W25_CMD_READ:
+			data[i] = chip.pattern ? (uint8_t)(chip.read_addr++) : 0xFF;
+			break;
+		default:
+			data[i] = 0xFF;
+			break;
+		}
+	}
+}
+
+uint8_t _chip_cmd_len(const uint8_t opcode)
+{
+	switch (opcode) {
+	case FLASH_W25_CMD_WRITE_SR1:
+		return 2;
+	case FLASH_W25_CMD_READ:
+	case FLASH_W25_CMD_ERASE_SECTOR:
+	case FLASH_W25_CMD_PAGE_PROGRAMM:
+		return 4;
+	default:
+		return 1;
+	}
+}
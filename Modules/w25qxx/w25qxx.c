@@ -12,20 +12,16 @@
 #include "gutils.h"
 #include "hal_defs.h"
 
+#if FLASH_EMULATOR
+#   include "w25qxx_emu.h"
+#endif
+
 
-typedef enum _flash_w25_command_t {
-    FLASH_W25_CMD_WRITE_SR1       = ((uint8_t)0x01),
-    FLASH_W25_CMD_PAGE_PROGRAMM   = ((uint8_t)0x02),
-    FLASH_W25_CMD_READ            = ((uint8_t)0x03),
-    FLASH_W25_CMD_WRITE_DISABLE   = ((uint8_t)0x04),
-    FLASH_W25_CMD_READ_SR1        = ((uint8_t)0x05),
-    FLASH_W25_CMD_WRITE_ENABLE    = ((uint8_t)0x06),
-    FLASH_W25_CMD_ERASE_SECTOR    = ((uint8_t)0x20),
-    FLASH_W25_CMD_WRITE_ENABLE_SR = ((uint8_t)0x50),
-    FLASH_W25_CMD_ENABLE_RESET    = ((uint8_t)0x66),
-    FLASH_W25_CMD_RESET           = ((uint8_t)0x99),
-    FLASH_W25_CMD_JEDEC_ID        = ((uint8_t)0x9f)
-} flash_w25_command_t;
+typedef struct __attribute__((packed)) _flash_scratch_marker_t {
+	uint32_t magic;
+	uint32_t sector_addr;    // Relocated sector
+	uint16_t preserve_mask;  // Sector pages that are saved in the scratch sector
+} flash_scratch_marker_t;
 
 
 typedef struct _flash_info_t {
@@ -52,6 +48,39 @@ typedef struct _flash_info_t {
 
 #define FLASH_SPI_TIMEOUT_MS          ((uint32_t)100)
 #define FLASH_SPI_COMMAND_SIZE_MAX    ((uint8_t)10)
+#define FLASH_ERASE_TIMEOUT_MS        ((uint32_t)500)
+#define FLASH_W25_VERIFY_CHUNK_SIZE   ((uint32_t)32)
+#define FLASH_SCRATCH_MAGIC           ((uint32_t)0x5C4A7C11)
+
+#ifndef FLASH_HW_CRC
+#   if !FLASH_EMULATOR && defined(CRC)
+#       define FLASH_HW_CRC               (1)
+#   else
+#       define FLASH_HW_CRC               (0)
+#   endif
+#endif
+
+
+typedef enum _flash_async_state_t {
+	FLASH_ASYNC_IDLE = 0,
+	FLASH_ASYNC_COMMAND,   // CS is set, the command is being sent
+	FLASH_ASYNC_READ,      // CS is set, the data is being received
+	FLASH_ASYNC_ERASE      // CS is reset, the chip is erasing the sector
+} flash_async_state_t;
+
+typedef struct _flash_async_t {
+	volatile flash_async_state_t state;
+	volatile flash_status_t      status;
+	volatile flash_status_t      result;   // Sector erase result
+
+	bool                         is_write;
+	uint8_t                      cmd[FLASH_SPI_COMMAND_SIZE_MAX];
+	uint8_t*                     data;
+	uint32_t                     len;
+	util_old_timer_t             timer;
+
+	flash_async_callback_t       callback;
+} flash_async_t;
 
 
 
@@ -67,12 +96,33 @@ flash_status_t _flash_read(uint32_t addr, uint8_t* data, uint32_t len);
 
 flash_status_t _flash_erase_sector(uint32_t addr);
 
-flash_status_t _flash_data_cmp(const uint32_t addr, const uint8_t* data, const uint32_t len, bool* cmp_res);
+flash_status_t _flash_page_check(const uint32_t addr, const uint8_t* data, const uint32_t len, bool* need_write, bool* need_erase);
+flash_status_t _flash_data_verify(const uint32_t addr, const uint8_t* data, const uint32_t len, bool* verified);
+flash_status_t _flash_data_is_empty(const uint32_t addr, const uint32_t len, bool* empty);
+void           _flash_crc_reset();
+void           _flash_crc_update(const uint8_t* data, const uint32_t len);
+uint32_t       _flash_crc_get();
 
 flash_status_t _flash_send_data(const uint8_t* data, const uint32_t len);
 flash_status_t _flash_recieve_data(uint8_t* data, uint32_t len);
+HAL_StatusTypeDef _flash_dma_send_data(uint8_t* data, const uint32_t len);
+HAL_StatusTypeDef _flash_dma_recieve_data(uint8_t* data, const uint32_t len);
+uint8_t        _flash_set_address_cmd(uint8_t* cmd, const uint8_t opcode, const uint32_t addr);
+
+uint16_t       _flash_get_target_mask(const uint32_t* addrs, const uint32_t count, const uint32_t first, uint32_t* next);
+flash_status_t _flash_check_sector(const uint32_t sector_addr, const uint16_t target_mask, bool* need_erase, uint16_t* preserve_mask);
+flash_status_t _flash_page_is_empty(const uint32_t addr, bool* empty);
+flash_status_t _flash_erase_sector_wait(const uint32_t sector_addr);
+flash_status_t _flash_copy_page(const uint32_t dst_addr, const uint32_t src_addr);
+flash_status_t _flash_relocate_sector(const uint32_t sector_addr, const uint16_t target_mask, const uint16_t preserve_mask);
+flash_status_t _flash_restore_sector(const uint32_t marker_addr, const flash_scratch_marker_t* marker);
+flash_status_t _flash_scratch_recover();
+uint32_t       _flash_get_scratch_addr();
+void           _flash_async_end(flash_status_t status);
+bool           _flash_async_free();
 void           _FLASH_CS_set();
 void           _FLASH_CS_reset();
+bool           _flash_cs_enabled();
 
 bool           _flash_check_FREE();
 bool           _flash_check_WEL();
@@ -114,6 +164,24 @@ flash_info_t flash_info = {
     .blocks_count     = 0
 };
 
+static flash_stats_t flash_stats = {0};
+
+#if !FLASH_HW_CRC
+static uint32_t flash_crc = 0xFFFFFFFF;
+#endif
+
+static flash_async_t flash_async = {
+	.state    = FLASH_ASYNC_IDLE,
+	.status   = FLASH_OK,
+	.result   = FLASH_OK,
+	.is_write = false,
+	.cmd      = { 0 },
+	.data     = NULL,
+	.len      = 0,
+	.timer    = { 0 },
+	.callback = NULL
+};
+
 
 flash_status_t flash_w25qxx_init()
 {
@@ -169,6 +237,14 @@ flash_status_t flash_w25qxx_init()
     flash_info.initialized      = true;
     flash_info.is_24bit_address = (flash_info.blocks_count >= FLASH_W25_24BIT_ADDR_SIZE) ? true : false;
 
+    // An interrupted erase relocation does not block the flash initialization
+    flash_status_t recover_status = _flash_scratch_recover();
+    if (recover_status != FLASH_OK) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash init: error=%u (scratch sector recover)", recover_status);
+#endif
+    }
+
 #if FLASH_BEDUG
     printTagLog(FLASH_TAG, "flash init: OK");
 #endif
@@ -261,6 +337,13 @@ flash_status_t flash_w25qxx_read(const uint32_t addr, uint8_t* data, const uint3
     	return FLASH_ERROR;
     }
 
+    if (!util_wait_event(_flash_async_free, FLASH_ERASE_TIMEOUT_MS)) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash read addr=%08lX len=%lu (async transfer is not finished)", addr, len);
+#endif
+        return FLASH_BUSY;
+    }
+
     _FLASH_CS_set();
 
     flash_status_t status = _flash_read(addr, data, len);
@@ -294,6 +377,13 @@ flash_status_t flash_w25qxx_write(const uint32_t addr, const uint8_t* data, cons
         return FLASH_ERROR;
     }
 
+    if (!util_wait_event(_flash_async_free, FLASH_ERASE_TIMEOUT_MS)) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash write addr=%08lX len=%lu (async transfer is not finished)", addr, len);
+#endif
+        return FLASH_BUSY;
+    }
+
 	_FLASH_CS_set();
 	flash_status_t status = FLASH_OK;
     if (addr + len > _flash_get_storage_bytes_size()) {
@@ -307,106 +397,49 @@ flash_status_t flash_w25qxx_write(const uint32_t addr, const uint8_t* data, cons
 	/* Check input data END */
 
 
-    /* Compare old flashed data BEGIN */
-	_FLASH_CS_set();
-    bool compare_status = false;
-    status = _flash_data_cmp(addr, data, len, &compare_status);
-	if (status != FLASH_OK) {
-#if FLASH_BEDUG
-		printTagLog(FLASH_TAG, "flash write addr=%08lX len=%lu error=%u (compare data)", addr, len, status);
-#endif
-        goto do_spi_stop;
-	}
-	_FLASH_CS_reset();
-
-	if (!compare_status) {
-#if FLASH_BEDUG
-		printTagLog(FLASH_TAG, "flash write addr=%08lX len=%lu: ABORT (already written)", addr, len);
-#endif
-        goto do_spi_stop;
-	}
-    /* Compare old flashed data END */
-
 	/* Erase data BEGIN */
-	{
+	// Every target page is read once: it is skipped, programmed or erased and programmed
+	uint32_t cur_len = 0;
+	while (cur_len < len) {
+		uint32_t sector_addr = ((addr + cur_len) / FLASH_W25_SECTOR_SIZE) * FLASH_W25_SECTOR_SIZE;
 		uint32_t erase_addrs[FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE] = {0};
-		bool     erase_need       = false;
-		unsigned erase_cnt        = 0;
-		uint32_t erase_len        = 0;
-		uint32_t erase_addr       = addr;
-		while (erase_len < len) {
-			uint32_t min_erase_size         = FLASH_W25_SECTOR_SIZE;
-			uint32_t erase_sector_addr      = (erase_addr / min_erase_size) * min_erase_size;
-			uint32_t erase_next_sector_addr = ((erase_addr + FLASH_W25_PAGE_SIZE) / min_erase_size) * min_erase_size;
-
-		    /* Compare old exist data BEGIN */
+		unsigned erase_cnt  = 0;
+		uint16_t write_mask = 0;
+		uint32_t sector_len = cur_len;
+		for (unsigned i = 0; sector_len < len; i++) {
+			uint32_t page_addr = addr + sector_len;
+			if ((page_addr / FLASH_W25_SECTOR_SIZE) * FLASH_W25_SECTOR_SIZE != sector_addr) {
+				break;
+			}
+
+			uint32_t write_len = FLASH_W25_PAGE_SIZE;
+			if (sector_len + write_len > len) {
+				write_len = len - sector_len;
+			}
+
+			bool need_write = false;
+			bool need_erase = false;
 			_FLASH_CS_set();
-		    bool compare_status = false;
-		    if (!erase_need) {
-		    	status = _flash_data_cmp(erase_addr, data + erase_len, FLASH_W25_PAGE_SIZE, &compare_status);
-		    }
+			status = _flash_page_check(page_addr, data + sector_len, write_len, &need_write, &need_erase);
+			_FLASH_CS_reset();
 			if (status != FLASH_OK) {
 #if FLASH_BEDUG
 				printTagLog(FLASH_TAG, "flash write addr=%08lX len=%lu error=%u (compare data)", addr, len, status);
 #endif
-	            goto do_spi_stop;
+				goto do_spi_stop;
 			}
-			_FLASH_CS_reset();
 
-			if (compare_status) {
-				erase_need = true;
+			if (need_write) {
+				write_mask |= (uint16_t)(1 << i);
 			}
-		    /* Compare old exist data END */
-
-			/* Erase addresses in current sector BEGIN */
-			if (erase_len < len) {
-				erase_addrs[erase_cnt++] = erase_addr;
-			}
-
-			if (erase_len + FLASH_W25_PAGE_SIZE >= len ||
-				erase_sector_addr != erase_next_sector_addr
-			) {
-				if (erase_need) {
-					status = flash_w25qxx_erase_addresses(erase_addrs, erase_cnt);
-				} else {
-					status = FLASH_OK;
-				}
-				if (status != FLASH_OK) {
-#if FLASH_BEDUG
-					printTagLog(
-						FLASH_TAG,
-						"flash write addr=%08lX len=%lu error=%u (unable to erase old data)",
-						addr,
-						len,
-						status
-					);
-#endif
-		            goto do_spi_stop;
-				}
-
-				memset(
-					(uint8_t*)erase_addrs,
-					0,
-					sizeof(erase_addrs)
-				);
-
-				if (status == FLASH_BUSY) {
-		            goto do_spi_stop;
-				}
-				if (status != FLASH_OK) {
-					break;
-				}
-
-				erase_need = false;
-				erase_cnt  = 0;
+			if (need_erase) {
+				erase_addrs[erase_cnt++] = page_addr;
 			}
-			/* Erase addresses in current sector END */
 
-			erase_addr += FLASH_W25_PAGE_SIZE;
-			erase_len  += FLASH_W25_PAGE_SIZE;
+			sector_len += write_len;
 		}
 
-		if (erase_need && erase_cnt) {
+		if (erase_cnt) {
 			status = flash_w25qxx_erase_addresses(erase_addrs, erase_cnt);
 		}
 		if (status != FLASH_OK) {
@@ -421,327 +454,648 @@ flash_status_t flash_w25qxx_write(const uint32_t addr, const uint8_t* data, cons
 #endif
 			goto do_spi_stop;
 		}
-	}
 	/* Erase data END */
 
+		/* Write data BEGIN */
+		for (unsigned i = 0; cur_len < sector_len; i++) {
+			uint32_t write_len = FLASH_W25_PAGE_SIZE;
+			if (cur_len + write_len > len) {
+				write_len = len - cur_len;
+			}
+
+			if (!(write_mask & (1 << i))) {
+				cur_len += write_len;
+				continue;
+			}
+
+			_FLASH_CS_set();
+			status = _flash_write(addr + cur_len, data + cur_len, write_len);
+			_FLASH_CS_reset();
+			if (status != FLASH_OK) {
+#if FLASH_BEDUG
+				printTagLog(FLASH_TAG, "flash write addr=%08lX len=%lu error=%u (write)", addr + cur_len, write_len, status);
+#endif
+				goto do_spi_stop;
+			}
+
+			bool verified = false;
+			_FLASH_CS_set();
+			status = _flash_data_verify(addr + cur_len, data + cur_len, write_len, &verified);
+			_FLASH_CS_reset();
+			if (status != FLASH_OK) {
+#if FLASH_BEDUG
+				printTagLog(FLASH_TAG, "flash write addr=%08lX len=%lu error=%u (read written page after write)", addr + cur_len, write_len, status);
+#endif
+				goto do_spi_stop;
+			}
+
+			if (!verified) {
+#if FLASH_BEDUG
+				printTagLog(FLASH_TAG, "flash write addr=%08lX len=%lu error (compare written page CRC)", addr + cur_len, write_len);
+				printTagLog(FLASH_TAG, "Needed page:");
+				util_debug_hex_dump(data + cur_len, addr + cur_len, (uint16_t)write_len);
+#endif
+				set_error(EXPECTED_MEMORY_ERROR);
+				status = FLASH_ERROR;
+				goto do_spi_stop;
+			}
+
+			reset_error(EXPECTED_MEMORY_ERROR);
+
+			cur_len += write_len;
+		}
+		/* Write data END */
+	}
+
+#if FLASH_BEDUG
+	printTagLog(FLASH_TAG, "flash write addr=%08lX len=%lu: OK", addr, len);
+#endif
+
+do_spi_stop:
+	_FLASH_CS_reset();
+
+    return status;
+}
+
+flash_status_t flash_w25qxx_program(const uint32_t addr, const uint8_t* data, const uint32_t len)
+{
+#if FLASH_BEDUG
+	printTagLog(FLASH_TAG, "flash program addr=%08lX len=%lu: begin", addr, len);
+#endif
+
+    if (!flash_info.initialized) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash program addr=%08lX len=%lu (flash was not initialized)", addr, len);
+#endif
+        return FLASH_ERROR;
+    }
+
+    if (!util_wait_event(_flash_async_free, FLASH_ERASE_TIMEOUT_MS)) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash program addr=%08lX len=%lu (async transfer is not finished)", addr, len);
+#endif
+        return FLASH_BUSY;
+    }
+
+    if (!len || addr / FLASH_W25_PAGE_SIZE != (addr + len - 1) / FLASH_W25_PAGE_SIZE) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash program addr=%08lX len=%lu error (page boundary)", addr, len);
+#endif
+        return FLASH_ERROR;
+    }
+
+	bool empty = false;
+	_FLASH_CS_set();
+	flash_status_t status = _flash_data_is_empty(addr, len, &empty);
+	_FLASH_CS_reset();
+	if (status != FLASH_OK) {
+#if FLASH_BEDUG
+		printTagLog(FLASH_TAG, "flash program addr=%08lX len=%lu error=%u (read target)", addr, len, status);
+#endif
+		return status;
+	}
+
+	if (!empty) {
+#if FLASH_BEDUG
+		printTagLog(FLASH_TAG, "flash program addr=%08lX len=%lu error (target is not empty)", addr, len);
+#endif
+		return FLASH_ERROR;
+	}
+
+	_FLASH_CS_set();
+	status = _flash_write(addr, data, len);
+	_FLASH_CS_reset();
+	if (status != FLASH_OK) {
+#if FLASH_BEDUG
+		printTagLog(FLASH_TAG, "flash program addr=%08lX len=%lu error=%u (write)", addr, len, status);
+#endif
+		return status;
+	}
+
+	bool verified = false;
+	_FLASH_CS_set();
+	status = _flash_data_verify(addr, data, len, &verified);
+	_FLASH_CS_reset();
+	if (status != FLASH_OK) {
+#if FLASH_BEDUG
+		printTagLog(FLASH_TAG, "flash program addr=%08lX len=%lu error=%u (read programmed data)", addr, len, status);
+#endif
+		return status;
+	}
+
+	if (!verified) {
+#if FLASH_BEDUG
+		printTagLog(FLASH_TAG, "flash program addr=%08lX len=%lu error (compare programmed data CRC)", addr, len);
+#endif
+		set_error(EXPECTED_MEMORY_ERROR);
+		return FLASH_ERROR;
+	}
+
+	reset_error(EXPECTED_MEMORY_ERROR);
+
+#if FLASH_BEDUG
+	printTagLog(FLASH_TAG, "flash program addr=%08lX len=%lu: OK", addr, len);
+#endif
+
+	return FLASH_OK;
+}
+
+flash_status_t flash_w25qxx_read_async(const uint32_t addr, uint8_t* data, const uint32_t len, flash_async_callback_t callback)
+{
+    if (!flash_info.initialized) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash async read addr=%08lX len=%lu (flash was not initialized)", addr, len);
+#endif
+        return FLASH_ERROR;
+    }
+
+    if (!data || !len || len > 0xFFFF) {
+        return FLASH_ERROR;
+    }
+
+    if (addr + len > _flash_get_storage_bytes_size()) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash async read addr=%08lX len=%lu: error (unacceptable address)", addr, len);
+#endif
+        return FLASH_OOM;
+    }
+
+    if (!_flash_async_free() || !_flash_check_FREE()) {
+        return FLASH_BUSY;
+    }
+
+    flash_async.is_write = false;
+    flash_async.data     = data;
+    flash_async.len      = len;
+    flash_async.callback = callback;
+    flash_async.status   = FLASH_BUSY;
+    flash_async.state    = FLASH_ASYNC_COMMAND;
+    util_old_timer_start(&flash_async.timer, FLASH_SPI_TIMEOUT_MS);
+
+    uint8_t counter = _flash_set_address_cmd(flash_async.cmd, FLASH_W25_CMD_READ, addr);
+
+    _FLASH_CS_set();
+    if (_flash_dma_send_data(flash_async.cmd, counter) != HAL_OK) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash async read addr=%08lX len=%lu: error (send command)", addr, len);
+#endif
+        _flash_async_end(FLASH_ERROR);
+        return FLASH_ERROR;
+    }
+
+    return FLASH_OK;
+}
+
+flash_status_t flash_w25qxx_erase_sector_async(const uint32_t addr, flash_async_callback_t callback)
+{
+    if (!flash_info.initialized) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash async erase addr=%08lX (flash was not initialized)", addr);
+#endif
+        return FLASH_ERROR;
+    }
+
+    if (addr % flash_info.sector_size > 0) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash async erase addr=%08lX error (unacceptable address)", addr);
+#endif
+        return FLASH_ERROR;
+    }
+
+    if (addr + flash_info.sector_size > _flash_get_storage_bytes_size()) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash async erase addr=%08lX error (unacceptable address)", addr);
+#endif
+        return FLASH_OOM;
+    }
+
+    if (!_flash_async_free()) {
+        return FLASH_BUSY;
+    }
+
+    _FLASH_CS_set();
+    flash_status_t status = _flash_set_protect_block(FLASH_W25_SR1_UNBLOCK_VALUE);
+    if (status == FLASH_OK) {
+        status = _flash_write_enable();
+    }
+    if (status == FLASH_OK && !util_wait_event(_flash_check_WEL, FLASH_SPI_TIMEOUT_MS)) {
+        status = FLASH_BUSY;
+    }
+    if (status == FLASH_OK && !util_wait_event(_flash_check_FREE, FLASH_SPI_TIMEOUT_MS)) {
+        status = FLASH_BUSY;
+    }
+    if (status == FLASH_OK) {
+        uint8_t counter = _flash_set_address_cmd(flash_async.cmd, FLASH_W25_CMD_ERASE_SECTOR, addr);
+        status = _flash_send_data(flash_async.cmd, counter);
+    }
+    if (status != FLASH_OK) {
+#if FLASH_BEDUG
+        printTagLog(FLASH_TAG, "flash async erase addr=%08lX error=%u (send command)", addr, status);
+#endif
+        _flash_set_protect_block(FLASH_W25_SR1_BLOCK_VALUE);
+        _FLASH_CS_reset();
+        return status;
+    }
+
+    // The chip starts sector erase after CS is reset
+    _FLASH_CS_reset();
+
+    flash_async.is_write = true;
+    flash_async.result   = FLASH_OK;
+    flash_async.data     = NULL;
+    flash_async.len      = 0;
+    flash_async.callback = callback;
+    flash_async.status   = FLASH_BUSY;
+    flash_async.state    = FLASH_ASYNC_ERASE;
+    util_old_timer_start(&flash_async.timer, FLASH_ERASE_TIMEOUT_MS);
+
+#if FLASH_BEDUG
+    printTagLog(FLASH_TAG, "flash async erase addr=%08lX: begin", addr);
+#endif
+
+    return FLASH_OK;
+}
+
+flash_status_t flash_w25qxx_async_status()
+{
+    switch (flash_async.state) {
+    case FLASH_ASYNC_IDLE:
+        return flash_async.status;
+    case FLASH_ASYNC_ERASE:
+        if (_flash_check_FREE()) {
+            flash_status_t status = flash_async.result;
+            _flash_async_end(status);
+            return status;
+        }
+        if (!util_old_timer_wait(&flash_async.timer)) {
+#if FLASH_BEDUG
+            printTagLog(FLASH_TAG, "flash async erase error (erase timeout)");
+#endif
+            _flash_async_end(FLASH_ERROR);
+            return FLASH_ERROR;
+        }
+        return FLASH_BUSY;
+    default:
+        if (!util_old_timer_wait(&flash_async.timer)) {
+#if FLASH_BEDUG
+            printTagLog(FLASH_TAG, "flash async transfer error (SPI DMA timeout)");
+#endif
+#if !FLASH_EMULATOR
+            HAL_SPI_Abort(&FLASH_SPI);
+#endif
+            _flash_async_end(FLASH_ERROR);
+            return FLASH_ERROR;
+        }
+        return FLASH_BUSY;
+    }
+}
+
+void flash_w25qxx_spi_tx_cplt_callback()
+{
+    HAL_StatusTypeDef status = HAL_OK;
+    switch (flash_async.state) {
+    case FLASH_ASYNC_COMMAND:
+        flash_async.state = FLASH_ASYNC_READ;
+        status = _flash_dma_recieve_data(flash_async.data, flash_async.len);
+        break;
+    default:
+        break;
+    }
+
+    if (status != HAL_OK) {
+        _flash_async_end(FLASH_ERROR);
+    }
+}
+
+void flash_w25qxx_spi_rx_cplt_callback()
+{
+    if (flash_async.state == FLASH_ASYNC_READ) {
+        _flash_async_end(FLASH_OK);
+    }
+}
+
+void flash_w25qxx_spi_error_callback()
+{
+    if (flash_async.state != FLASH_ASYNC_IDLE && flash_async.state != FLASH_ASYNC_ERASE) {
+        _flash_async_end(FLASH_ERROR);
+    }
+}
+
+flash_status_t flash_w25qxx_erase_addresses(const uint32_t* addrs, const uint32_t count)
+{
+	if (!addrs) {
+#if FLASH_BEDUG
+		printTagLog(FLASH_TAG, "erase flash addresses error: addresses=NULL");
+#endif
+		return FLASH_ERROR;
+	}
+
+	if (!count) {
+#if FLASH_BEDUG
+		printTagLog(FLASH_TAG, "erase flash addresses error: count=%lu", count);
+#endif
+		return FLASH_ERROR;
+	}
+
+	if (!util_wait_event(_flash_async_free, FLASH_ERASE_TIMEOUT_MS)) {
+#if FLASH_BEDUG
+		printTagLog(FLASH_TAG, "erase flash addresses error: async transfer is not finished");
+#endif
+		return FLASH_BUSY;
+	}
+
+#if FLASH_BEDUG
+	printTagLog(FLASH_TAG, "erase flash addresses: ")
+	for (uint32_t i = 0; i < count; i++) {
+		gprint("%08lX ", addrs[i]);
+	}
+	gprint("\n");
+#endif
+
+	for (uint32_t i = 0; i < count;) {
+		uint32_t cur_sector_addr = (addrs[i] / FLASH_W25_SECTOR_SIZE) * FLASH_W25_SECTOR_SIZE;
+
+		/* Check target sector need erase BEGIN */
+		uint32_t next_sector_i = 0;
+		uint16_t target_mask   = _flash_get_target_mask(addrs, count, i, &next_sector_i);
+		uint16_t preserve_mask = 0;
+		bool     need_erase    = false;
+		flash_status_t status = _flash_check_sector(cur_sector_addr, target_mask, &need_erase, &preserve_mask);
+		if (status != FLASH_OK) {
+#if FLASH_BEDUG
+			printTagLog(FLASH_TAG, "flash erase data addr=%08lX error=%u (unable to read sector)", cur_sector_addr, status);
+#endif
+			return status;
+		}
+		if (!need_erase) {
+#if FLASH_BEDUG
+			printTagLog(FLASH_TAG, "flash sector addr=%08lX already empty", cur_sector_addr);
+#endif
+			i = next_sector_i;
+			continue;
+		}
+		/* Check target sector need erase END */
 
-    /* Write data BEGIN */
-    uint32_t cur_len = 0;
-    while (cur_len < len) {
-    	uint32_t write_len = FLASH_W25_PAGE_SIZE;
-    	if (cur_len + write_len > len) {
-    		write_len = len - cur_len;
-    	}
-    	_FLASH_CS_set();
-    	status = _flash_write(addr + cur_len, data + cur_len, write_len);
-    	_FLASH_CS_reset();
-    	if (status != FLASH_OK) {
+		/* Erase sector BEGIN */
+		if (preserve_mask) {
+			status = _flash_relocate_sector(cur_sector_addr, target_mask, preserve_mask);
+		} else {
+			status = _flash_erase_sector_wait(cur_sector_addr);
+		}
+		if (status != FLASH_OK) {
 #if FLASH_BEDUG
-        	printTagLog(FLASH_TAG, "flash write addr=%08lX len=%lu error=%u (write)", addr + cur_len, write_len, status);
+			printTagLog(FLASH_TAG, "flash erase data addr=%08lX error=%u (unable to erase sector)", cur_sector_addr, status);
 #endif
-            goto do_spi_stop;
-    	}
+			return status;
+		}
+		/* Erase sector END */
+
+		i = next_sector_i;
+	}
+
+	return FLASH_OK;
+}
+
+uint16_t _flash_get_target_mask(const uint32_t* addrs, const uint32_t count, const uint32_t first, uint32_t* next)
+{
+	uint32_t sector_idx = addrs[first] / FLASH_W25_SECTOR_SIZE;
+	uint16_t mask = 0;
+	*next = count;
+	for (uint32_t j = first; j < count; j++) {
+		if (addrs[j] / FLASH_W25_SECTOR_SIZE != sector_idx) {
+			*next = j;
+			break;
+		}
+		mask |= (uint16_t)(1 << ((addrs[j] % FLASH_W25_SECTOR_SIZE) / FLASH_W25_PAGE_SIZE));
+	}
+	return mask;
+}
+
+flash_status_t _flash_check_sector(const uint32_t sector_addr, const uint16_t target_mask, bool* need_erase, uint16_t* preserve_mask)
+{
+	*need_erase    = false;
+	*preserve_mask = 0;
+
+	// The sector is streamed page by page: one page buffer on the stack
+	for (uint32_t j = 0; j < FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE; j++) {
+		bool empty = true;
+		flash_status_t status = _flash_page_is_empty(sector_addr + j * FLASH_W25_PAGE_SIZE, &empty);
+		if (status != FLASH_OK) {
+			return status;
+		}
+		if (empty) {
+			continue;
+		}
+		if (target_mask & (1 << j)) {
+			*need_erase = true;
+		} else {
+			*preserve_mask |= (uint16_t)(1 << j);
+		}
+	}
+
+	return FLASH_OK;
+}
+
+flash_status_t _flash_page_is_empty(const uint32_t addr, bool* empty)
+{
+	uint8_t page_buf[FLASH_W25_PAGE_SIZE] = {0};
+	_FLASH_CS_set();
+	flash_status_t status = _flash_read(addr, page_buf, sizeof(page_buf));
+	_FLASH_CS_reset();
+	if (status != FLASH_OK) {
+		return status;
+	}
+
+	*empty = true;
+	for (uint32_t k = 0; k < sizeof(page_buf); k++) {
+		if (page_buf[k] != 0xFF) {
+			*empty = false;
+			break;
+		}
+	}
 
-    	_FLASH_CS_set();
-    	uint8_t page_buf[FLASH_W25_PAGE_SIZE] = {0};
-		status = _flash_read(addr + cur_len, page_buf, write_len);
-    	_FLASH_CS_reset();
-    	if (status != FLASH_OK) {
+	return FLASH_OK;
+}
+
+flash_status_t _flash_erase_sector_wait(const uint32_t sector_addr)
+{
+	_FLASH_CS_set();
+	flash_status_t status = _flash_erase_sector(sector_addr);
+	_FLASH_CS_reset();
+	if (status != FLASH_OK) {
+		return status;
+	}
+
+	_FLASH_CS_set();
+	if (!util_wait_event(_flash_check_FREE, FLASH_ERASE_TIMEOUT_MS)) {
+		_FLASH_CS_reset();
 #if FLASH_BEDUG
-        	printTagLog(FLASH_TAG, "flash write addr=%08lX len=%lu error=%u (read written page after write)", addr + cur_len, write_len, status);
+		printTagLog(FLASH_TAG, "flash erase sector addr=%08lX error (flash is busy)", sector_addr);
 #endif
-            goto do_spi_stop;
-    	}
+		return FLASH_BUSY;
+	}
+	_FLASH_CS_reset();
 
-    	int cmp_res = memcmp(page_buf, data + cur_len, write_len);
-		if (cmp_res) {
-#if FLASH_BEDUG
-        	printTagLog(
-				FLASH_TAG,
-				"flash write addr=%08lX len=%lu error=%d (compare written page with read)",
-				addr + cur_len,
-				write_len,
-				cmp_res
-			);
-			printTagLog(FLASH_TAG, "Needed page:");
-			util_debug_hex_dump(data + cur_len, addr + cur_len, (uint16_t)write_len);
-			printTagLog(FLASH_TAG, "Readed page:");
-			util_debug_hex_dump(page_buf, addr + cur_len, (uint16_t)write_len);
-#endif
-			set_error(EXPECTED_MEMORY_ERROR);
-			status = FLASH_ERROR;
-	        goto do_spi_stop;
-    	}
+	return FLASH_OK;
+}
 
-		reset_error(EXPECTED_MEMORY_ERROR);
+flash_status_t _flash_copy_page(const uint32_t dst_addr, const uint32_t src_addr)
+{
+	uint8_t page_buf[FLASH_W25_PAGE_SIZE] = {0};
 
-    	cur_len += write_len;
-    }
-    /* Write data END */
+	_FLASH_CS_set();
+	flash_status_t status = _flash_read(src_addr, page_buf, sizeof(page_buf));
+	_FLASH_CS_reset();
+	if (status != FLASH_OK) {
+		return status;
+	}
+
+	_FLASH_CS_set();
+	status = _flash_write(dst_addr, page_buf, sizeof(page_buf));
+	_FLASH_CS_reset();
+	if (status != FLASH_OK) {
+		return status;
+	}
 
+	// Verify the copy in small chunks to keep the one page buffer
+	for (uint32_t k = 0; k < sizeof(page_buf); k += FLASH_W25_VERIFY_CHUNK_SIZE) {
+		uint8_t chunk[FLASH_W25_VERIFY_CHUNK_SIZE] = {0};
+		_FLASH_CS_set();
+		status = _flash_read(dst_addr + k, chunk, sizeof(chunk));
+		_FLASH_CS_reset();
+		if (status != FLASH_OK) {
+			return status;
+		}
+		if (memcmp(chunk, &page_buf[k], sizeof(chunk))) {
 #if FLASH_BEDUG
-	printTagLog(FLASH_TAG, "flash write addr=%08lX len=%lu: OK", addr, len);
+			printTagLog(FLASH_TAG, "flash copy page %08lX -> %08lX error (compare written page with read)", src_addr, dst_addr);
 #endif
+			set_error(EXPECTED_MEMORY_ERROR);
+			return FLASH_ERROR;
+		}
+	}
 
-do_spi_stop:
-	_FLASH_CS_reset();
+	reset_error(EXPECTED_MEMORY_ERROR);
 
-    return status;
+	return FLASH_OK;
 }
 
-flash_status_t flash_w25qxx_erase_addresses(const uint32_t* addrs, const uint32_t count)
+flash_status_t _flash_relocate_sector(const uint32_t sector_addr, const uint16_t target_mask, const uint16_t preserve_mask)
 {
-	if (!addrs) {
-#if FLASH_BEDUG
-		printTagLog(FLASH_TAG, "erase flash addresses error: addresses=NULL");
-#endif
+	const uint32_t scratch_addr = _flash_get_scratch_addr();
+	if (sector_addr == scratch_addr) {
 		return FLASH_ERROR;
 	}
 
-	if (!count) {
 #if FLASH_BEDUG
-		printTagLog(FLASH_TAG, "erase flash addresses error: count=%lu", count);
+	printTagLog(FLASH_TAG, "flash relocate sector addr=%08lX preserve=%04X: begin", sector_addr, preserve_mask);
 #endif
-		return FLASH_ERROR;
-	}
 
-#if FLASH_BEDUG
-	printTagLog(FLASH_TAG, "erase flash addresses: ")
-	for (uint32_t i = 0; i < count; i++) {
-		gprint("%08lX ", addrs[i]);
+	flash_status_t status = _flash_erase_sector_wait(scratch_addr);
+	if (status != FLASH_OK) {
+		return status;
 	}
-	gprint("\n");
-#endif
-
-	for (uint32_t i = 0; i < count;) {
-		uint32_t cur_sector_idx  = addrs[i] / FLASH_W25_SECTOR_SIZE;
-		uint32_t cur_sector_addr = cur_sector_idx * FLASH_W25_SECTOR_SIZE;
-		uint8_t  sector_buf[FLASH_W25_SECTOR_SIZE] = {0};
 
-		/* Addresses for erase in current sector BEGIN */
-		uint32_t next_sector_i = 0;
-		for (uint32_t j = i; j < count; j++) {
-			if (addrs[j] / FLASH_W25_SECTOR_SIZE != cur_sector_idx) {
-				next_sector_i = j;
-				break;
-			}
-		}
-		if (!next_sector_i) {
-			next_sector_i = count;
+	for (uint32_t j = 0; j < FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE; j++) {
+		if (!(preserve_mask & (1 << j))) {
+			continue;
 		}
-		/* Addresses for erase in current sector END */
-
-		/* Read target sector BEGIN */
-		_FLASH_CS_set();
-		flash_status_t status = _flash_read(cur_sector_addr, sector_buf, sizeof(sector_buf));
-		_FLASH_CS_reset();
+		status = _flash_copy_page(scratch_addr + j * FLASH_W25_PAGE_SIZE, sector_addr + j * FLASH_W25_PAGE_SIZE);
 		if (status != FLASH_OK) {
-#if FLASH_BEDUG
-			printTagLog(
-				FLASH_TAG,
-				"flash erase data addr=%08lX error (unable to read sector: block_idx=%lu sector_idx=%lu len=%lu)",
-				cur_sector_addr,
-				cur_sector_addr / flash_info.block_size,
-				(cur_sector_addr % flash_info.block_size) / flash_info.sector_size,
-				FLASH_W25_SECTOR_SIZE
-			);
-#endif
 			return status;
 		}
-		/* Read target sector END */
-
+	}
 
-		/* Check target sector need erase BEGIN */
-		bool need_erase_sector = false;
-		for (uint32_t j = i; j < next_sector_i; j++) {
-			uint32_t addr_in_sector = addrs[j] % FLASH_W25_SECTOR_SIZE;
-			for (uint32_t k = 0; k < FLASH_W25_PAGE_SIZE; k++) {
-				if (sector_buf[addr_in_sector + k] != 0xFF) {
-					need_erase_sector = true;
-					break;
-				}
-			}
-			if (need_erase_sector) {
-				break;
-			}
-		}
-		if (!need_erase_sector) {
-#if FLASH_BEDUG
-			for (uint32_t j = i; j < next_sector_i; j++) {
-				printTagLog(
-					FLASH_TAG,
-					"flash address=%08lX (sector addr=%08lX) already empty",
-					addrs[j],
-					cur_sector_addr
-				);
-			}
-#endif
-			i = next_sector_i;
-			continue;
+	// The marker is saved on a target page place: it is empty in the scratch sector
+	uint32_t marker_addr = scratch_addr;
+	for (uint32_t j = 0; j < FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE; j++) {
+		if (target_mask & (1 << j)) {
+			marker_addr = scratch_addr + j * FLASH_W25_PAGE_SIZE;
+			break;
 		}
-		/* Check target sector need erase END */
+	}
+	flash_scratch_marker_t marker = {
+		.magic         = FLASH_SCRATCH_MAGIC,
+		.sector_addr   = sector_addr,
+		.preserve_mask = preserve_mask
+	};
+	_FLASH_CS_set();
+	status = _flash_write(marker_addr, (uint8_t*)&marker, sizeof(marker));
+	_FLASH_CS_reset();
+	if (status != FLASH_OK) {
+		return status;
+	}
 
+	return _flash_restore_sector(marker_addr, &marker);
+}
 
-		/* Erase sector BEGIN */
-		_FLASH_CS_set();
-		status = _flash_erase_sector(cur_sector_addr);
-		_FLASH_CS_reset();
+flash_status_t _flash_restore_sector(const uint32_t marker_addr, const flash_scratch_marker_t* marker)
+{
+	const uint32_t scratch_addr = _flash_get_scratch_addr();
+
+	flash_status_t status = _flash_erase_sector_wait(marker->sector_addr);
+	if (status != FLASH_OK) {
+		return status;
+	}
+
+	for (uint32_t j = 0; j < FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE; j++) {
+		if (!(marker->preserve_mask & (1 << j))) {
+			continue;
+		}
+		status = _flash_copy_page(marker->sector_addr + j * FLASH_W25_PAGE_SIZE, scratch_addr + j * FLASH_W25_PAGE_SIZE);
 		if (status != FLASH_OK) {
-#if FLASH_BEDUG
-			printTagLog(
-				FLASH_TAG,
-				"flash erase data addr=%08lX error (unable to erase sector: block_addr=%08lX sector_addr=%08lX len=%lu)",
-				cur_sector_addr,
-				cur_sector_addr / flash_info.block_size,
-				(cur_sector_addr % flash_info.block_size) / flash_info.sector_size,
-				FLASH_W25_SECTOR_SIZE
-			);
-#endif
 			return status;
 		}
-		_FLASH_CS_set();
-		if (!util_wait_event(_flash_check_FREE, FLASH_SPI_TIMEOUT_MS)) {
-			_FLASH_CS_reset();
-#if FLASH_BEDUG
-			printTagLog(FLASH_TAG, "flash erase data addr=%08lX error (flash is busy)", cur_sector_addr);
-#endif
-			return FLASH_BUSY;
-		}
-		_FLASH_CS_reset();
-		/* Erase sector END */
+	}
 
+	// Bits can be cleared without erase: the marker becomes invalid
+	uint32_t magic = 0;
+	_FLASH_CS_set();
+	status = _flash_write(marker_addr, (uint8_t*)&magic, sizeof(magic));
+	_FLASH_CS_reset();
 
-		/* Return old data BEGIN */
-		for (unsigned j = 0; j < FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE; j++) {
-			bool need_restore = true;
-			uint32_t tmp_page_addr = cur_sector_addr + j * FLASH_W25_PAGE_SIZE;
-			for (unsigned k = i; k < next_sector_i; k++) {
-				if (addrs[k] == tmp_page_addr) {
-					need_restore = false;
-				}
-			}
-			if (!need_restore) {
 #if FLASH_BEDUG
-				printTagLog(
-					FLASH_TAG,
-					"flash restore data addr=%08lX ignored",
-					tmp_page_addr
-				);
+	printTagLog(FLASH_TAG, "flash relocate sector addr=%08lX: end status=%u", marker->sector_addr, status);
 #endif
-				continue;
-			}
 
-			need_restore = false;
-			for (unsigned k = 0; k < FLASH_W25_PAGE_SIZE; k++) {
-				if (sector_buf[tmp_page_addr % FLASH_W25_SECTOR_SIZE + k] != 0xFF) {
-					need_restore = true;
-					break;
-				}
-			}
-			if (!need_restore) {
-#if FLASH_BEDUG
-				printTagLog(
-					FLASH_TAG,
-					"flash restore data addr=%08lX ignored (page empty)",
-					tmp_page_addr
-				);
-#endif
-				continue;
-			}
+	return status;
+}
 
-#if FLASH_BEDUG
-			printTagLog(
-				FLASH_TAG,
-				"flash restore data addr=%08lX begin",
-				tmp_page_addr
-			);
-#endif
-			_FLASH_CS_set();
-			status = _flash_write(
-				tmp_page_addr,
-				&sector_buf[tmp_page_addr % FLASH_W25_SECTOR_SIZE],
-				FLASH_W25_PAGE_SIZE
-			);
-			_FLASH_CS_reset();
-			if (status != FLASH_OK) {
-#if FLASH_BEDUG
-				printTagLog(
-					FLASH_TAG,
-					"flash erase data addr=%08lX error=%u (unable to write old data page addr=%08lX)",
-					cur_sector_addr,
-					status,
-					tmp_page_addr
-				);
-#endif
-				return status;
-			}
+flash_status_t _flash_scratch_recover()
+{
+	const uint32_t scratch_addr = _flash_get_scratch_addr();
 
-	    	uint8_t page_buf[FLASH_W25_PAGE_SIZE] = {0};
-	    	_FLASH_CS_set();
-			status = _flash_read(tmp_page_addr, page_buf, FLASH_W25_PAGE_SIZE);
-	    	_FLASH_CS_reset();
-	    	if (status != FLASH_OK) {
-	#if FLASH_BEDUG
-	        	printTagLog(
-					FLASH_TAG,
-					"flash erase data addr=%08lX error=%u (unable to read page addr=%08lX)",
-					cur_sector_addr,
-					status,
-					tmp_page_addr
-				);
-	#endif
-				return status;
-	    	}
-
-	    	int cmp_res = memcmp(
-				page_buf,
-				&sector_buf[tmp_page_addr % FLASH_W25_SECTOR_SIZE],
-				FLASH_W25_PAGE_SIZE
-			);
-			if (cmp_res) {
-#if FLASH_BEDUG
-	        	printTagLog(
-					FLASH_TAG,
-					"flash erase data addr=%08lX error=%d (compare written page with read)",
-					tmp_page_addr,
-					status
-				);
-				printTagLog(FLASH_TAG, "Needed page:");
-				util_debug_hex_dump(
-					&sector_buf[tmp_page_addr % FLASH_W25_SECTOR_SIZE],
-					tmp_page_addr,
-					FLASH_W25_PAGE_SIZE
-				);
-				printTagLog(FLASH_TAG, "Readed page:");
-				util_debug_hex_dump(
-					page_buf,
-					tmp_page_addr,
-					FLASH_W25_PAGE_SIZE
-				);
-#endif
-				set_error(EXPECTED_MEMORY_ERROR);
-				status = FLASH_ERROR;
-				return status;
-	    	}
+	for (uint32_t j = 0; j < FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE; j++) {
+		uint32_t marker_addr = scratch_addr + j * FLASH_W25_PAGE_SIZE;
+		flash_scratch_marker_t marker = {0};
+		_FLASH_CS_set();
+		flash_status_t status = _flash_read(marker_addr, (uint8_t*)&marker, sizeof(marker));
+		_FLASH_CS_reset();
+		if (status != FLASH_OK) {
+			return status;
+		}
+		if (marker.magic != FLASH_SCRATCH_MAGIC ||
+			marker.sector_addr % FLASH_W25_SECTOR_SIZE ||
+			marker.sector_addr >= scratch_addr
+		) {
+			continue;
+		}
 
 #if FLASH_BEDUG
-			printTagLog(
-				FLASH_TAG,
-				"flash restore data addr=%08lX OK",
-				tmp_page_addr
-			);
+		printTagLog(FLASH_TAG, "flash scratch recover sector addr=%08lX", marker.sector_addr);
 #endif
-
-			reset_error(EXPECTED_MEMORY_ERROR);
-		}
-		/* Return old data END */
-
-		i = next_sector_i;
+		// The relocation was interrupted: the preserved pages are restored again
+		return _flash_restore_sector(marker_addr, &marker);
 	}
 
 	return FLASH_OK;
 }
 
+uint32_t _flash_get_scratch_addr()
+{
+	return _flash_get_storage_bytes_size() - FLASH_W25_SECTOR_SIZE;
+}
+
 flash_status_t _flash_write(const uint32_t addr, const uint8_t* data, const uint32_t len)
 {
 	if (len > flash_info.page_size) {
@@ -832,10 +1186,21 @@ do_block_protect:
     return status;
 }
 
+void flash_w25qxx_get_stats(flash_stats_t* stats)
+{
+	memcpy(stats, &flash_stats, sizeof(flash_stats_t));
+}
+
+void flash_w25qxx_reset_stats()
+{
+	memset(&flash_stats, 0, sizeof(flash_stats));
+}
+
 uint32_t flash_w25qxx_get_pages_count()
 {
+    // The last sector is the scratch sector of flash_w25qxx_erase_addresses()
 #if FLASH_TEST
-	return FLASH_TEST_PAGES_COUNT;
+	return FLASH_TEST_PAGES_COUNT - FLASH_W25_SECTOR_SIZE / FLASH_W25_PAGE_SIZE;
 #endif
     flash_status_t status = FLASH_OK;
     if (!flash_info.initialized) {
@@ -847,7 +1212,7 @@ uint32_t flash_w25qxx_get_pages_count()
 #endif
         return 0;
     }
-    return flash_info.pages_count * flash_info.sectors_in_block * flash_info.blocks_count;
+    return (_flash_get_storage_bytes_size() - FLASH_W25_SECTOR_SIZE) / FLASH_W25_PAGE_SIZE;
 }
 
 uint32_t flash_w25qxx_get_blocks_count()
@@ -883,37 +1248,127 @@ uint32_t flash_w25qxx_get_block_size()
     return flash_info.block_size;
 }
 
-flash_status_t _flash_data_cmp(const uint32_t addr, const uint8_t* data, const uint32_t len, bool* cmp_res)
+flash_status_t _flash_page_check(const uint32_t addr, const uint8_t* data, const uint32_t len, bool* need_write, bool* need_erase)
 {
-	*cmp_res = false;
-
-	uint32_t cur_len = 0;
-	while (cur_len < len) {
-		uint32_t needed_len = FLASH_W25_PAGE_SIZE;
-		if (cur_len + needed_len > len) {
-			needed_len = len - cur_len;
-		}
+	*need_write = false;
+	*need_erase = false;
 
-		uint8_t read_data[FLASH_W25_PAGE_SIZE] = {0};
-		flash_status_t status = _flash_read(addr + cur_len, read_data, needed_len);
-		if (status != FLASH_OK) {
+	uint8_t read_data[FLASH_W25_PAGE_SIZE] = {0};
+	flash_status_t status = _flash_read(addr, read_data, len);
+	if (status != FLASH_OK) {
 #if FLASH_BEDUG
-	        printTagLog(FLASH_TAG, "flash compare addr=%08lX len=%lu error=%u (read)", addr + cur_len, needed_len, status);
+		printTagLog(FLASH_TAG, "flash compare addr=%08lX len=%lu error=%u (read)", addr, len, status);
 #endif
-	        return status;
-		}
+		return status;
+	}
 
-		if (memcmp(read_data, data + cur_len, needed_len)) {
-			*cmp_res = true;
+	for (uint32_t i = 0; i < len; i++) {
+		if (read_data[i] == data[i]) {
+			continue;
+		}
+		*need_write = true;
+		// Page program can only clear bits
+		if ((read_data[i] & data[i]) != data[i]) {
+			*need_erase = true;
 			break;
 		}
+	}
+
+	return FLASH_OK;
+}
+
+flash_status_t _flash_data_verify(const uint32_t addr, const uint8_t* data, const uint32_t len, bool* verified)
+{
+	*verified = false;
+
+	_flash_crc_reset();
+	_flash_crc_update(data, len);
+	uint32_t data_crc = _flash_crc_get();
+
+	// Written data is streamed through CRC: no second page buffer
+	_flash_crc_reset();
+	for (uint32_t i = 0; i < len; i += FLASH_W25_VERIFY_CHUNK_SIZE) {
+		uint32_t chunk_len = FLASH_W25_VERIFY_CHUNK_SIZE;
+		if (i + chunk_len > len) {
+			chunk_len = len - i;
+		}
+		uint8_t chunk[FLASH_W25_VERIFY_CHUNK_SIZE] = {0};
+		flash_status_t status = _flash_read(addr + i, chunk, chunk_len);
+		if (status != FLASH_OK) {
+			return status;
+		}
+		_flash_crc_update(chunk, chunk_len);
+	}
+
+	*verified = (_flash_crc_get() == data_crc);
+
+	return FLASH_OK;
+}
 
-		cur_len += needed_len;
+flash_status_t _flash_data_is_empty(const uint32_t addr, const uint32_t len, bool* empty)
+{
+	*empty = false;
+
+	for (uint32_t i = 0; i < len; i += FLASH_W25_VERIFY_CHUNK_SIZE) {
+		uint32_t chunk_len = FLASH_W25_VERIFY_CHUNK_SIZE;
+		if (i + chunk_len > len) {
+			chunk_len = len - i;
+		}
+		uint8_t chunk[FLASH_W25_VERIFY_CHUNK_SIZE] = {0};
+		flash_status_t status = _flash_read(addr + i, chunk, chunk_len);
+		if (status != FLASH_OK) {
+			return status;
+		}
+		for (uint32_t j = 0; j < chunk_len; j++) {
+			if (chunk[j] != 0xFF) {
+				return FLASH_OK;
+			}
+		}
 	}
 
+	*empty = true;
+
 	return FLASH_OK;
 }
 
+void _flash_crc_reset()
+{
+#if FLASH_HW_CRC
+	__HAL_RCC_CRC_CLK_ENABLE();
+	CRC->CR = CRC_CR_RESET;
+#else
+	flash_crc = 0xFFFFFFFF;
+#endif
+}
+
+void _flash_crc_update(const uint8_t* data, const uint32_t len)
+{
+	// CRC-32/MPEG-2 by 32-bit big-endian words as the STM32F1 CRC unit, the tail is padded by 0xFF
+	for (uint32_t i = 0; i < len; i += sizeof(uint32_t)) {
+		uint32_t word = 0;
+		for (uint32_t j = 0; j < sizeof(uint32_t); j++) {
+			word = (word << 8) | ((i + j < len) ? data[i + j] : 0xFF);
+		}
+#if FLASH_HW_CRC
+		CRC->DR = word;
+#else
+		flash_crc ^= word;
+		for (unsigned k = 0; k < 32; k++) {
+			flash_crc = (flash_crc & 0x80000000) ? ((flash_crc << 1) ^ 0x04C11DB7) : (flash_crc << 1);
+		}
+#endif
+	}
+}
+
+uint32_t _flash_crc_get()
+{
+#if FLASH_HW_CRC
+	return CRC->DR;
+#else
+	return flash_crc;
+#endif
+}
+
 flash_status_t _flash_read(uint32_t addr, uint8_t* data, uint32_t len)
 {
     if (addr + len > _flash_get_storage_bytes_size()) {
@@ -1007,35 +1462,26 @@ flash_status_t _flash_read_SR1(uint8_t* SR1)
 {
     uint8_t spi_cmd[] = { FLASH_W25_CMD_READ_SR1 };
 
-    bool cs_enabled = !(bool)HAL_GPIO_ReadPin(FLASH_CS_GPIO_Port, FLASH_CS_Pin);
+    bool cs_enabled = _flash_cs_enabled();
 	if (cs_enabled) {
 	    _FLASH_CS_reset();
 	}
     _FLASH_CS_set();
 
-    HAL_StatusTypeDef status = HAL_SPI_Transmit(&FLASH_SPI, spi_cmd, sizeof(spi_cmd), FLASH_SPI_TIMEOUT_MS);
-    if (status != HAL_OK) {
+    flash_status_t status = _flash_send_data(spi_cmd, sizeof(spi_cmd));
+    if (status != FLASH_OK) {
         goto do_spi_stop;
     }
 
-    status = HAL_SPI_Receive(&FLASH_SPI, SR1, sizeof(uint8_t), FLASH_SPI_TIMEOUT_MS);
-    if (status != HAL_OK) {
-        goto do_spi_stop;
-    }
+    status = _flash_recieve_data(SR1, sizeof(uint8_t));
 
 do_spi_stop:
 	_FLASH_CS_reset();
 	if (cs_enabled) {
 		_FLASH_CS_set();
 	}
-    if (status == HAL_BUSY) {
-    	return FLASH_BUSY;
-    }
-    if (status != HAL_OK) {
-    	return FLASH_ERROR;
-    }
 
-    return FLASH_OK;
+    return status;
 }
 
 flash_status_t _flash_write_enable()
@@ -1218,6 +1664,10 @@ do_spi_stop:
 
 flash_status_t _flash_send_data(const uint8_t* data, const uint32_t len)
 {
+    flash_stats.tx_bytes += len;
+#if FLASH_EMULATOR
+    return flash_emu_transmit(data, len);
+#else
     HAL_StatusTypeDef status = HAL_SPI_Transmit(&FLASH_SPI, (uint8_t*)data, (uint16_t)len, FLASH_SPI_TIMEOUT_MS);
 
     if (status == HAL_BUSY) {
@@ -1228,10 +1678,15 @@ flash_status_t _flash_send_data(const uint8_t* data, const uint32_t len)
     }
 
     return FLASH_OK;
+#endif
 }
 
 flash_status_t _flash_recieve_data(uint8_t* data, uint32_t len)
 {
+    flash_stats.rx_bytes += len;
+#if FLASH_EMULATOR
+    return flash_emu_receive(data, len);
+#else
     HAL_StatusTypeDef status =  HAL_SPI_Receive(&FLASH_SPI, data, (uint16_t)len, FLASH_SPI_TIMEOUT_MS);
 
     if (status == HAL_BUSY) {
@@ -1242,16 +1697,100 @@ flash_status_t _flash_recieve_data(uint8_t* data, uint32_t len)
     }
 
     return FLASH_OK;
+#endif
+}
+
+HAL_StatusTypeDef _flash_dma_send_data(uint8_t* data, const uint32_t len)
+{
+    flash_stats.tx_bytes += len;
+#if FLASH_EMULATOR
+    // The emulated transfer is finished at once
+    if (flash_emu_transmit(data, len) != FLASH_OK) {
+        return HAL_ERROR;
+    }
+    flash_w25qxx_spi_tx_cplt_callback();
+    return HAL_OK;
+#else
+    return HAL_SPI_Transmit_DMA(&FLASH_SPI, data, (uint16_t)len);
+#endif
+}
+
+HAL_StatusTypeDef _flash_dma_recieve_data(uint8_t* data, const uint32_t len)
+{
+    flash_stats.rx_bytes += len;
+#if FLASH_EMULATOR
+    if (flash_emu_receive(data, len) != FLASH_OK) {
+        return HAL_ERROR;
+    }
+    flash_w25qxx_spi_rx_cplt_callback();
+    return HAL_OK;
+#else
+    return HAL_SPI_Receive_DMA(&FLASH_SPI, data, (uint16_t)len);
+#endif
+}
+
+uint8_t _flash_set_address_cmd(uint8_t* cmd, const uint8_t opcode, const uint32_t addr)
+{
+    uint8_t counter = 0;
+    cmd[counter++] = opcode;
+    if (flash_info.is_24bit_address) {
+        cmd[counter++] = (uint8_t)(addr >> 24) & 0xFF;
+    }
+    cmd[counter++] = (addr >> 16) & 0xFF;
+    cmd[counter++] = (addr >> 8) & 0xFF;
+    cmd[counter++] = addr & 0xFF;
+    return counter;
+}
+
+void _flash_async_end(flash_status_t status)
+{
+    if (flash_async.is_write) {
+        // Restore the write protection after the sector erase
+        _FLASH_CS_set();
+        _flash_write_disable();
+        _flash_set_protect_block(FLASH_W25_SR1_BLOCK_VALUE);
+    }
+    _FLASH_CS_reset();
+
+    flash_async.is_write = false;
+    flash_async.status   = status;
+    flash_async.state    = FLASH_ASYNC_IDLE;
+
+    if (flash_async.callback) {
+        flash_async.callback(status);
+    }
+}
+
+bool _flash_async_free()
+{
+    return flash_w25qxx_async_status() != FLASH_BUSY;
 }
 
 void _FLASH_CS_set()
 {
+#if FLASH_EMULATOR
+    flash_emu_cs(true);
+#else
     HAL_GPIO_WritePin(FLASH_CS_GPIO_Port, FLASH_CS_Pin, GPIO_PIN_RESET);
+#endif
 }
 
 void _FLASH_CS_reset()
 {
+#if FLASH_EMULATOR
+    flash_emu_cs(false);
+#else
     HAL_GPIO_WritePin(FLASH_CS_GPIO_Port, FLASH_CS_Pin, GPIO_PIN_SET);
+#endif
+}
+
+bool _flash_cs_enabled()
+{
+#if FLASH_EMULATOR
+    return flash_emu_cs_enabled();
+#else
+    return !(bool)HAL_GPIO_ReadPin(FLASH_CS_GPIO_Port, FLASH_CS_Pin);
+#endif
 }
 
 bool _flash_check_FREE()
@@ -1279,7 +1818,7 @@ bool _flash_check_WEL()
 uint32_t _flash_get_storage_bytes_size()
 {
 #if FLASH_TEST
-	return flash_w25qxx_get_pages_count() * FLASH_W25_PAGE_SIZE;
+	return FLASH_TEST_PAGES_COUNT * FLASH_W25_PAGE_SIZE;
 #endif
     return flash_info.blocks_count * flash_info.block_size;
 }
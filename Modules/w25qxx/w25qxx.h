@@ -18,11 +18,16 @@ extern "C" {
 #define FLASH_TEST                (false)
 #define FLASH_TEST_PAGES_COUNT    ((uint32_t)64)
 
+#ifndef FLASH_EMULATOR
+#   define FLASH_EMULATOR         (0)  // Host build: the chip is emulated by w25qxx_emu.c
+#endif
+
 #define FLASH_W25_PAGE_SIZE       ((uint32_t)0x100)
 #define FLASH_W25_SECTOR_SIZE     ((uint32_t)0x1000)
 #define FLASH_W25_SETORS_IN_BLOCK ((uint32_t)0x10)
 
 
+
 typedef enum _flash_status_t {
     FLASH_OK    = ((uint8_t)0x00),  // OK
     FLASH_ERROR = ((uint8_t)0x01),  // Internal error
@@ -30,6 +35,27 @@ typedef enum _flash_status_t {
     FLASH_OOM   = ((uint8_t)0x03)   // Out Of Memory
 } flash_status_t;
 
+typedef enum _flash_w25_command_t {
+    FLASH_W25_CMD_WRITE_SR1       = ((uint8_t)0x01),
+    FLASH_W25_CMD_PAGE_PROGRAMM   = ((uint8_t)0x02),
+    FLASH_W25_CMD_READ            = ((uint8_t)0x03),
+    FLASH_W25_CMD_WRITE_DISABLE   = ((uint8_t)0x04),
+    FLASH_W25_CMD_READ_SR1        = ((uint8_t)0x05),
+    FLASH_W25_CMD_WRITE_ENABLE    = ((uint8_t)0x06),
+    FLASH_W25_CMD_ERASE_SECTOR    = ((uint8_t)0x20),
+    FLASH_W25_CMD_WRITE_ENABLE_SR = ((uint8_t)0x50),
+    FLASH_W25_CMD_ENABLE_RESET    = ((uint8_t)0x66),
+    FLASH_W25_CMD_RESET           = ((uint8_t)0x99),
+    FLASH_W25_CMD_JEDEC_ID        = ((uint8_t)0x9f)
+} flash_w25_command_t;
+
+typedef void (*flash_async_callback_t)(flash_status_t status);
+
+typedef struct _flash_stats_t {
+    uint32_t tx_bytes;  // Bytes sent to the chip by SPI
+    uint32_t rx_bytes;  // Bytes received from the chip by SPI
+} flash_stats_t;
+
 
 /**
  *  Initializes the W25Qxx chip.
@@ -62,7 +88,49 @@ flash_status_t flash_w25qxx_read(const uint32_t addr, uint8_t* data, const uint3
 flash_status_t flash_w25qxx_write(const uint32_t addr, const uint8_t* data, const uint32_t len);
 
 /**
- *  Erases addresses in the FLASH memory.
+ *  Programs data into an already erased area of one page without
+ *  erasing the sector (the target bytes have to be 0xFF).
+ *  @param addr Target program address.
+ *  @param data Buffer with data for program.
+ *  @param len Data buffer length (must not cross the page boundary).
+ *  @return Result status.
+ */
+flash_status_t flash_w25qxx_program(const uint32_t addr, const uint8_t* data, const uint32_t len);
+
+/**
+ *  Starts a non-blocking (SPI DMA) read from the FLASH memory.
+ *  @param addr Target read address.
+ *  @param data Data buffer for read (has to be valid until the end of the transfer).
+ *  @param len Data buffer length.
+ *  @param callback Transfer end callback (called from the interrupt), may be NULL.
+ *  @return FLASH_OK if the transfer was started.
+ */
+flash_status_t flash_w25qxx_read_async(const uint32_t addr, uint8_t* data, const uint32_t len, flash_async_callback_t callback);
+
+/**
+ *  Starts a non-blocking erase of one sector (the chip erases it while the CPU is free).
+ *  @param addr Target sector address.
+ *  @param callback Erase end callback (called from flash_w25qxx_async_status()), may be NULL.
+ *  @return FLASH_OK if the erase was started.
+ */
+flash_status_t flash_w25qxx_erase_sector_async(const uint32_t addr, flash_async_callback_t callback);
+
+/**
+ *  Polls the non-blocking transfer.
+ *  @return FLASH_BUSY while the transfer is in progress, otherwise the last transfer result.
+ */
+flash_status_t flash_w25qxx_async_status();
+
+/**
+ *  SPI DMA events of the non-blocking transfer (have to be called from HAL SPI callbacks).
+ */
+void flash_w25qxx_spi_tx_cplt_callback();
+void flash_w25qxx_spi_rx_cplt_callback();
+void flash_w25qxx_spi_error_callback();
+
+/**
+ *  Erases addresses in the FLASH memory. Not empty pages of the sector that
+ *  are not in the addresses are relocated through the scratch sector.
  *  @param addrs[] Array of addresses.
  *  @param count   Number of the addresses.
  *  @return Result status.
@@ -70,7 +138,18 @@ flash_status_t flash_w25qxx_write(const uint32_t addr, const uint8_t* data, cons
 flash_status_t flash_w25qxx_erase_addresses(const uint32_t* addrs, const uint32_t count);
 
 /**
- *  @return FLASH memory pages count.
+ *  Gets SPI traffic counters.
+ *  @param stats Result counters.
+ */
+void flash_w25qxx_get_stats(flash_stats_t* stats);
+
+/**
+ *  Resets SPI traffic counters.
+ */
+void flash_w25qxx_reset_stats();
+
+/**
+ *  @return FLASH memory pages count (without the scratch sector).
  */
 uint32_t flash_w25qxx_get_pages_count();
 
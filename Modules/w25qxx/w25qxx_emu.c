@@ -0,0 +1,445 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#include "w25qxx_emu.h"
+
+
+#if FLASH_EMULATOR
+
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define FLASH_EMU_CMD_SIZE_MAX   ((uint8_t)5)
+#define FLASH_EMU_JEDEC_ID_MANUF ((uint8_t)0xEF)
+#define FLASH_EMU_JEDEC_ID_TYPE  ((uint8_t)0x40)
+#define FLASH_EMU_JEDEC_ID_CAP   ((uint8_t)0x11)  // Capacity ID of W25Q10
+#define FLASH_EMU_SR1_BUSY       ((uint8_t)0x01)
+#define FLASH_EMU_SR1_WEL        ((uint8_t)0x02)
+#define FLASH_EMU_SR1_BP_MASK    ((uint8_t)0x3C)
+#define FLASH_EMU_4BYTE_BLOCKS   ((uint32_t)512)
+
+
+typedef struct _flash_emu_t {
+    bool              initialized;
+    bool              powered;
+    int               fd;
+    uint8_t*          memory;
+    uint32_t          size;
+    uint32_t          addr_len;
+    uint8_t           jedec_cap;
+    uint32_t*         erase_counts;
+
+    bool              cs_enabled;
+    uint8_t           cmd[FLASH_EMU_CMD_SIZE_MAX];
+    uint8_t           cmd_len;
+    uint32_t          data_addr;
+    uint8_t           program_buf[FLASH_W25_PAGE_SIZE];
+    uint32_t          program_len;
+
+    uint8_t           sr1;
+    bool              sr_write_enabled;
+    uint64_t          time_ns;
+    uint64_t          busy_end_ns;
+    uint32_t          power_cut_ops;
+
+    flash_emu_stats_t stats;
+} flash_emu_t;
+
+
+static flash_emu_t flash_emu = {0};
+
+
+static bool     _flash_emu_busy();
+static void     _flash_emu_set_busy(const uint32_t time_us);
+static uint8_t  _flash_emu_cmd_len(const uint8_t opcode);
+static uint32_t _flash_emu_cmd_addr();
+static void     _flash_emu_execute();
+static void     _flash_emu_program();
+static void     _flash_emu_erase();
+static bool     _flash_emu_power_cut();
+static bool     _flash_emu_write_allowed();
+
+
+flash_status_t flash_emu_init(const char* path, const uint32_t blocks_count)
+{
+    if (flash_emu.initialized) {
+        flash_emu_deinit();
+    }
+
+    uint8_t jedec_cap = FLASH_EMU_JEDEC_ID_CAP;
+    for (uint32_t count = 2; count < blocks_count; count <<= 1) {
+        jedec_cap++;
+    }
+    if (!blocks_count || (blocks_count & (blocks_count - 1))) {
+        return FLASH_ERROR;
+    }
+
+    const uint32_t size = blocks_count * FLASH_W25_SETORS_IN_BLOCK * FLASH_W25_SECTOR_SIZE;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return FLASH_ERROR;
+    }
+
+    struct stat st = {0};
+    if (fstat(fd, &st) < 0 || ftruncate(fd, size) < 0) {
+        close(fd);
+        return FLASH_ERROR;
+    }
+
+    uint8_t* memory = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        close(fd);
+        return FLASH_ERROR;
+    }
+    // The new part of the file is erased memory
+    if ((uint32_t)st.st_size < size) {
+        memset(memory + st.st_size, 0xFF, size - (uint32_t)st.st_size);
+    }
+
+    memset(&flash_emu, 0, sizeof(flash_emu));
+    flash_emu.erase_counts = (uint32_t*)calloc(size / FLASH_W25_SECTOR_SIZE, sizeof(uint32_t));
+    if (!flash_emu.erase_counts) {
+        munmap(memory, size);
+        close(fd);
+        return FLASH_ERROR;
+    }
+
+    flash_emu.initialized = true;
+    flash_emu.powered     = true;
+    flash_emu.fd          = fd;
+    flash_emu.memory      = memory;
+    flash_emu.size        = size;
+    flash_emu.addr_len    = (blocks_count >= FLASH_EMU_4BYTE_BLOCKS) ? 4 : 3;
+    flash_emu.jedec_cap   = jedec_cap;
+
+    return FLASH_OK;
+}
+
+void flash_emu_deinit()
+{
+    if (!flash_emu.initialized) {
+        return;
+    }
+
+    msync(flash_emu.memory, flash_emu.size, MS_SYNC);
+    munmap(flash_emu.memory, flash_emu.size);
+    close(flash_emu.fd);
+    free(flash_emu.erase_counts);
+
+    memset(&flash_emu, 0, sizeof(flash_emu));
+}
+
+void flash_emu_cs(const bool enabled)
+{
+    if (flash_emu.cs_enabled && !enabled && flash_emu.powered) {
+        // Program and erase start after CS goes high
+        _flash_emu_execute();
+    }
+
+    flash_emu.cs_enabled  = enabled;
+    flash_emu.cmd_len     = 0;
+    flash_emu.program_len = 0;
+}
+
+bool flash_emu_cs_enabled()
+{
+    return flash_emu.cs_enabled;
+}
+
+flash_status_t flash_emu_transmit(const uint8_t* data, const uint32_t len)
+{
+    if (!flash_emu.initialized || !flash_emu.powered || !flash_emu.cs_enabled) {
+        return FLASH_ERROR;
+    }
+
+    flash_emu.time_ns += (uint64_t)len * FLASH_EMU_SPI_BYTE_NS;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (!flash_emu.cmd_len) {
+            flash_emu.cmd[flash_emu.cmd_len++] = data[i];
+            if (data[i] != FLASH_W25_CMD_READ_SR1) {
+                flash_emu.stats.commands++;
+            }
+        } else if (flash_emu.cmd_len < _flash_emu_cmd_len(flash_emu.cmd[0])) {
+            flash_emu.cmd[flash_emu.cmd_len++] = data[i];
+            if (flash_emu.cmd_len == _flash_emu_cmd_len(flash_emu.cmd[0])) {
+                flash_emu.data_addr = _flash_emu_cmd_addr();
+            }
+            continue;
+        } else if (flash_emu.cmd[0] == FLASH_W25_CMD_PAGE_PROGRAMM) {
+            // Data past the page end wraps to the page start as on the chip
+            flash_emu.program_buf[flash_emu.program_len % FLASH_W25_PAGE_SIZE] = data[i];
+            if (flash_emu.program_len < FLASH_W25_PAGE_SIZE) {
+                flash_emu.program_len++;
+            }
+            continue;
+        } else {
+            continue;
+        }
+
+        // The driver sends single byte commands without CS toggling: they are executed at once
+        if (_flash_emu_cmd_len(flash_emu.cmd[0]) == 1) {
+            _flash_emu_execute();
+            flash_emu.cmd_len = 0;
+        }
+    }
+
+    return FLASH_OK;
+}
+
+flash_status_t flash_emu_receive(uint8_t* data, const uint32_t len)
+{
+    if (!flash_emu.initialized || !flash_emu.powered || !flash_emu.cs_enabled) {
+        return FLASH_ERROR;
+    }
+
+    flash_emu.time_ns += (uint64_t)len * FLASH_EMU_SPI_BYTE_NS;
+
+    memset(data, 0xFF, len);
+    if (!flash_emu.cmd_len) {
+        return FLASH_OK;
+    }
+
+    switch (flash_emu.cmd[0]) {
+    case FLASH_W25_CMD_READ_SR1:
+        // The driver polls SR1 while it waits for the chip
+        flash_emu.time_ns += (uint64_t)FLASH_EMU_POLL_US * 1000;
+        _flash_emu_busy();
+        memset(data, flash_emu.sr1, len);
+        break;
+    case FLASH_W25_CMD_JEDEC_ID:
+        if (_flash_emu_busy()) {
+            break;
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            const uint8_t jedec_id[] = { FLASH_EMU_JEDEC_ID_MANUF, FLASH_EMU_JEDEC_ID_TYPE, flash_emu.jedec_cap };
+            data[i] = (i < sizeof(jedec_id)) ? jedec_id[i] : 0xFF;
+        }
+        break;
+    case FLASH_W25_CMD_READ:
+        if (_flash_emu_busy() || flash_emu.cmd_len < _flash_emu_cmd_len(FLASH_W25_CMD_READ)) {
+            break;
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            data[i] = flash_emu.memory[flash_emu.data_addr];
+            flash_emu.data_addr = (flash_emu.data_addr + 1) % flash_emu.size;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return FLASH_OK;
+}
+
+void flash_emu_set_power_cut(const uint32_t operations)
+{
+    flash_emu.power_cut_ops = operations;
+}
+
+void flash_emu_power_on()
+{
+    flash_emu.powered          = true;
+    flash_emu.cs_enabled       = false;
+    flash_emu.cmd_len          = 0;
+    flash_emu.program_len      = 0;
+    flash_emu.sr1              = 0;
+    flash_emu.sr_write_enabled = false;
+    flash_emu.busy_end_ns      = flash_emu.time_ns;
+    flash_emu.power_cut_ops    = 0;
+}
+
+bool flash_emu_is_powered()
+{
+    return flash_emu.powered;
+}
+
+uint32_t flash_emu_get_erase_count(const uint32_t sector)
+{
+    if (!flash_emu.initialized || sector >= flash_emu.size / FLASH_W25_SECTOR_SIZE) {
+        return 0;
+    }
+    return flash_emu.erase_counts[sector];
+}
+
+void flash_emu_get_stats(flash_emu_stats_t* stats)
+{
+    memcpy(stats, &flash_emu.stats, sizeof(flash_emu_stats_t));
+    stats->time_us = flash_emu.time_ns / 1000;
+}
+
+bool _flash_emu_busy()
+{
+    if (flash_emu.time_ns >= flash_emu.busy_end_ns) {
+        flash_emu.sr1 &= (uint8_t)~FLASH_EMU_SR1_BUSY;
+    }
+    return flash_emu.sr1 & FLASH_EMU_SR1_BUSY;
+}
+
+void _flash_emu_set_busy(const uint32_t time_us)
+{
+    flash_emu.sr1         |= FLASH_EMU_SR1_BUSY;
+    flash_emu.sr1         &= (uint8_t)~FLASH_EMU_SR1_WEL;
+    flash_emu.busy_end_ns  = flash_emu.time_ns + (uint64_t)time_us * 1000;
+}
+
+uint8_t _flash_emu_cmd_len(const uint8_t opcode)
+{
+    switch (opcode) {
+    case FLASH_W25_CMD_READ:
+    case FLASH_W25_CMD_PAGE_PROGRAMM:
+    case FLASH_W25_CMD_ERASE_SECTOR:
+        return (uint8_t)(1 + flash_emu.addr_len);
+    case FLASH_W25_CMD_WRITE_SR1:
+        return 2;
+    case FLASH_W25_CMD_READ_SR1:
+    case FLASH_W25_CMD_JEDEC_ID:
+        // Read commands: the response is received after the opcode
+        return FLASH_EMU_CMD_SIZE_MAX;
+    default:
+        return 1;
+    }
+}
+
+uint32_t _flash_emu_cmd_addr()
+{
+    uint32_t addr = 0;
+    for (uint32_t i = 0; i < flash_emu.addr_len; i++) {
+        addr = (addr << 8) | flash_emu.cmd[1 + i];
+    }
+    return addr % flash_emu.size;
+}
+
+void _flash_emu_execute()
+{
+    if (!flash_emu.cmd_len) {
+        return;
+    }
+
+    const uint8_t opcode = flash_emu.cmd[0];
+    if (opcode == FLASH_W25_CMD_READ_SR1 ||
+        opcode == FLASH_W25_CMD_READ ||
+        opcode == FLASH_W25_CMD_JEDEC_ID
+    ) {
+        return;
+    }
+
+    // The chip ignores all commands except SR1 read while it is busy
+    if (_flash_emu_busy()) {
+        flash_emu.stats.ignored++;
+        return;
+    }
+
+    switch (opcode) {
+    case FLASH_W25_CMD_WRITE_ENABLE:
+        flash_emu.sr1 |= FLASH_EMU_SR1_WEL;
+        break;
+    case FLASH_W25_CMD_WRITE_DISABLE:
+        flash_emu.sr1 &= (uint8_t)~FLASH_EMU_SR1_WEL;
+        break;
+    case FLASH_W25_CMD_WRITE_ENABLE_SR:
+        flash_emu.sr_write_enabled = true;
+        break;
+    case FLASH_W25_CMD_WRITE_SR1:
+        if (flash_emu.cmd_len < 2 ||
+            (!flash_emu.sr_write_enabled && !(flash_emu.sr1 & FLASH_EMU_SR1_WEL))
+        ) {
+            flash_emu.stats.ignored++;
+            break;
+        }
+        flash_emu.sr1 = (uint8_t)((flash_emu.sr1 & ~FLASH_EMU_SR1_BP_MASK) | (flash_emu.cmd[1] & FLASH_EMU_SR1_BP_MASK));
+        flash_emu.sr1 &= (uint8_t)~FLASH_EMU_SR1_WEL;
+        flash_emu.sr_write_enabled = false;
+        break;
+    case FLASH_W25_CMD_PAGE_PROGRAMM:
+        _flash_emu_program();
+        break;
+    case FLASH_W25_CMD_ERASE_SECTOR:
+        _flash_emu_erase();
+        break;
+    default:
+        break;
+    }
+}
+
+void _flash_emu_program()
+{
+    if (flash_emu.cmd_len < _flash_emu_cmd_len(FLASH_W25_CMD_PAGE_PROGRAMM) || !_flash_emu_write_allowed()) {
+        return;
+    }
+
+    flash_emu.stats.programs++;
+
+    uint32_t len = flash_emu.program_len;
+    const bool power_cut = _flash_emu_power_cut();
+    if (power_cut) {
+        len /= 2;
+    }
+
+    const uint32_t page_addr = (flash_emu.data_addr / FLASH_W25_PAGE_SIZE) * FLASH_W25_PAGE_SIZE;
+    for (uint32_t i = 0; i < len; i++) {
+        uint32_t addr = page_addr + (flash_emu.data_addr + i) % FLASH_W25_PAGE_SIZE;
+        // Page program can only clear bits
+        flash_emu.memory[addr] &= flash_emu.program_buf[i];
+    }
+
+    if (!power_cut) {
+        _flash_emu_set_busy(FLASH_EMU_PROGRAM_US);
+    }
+}
+
+void _flash_emu_erase()
+{
+    if (flash_emu.cmd_len < _flash_emu_cmd_len(FLASH_W25_CMD_ERASE_SECTOR) || !_flash_emu_write_allowed()) {
+        return;
+    }
+
+    flash_emu.stats.erases++;
+
+    const uint32_t sector = flash_emu.data_addr / FLASH_W25_SECTOR_SIZE;
+    flash_emu.erase_counts[sector]++;
+
+    uint32_t len = FLASH_W25_SECTOR_SIZE;
+    const bool power_cut = _flash_emu_power_cut();
+    if (power_cut) {
+        len /= 2;
+    }
+
+    memset(flash_emu.memory + sector * FLASH_W25_SECTOR_SIZE, 0xFF, len);
+
+    if (!power_cut) {
+        _flash_emu_set_busy(FLASH_EMU_ERASE_US);
+    }
+}
+
+bool _flash_emu_power_cut()
+{
+    if (!flash_emu.power_cut_ops) {
+        return false;
+    }
+    if (--flash_emu.power_cut_ops) {
+        return false;
+    }
+
+    // The operation is interrupted in the middle
+    flash_emu.powered = false;
+    return true;
+}
+
+bool _flash_emu_write_allowed()
+{
+    if (!(flash_emu.sr1 & FLASH_EMU_SR1_WEL) || (flash_emu.sr1 & FLASH_EMU_SR1_BP_MASK)) {
+        flash_emu.sr1 &= (uint8_t)~FLASH_EMU_SR1_WEL;
+        flash_emu.stats.ignored++;
+        return false;
+    }
+    return true;
+}
+
+
+#endif
@@ -0,0 +1,124 @@
+/* Copyright © 2024 Georgy E. All rights reserved. */
+
+#ifndef _FLASH_EMU_H_
+#define _FLASH_EMU_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "w25qxx.h"
+
+
+#if FLASH_EMULATOR
+
+
+#ifndef FLASH_EMU_SPI_BYTE_NS
+#   define FLASH_EMU_SPI_BYTE_NS     ((uint32_t)445)    // 18 MHz SPI clock
+#endif
+#ifndef FLASH_EMU_PROGRAM_US
+#   define FLASH_EMU_PROGRAM_US      ((uint32_t)700)    // Typical page program time
+#endif
+#ifndef FLASH_EMU_ERASE_US
+#   define FLASH_EMU_ERASE_US        ((uint32_t)45000)  // Typical sector erase time
+#endif
+#ifndef FLASH_EMU_POLL_US
+#   define FLASH_EMU_POLL_US         ((uint32_t)10)     // Time between SR1 reads of the driver
+#endif
+
+
+typedef struct _flash_emu_stats_t {
+    uint64_t time_us;   // Emulated time: SPI transfers and chip busy time
+    uint32_t commands;  // Received commands except the status register reads (busy polls)
+    uint32_t programs;  // Page program commands
+    uint32_t erases;    // Sector erase commands
+    uint32_t ignored;   // Commands ignored: chip busy, WEL is not set or memory is protected
+} flash_emu_stats_t;
+
+
+/**
+ *  Initializes the W25Qxx emulator backed by the file.
+ *  A new file is created erased.
+ *  @param path         Backing file path.
+ *  @param blocks_count Number of 64 KB blocks (W25Q16 - 32 blocks).
+ *  @return Result status.
+ */
+flash_status_t flash_emu_init(const char* path, const uint32_t blocks_count);
+
+/**
+ *  Flushes and closes the backing file.
+ */
+void flash_emu_deinit();
+
+/**
+ *  Emulates chip select pin.
+ *  @param enabled True when CS is low.
+ */
+void flash_emu_cs(const bool enabled);
+
+/**
+ *  @return True when CS is low.
+ */
+bool flash_emu_cs_enabled();
+
+/**
+ *  Emulates SPI transmit to the chip.
+ *  @param data Data to send.
+ *  @param len  Data length.
+ *  @return Result status.
+ */
+flash_status_t flash_emu_transmit(const uint8_t* data, const uint32_t len);
+
+/**
+ *  Emulates SPI receive from the chip.
+ *  @param data Result data.
+ *  @param len  Data length.
+ *  @return Result status.
+ */
+flash_status_t flash_emu_receive(uint8_t* data, const uint32_t len);
+
+/**
+ *  Cuts power during the program or erase operation.
+ *  The operation is left partially done and the chip stops responding
+ *  until flash_emu_power_on().
+ *  @param operations Number of the program and erase operations to cut power on (0 - disabled).
+ */
+void flash_emu_set_power_cut(const uint32_t operations);
+
+/**
+ *  Restores power after the power cut. Volatile chip state is reset.
+ */
+void flash_emu_power_on();
+
+/**
+ *  @return True when the chip is powered.
+ */
+bool flash_emu_is_powered();
+
+/**
+ *  @param sector Sector index.
+ *  @return Number of the sector erases after flash_emu_init().
+ */
+uint32_t flash_emu_get_erase_count(const uint32_t sector);
+
+/**
+ *  Gets emulator counters.
+ *  @param stats Result counters.
+ */
+void flash_emu_get_stats(flash_emu_stats_t* stats);
+
+
+#endif
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif